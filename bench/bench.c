@@ -0,0 +1,136 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static he_bench_options_t he_bench_options = {
+    .format = HE_BENCH_FORMAT_JSON,
+    .samples = 50,
+    .min_sample_ns = 2000000,
+    .filter = NULL,
+};
+
+static uint64_t he_bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t he_bench_time(he_bench_fn_t fn, void *context, size_t iterations)
+{
+    uint64_t start = he_bench_now_ns();
+    fn(context, iterations);
+    return he_bench_now_ns() - start;
+}
+
+static int he_bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank, so every reported percentile is a sample that was actually seen
+static double he_bench_percentile(const double *sorted, size_t count, double percentile)
+{
+    size_t rank = (size_t)(percentile / 100.0 * (double)count + 0.999999);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    if (rank > count)
+    {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
+void he_bench_init(const he_bench_options_t *options)
+{
+    he_bench_options = *options;
+    if (he_bench_options.samples == 0)
+    {
+        he_bench_options.samples = 1;
+    }
+
+    if (he_bench_options.format == HE_BENCH_FORMAT_CSV)
+    {
+        printf("suite,name,param,value,samples,iterations,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,"
+               "max_ns,ops_per_sec,mb_per_sec\n");
+    }
+}
+
+bool he_bench_enabled(const char *suite, const char *name)
+{
+    if (he_bench_options.filter == NULL)
+    {
+        return true;
+    }
+
+    char full_name[256];
+    snprintf(full_name, sizeof(full_name), "%s/%s", suite, name);
+    return strstr(full_name, he_bench_options.filter) != NULL;
+}
+
+void he_bench_run(const char *suite, const char *name, const char *param, size_t value,
+                  size_t bytes_per_op, he_bench_fn_t fn, void *context)
+{
+    if (!he_bench_enabled(suite, name))
+    {
+        return;
+    }
+
+    // Warm up caches and branch predictors, then double the batch until one sample is long
+    // enough for the clock's resolution not to matter
+    size_t iterations = 1;
+    he_bench_time(fn, context, iterations);
+    while (he_bench_time(fn, context, iterations) < he_bench_options.min_sample_ns &&
+           iterations < ((size_t)1 << 40))
+    {
+        iterations *= 2;
+    }
+
+    size_t count = he_bench_options.samples;
+    double *samples = calloc(count, sizeof(double));
+    if (samples == NULL)
+    {
+        fprintf(stderr, "%s/%s: out of memory\n", suite, name);
+        return;
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        samples[i] = (double)he_bench_time(fn, context, iterations) / (double)iterations;
+        total += samples[i];
+    }
+    qsort(samples, count, sizeof(double), he_bench_compare);
+
+    double mean = total / (double)count;
+    double p50 = he_bench_percentile(samples, count, 50);
+    double p90 = he_bench_percentile(samples, count, 90);
+    double p99 = he_bench_percentile(samples, count, 99);
+    double ops_per_sec = p50 > 0 ? 1e9 / p50 : 0;
+    double mb_per_sec = ops_per_sec * (double)bytes_per_op / 1e6;
+
+    if (he_bench_options.format == HE_BENCH_FORMAT_CSV)
+    {
+        printf("%s,%s,%s,%zu,%zu,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.0f,%.2f\n", suite, name, param,
+               value, count, iterations, samples[0], mean, p50, p90, p99, samples[count - 1],
+               ops_per_sec, mb_per_sec);
+    }
+    else
+    {
+        printf("{\"suite\":\"%s\",\"name\":\"%s\",\"param\":\"%s\",\"value\":%zu,\"samples\":%zu,"
+               "\"iterations\":%zu,\"ns_per_op\":{\"min\":%.2f,\"mean\":%.2f,\"p50\":%.2f,"
+               "\"p90\":%.2f,\"p99\":%.2f,\"max\":%.2f},\"ops_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+               suite, name, param, value, count, iterations, samples[0], mean, p50, p90, p99,
+               samples[count - 1], ops_per_sec, mb_per_sec);
+    }
+    fflush(stdout);
+
+    free(samples);
+}
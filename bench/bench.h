@@ -0,0 +1,77 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The code under test, run iterations times back to back
+ *
+ * Anything that must not be timed (setup, resetting state between samples) belongs outside this
+ * function, in the suite that calls he_bench_run().
+ */
+typedef void (*he_bench_fn_t)(void *context, size_t iterations);
+
+typedef enum he_bench_format
+{
+    HE_BENCH_FORMAT_JSON = 0,
+    HE_BENCH_FORMAT_CSV = 1
+} he_bench_format_t;
+
+typedef struct he_bench_options
+{
+    he_bench_format_t format;
+    /// Number of timed samples per benchmark, percentiles are taken over these
+    size_t samples;
+    /// Each sample runs enough iterations to take at least this long
+    uint64_t min_sample_ns;
+    /// Only run benchmarks whose "suite/name" contains this string, NULL for all
+    const char *filter;
+} he_bench_options_t;
+
+/**
+ * @brief Set the options used by every later he_bench_run() and print the CSV header if needed
+ */
+void he_bench_init(const he_bench_options_t *options);
+
+/**
+ * @brief Tell whether a benchmark would be run under the current filter
+ *
+ * Lets a suite skip expensive setup for benchmarks that won't run.
+ */
+bool he_bench_enabled(const char *suite, const char *name);
+
+/**
+ * @brief Time fn and print one result line
+ * @param suite The group the benchmark belongs to, e.g. "plugin_chain"
+ * @param name The operation being measured, e.g. "ingress"
+ * @param param What is being swept, e.g. "plugins" or "bytes"
+ * @param value The value of param for this run
+ * @param bytes_per_op Bytes processed per iteration, used for throughput, 0 if not meaningful
+ *
+ * The number of iterations per sample is calibrated first, then the configured number of samples
+ * is taken. Results are reported per operation: min, mean, p50, p90, p99 and max in nanoseconds,
+ * and operations per second at the median.
+ */
+void he_bench_run(const char *suite, const char *name, const char *param, size_t value,
+                  size_t bytes_per_op, he_bench_fn_t fn, void *context);
+
+/**
+ * @brief Stop the compiler from optimising away work on the memory behind pointer
+ */
+static inline void he_bench_clobber(const void *pointer)
+{
+    __asm__ volatile("" : : "r"(pointer) : "memory");
+}
+
+/// Suites, each runs every benchmark it has that passes the filter
+void he_bench_suite_plugin_chain(void);
+void he_bench_suite_wolf(void);
+void he_bench_suite_padding(void);
+void he_bench_suite_conn(void);
+void he_bench_suite_trace(void);
+void he_bench_suite_compress(void);
+void he_bench_suite_classify(void);
+
+#endif // BENCH_H
@@ -0,0 +1,57 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "he.h"
+#include "classify.h"
+
+// Classifying a full burst of wire headers, all good and with a share of junk mixed in, as a
+// server under a flood of junk would see
+
+typedef struct bench_classify
+{
+    uint8_t storage[HE_CLASSIFY_MAX_BURST][64];
+    const uint8_t *packets[HE_CLASSIFY_MAX_BURST];
+    size_t lengths[HE_CLASSIFY_MAX_BURST];
+    he_classified_burst_t burst;
+} bench_classify_t;
+
+static void bench_classify_burst(void *context, size_t iterations)
+{
+    bench_classify_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        he_classify_burst(bench->packets, bench->lengths, HE_CLASSIFY_MAX_BURST, 1, &bench->burst);
+        he_bench_clobber(&bench->burst);
+    }
+}
+
+static void bench_classify_fill(bench_classify_t *bench, size_t junk_percent)
+{
+    for (size_t i = 0; i < HE_CLASSIFY_MAX_BURST; i++)
+    {
+        he_wire_hdr_t hdr = {{'H', 'e'}, 1, 0};
+        hdr.session = 0x1000 + i % 8;
+        memcpy(bench->storage[i], &hdr, sizeof(hdr));
+        bench->packets[i] = bench->storage[i];
+        bench->lengths[i] = sizeof(bench->storage[i]);
+
+        if (i * 100 / HE_CLASSIFY_MAX_BURST < junk_percent)
+        {
+            bench->storage[i][0] = 'X';
+        }
+    }
+}
+
+void he_bench_suite_classify(void)
+{
+    static const size_t junk[] = {0, 50, 100};
+    static bench_classify_t bench;
+
+    for (size_t i = 0; i < sizeof(junk) / sizeof(junk[0]); i++)
+    {
+        bench_classify_fill(&bench, junk[i]);
+        he_bench_run("classify", "burst", "junk_percent", junk[i], 0, bench_classify_burst, &bench);
+    }
+}
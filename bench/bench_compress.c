@@ -0,0 +1,92 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "he.h"
+#include "compress.h"
+
+// Compressing a packet and restoring it, next to what the bailout costs on a packet that looks
+// encrypted. The egress side works on a copy as it rewrites the packet in place.
+
+typedef struct bench_compress
+{
+    he_compress_plugin_t compress;
+    size_t length;
+    uint8_t source[HE_MAX_MTU];
+    uint8_t compressed[HE_MAX_MTU];
+    size_t compressed_length;
+    uint8_t packet[HE_MAX_MTU];
+} bench_compress_t;
+
+static void bench_compress_egress(void *context, size_t iterations)
+{
+    bench_compress_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        memcpy(bench->packet, bench->source, bench->length);
+        size_t length = bench->length;
+        bench->compress.plugin.do_egress(bench->packet, &length, sizeof(bench->packet),
+                                         bench->compress.plugin.data);
+        he_bench_clobber(bench->packet);
+    }
+}
+
+static void bench_compress_ingress(void *context, size_t iterations)
+{
+    bench_compress_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        memcpy(bench->packet, bench->compressed, bench->compressed_length);
+        size_t length = bench->compressed_length;
+        bench->compress.plugin.do_ingress(bench->packet, &length, sizeof(bench->packet),
+                                          bench->compress.plugin.data);
+        he_bench_clobber(bench->packet);
+    }
+}
+
+static void bench_compress_fill(bench_compress_t *bench, bool random)
+{
+    static const char text[] = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n";
+    uint32_t state = 0x12345678;
+
+    memset(bench->source, 0, sizeof(bench->source));
+    bench->source[0] = 0x45;
+    bench->source[2] = (uint8_t)(bench->length >> 8);
+    bench->source[3] = (uint8_t)bench->length;
+    bench->source[9] = 6;
+    for (size_t i = 20; i < bench->length; i++)
+    {
+        state = state * 1103515245u + 12345u;
+        bench->source[i] = random ? (uint8_t)(state >> 16) : (uint8_t)text[i % (sizeof(text) - 1)];
+    }
+
+    memcpy(bench->compressed, bench->source, bench->length);
+    bench->compressed_length = bench->length;
+    bench->compress.plugin.do_egress(bench->compressed, &bench->compressed_length,
+                                     sizeof(bench->compressed), bench->compress.plugin.data);
+}
+
+void he_bench_suite_compress(void)
+{
+    static const size_t lengths[] = {200, 576, 1350};
+    static bench_compress_t bench;
+
+    he_compress_plugin_init(&bench.compress);
+
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        bench.length = lengths[i];
+
+        bench_compress_fill(&bench, false);
+        he_bench_run("compress", "egress_text", "bytes", bench.length, bench.length,
+                     bench_compress_egress, &bench);
+        he_bench_run("compress", "ingress_text", "bytes", bench.length, bench.length,
+                     bench_compress_ingress, &bench);
+
+        bench_compress_fill(&bench, true);
+        he_bench_run("compress", "egress_random", "bytes", bench.length, bench.length,
+                     bench_compress_egress, &bench);
+    }
+}
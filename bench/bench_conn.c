@@ -0,0 +1,547 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "he.h"
+#include "conn.h"
+#include "conn_template.h"
+#include "core.h"
+#include "handshake_pool.h"
+#include "session_cache.h"
+#include "wolf.h"
+
+#include <wolfssl/certs_test.h>
+
+// An end-to-end client and server he_conn_t pair over real DTLS 1.2, joined by in-memory queues
+// in place of sockets. Each data path operation is one inside packet encrypted by the client,
+// carried across and decrypted by the server. Each handshake operation is a fresh pair of
+// connections brought up from nothing, in full or by resuming a session the server has cached.
+// The data path is also measured while new clients keep arriving, with the server's side of
+// their handshakes run in line or on a handshake pool.
+
+#define BENCH_LINK_SLOTS 64
+
+typedef struct bench_link
+{
+    uint8_t packets[BENCH_LINK_SLOTS][HE_MAX_WIRE_MTU];
+    size_t lengths[BENCH_LINK_SLOTS];
+    size_t head;
+    size_t count;
+    size_t dropped;
+} bench_link_t;
+
+typedef struct bench_pair
+{
+    WOLFSSL_CTX *client_ctx;
+    WOLFSSL_CTX *server_ctx;
+    he_conn_t *client;
+    he_conn_t *server;
+    /// Settings shared by both ends
+    he_conn_template_t *settings;
+    /// Sessions the server can resume, and one the client saved to resume
+    he_session_cache_t *cache;
+    uint8_t session[HE_MAX_SESSION_DATA];
+    size_t session_length;
+    size_t failed_handshakes;
+    size_t full_handshakes;
+    /// The client's second ClientHello, the one with the cookie, replayed to start handshakes
+    uint8_t hello[HE_MAX_WIRE_MTU];
+    size_t hello_length;
+    size_t client_datagrams;
+    uint8_t hello_copy[HE_MAX_WIRE_MTU];
+    /// Settings for the replayed handshakes, and the pool they run on if not in line
+    he_conn_template_t *storm_settings;
+    he_handshake_pool_t *handshake_pool;
+    size_t handshake_every;
+    /// Datagrams on their way from the client to the server, and back
+    bench_link_t to_server;
+    bench_link_t to_client;
+    size_t delivered;
+    size_t size;
+    uint8_t packet[HE_MAX_MTU];
+} bench_pair_t;
+
+static he_return_code_t bench_link_write(he_conn_t *conn, uint8_t *packet, size_t length,
+                                         void *context)
+{
+    bench_pair_t *pair = context;
+    bench_link_t *link = conn == pair->client ? &pair->to_server : &pair->to_client;
+
+    if (conn == pair->client && pair->hello_length == 0 && ++pair->client_datagrams == 2 &&
+        length <= sizeof(pair->hello))
+    {
+        memcpy(pair->hello, packet, length);
+        pair->hello_length = length;
+    }
+
+    if (link->count == BENCH_LINK_SLOTS || length > HE_MAX_WIRE_MTU)
+    {
+        link->dropped++;
+        return HE_SUCCESS;
+    }
+
+    size_t slot = (link->head + link->count) % BENCH_LINK_SLOTS;
+    memcpy(link->packets[slot], packet, length);
+    link->lengths[slot] = length;
+    link->count++;
+
+    return HE_SUCCESS;
+}
+
+static he_return_code_t bench_inside_write(he_conn_t *conn, uint8_t *packet, size_t length,
+                                           void *context)
+{
+    bench_pair_t *pair = context;
+    he_bench_clobber(packet);
+    pair->delivered++;
+    return HE_SUCCESS;
+}
+
+static void bench_link_deliver(bench_link_t *link, he_conn_t *conn)
+{
+    while (link->count)
+    {
+        size_t slot = link->head;
+        link->head = (link->head + 1) % BENCH_LINK_SLOTS;
+        link->count--;
+        he_conn_outside_data_received(conn, link->packets[slot], link->lengths[slot]);
+    }
+}
+
+static void bench_pump(bench_pair_t *pair)
+{
+    while (pair->to_server.count || pair->to_client.count)
+    {
+        bench_link_deliver(&pair->to_server, pair->server);
+        bench_link_deliver(&pair->to_client, pair->client);
+    }
+}
+
+// Any fixed cookie will do, there is no address to bind it to
+static int bench_gen_cookie(WOLFSSL *ssl, unsigned char *buf, int sz, void *ctx)
+{
+    memset(buf, 0x42, (size_t)sz);
+    return sz;
+}
+
+static WOLFSSL_CTX *bench_create_ctx(bool server)
+{
+    WOLFSSL_CTX *ctx =
+        wolfSSL_CTX_new(server ? wolfDTLSv1_2_server_method() : wolfDTLSv1_2_client_method());
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    wolfSSL_CTX_SetIORecv(ctx, he_wolf_dtls_read);
+    wolfSSL_CTX_SetIOSend(ctx, he_wolf_dtls_write);
+
+    if (server)
+    {
+        wolfSSL_CTX_SetGenCookie(ctx, bench_gen_cookie);
+        if (wolfSSL_CTX_use_certificate_buffer(ctx, server_cert_der_2048,
+                                               sizeof_server_cert_der_2048,
+                                               WOLFSSL_FILETYPE_ASN1) != WOLFSSL_SUCCESS ||
+            wolfSSL_CTX_use_PrivateKey_buffer(ctx, server_key_der_2048,
+                                              sizeof_server_key_der_2048,
+                                              WOLFSSL_FILETYPE_ASN1) != WOLFSSL_SUCCESS)
+        {
+            wolfSSL_CTX_free(ctx);
+            return NULL;
+        }
+    }
+    else
+    {
+        // Only the data path is being measured, who the server is doesn't matter
+        wolfSSL_CTX_set_verify(ctx, WOLFSSL_VERIFY_NONE, NULL);
+    }
+
+    return ctx;
+}
+
+static he_conn_t *bench_create_conn(WOLFSSL_CTX *ctx, he_conn_template_t *settings,
+                                    bench_pair_t *pair)
+{
+    he_conn_t *conn = he_conn_create();
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+
+    he_conn_set_template(conn, settings);
+    conn->data = pair;
+
+    conn->wolf_ssl = wolfSSL_new(ctx);
+    if (conn->wolf_ssl == NULL)
+    {
+        he_conn_destroy(conn);
+        return NULL;
+    }
+    wolfSSL_SetIOReadCtx(conn->wolf_ssl, conn);
+    wolfSSL_SetIOWriteCtx(conn->wolf_ssl, conn);
+    wolfSSL_dtls_set_using_nonblock(conn->wolf_ssl, 1);
+
+    return conn;
+}
+
+// There is no client behind a replayed handshake, so stop it once the server has answered
+static he_return_code_t bench_storm_write(he_conn_t *conn, uint8_t *packet, size_t length,
+                                          void *context)
+{
+    he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
+    return HE_SUCCESS;
+}
+
+static void bench_pair_close(bench_pair_t *pair)
+{
+    he_conn_destroy(pair->client);
+    he_conn_destroy(pair->server);
+    pair->client = NULL;
+    pair->server = NULL;
+    memset(&pair->to_server, 0, sizeof(pair->to_server));
+    memset(&pair->to_client, 0, sizeof(pair->to_client));
+}
+
+static void bench_pair_destroy(bench_pair_t *pair)
+{
+    bench_pair_close(pair);
+    he_conn_template_release(pair->settings);
+    he_conn_template_release(pair->storm_settings);
+    wolfSSL_CTX_free(pair->client_ctx);
+    wolfSSL_CTX_free(pair->server_ctx);
+    he_session_cache_destroy(pair->cache);
+}
+
+static bool bench_pair_init(bench_pair_t *pair)
+{
+    static const he_conn_settings_t settings = {
+        .connection_type = HE_CONNECTION_TYPE_DATAGRAM,
+        .outside_write_cb = bench_link_write,
+        .inside_write_cb = bench_inside_write,
+    };
+
+    static const he_conn_settings_t storm_settings = {
+        .connection_type = HE_CONNECTION_TYPE_DATAGRAM,
+        .outside_write_cb = bench_storm_write,
+    };
+
+    pair->settings = he_conn_template_create(&settings);
+    pair->storm_settings = he_conn_template_create(&storm_settings);
+    pair->client_ctx = bench_create_ctx(false);
+    pair->server_ctx = bench_create_ctx(true);
+    pair->cache = he_session_cache_create(1024, 1);
+    if (pair->settings == NULL || pair->storm_settings == NULL || pair->client_ctx == NULL ||
+        pair->server_ctx == NULL || pair->cache == NULL)
+    {
+        return false;
+    }
+
+    return he_session_cache_attach(pair->cache, pair->server_ctx) == HE_SUCCESS;
+}
+
+static bool bench_pair_connect(bench_pair_t *pair, bool resume)
+{
+    pair->client = bench_create_conn(pair->client_ctx, pair->settings, pair);
+    pair->server = bench_create_conn(pair->server_ctx, pair->settings, pair);
+    if (pair->client == NULL || pair->server == NULL)
+    {
+        return false;
+    }
+
+    if (resume && pair->session_length &&
+        he_conn_set_resumption_data(pair->client, pair->session, pair->session_length) !=
+            HE_SUCCESS)
+    {
+        return false;
+    }
+
+    // The handshake is driven by the receive path, wolfSSL_connect() only sends the first flight
+    wolfSSL_connect(pair->client->wolf_ssl);
+    for (int round = 0; round < 100; round++)
+    {
+        bench_pump(pair);
+
+        if (wolfSSL_is_init_finished(pair->client->wolf_ssl) &&
+            wolfSSL_is_init_finished(pair->server->wolf_ssl))
+        {
+            he_internal_change_conn_state(pair->client, HE_STATE_ONLINE);
+            he_internal_change_conn_state(pair->server, HE_STATE_ONLINE);
+            return true;
+        }
+
+        wolfSSL_connect(pair->client->wolf_ssl);
+    }
+
+    return false;
+}
+
+// Handshakes per second is the number that decides how fast a server recovers from a failover
+static void bench_handshake(bench_pair_t *pair, size_t iterations, bool resume)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (!bench_pair_connect(pair, resume))
+        {
+            pair->failed_handshakes++;
+        }
+        else if (resume && !he_conn_is_resumed(pair->client))
+        {
+            pair->full_handshakes++;
+        }
+        bench_pair_close(pair);
+    }
+}
+
+static void bench_handshake_full(void *context, size_t iterations)
+{
+    bench_handshake(context, iterations, false);
+}
+
+static void bench_handshake_resumed(void *context, size_t iterations)
+{
+    bench_handshake(context, iterations, true);
+}
+
+static void bench_set_packet_size(bench_pair_t *pair, size_t size)
+{
+    pair->size = size;
+
+    // An IPv4 header carrying the real length, so padding is stripped on arrival
+    memset(pair->packet, 0, sizeof(pair->packet));
+    pair->packet[0] = 0x45;
+    pair->packet[2] = (uint8_t)(size >> 8);
+    pair->packet[3] = (uint8_t)size;
+}
+
+static void bench_client_to_server(void *context, size_t iterations)
+{
+    bench_pair_t *pair = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        he_conn_inside_packet_received(pair->client, pair->packet, pair->size,
+                                       sizeof(pair->packet));
+        bench_link_deliver(&pair->to_server, pair->server);
+    }
+}
+
+static void bench_storm_done(he_conn_t *conn, he_return_code_t result, void *context)
+{
+    he_conn_destroy(conn);
+}
+
+// The server's half of a new client's handshake: the certificate, the key exchange and signing it
+static void bench_start_handshake(bench_pair_t *pair)
+{
+    he_conn_t *conn = bench_create_conn(pair->server_ctx, pair->storm_settings, pair);
+    if (conn == NULL)
+    {
+        pair->failed_handshakes++;
+        return;
+    }
+    he_internal_change_conn_state(conn, HE_STATE_CONNECTING);
+
+    bool queued = false;
+    if (pair->handshake_pool)
+    {
+        he_handshake_pool_route(pair->handshake_pool, 0, conn, pair->hello, pair->hello_length,
+                                &queued);
+    }
+
+    if (!queued)
+    {
+        memcpy(pair->hello_copy, pair->hello, pair->hello_length);
+        he_conn_outside_data_received(conn, pair->hello_copy, pair->hello_length);
+        he_conn_destroy(conn);
+    }
+}
+
+static void bench_client_to_server_under_handshakes(void *context, size_t iterations)
+{
+    bench_pair_t *pair = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (i % pair->handshake_every == 0)
+        {
+            bench_start_handshake(pair);
+        }
+        if (pair->handshake_pool)
+        {
+            he_handshake_pool_collect(pair->handshake_pool, 0, 16, bench_storm_done, NULL);
+        }
+
+        he_conn_inside_packet_received(pair->client, pair->packet, pair->size,
+                                       sizeof(pair->packet));
+        bench_link_deliver(&pair->to_server, pair->server);
+    }
+}
+
+static void bench_drain_handshake_pool(bench_pair_t *pair)
+{
+    he_handshake_pool_stats_t stats = {0};
+    for (int i = 0; i < 5000; i++)
+    {
+        he_handshake_pool_collect(pair->handshake_pool, 0, SIZE_MAX, bench_storm_done, NULL);
+        he_handshake_pool_get_stats(pair->handshake_pool, &stats);
+        if (stats.in_flight == 0)
+        {
+            break;
+        }
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+
+    if (stats.declined || stats.dropped)
+    {
+        fprintf(stderr, "conn: the handshake pool declined %llu handshakes, dropped %llu datagrams\n",
+                (unsigned long long)stats.declined, (unsigned long long)stats.dropped);
+    }
+    he_handshake_pool_destroy(pair->handshake_pool);
+    pair->handshake_pool = NULL;
+}
+
+// What a server pays per connection before the handshake starts
+static void bench_create_destroy(void *context, size_t iterations)
+{
+    he_conn_template_t *settings = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        he_conn_t *conn = he_conn_create();
+        he_conn_set_template(conn, settings);
+        he_bench_clobber(conn);
+        he_conn_destroy(conn);
+    }
+}
+
+void he_bench_suite_conn(void)
+{
+    static const size_t sizes[] = {64, 256, 576, 1024, 1350};
+    static bench_pair_t pair;
+
+    he_conn_template_t *settings = he_conn_template_create(NULL);
+    if (settings != NULL)
+    {
+        he_bench_run("conn", "create_destroy", "conn_bytes", sizeof(he_conn_t), 0,
+                     bench_create_destroy, settings);
+        he_conn_template_release(settings);
+    }
+
+    bool handshakes =
+        he_bench_enabled("conn", "handshake_full") || he_bench_enabled("conn", "handshake_resumed");
+    bool storm = he_bench_enabled("conn", "client_to_server_handshakes_inline") ||
+                 he_bench_enabled("conn", "client_to_server_handshakes_pool");
+    if (!handshakes && !storm && !he_bench_enabled("conn", "client_to_server"))
+    {
+        return;
+    }
+
+    memset(&pair, 0, sizeof(pair));
+    wolfSSL_Init();
+
+    if (!bench_pair_init(&pair))
+    {
+        fprintf(stderr, "conn: setting up the benchmark pair failed\n");
+        bench_pair_destroy(&pair);
+        wolfSSL_Cleanup();
+        return;
+    }
+
+    if (handshakes)
+    {
+        he_bench_run("conn", "handshake_full", "key_bits", 2048, 0, bench_handshake_full, &pair);
+
+        // Save one session for every resumed handshake to offer
+        size_t length = sizeof(pair.session);
+        if (bench_pair_connect(&pair, false) &&
+            he_conn_get_resumption_data(pair.client, pair.session, &length) == HE_SUCCESS)
+        {
+            pair.session_length = length;
+            bench_pair_close(&pair);
+            he_bench_run("conn", "handshake_resumed", "key_bits", 2048, 0, bench_handshake_resumed,
+                         &pair);
+        }
+        bench_pair_close(&pair);
+
+        he_session_cache_stats_t stats;
+        he_session_cache_get_stats(pair.cache, &stats);
+        if (pair.failed_handshakes || pair.full_handshakes || pair.session_length == 0)
+        {
+            fprintf(stderr,
+                    "conn: %zu handshakes failed, %zu resumptions fell back to a full handshake, "
+                    "%llu of %llu session lookups hit\n",
+                    pair.failed_handshakes, pair.full_handshakes, (unsigned long long)stats.hits,
+                    (unsigned long long)stats.lookups);
+        }
+    }
+
+    if (!storm && !he_bench_enabled("conn", "client_to_server"))
+    {
+        bench_pair_destroy(&pair);
+        wolfSSL_Cleanup();
+        return;
+    }
+
+    if (!bench_pair_connect(&pair, false))
+    {
+        fprintf(stderr, "conn: DTLS handshake between the benchmark pair failed\n");
+        bench_pair_destroy(&pair);
+        wolfSSL_Cleanup();
+        return;
+    }
+
+    static const struct
+    {
+        const char *name;
+        he_padding_type_t padding_type;
+    } modes[] = {
+        {"client_to_server", HE_PADDING_NONE},
+        {"client_to_server_pad_450", HE_PADDING_450},
+        {"client_to_server_pad_full", HE_PADDING_FULL},
+    };
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        he_conn_set_padding_type(pair.client, modes[m].padding_type);
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            bench_set_packet_size(&pair, sizes[i]);
+            he_bench_run("conn", modes[m].name, "bytes", pair.size, pair.size,
+                         bench_client_to_server, &pair);
+        }
+    }
+
+    // One new client every 64 packets, with the handshakes in line and then on two threads
+    if (storm && pair.hello_length)
+    {
+        he_conn_set_padding_type(pair.client, HE_PADDING_NONE);
+        bench_set_packet_size(&pair, 576);
+        pair.handshake_every = 64;
+
+        he_bench_run("conn", "client_to_server_handshakes_inline", "handshake_every",
+                     pair.handshake_every, pair.size, bench_client_to_server_under_handshakes,
+                     &pair);
+
+        pair.handshake_pool = he_handshake_pool_create(2, 1, 4096, 1024);
+        if (pair.handshake_pool)
+        {
+            he_bench_run("conn", "client_to_server_handshakes_pool", "handshake_every",
+                         pair.handshake_every, pair.size, bench_client_to_server_under_handshakes,
+                         &pair);
+            bench_drain_handshake_pool(&pair);
+        }
+    }
+
+    if (pair.to_server.dropped || pair.delivered == 0)
+    {
+        fprintf(stderr, "conn: %zu datagrams dropped, %zu packets delivered\n",
+                pair.to_server.dropped, pair.delivered);
+    }
+
+    bench_pair_destroy(&pair);
+    wolfSSL_Cleanup();
+}
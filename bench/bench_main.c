@@ -0,0 +1,101 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct he_bench_suite
+{
+    const char *name;
+    void (*run)(void);
+} he_bench_suite_t;
+
+static const he_bench_suite_t he_bench_suites[] = {
+    {"plugin_chain", he_bench_suite_plugin_chain},
+    {"wolf", he_bench_suite_wolf},
+    {"padding", he_bench_suite_padding},
+    {"conn", he_bench_suite_conn},
+    {"trace", he_bench_suite_trace},
+    {"compress", he_bench_suite_compress},
+    {"classify", he_bench_suite_classify},
+};
+
+static void he_bench_usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [--format json|csv] [--samples N] [--min-sample-us N] [--filter TEXT]\n"
+            "\n"
+            "Runs every benchmark whose \"suite/name\" contains TEXT and prints one result per\n"
+            "line to stdout, as JSON objects or CSV with a header row.\n"
+            "\n"
+            "Suites:",
+            program);
+    for (size_t i = 0; i < sizeof(he_bench_suites) / sizeof(he_bench_suites[0]); i++)
+    {
+        fprintf(stderr, " %s", he_bench_suites[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    he_bench_options_t options = {
+        .format = HE_BENCH_FORMAT_JSON,
+        .samples = 50,
+        .min_sample_ns = 2000000,
+        .filter = NULL,
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--format") == 0 && value)
+        {
+            if (strcmp(value, "csv") == 0)
+            {
+                options.format = HE_BENCH_FORMAT_CSV;
+            }
+            else if (strcmp(value, "json") == 0)
+            {
+                options.format = HE_BENCH_FORMAT_JSON;
+            }
+            else
+            {
+                he_bench_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--samples") == 0 && value)
+        {
+            options.samples = strtoul(value, NULL, 10);
+            i++;
+        }
+        else if (strcmp(arg, "--min-sample-us") == 0 && value)
+        {
+            options.min_sample_ns = strtoull(value, NULL, 10) * 1000;
+            i++;
+        }
+        else if (strcmp(arg, "--filter") == 0 && value)
+        {
+            options.filter = value;
+            i++;
+        }
+        else
+        {
+            he_bench_usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    he_bench_init(&options);
+
+    for (size_t i = 0; i < sizeof(he_bench_suites) / sizeof(he_bench_suites[0]); i++)
+    {
+        he_bench_suites[i].run();
+    }
+
+    return 0;
+}
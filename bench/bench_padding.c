@@ -0,0 +1,62 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "he.h"
+#include "core.h"
+
+// Padding is timed on its own, apart from encryption, so the cost of hiding packet sizes can be
+// quoted separately from the cost of the tunnel itself
+
+typedef struct bench_padding
+{
+    he_padding_type_t padding_type;
+    size_t length;
+    uint8_t packet[HE_MAX_MTU];
+} bench_padding_t;
+
+static void bench_pad(void *context, size_t iterations)
+{
+    bench_padding_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t padded = he_internal_get_padded_length(bench->padding_type, bench->length);
+        he_internal_pad_packet(bench->packet, bench->length, padded);
+        he_bench_clobber(bench->packet);
+    }
+}
+
+static void bench_strip(void *context, size_t iterations)
+{
+    bench_padding_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t length = he_internal_strip_padding(bench->packet, HE_MAX_MTU);
+        he_bench_clobber(&length);
+    }
+}
+
+void he_bench_suite_padding(void)
+{
+    static const size_t lengths[] = {40, 200, 576, 1000, 1280};
+    static bench_padding_t bench;
+
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        bench.length = lengths[i];
+
+        // An IPv4 header with the right total length, as strip_padding expects
+        memset(bench.packet, 0, sizeof(bench.packet));
+        bench.packet[0] = 0x45;
+        bench.packet[2] = (uint8_t)(bench.length >> 8);
+        bench.packet[3] = (uint8_t)bench.length;
+
+        bench.padding_type = HE_PADDING_FULL;
+        he_bench_run("padding", "pad_full", "bytes", bench.length, bench.length, bench_pad, &bench);
+        bench.padding_type = HE_PADDING_450;
+        he_bench_run("padding", "pad_450", "bytes", bench.length, bench.length, bench_pad, &bench);
+        he_bench_run("padding", "strip", "bytes", bench.length, bench.length, bench_strip, &bench);
+    }
+}
@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include "he.h"
+#include "plugin_chain.h"
+
+#define BENCH_MAX_PLUGINS 16
+
+typedef struct bench_chain
+{
+    he_plugin_chain_t *chain;
+    uint8_t packet[HE_MAX_WIRE_MTU];
+    size_t length;
+} bench_chain_t;
+
+// Touches the packet so each plugin costs a call and a look at the data, nothing more. What is
+// being measured is the chain's own overhead per plugin.
+static he_plugin_return_code_t bench_touch_hook(uint8_t *packet, size_t *length, size_t capacity,
+                                                void *data)
+{
+    he_bench_clobber(packet);
+    return HE_PLUGIN_SUCCESS;
+}
+
+static void bench_ingress(void *context, size_t iterations)
+{
+    bench_chain_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t length = bench->length;
+        he_plugin_ingress(bench->chain, bench->packet, &length, sizeof(bench->packet));
+        he_bench_clobber(&length);
+    }
+}
+
+static void bench_egress(void *context, size_t iterations)
+{
+    bench_chain_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t length = bench->length;
+        he_plugin_egress(bench->chain, bench->packet, &length, sizeof(bench->packet));
+        he_bench_clobber(&length);
+    }
+}
+
+void he_bench_suite_plugin_chain(void)
+{
+    static const size_t plugin_counts[] = {0, 1, 2, 4, 8, 16};
+    static plugin_struct_t plugins[BENCH_MAX_PLUGINS];
+    static bench_chain_t bench;
+
+    for (size_t i = 0; i < BENCH_MAX_PLUGINS; i++)
+    {
+        plugins[i].do_ingress = bench_touch_hook;
+        plugins[i].do_egress = bench_touch_hook;
+    }
+
+    bench.length = HE_MAX_MTU;
+
+    for (size_t i = 0; i < sizeof(plugin_counts) / sizeof(plugin_counts[0]); i++)
+    {
+        bench.chain = he_plugin_chain_create();
+        if (bench.chain == NULL)
+        {
+            return;
+        }
+
+        for (size_t p = 0; p < plugin_counts[i]; p++)
+        {
+            he_plugin_register_plugin(bench.chain, &plugins[p]);
+        }
+
+        he_bench_run("plugin_chain", "ingress", "plugins", plugin_counts[i], bench.length,
+                     bench_ingress, &bench);
+        he_bench_run("plugin_chain", "egress", "plugins", plugin_counts[i], bench.length,
+                     bench_egress, &bench);
+
+        he_plugin_destroy_chain(bench.chain);
+    }
+}
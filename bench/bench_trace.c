@@ -0,0 +1,26 @@
+#include "bench.h"
+
+#include "he.h"
+#include "trace.h"
+
+// What a tracepoint costs on the data path, with recording switched on and off. Called directly
+// so it is measured whether or not this build has HE_ENABLE_TRACE.
+
+static void bench_trace_pair(void *context, size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        he_internal_trace(0x1234, HE_TRACE_DTLS_WRITE, HE_TRACE_EVENT_BEGIN, 0, 1350, 0);
+        he_internal_trace(0x1234, HE_TRACE_DTLS_WRITE, HE_TRACE_EVENT_END, 0, 1350, 1350);
+    }
+}
+
+void he_bench_suite_trace(void)
+{
+    he_trace_set_enabled(false);
+    he_bench_run("trace", "begin_end_disabled", "records", 2, 0, bench_trace_pair, NULL);
+
+    he_trace_set_enabled(true);
+    he_bench_run("trace", "begin_end_enabled", "records", 2, 0, bench_trace_pair, NULL);
+    he_trace_set_enabled(false);
+}
@@ -0,0 +1,102 @@
+#include "bench.h"
+
+#include <string.h>
+
+#include "he.h"
+#include "conn.h"
+#include "conn_template.h"
+#include "wolf.h"
+
+static const size_t bench_record_sizes[] = {64, 128, 256, 512, 1024, 1400};
+
+typedef struct bench_wolf
+{
+    he_conn_t *conn;
+    size_t size;
+    uint8_t record[HE_MAX_WIRE_MTU];
+    char ssl_buffer[HE_MAX_WIRE_MTU];
+} bench_wolf_t;
+
+static he_return_code_t bench_outside_write(he_conn_t *conn, uint8_t *packet, size_t length,
+                                            void *context)
+{
+    he_bench_clobber(packet);
+    return HE_SUCCESS;
+}
+
+static he_return_code_t bench_outside_write_gather(he_conn_t *conn, const uint8_t *header,
+                                                   size_t header_length, const uint8_t *payload,
+                                                   size_t payload_length, void *context)
+{
+    he_bench_clobber(header);
+    he_bench_clobber(payload);
+    return HE_SUCCESS;
+}
+
+static void bench_dtls_read(void *context, size_t iterations)
+{
+    bench_wolf_t *bench = context;
+    he_conn_t *conn = bench->conn;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        // What he_conn_outside_data_received() sets up before each wolfSSL_read()
+        conn->incoming_data = bench->record;
+        conn->incoming_data_length = bench->size;
+        conn->packet_seen = false;
+
+        int res = he_wolf_dtls_read(NULL, bench->ssl_buffer, sizeof(bench->ssl_buffer), conn);
+        he_bench_clobber(&res);
+    }
+}
+
+static void bench_dtls_write(void *context, size_t iterations)
+{
+    bench_wolf_t *bench = context;
+
+    for (size_t i = 0; i < iterations; i++)
+    {
+        int res = he_wolf_dtls_write(NULL, bench->ssl_buffer, (int)bench->size, bench->conn);
+        he_bench_clobber(&res);
+    }
+}
+
+void he_bench_suite_wolf(void)
+{
+    static bench_wolf_t bench;
+
+    bench.conn = he_conn_create();
+    if (bench.conn == NULL)
+    {
+        return;
+    }
+    // Online, so records are only sent once
+    bench.conn->state = HE_STATE_ONLINE;
+    he_conn_settings_t *settings = he_conn_edit_settings(bench.conn);
+    if (settings == NULL)
+    {
+        he_conn_destroy(bench.conn);
+        return;
+    }
+    settings->outside_write_cb = bench_outside_write;
+    memset(bench.record, 0x5a, sizeof(bench.record));
+    memset(bench.ssl_buffer, 0xa5, sizeof(bench.ssl_buffer));
+
+    for (size_t i = 0; i < sizeof(bench_record_sizes) / sizeof(bench_record_sizes[0]); i++)
+    {
+        bench.size = bench_record_sizes[i];
+
+        he_bench_run("wolf", "dtls_read", "bytes", bench.size, bench.size, bench_dtls_read, &bench);
+
+        settings->outside_write_gather_cb = NULL;
+        he_bench_run("wolf", "dtls_write", "bytes", bench.size, bench.size, bench_dtls_write,
+                     &bench);
+
+        settings->outside_write_gather_cb = bench_outside_write_gather;
+        he_bench_run("wolf", "dtls_write_gather", "bytes", bench.size, bench.size,
+                     bench_dtls_write, &bench);
+    }
+
+    bench.conn->incoming_data = NULL;
+    he_conn_destroy(bench.conn);
+}
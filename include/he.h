@@ -1,3 +1,6 @@
+#ifndef HE_H
+#define HE_H
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -11,11 +14,17 @@
 /// Maximum size of an IPV4 String
 #define HE_MAX_IPV4_STRING_LENGTH 24
 
+/// Size of a TLS record header: content type, version and length
+#define HE_TLS_RECORD_HEADER_SIZE 5
+
 /// Default MTU sizes
 #define HE_MAX_WIRE_MTU 1500
 #define HE_MAX_MTU 1350
 #define HE_MAX_MTU_STR "1350"
 
+/// Largest serialised D/TLS session Helium hands out or takes back for resumption
+#define HE_MAX_SESSION_DATA 4096
+
 typedef enum he_return_code
 {
   /// If the function call completed successfully, this will be returned.
@@ -138,6 +147,14 @@ typedef enum he_return_code
   HE_ERR_SERVER_GOODBYE = -56,
   /// Invalid authentication type
   HE_ERR_INVALID_AUTH_TYPE = -57,
+  /// The session ID is already in use
+  HE_ERR_SESSION_EXISTS = -58,
+  /// The destination queue is full, the packet was not queued
+  HE_ERR_QUEUE_FULL = -59,
+  /// The shard index is out of range
+  HE_ERR_INVALID_SHARD = -60,
+  /// The buffer given is too small for the data
+  HE_ERR_BUFFER_TOO_SMALL = -61,
 } he_return_code_t;
 
 typedef enum he_conn_state
@@ -174,6 +191,8 @@ typedef enum he_conn_event
     HE_EVENT_SECURE_RENEGOTIATION_COMPLETED = 4,
     // Pending Session Acknowledged
     HE_EVENT_PENDING_SESSION_ACKNOWLEDGED = 5,
+    // Path MTU discovery changed the connection's inside MTU, see he_conn_get_inside_mtu()
+    HE_EVENT_PMTU_CHANGED = 6,
 } he_conn_event_t;
 
 typedef enum he_plugin_return_code
@@ -197,20 +216,80 @@ typedef he_plugin_return_code_t (*plugin_do_egress) (
     void *data
 );
 
+/**
+ * @brief Optional batch variants of the plugin hooks
+ * @param packets Array of pointers to the packets in the batch
+ * @param lengths Array of packet lengths, which the plugin may update
+ * @param capacities Array of buffer capacities for each packet
+ * @param verdicts Array of per-packet verdicts, both input and output
+ * @param count Number of entries in each of the arrays
+ * @param data The plugin's data pointer
+ * @return HE_PLUGIN_FAIL to fail every packet still live in the batch, otherwise HE_PLUGIN_SUCCESS
+ *
+ * Only packets whose verdict is HE_PLUGIN_SUCCESS on entry are live; the hook must leave the
+ * other entries untouched. To drop or fail an individual packet the hook sets its verdict to
+ * HE_PLUGIN_DROP or HE_PLUGIN_FAIL.
+ */
+typedef he_plugin_return_code_t (*plugin_do_ingress_batch) (
+    uint8_t **packets,
+    size_t *lengths,
+    const size_t *capacities,
+    he_plugin_return_code_t *verdicts,
+    size_t count,
+    void *data
+);
+
+typedef he_plugin_return_code_t (*plugin_do_egress_batch) (
+    uint8_t **packets,
+    size_t *lengths,
+    const size_t *capacities,
+    he_plugin_return_code_t *verdicts,
+    size_t count,
+    void *data
+);
+
 typedef struct plugin_struct
 {
     plugin_do_ingress do_ingress;
     plugin_do_egress do_egress;
     void *data;
+    /// Optional, used by he_plugin_ingress_batch in preference to calling do_ingress per packet
+    plugin_do_ingress_batch do_ingress_batch;
+    /// Optional, used by he_plugin_egress_batch in preference to calling do_egress per packet
+    plugin_do_egress_batch do_egress_batch;
 } plugin_struct_t;
 
+/**
+ * @brief A flat list of plugins, walked with a plain loop on every packet
+ *
+ * Plugins are kept in registration order. Alongside that list the chain keeps two compacted
+ * arrays holding only the plugins that implement ingress and egress (single or batch hook)
+ * respectively, so the per-packet loops never have to skip over plugins that don't care about
+ * that direction.
+ *
+ * All three arrays live in a single allocation of 3 * capacity pointers which is doubled when
+ * full, making registration O(1) amortized.
+ */
 typedef struct he_plugin_chain he_plugin_chain_t;
 struct he_plugin_chain
 {
-    plugin_struct_t *plugin;
-    he_plugin_chain_t *next;
+    /// All registered plugins, in registration order
+    plugin_struct_t **plugins;
+    /// Plugins with an ingress handler, in registration order
+    plugin_struct_t **ingress;
+    /// Plugins with an egress handler, in registration order
+    plugin_struct_t **egress;
+    size_t num_plugins;
+    size_t num_ingress;
+    size_t num_egress;
+    /// Number of slots available in each of the three arrays
+    size_t capacity;
+    /// The arrays belong to someone else (e.g. a connection pool), never grow or free them
+    bool fixed_storage;
 };
 
+typedef struct he_conn he_conn_t;
+
 typedef enum he_connection_type {
   /// Datagram mode (i.e. UDP)
   HE_CONNECTION_TYPE_DATAGRAM = 0,
@@ -227,6 +306,29 @@ typedef enum he_padding_type {
   HE_PADDING_450 = 2
 } he_padding_type_t;
 
+typedef enum he_stats_direction {
+  /// Packets from the inside (i.e. the tun device) handed to Helium to send
+  HE_STATS_INSIDE_IN = 0,
+  /// Decrypted packets handed to the inside write callbacks
+  HE_STATS_INSIDE_OUT = 1,
+  /// Datagrams (or stream reads) received on the outside
+  HE_STATS_OUTSIDE_IN = 2,
+  /// Records handed to the outside write callbacks, not counting aggressive mode duplicates
+  HE_STATS_OUTSIDE_OUT = 3,
+  HE_STATS_DIRECTIONS = 4
+} he_stats_direction_t;
+
+/// Counters for a single connection, only ever written by the thread serving it
+typedef struct he_conn_stats {
+  /// Indexed by he_stats_direction_t
+  uint64_t packets[HE_STATS_DIRECTIONS];
+  uint64_t bytes[HE_STATS_DIRECTIONS];
+  /// Packets dropped for any reason, the per-thread stats break this down by reason
+  uint64_t dropped;
+  /// Extra copies of records sent while connecting or in aggressive mode
+  uint64_t aggressive_duplicates;
+} he_conn_stats_t;
+
 /**
  * @brief The prototype for the state callback function
  * @param conn A pointer to the connection that triggered this callback
@@ -275,6 +377,24 @@ typedef he_return_code_t (*he_nudge_time_cb_t)(he_conn_t *conn, int timeout, voi
 typedef he_return_code_t (*he_inside_write_cb_t)(he_conn_t *conn, uint8_t *packet, size_t length,
                                                  void *context);
 
+/**
+ * @brief The prototype for the batched inside write callback function
+ * @param conn A pointer to the connection that triggered this callback
+ * @param packets An array of pointers to the decrypted packets, in the order they were received
+ * @param lengths An array holding the length of each packet in bytes
+ * @param count The number of packets
+ * @param context A pointer to the user defined context
+ * @see he_conn_outside_data_received_batch
+ *
+ * Used by he_conn_outside_data_received_batch() in place of the inside write callback so that
+ * a whole burst of decrypted packets can be written to the tun device at once.
+ *
+ * @note The packets are only valid until the callback returns.
+ */
+typedef he_return_code_t (*he_inside_write_batch_cb_t)(he_conn_t *conn, uint8_t **packets,
+                                                       size_t *lengths, size_t count,
+                                                       void *context);
+
 /**
  * @brief The prototype for the outside write callback function
  * @param conn A pointer to the connection that triggered this callback
@@ -285,10 +405,62 @@ typedef he_return_code_t (*he_inside_write_cb_t)(he_conn_t *conn, uint8_t *packe
  *
  * Whenever Helium needs to do an outside write this function will be called. On Linux this would
  * usually be writing to a UDP socket to send encrypted data over the Internet.
+ *
+ * @note The packet is only valid until the callback returns. The callback may send on other
+ * connections, those writes don't disturb the packet.
  */
 typedef he_return_code_t (*he_outside_write_cb_t)(he_conn_t *conn, uint8_t *packet, size_t length,
                                                   void *context);
 
+/**
+ * @brief The prototype for the gather variant of the outside write callback
+ * @param conn A pointer to the connection that triggered this callback
+ * @param header A pointer to the Helium wire header, NULL on stream connections
+ * @param header_length The length of the wire header in bytes, 0 on stream connections
+ * @param payload A pointer to the D/TLS record that follows the header
+ * @param payload_length The length of the D/TLS record in bytes
+ * @param context A pointer to the user defined context
+ * @see he_conn_set_context Sets the value of the context pointer
+ *
+ * When set and no outside plugin modifies outgoing packets, Helium calls this instead of the
+ * outside write callback. The datagram to send is the header followed by the payload; the payload
+ * points straight into wolfSSL's output buffer so nothing is copied to build the packet. On Linux
+ * this maps directly onto sendmsg() with a two element iovec. Stream connections send the TLS
+ * records as they are, without a wire header.
+ *
+ * @note Both pointers are only valid until the callback returns.
+ */
+typedef he_return_code_t (*he_outside_write_gather_cb_t)(he_conn_t *conn, const uint8_t *header,
+                                                         size_t header_length,
+                                                         const uint8_t *payload,
+                                                         size_t payload_length, void *context);
+
+/// A single datagram queued for the outside batch write callback
+typedef struct he_outside_datagram {
+  /// Start of the datagram, including the wire header
+  const uint8_t *packet;
+  /// Length of the datagram in bytes
+  size_t length;
+} he_outside_datagram_t;
+
+/**
+ * @brief The prototype for the batched outside write callback function
+ * @param conn A pointer to the connection that triggered this callback
+ * @param datagrams An array of datagrams to send, in order
+ * @param count The number of entries in datagrams
+ * @param context A pointer to the user defined context
+ * @see he_conn_set_outside_write_batch_cb
+ *
+ * Records produced while Helium processes a burst of input are queued and handed over in a single
+ * call at the end of the burst, which maps directly onto one sendmmsg() call on Linux. Aggressive
+ * mode duplicates are separate entries that point at the same packet memory.
+ *
+ * @note The datagrams are only valid until the callback returns.
+ */
+typedef he_return_code_t (*he_outside_write_batch_cb_t)(he_conn_t *conn,
+                                                        const he_outside_datagram_t *datagrams,
+                                                        size_t count, void *context);
+
 typedef struct he_network_config_ipv4 {
   char local_ip[HE_MAX_IPV4_STRING_LENGTH];
   char peer_ip[HE_MAX_IPV4_STRING_LENGTH];
@@ -389,58 +561,59 @@ typedef struct he_version_info {
   uint8_t minor_version;
 } he_version_info_t;
 
-typedef struct he_packet_buffer {
-  // Buffer has data
-  bool has_packet;
-  // Size of packet
-  int packet_size;
-  // The packet itself
-  uint8_t packet[HE_MAX_WIRE_MTU];
-} he_packet_buffer_t;
-
-typedef struct he_conn he_conn_t;
-struct he_conn {
-  /// Internal Structure Member for client/server determination
-  /// No explicit setter or getter, we internally set this in
-  /// either client or server connect functions
-  bool is_server;
-
-  /// Client State
-  he_conn_state_t state;
-
-  /// Pointer to incoming data buffer
-  uint8_t *incoming_data;
-  /// Length of the data in the
-  size_t incoming_data_length;
-  // WolfSSL stuff
-  WOLFSSL *wolf_ssl;
-  /// Wolf Timeout
-  int wolf_timeout;
-  /// Write buffer
-  uint8_t write_buffer[HE_MAX_WIRE_MTU];
-  /// Packet seen
-  bool packet_seen;
-  /// Session ID
-  uint64_t session_id;
-  uint64_t pending_session_id;
-  /// Read packet buffers
-  he_packet_buffer_t read_packet;
-  /// Has the first message been received?
-  bool first_message_received;
-  /// Bytes left to read in the packet buffer (Streaming only)
-  size_t incoming_data_left_to_read;
-  /// Index into the incoming data buffer
-  uint8_t *incoming_data_read_offset_ptr;
-
-  bool renegotiation_in_progress;
-  bool renegotiation_due;
-
-  /// Do we already have a timer running? If so, we don't want to generate new callbacks
-  bool is_nudge_timer_running;
-
-  he_plugin_chain_t *inside_plugins;
-  he_plugin_chain_t *outside_plugins;
+/**
+ * @brief The wire header format
+ * It is strongly discouraged to interact with this header structure, however,
+ * it is provided for specific use cases (such as a server rejecting a session,
+ * where by definition we don't have a connection object).
+ */
+typedef struct he_wire_hdr {
+  // First two bytes to contain the 'H' and 'e'
+  char he[2];
+  // Version of the wire protocol
+  uint8_t major_version;
+  uint8_t minor_version;
+  // Request aggressive mode
+  uint8_t aggressive_mode;
+  // Three bytes reserved for future use
+  uint8_t reserved[3];
+  // 64 bit session identifier
+  uint64_t session;
+} he_wire_hdr_t;
 
+/// Number of top bits of a sharded session ID that hold the index of the owning shard
+#define HE_SESSION_SHARD_BITS 8
+#define HE_SESSION_SHARD_SHIFT (64 - HE_SESSION_SHARD_BITS)
+#define HE_MAX_SHARDS (1 << HE_SESSION_SHARD_BITS)
+
+/// Index of the shard that owns a sharded session ID
+#define HE_SESSION_SHARD(session) ((size_t)((uint64_t)(session) >> HE_SESSION_SHARD_SHIFT))
+
+/// Maximum number of datagrams, and of decrypted packets, handled per step of a batched receive
+#define HE_RECEIVE_BATCH_SIZE 32
+
+/// Maximum number of distinct records queued before the outside batch is flushed
+#define HE_OUTSIDE_WRITE_BATCH_SIZE 32
+
+/// Every record can be sent up to three times in aggressive mode
+#define HE_OUTSIDE_WRITE_BATCH_MAX_DATAGRAMS (HE_OUTSIDE_WRITE_BATCH_SIZE * 3)
+
+typedef struct he_outside_write_batch {
+  /// Connection the queued datagrams belong to, a thread's batch holds one connection's at a time
+  he_conn_t *conn;
+  /// Set while the datagrams are with the batch write callback
+  bool flushing;
+  /// Datagrams queued for the batch write callback
+  he_outside_datagram_t datagrams[HE_OUTSIDE_WRITE_BATCH_MAX_DATAGRAMS];
+  size_t num_datagrams;
+  /// Number of entries in buffers that are in use
+  size_t num_buffers;
+  /// Storage for the queued records, wolfSSL reuses its own buffer as soon as the write returns
+  uint8_t buffers[HE_OUTSIDE_WRITE_BATCH_SIZE][HE_MAX_WIRE_MTU];
+} he_outside_write_batch_t;
+
+/// Credentials for the auth message, only allocated while they are needed
+typedef struct he_conn_auth {
   uint8_t auth_type;
 
   /// VPN username -- room for a null on the end
@@ -450,30 +623,40 @@ struct he_conn {
 
   uint8_t auth_buffer[HE_MAX_MTU];
   uint16_t auth_buffer_length;
+} he_conn_auth_t;
 
-  /// MTU Helium should use for the outside connection (i.e. Internet)
-  int outside_mtu;
-
-  void *data;
-
-  // Data from the SSL context config copied here to make this hermetic
-  /// Don't send session ID in packet header
-  bool disable_roaming_connections;
+/**
+ * Settings and callbacks that are usually the same for every connection a host application runs.
+ * Rather than each connection carrying its own copy, connections point at a shared, reference
+ * counted he_conn_template_t holding them.
+ * @see he_conn_template_create
+ */
+typedef struct he_conn_settings {
+  /// TCP or UDP?
+  he_connection_type_t connection_type;
   /// Which padding type to use
   he_padding_type_t padding_type;
   /// Use aggressive mode
   bool use_aggressive_mode;
-  /// TCP or UDP?
-  he_connection_type_t connection_type;
+  /// Don't send session ID in packet header
+  bool disable_roaming_connections;
+  /// MTU Helium should use for the outside connection (i.e. Internet)
+  int outside_mtu;
 
-  /// State callback
-  he_state_change_cb_t state_change_cb;
-  /// Nudge timer
-  he_nudge_time_cb_t nudge_time_cb;
   /// Callback for writing to the inside (i.e. a TUN device)
   he_inside_write_cb_t inside_write_cb;
+  /// Batched alternative to inside_write_cb, used by batched receives (optional)
+  he_inside_write_batch_cb_t inside_write_batch_cb;
   /// Callback for writing to the outside (i.e. a socket)
   he_outside_write_cb_t outside_write_cb;
+  /// Copy-free alternative to outside_write_cb (optional)
+  he_outside_write_gather_cb_t outside_write_gather_cb;
+  /// Batched alternative to outside_write_cb (optional)
+  he_outside_write_batch_cb_t outside_write_batch_cb;
+  /// State callback
+  he_state_change_cb_t state_change_cb;
+  /// Nudge timer
+  he_nudge_time_cb_t nudge_time_cb;
   /// Network config callback
   he_network_config_ipv4_cb_t network_config_ipv4_cb;
   /// Server config callback
@@ -485,30 +668,135 @@ struct he_conn {
   he_auth_buf_cb_t auth_buf_cb;
   // Callback for populating the network config (server-only)
   he_populate_network_config_ipv4_cb_t populate_network_config_ipv4_cb;
+} he_conn_settings_t;
+
+/// Shared, read-only settings for any number of connections, see conn_template.h
+typedef struct he_conn_template he_conn_template_t;
+
+/**
+ * The fields every packet touches come first so the data path only pulls in the first few cache
+ * lines of a connection. Anything large or only needed during setup is allocated on demand, and
+ * packet buffers are borrowed from per-thread scratch space, so an idle connection costs a few
+ * hundred bytes plus its WOLFSSL object.
+ */
+struct he_conn {
+  /// Client State
+  he_conn_state_t state;
+
+  /// Internal Structure Member for client/server determination
+  /// No explicit setter or getter, we internally set this in
+  /// either client or server connect functions
+  bool is_server;
+  /// Packet seen
+  bool packet_seen;
+  /// Has the first message been received?
+  bool first_message_received;
+  /// Decrypt datagrams back into the caller's buffer instead of the read scratch buffer
+  bool in_place_receive;
+  /// Set while Helium is processing a burst of input, writes are flushed when it ends
+  bool in_input_burst;
+
+  /// Session ID
+  uint64_t session_id;
+  uint64_t pending_session_id;
+
+  // WolfSSL stuff
+  WOLFSSL *wolf_ssl;
+
+  /// Wire header for outgoing packets, rebuilt only when the session or version changes
+  he_wire_hdr_t wire_hdr;
+
+  /// Pointer to incoming data buffer
+  uint8_t *incoming_data;
+  /// Length of the data in the
+  size_t incoming_data_length;
+  /// Datagrams queued by he_conn_outside_data_received_batch, read in order
+  uint8_t **incoming_queue;
+  size_t *incoming_queue_lengths;
+  size_t incoming_queue_count;
+  /// Next datagram in the queue to hand to wolfSSL
+  size_t incoming_queue_index;
+  /// Bytes left to read in the packet buffer (Streaming only)
+  size_t incoming_data_left_to_read;
+  /// Index into the incoming data buffer
+  uint8_t *incoming_data_read_offset_ptr;
+
+  he_plugin_chain_t *inside_plugins;
+  he_plugin_chain_t *outside_plugins;
+
+  void *data;
+
+  /// Shared settings and callbacks, NULL for the defaults. Never written through while shared,
+  /// see he_conn_edit_settings().
+  he_conn_template_t *conn_template;
+
+  // Everything below is cold: only touched during setup, on timers or on rare events
+
+  /// Bytes of stream_record_hdr collected so far, zero when at a record boundary
+  size_t stream_record_hdr_length;
+  /// Body bytes still to come for the record wolfSSL is holding a part of
+  size_t stream_record_remaining;
+  /// Header of a TLS record that straddles two stream reads (Streaming only)
+  uint8_t stream_record_hdr[HE_TLS_RECORD_HEADER_SIZE];
+
+  /// Set while a renegotiation started by he_conn_start_renegotiation() is running
+  bool renegotiation_in_progress;
+  /// Set while a rekey scheduler holds back a renegotiation that is due, see rekey.h
+  bool renegotiation_due;
+
+  /// Do we already have a timer running? If so, we don't want to generate new callbacks
+  bool is_nudge_timer_running;
+
+  /// Encode session_shard in the top bits of every session ID generated for this connection
+  bool use_session_shard;
+  uint16_t session_shard;
+
+  /// Traffic and drop counters, see he_conn_get_stats()
+  he_conn_stats_t stats;
+
+  /// Forward error correction state, only allocated while FEC is enabled. Kept out of the hot
+  /// fields as most connections never turn it on.
+  struct he_fec *fec;
+  /// Path MTU discovery state, only allocated while discovery is enabled
+  struct he_pmtu *pmtu;
+  /// Small inside packets waiting to share a record, only allocated while coalescing is enabled
+  struct he_coalesce *coalesce;
+
+  /// Wolf Timeout
+  int wolf_timeout;
+
+  /// Set while a handshake pool has the connection, until it is collected. Only touched by the
+  /// data-plane thread serving the connection, see handshake_pool.h.
+  struct he_handshake_ticket *handshake;
+
+  /// Timer wheel that owns the nudge timer, NULL to use nudge_time_cb instead
+  struct he_timers *timers;
+  /// Links in the timer wheel slot the nudge timer is armed in, timer_pprev is NULL if unarmed
+  he_conn_t *timer_next;
+  he_conn_t **timer_pprev;
+  /// Tick the nudge timer fires on
+  uint64_t timer_expires;
+
+  /// Renegotiation scheduler the connection is attached to, NULL if none
+  struct he_rekey *rekey;
+  /// Links in the scheduler list the connection is on, rekey_pprev is NULL if on none
+  he_conn_t *rekey_next;
+  he_conn_t **rekey_pprev;
+  /// When the scheduler next looks at the connection, or when its running renegotiation started
+  uint64_t rekey_at;
+  /// Latest a due renegotiation may be put off to while the connection moves bulk traffic
+  uint64_t rekey_deadline;
+  /// Inside bytes counted when the current bulk traffic check began
+  uint64_t rekey_bytes;
 
   /// Connection version -- set on client side, accepted on server side
   he_version_info_t protocol_version;
 
-  /// Random number generator
-  RNG wolf_rng;
+  /// Credentials, allocated when first set and released once the connection is online
+  he_conn_auth_t *auth;
+
+  /// Random number generator, allocated the first time a session ID is generated
+  RNG *wolf_rng;
 };
 
-/**
- * @brief The wire header format
- * It is strongly discouraged to interact with this header structure, however,
- * it is provided for specific use cases (such as a server rejecting a session,
- * where by definition we don't have a connection object).
- */
-typedef struct he_wire_hdr {
-  // First two bytes to contain the 'H' and 'e'
-  char he[2];
-  // Version of the wire protocol
-  uint8_t major_version;
-  uint8_t minor_version;
-  // Request aggressive mode
-  uint8_t aggressive_mode;
-  // Three bytes reserved for future use
-  uint8_t reserved[3];
-  // 64 bit session identifier
-  uint64_t session;
-} he_wire_hdr_t;
+#endif // HE_H
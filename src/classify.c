@@ -0,0 +1,196 @@
+#include "classify.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/// Compared four at a time, the prefix array is padded up to a multiple of this
+#define HE_CLASSIFY_LANES 4
+
+/**
+ * @brief Compare the first four bytes of every datagram with what a wire header should start with
+ * @param prefixes The first four bytes of each datagram, padded to a multiple of
+ *        HE_CLASSIFY_LANES
+ * @return A bit per datagram, set where (prefix & mask) == expected
+ */
+static uint64_t he_classify_match(const uint32_t *prefixes, size_t count, uint32_t expected,
+                                  uint32_t mask)
+{
+    uint64_t matches = 0;
+
+#if defined(__SSE2__)
+    __m128i expected_v = _mm_set1_epi32((int)expected);
+    __m128i mask_v = _mm_set1_epi32((int)mask);
+    for (size_t i = 0; i < count; i += HE_CLASSIFY_LANES)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(prefixes + i));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, mask_v), expected_v);
+        matches |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+#elif defined(__aarch64__)
+    static const uint32_t lane_bits[HE_CLASSIFY_LANES] = {1, 2, 4, 8};
+    uint32x4_t expected_v = vdupq_n_u32(expected);
+    uint32x4_t mask_v = vdupq_n_u32(mask);
+    uint32x4_t bits_v = vld1q_u32(lane_bits);
+    for (size_t i = 0; i < count; i += HE_CLASSIFY_LANES)
+    {
+        uint32x4_t eq = vceqq_u32(vandq_u32(vld1q_u32(prefixes + i), mask_v), expected_v);
+        matches |= (uint64_t)vaddvq_u32(vandq_u32(eq, bits_v)) << i;
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((prefixes[i] & mask) == expected)
+        {
+            matches |= 1ull << i;
+        }
+    }
+#endif
+
+    return matches;
+}
+
+/// Build a word with the given bytes in memory order, to compare against prefixes as loaded
+static uint32_t he_classify_word(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    const uint8_t bytes[4] = {b0, b1, b2, b3};
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+size_t he_classify_burst(const uint8_t *const *packets, const size_t *lengths, size_t count,
+                         uint8_t major_version, he_classified_burst_t *burst)
+{
+    if (count > HE_CLASSIFY_MAX_BURST)
+    {
+        count = HE_CLASSIFY_MAX_BURST;
+    }
+
+    // Gather the prefixes so they can be compared side by side. Datagrams too short for a
+    // header get a prefix that never matches.
+    uint32_t prefixes[HE_CLASSIFY_MAX_BURST];
+    uint64_t too_small = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lengths[i] < sizeof(he_wire_hdr_t))
+        {
+            prefixes[i] = 0;
+            burst->sessions[i] = 0;
+            too_small |= 1ull << i;
+            continue;
+        }
+
+        memcpy(&prefixes[i], packets[i], sizeof(prefixes[i]));
+        memcpy(&burst->sessions[i], packets[i] + offsetof(he_wire_hdr_t, session),
+               sizeof(burst->sessions[i]));
+    }
+
+    size_t padded = (count + HE_CLASSIFY_LANES - 1) & ~(size_t)(HE_CLASSIFY_LANES - 1);
+    for (size_t i = count; i < padded; i++)
+    {
+        prefixes[i] = 0;
+    }
+
+    uint64_t is_helium =
+        he_classify_match(prefixes, padded, he_classify_word('H', 'e', 0, 0),
+                          he_classify_word(0xff, 0xff, 0, 0));
+    uint64_t right_version =
+        major_version ? he_classify_match(prefixes, padded,
+                                          he_classify_word('H', 'e', major_version, 0),
+                                          he_classify_word(0xff, 0xff, 0xff, 0))
+                      : is_helium;
+
+    // Group the valid datagrams by session, counting first and placing second so each group
+    // keeps the order its datagrams arrived in
+    uint8_t group_of[HE_CLASSIFY_MAX_BURST];
+    burst->num_groups = 0;
+    burst->num_valid = 0;
+    burst->num_wrong_version = 0;
+    burst->num_not_helium = 0;
+
+    size_t last_group = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t bit = 1ull << i;
+
+        if (too_small & bit)
+        {
+            burst->verdicts[i] = HE_ERR_PACKET_TOO_SMALL;
+            burst->num_not_helium++;
+            continue;
+        }
+        if (!(is_helium & bit))
+        {
+            burst->verdicts[i] = HE_ERR_NOT_HE_PACKET;
+            burst->num_not_helium++;
+            continue;
+        }
+        if (!(right_version & bit))
+        {
+            burst->verdicts[i] = HE_ERR_INCORRECT_PROTOCOL_VERSION;
+            burst->num_wrong_version++;
+            continue;
+        }
+
+        burst->verdicts[i] = HE_SUCCESS;
+        burst->num_valid++;
+
+        // Bursts are usually runs from a handful of sessions, try the last one first
+        uint64_t session = burst->sessions[i];
+        size_t group = last_group;
+        if (burst->num_groups == 0 || burst->groups[group].session != session)
+        {
+            for (group = 0; group < burst->num_groups; group++)
+            {
+                if (burst->groups[group].session == session)
+                {
+                    break;
+                }
+            }
+            if (group == burst->num_groups)
+            {
+                burst->groups[group].session = session;
+                burst->groups[group].count = 0;
+                burst->num_groups++;
+            }
+        }
+
+        burst->groups[group].count++;
+        group_of[i] = (uint8_t)group;
+        last_group = group;
+    }
+
+    size_t next[HE_CLASSIFY_MAX_BURST];
+    size_t position = 0;
+    for (size_t g = 0; g < burst->num_groups; g++)
+    {
+        burst->groups[g].first = position;
+        next[g] = position;
+        position += burst->groups[g].count;
+    }
+
+    size_t wrong_version = burst->num_valid;
+    size_t not_helium = burst->num_valid + burst->num_wrong_version;
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (burst->verdicts[i])
+        {
+            case HE_SUCCESS:
+                burst->order[next[group_of[i]]++] = (uint8_t)i;
+                break;
+            case HE_ERR_INCORRECT_PROTOCOL_VERSION:
+                burst->order[wrong_version++] = (uint8_t)i;
+                break;
+            default:
+                burst->order[not_helium++] = (uint8_t)i;
+                break;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,66 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include "he.h"
+
+/**
+ * Wire header classification for bursts of datagrams
+ *
+ * A server reading datagrams in bursts (e.g. with recvmmsg) checks every wire header in one pass
+ * before any of them gets near wolfSSL or the session table. The magic and version of the whole
+ * burst are compared several datagrams at a time with SSE2 or NEON where available, then the
+ * burst is sorted into:
+ *
+ *  - valid datagrams, grouped by session in the order each session first appears, so each group
+ *    can go to its connection with he_conn_outside_data_received_batch()
+ *  - datagrams with the wrong major version
+ *  - datagrams that aren't Helium at all, including any too short to hold a wire header
+ *
+ * Datagrams keep their order within each group.
+ */
+
+/// Most datagrams classified per call
+#define HE_CLASSIFY_MAX_BURST 64
+
+/// A run of valid datagrams for one session
+typedef struct he_classify_group
+{
+    uint64_t session;
+    /// Where the run starts in he_classified_burst_t.order, and how long it is
+    size_t first;
+    size_t count;
+} he_classify_group_t;
+
+typedef struct he_classified_burst
+{
+    /// Per datagram, in burst order: HE_SUCCESS, HE_ERR_PACKET_TOO_SMALL, HE_ERR_NOT_HE_PACKET or
+    /// HE_ERR_INCORRECT_PROTOCOL_VERSION
+    he_return_code_t verdicts[HE_CLASSIFY_MAX_BURST];
+    /// Per datagram, in burst order, the session of every datagram with a full wire header
+    uint64_t sessions[HE_CLASSIFY_MAX_BURST];
+
+    /// Positions in the burst: valid datagrams group by group, then those with the wrong version,
+    /// then those that aren't Helium
+    uint8_t order[HE_CLASSIFY_MAX_BURST];
+    size_t num_valid;
+    size_t num_wrong_version;
+    size_t num_not_helium;
+
+    he_classify_group_t groups[HE_CLASSIFY_MAX_BURST];
+    size_t num_groups;
+} he_classified_burst_t;
+
+/**
+ * @brief Check the wire headers of a burst of datagrams and sort it
+ * @param packets The datagrams, at any alignment
+ * @param lengths Their lengths
+ * @param count How many there are
+ * @param major_version The major version to accept, 0 to accept any
+ * @param burst Filled in with the result
+ * @return How many datagrams were classified, at most HE_CLASSIFY_MAX_BURST. Call again with
+ *         the rest if that is fewer than count.
+ */
+size_t he_classify_burst(const uint8_t *const *packets, const size_t *lengths, size_t count,
+                         uint8_t major_version, he_classified_burst_t *burst);
+
+#endif // CLASSIFY_H
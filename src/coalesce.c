@@ -0,0 +1,96 @@
+#include "coalesce.h"
+#include "conn_template.h"
+#include "core.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+/// Smallest packet worth keeping a record open for, an IPv4 header
+#define HE_COALESCE_MIN_PACKET 20
+
+static uint64_t he_coalesce_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+he_return_code_t he_internal_coalesce_flush(he_conn_t *conn)
+{
+    he_coalesce_t *coalesce = conn->coalesce;
+    if (coalesce == NULL || coalesce->length == 0)
+    {
+        return HE_SUCCESS;
+    }
+
+    size_t length = coalesce->length;
+    size_t packets = coalesce->packets;
+    coalesce->length = 0;
+    coalesce->packets = 0;
+
+    // Padding is zeroes, which the receiver reads as the end of the record
+    size_t inside_mtu = he_internal_inside_mtu(conn);
+    size_t padded_length =
+        he_internal_get_padded_length(he_internal_settings(conn)->padding_type, length);
+    if (padded_length > inside_mtu)
+    {
+        padded_length = inside_mtu < length ? length : inside_mtu;
+    }
+    he_internal_pad_packet(coalesce->record, length, padded_length);
+
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_ENCRYPT, 0, padded_length);
+    int res = wolfSSL_write(conn->wolf_ssl, coalesce->record, (int)padded_length);
+    HE_TRACE_END(conn->session_id, HE_TRACE_ENCRYPT, 0, padded_length, res);
+    if (res <= 0)
+    {
+        he_internal_stats_drop(conn, HE_ERR_SSL_ERROR, packets);
+        return HE_ERR_SSL_ERROR;
+    }
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_internal_coalesce_add(he_conn_t *conn, const uint8_t *packet, size_t length)
+{
+    he_coalesce_t *coalesce = conn->coalesce;
+    size_t inside_mtu = he_internal_inside_mtu(conn);
+    size_t framed = HE_COALESCE_FRAME_HEADER + length;
+    he_return_code_t ret = HE_SUCCESS;
+
+    if (coalesce->length && coalesce->length + framed > inside_mtu)
+    {
+        ret = he_internal_coalesce_flush(conn);
+    }
+
+    uint64_t now_us = he_coalesce_now_us();
+    if (coalesce->length == 0)
+    {
+        coalesce->record[0] = HE_COALESCE_MARKER;
+        coalesce->length = 1;
+        coalesce->first_queued_us = now_us;
+    }
+
+    uint8_t *frame = coalesce->record + coalesce->length;
+    frame[0] = (uint8_t)(length >> 8);
+    frame[1] = (uint8_t)length;
+    memcpy(frame + HE_COALESCE_FRAME_HEADER, packet, length);
+    coalesce->length += framed;
+    coalesce->packets++;
+
+    // Send now rather than hold a record no further packet could join, or keep the first packet
+    // waiting past its deadline
+    if (inside_mtu - coalesce->length < HE_COALESCE_FRAME_HEADER + HE_COALESCE_MIN_PACKET ||
+        now_us - coalesce->first_queued_us >= coalesce->deadline_us)
+    {
+        he_return_code_t flush_ret = he_internal_coalesce_flush(conn);
+        if (ret == HE_SUCCESS)
+        {
+            ret = flush_ret;
+        }
+    }
+
+    return ret;
+}
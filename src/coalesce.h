@@ -0,0 +1,112 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "he.h"
+
+/**
+ * Coalescing of small inside packets
+ *
+ * Every record costs the same fixed overhead whatever it carries: a record header, nonce and
+ * AEAD tag, the wire header, an encryption and a call to the outside write callback. For a 40 byte
+ * TCP ACK that is most of the datagram. A connection with coalescing on packs inside packets of up
+ * to HE_COALESCE_MAX_PACKET bytes into one record instead, so an ACK-heavy download sends a
+ * fraction of the records and datagrams.
+ *
+ * A coalesced record is HE_COALESCE_MARKER followed by the packets, each prefixed with its length
+ * (two bytes, big endian). The marker is IP version 1, so the record can't be mistaken for an
+ * inside packet. A zero length ends the record, which is what padding looks like. The receiver
+ * hands the packets on where they lie in the decrypted record, without copying them, unless the
+ * inside plugins have ingress hooks. Those may grow a packet, so each one is copied out to a
+ * buffer of HE_MAX_WIRE_MTU bytes first.
+ *
+ * Queued packets go out as one record when:
+ *
+ *  - the next packet doesn't fit in what is left of the inside MTU, or the record is too full to
+ *    take another IPv4 header
+ *  - a packet too large to coalesce is sent, so the packets stay in order
+ *  - a packet arrives more than HE_COALESCE_DEADLINE_US after the first one queued
+ *  - the host calls he_conn_flush_inside_packets(), which it must do each time it has read all it
+ *    can from the inside, e.g. when the TUN read returns EAGAIN
+ *
+ * Only the sender needs coalescing on, but the peer must run a version that knows the records.
+ */
+
+/// First byte of a coalesced record
+#define HE_COALESCE_MARKER 0x10
+/// Bytes in front of each packet
+#define HE_COALESCE_FRAME_HEADER 2
+/// Largest packet that is coalesced, larger ones gain little and are sent on their own
+#define HE_COALESCE_MAX_PACKET 512
+/// Longest a packet waits for others to share its record if more keep arriving
+#define HE_COALESCE_DEADLINE_US 50
+
+typedef struct he_coalesce
+{
+    /// Bytes in record, marker included, zero if nothing is queued
+    size_t length;
+    /// Packets in record
+    size_t packets;
+    /// When the first packet in record was queued, in microseconds
+    uint64_t first_queued_us;
+    /// HE_COALESCE_DEADLINE_US unless changed for testing
+    uint64_t deadline_us;
+    uint8_t record[HE_MAX_WIRE_MTU];
+} he_coalesce_t;
+
+/**
+ * @brief Whether a decrypted record holds coalesced packets rather than a single inside packet
+ */
+static inline bool he_internal_coalesce_is_record(const uint8_t *record, size_t length)
+{
+    return length > 0 && record[0] == HE_COALESCE_MARKER;
+}
+
+/**
+ * @brief Find the next packet in a coalesced record
+ * @param record The decrypted record
+ * @param length The length of the record
+ * @param offset Where to look, start at zero. Moved past the packet found.
+ * @param packet_length Set to the length of the packet found
+ * @return A pointer to the packet inside the record, or NULL once there are no more
+ *
+ * A length that runs past the end of the record ends it, like padding does.
+ */
+static inline uint8_t *he_internal_coalesce_next(uint8_t *record, size_t length, size_t *offset,
+                                                 size_t *packet_length)
+{
+    size_t at = *offset ? *offset : 1;
+    if (at + HE_COALESCE_FRAME_HEADER > length)
+    {
+        return NULL;
+    }
+
+    size_t frame = ((size_t)record[at] << 8) | record[at + 1];
+    at += HE_COALESCE_FRAME_HEADER;
+    if (frame == 0 || frame > length - at)
+    {
+        return NULL;
+    }
+
+    *offset = at + frame;
+    *packet_length = frame;
+
+    return record + at;
+}
+
+/**
+ * @brief Queue an inside packet that has been through the plugins, sending the record if it is due
+ * @return HE_SUCCESS if the packet was queued and any record due was sent
+ * @return HE_ERR_SSL_ERROR if wolfSSL failed to send a record, whose packets are lost
+ *
+ * Only call this for packets of up to HE_COALESCE_MAX_PACKET bytes.
+ */
+he_return_code_t he_internal_coalesce_add(he_conn_t *conn, const uint8_t *packet, size_t length);
+
+/**
+ * @brief Send whatever is queued as one record
+ * @return HE_SUCCESS if the record was sent or nothing was queued
+ * @return HE_ERR_SSL_ERROR if wolfSSL failed to send it, the packets are lost
+ */
+he_return_code_t he_internal_coalesce_flush(he_conn_t *conn);
+
+#endif // COALESCE_H
@@ -0,0 +1,435 @@
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/// LZ4 block format limits: matches are at least 4 bytes, the last 5 bytes are always literals
+/// and no match starts in the last 12
+#define HE_LZ4_MIN_MATCH 4
+#define HE_LZ4_LAST_LITERALS 5
+#define HE_LZ4_MATCH_LIMIT 12
+#define HE_LZ4_MAX_OFFSET 65535
+
+static inline uint32_t he_compress_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t he_compress_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HE_COMPRESS_HASH_BITS);
+}
+
+/**
+ * @brief Write an LZ4 length extension
+ * @return The next byte of output
+ */
+static inline size_t he_compress_write_length(uint8_t *dst, size_t op, size_t length)
+{
+    while (length >= 255)
+    {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = (uint8_t)length;
+    return op;
+}
+
+/**
+ * @brief Write a sequence of literals followed by a match, or just literals if match_length is 0
+ * @return The next byte of output, or 0 if it would go past limit
+ */
+static size_t he_compress_sequence(uint8_t *dst, size_t op, size_t limit, const uint8_t *literals,
+                                   size_t literal_length, size_t offset, size_t match_length)
+{
+    // Worst case: token, literal length, literals, offset and match length
+    size_t needed = 1 + literal_length / 255 + 1 + literal_length;
+    if (match_length)
+    {
+        needed += 2 + (match_length - HE_LZ4_MIN_MATCH) / 255 + 1;
+    }
+    if (op + needed > limit)
+    {
+        return 0;
+    }
+
+    size_t token = op++;
+    dst[token] = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+    {
+        op = he_compress_write_length(dst, op, literal_length - 15);
+    }
+    memcpy(dst + op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length)
+    {
+        dst[op++] = (uint8_t)offset;
+        dst[op++] = (uint8_t)(offset >> 8);
+
+        size_t extra = match_length - HE_LZ4_MIN_MATCH;
+        dst[token] |= (uint8_t)(extra < 15 ? extra : 15);
+        if (extra >= 15)
+        {
+            op = he_compress_write_length(dst, op, extra - 15);
+        }
+    }
+
+    return op;
+}
+
+size_t he_compress_block(he_compress_plugin_t *compress, const uint8_t *src, size_t length,
+                         uint8_t *dst, size_t limit)
+{
+    // Rather than clearing the table for every packet, positions are stored offset by a
+    // generation that moves past the previous packet. Anything older is ignored.
+    if (compress->generation == 0 || compress->generation > UINT32_MAX - 2 * HE_MAX_MTU)
+    {
+        memset(compress->table, 0, sizeof(compress->table));
+        compress->generation = 1;
+    }
+    uint32_t base = compress->generation;
+    compress->generation += (uint32_t)length + 1;
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if (length > HE_LZ4_MATCH_LIMIT)
+    {
+        size_t match_limit = length - HE_LZ4_MATCH_LIMIT;
+        size_t end_limit = length - HE_LZ4_LAST_LITERALS;
+
+        while (ip < match_limit)
+        {
+            uint32_t sequence = he_compress_read32(src + ip);
+            uint32_t *entry = &compress->table[he_compress_hash(sequence)];
+            uint32_t candidate = *entry;
+            *entry = base + (uint32_t)ip;
+
+            if (candidate < base || ip - (candidate - base) > HE_LZ4_MAX_OFFSET ||
+                he_compress_read32(src + (candidate - base)) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            size_t ref = candidate - base;
+            size_t match_length = HE_LZ4_MIN_MATCH;
+            while (ip + match_length < end_limit && src[ip + match_length] == src[ref + match_length])
+            {
+                match_length++;
+            }
+
+            op = he_compress_sequence(dst, op, limit, src + anchor, ip - anchor, ip - ref,
+                                      match_length);
+            if (op == 0)
+            {
+                return 0;
+            }
+
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    op = he_compress_sequence(dst, op, limit, src + anchor, length - anchor, 0, 0);
+    return op;
+}
+
+/**
+ * @brief Read an LZ4 length extension
+ * @return false if the input ran out
+ */
+static inline bool he_decompress_length(const uint8_t *src, size_t length, size_t *ip,
+                                        size_t *value)
+{
+    uint8_t byte;
+    do
+    {
+        if (*ip >= length)
+        {
+            return false;
+        }
+        byte = src[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+size_t he_decompress_block(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < length)
+    {
+        uint8_t token = src[ip++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !he_decompress_length(src, length, &ip, &literal_length))
+        {
+            return SIZE_MAX;
+        }
+        if (literal_length > length - ip || literal_length > capacity - op)
+        {
+            return SIZE_MAX;
+        }
+        memcpy(dst + op, src + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // The last sequence is literals only
+        if (ip == length)
+        {
+            break;
+        }
+
+        if (length - ip < 2)
+        {
+            return SIZE_MAX;
+        }
+        size_t offset = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op)
+        {
+            return SIZE_MAX;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && !he_decompress_length(src, length, &ip, &match_length))
+        {
+            return SIZE_MAX;
+        }
+        match_length += HE_LZ4_MIN_MATCH;
+        if (match_length > capacity - op)
+        {
+            return SIZE_MAX;
+        }
+
+        // Matches may overlap what they produce, copy a byte at a time
+        const uint8_t *match = dst + op - offset;
+        for (size_t i = 0; i < match_length; i++)
+        {
+            dst[op + i] = match[i];
+        }
+        op += match_length;
+    }
+
+    return op;
+}
+
+/**
+ * @brief Find the IP header of a packet
+ * @param protocol Set to the byte holding the protocol or next header
+ * @return The length of the IP header, 0 if it isn't an IP packet we can handle
+ */
+static size_t he_compress_ip_header(uint8_t *packet, size_t length, uint8_t **protocol)
+{
+    if (length >= 20 && (packet[0] >> 4) == 4)
+    {
+        size_t header_length = (size_t)(packet[0] & 0x0f) * 4;
+        if (header_length < 20 || header_length > length)
+        {
+            return 0;
+        }
+        *protocol = &packet[9];
+        return header_length;
+    }
+
+    if (length >= 40 && (packet[0] >> 4) == 6)
+    {
+        *protocol = &packet[6];
+        return 40;
+    }
+
+    return 0;
+}
+
+/// Set the length in the IP header to that of the whole packet
+static void he_compress_set_ip_length(uint8_t *packet, size_t length)
+{
+    if ((packet[0] >> 4) == 4)
+    {
+        packet[2] = (uint8_t)(length >> 8);
+        packet[3] = (uint8_t)length;
+    }
+    else
+    {
+        packet[4] = (uint8_t)((length - 40) >> 8);
+        packet[5] = (uint8_t)(length - 40);
+    }
+}
+
+/**
+ * @brief Tell whether a payload looks random, by how many distinct bytes a sample has
+ */
+static bool he_compress_looks_random(const uint8_t *payload, size_t length)
+{
+    uint64_t seen[4] = {0};
+    size_t distinct = 0;
+    size_t stride = length / HE_COMPRESS_SAMPLE_SIZE;
+
+    for (size_t i = 0; i < HE_COMPRESS_SAMPLE_SIZE; i++)
+    {
+        uint8_t byte = payload[i * stride];
+        uint64_t bit = 1ull << (byte & 63);
+        if (!(seen[byte >> 6] & bit))
+        {
+            seen[byte >> 6] |= bit;
+            distinct++;
+        }
+    }
+
+    return distinct >= HE_COMPRESS_RANDOM_DISTINCT;
+}
+
+static he_plugin_return_code_t he_compress_egress(uint8_t *packet, size_t *length, size_t capacity,
+                                                  void *data)
+{
+    he_compress_plugin_t *compress = data;
+
+    uint8_t *protocol = NULL;
+    size_t header_length = he_compress_ip_header(packet, *length, &protocol);
+    if (header_length == 0)
+    {
+        return HE_PLUGIN_SUCCESS;
+    }
+
+    uint8_t *payload = packet + header_length;
+    size_t payload_length = *length - header_length;
+    he_compress_hdr_t hdr = {
+        .protocol = *protocol,
+        .method = HE_COMPRESS_METHOD_LZ4,
+        .length = {(uint8_t)(payload_length >> 8), (uint8_t)payload_length},
+    };
+
+    size_t compressed_length = 0;
+    if (*protocol != HE_COMPRESS_IP_PROTOCOL)
+    {
+        if (payload_length < HE_COMPRESS_MIN_PAYLOAD || payload_length > sizeof(compress->scratch))
+        {
+            return HE_PLUGIN_SUCCESS;
+        }
+
+        if (he_compress_looks_random(payload, payload_length))
+        {
+            compress->stats.skipped_random++;
+            return HE_PLUGIN_SUCCESS;
+        }
+
+        compressed_length =
+            he_compress_block(compress, payload, payload_length, compress->scratch,
+                              payload_length - sizeof(he_compress_hdr_t) - HE_COMPRESS_MIN_SAVING);
+        if (compressed_length == 0)
+        {
+            compress->stats.skipped_incompressible++;
+            return HE_PLUGIN_SUCCESS;
+        }
+
+        memcpy(payload + sizeof(he_compress_hdr_t), compress->scratch, compressed_length);
+        compress->stats.compressed++;
+        compress->stats.bytes_in += payload_length;
+        compress->stats.bytes_out += compressed_length;
+    }
+    else
+    {
+        // Already using our protocol number, wrap it so the peer doesn't try to decompress it
+        if (*length + sizeof(he_compress_hdr_t) > capacity)
+        {
+            return HE_PLUGIN_DROP;
+        }
+        memmove(payload + sizeof(he_compress_hdr_t), payload, payload_length);
+        hdr.method = HE_COMPRESS_METHOD_STORED;
+        compressed_length = payload_length;
+    }
+
+    memcpy(payload, &hdr, sizeof(hdr));
+    *protocol = HE_COMPRESS_IP_PROTOCOL;
+    *length = header_length + sizeof(he_compress_hdr_t) + compressed_length;
+    he_compress_set_ip_length(packet, *length);
+
+    return HE_PLUGIN_SUCCESS;
+}
+
+static he_plugin_return_code_t he_compress_ingress(uint8_t *packet, size_t *length,
+                                                   size_t capacity, void *data)
+{
+    he_compress_plugin_t *compress = data;
+
+    uint8_t *protocol = NULL;
+    size_t header_length = he_compress_ip_header(packet, *length, &protocol);
+    if (header_length == 0 || *protocol != HE_COMPRESS_IP_PROTOCOL)
+    {
+        return HE_PLUGIN_SUCCESS;
+    }
+
+    // Corrupt packets are dropped rather than failed, one bad packet shouldn't stop the others
+    if (*length < header_length + sizeof(he_compress_hdr_t))
+    {
+        compress->stats.dropped++;
+        return HE_PLUGIN_DROP;
+    }
+
+    uint8_t *payload = packet + header_length;
+    he_compress_hdr_t hdr;
+    memcpy(&hdr, payload, sizeof(hdr));
+
+    size_t original_length = (size_t)hdr.length[0] << 8 | hdr.length[1];
+    size_t body_length = *length - header_length - sizeof(he_compress_hdr_t);
+
+    if (header_length + original_length > capacity)
+    {
+        compress->stats.dropped++;
+        return HE_PLUGIN_DROP;
+    }
+
+    if (hdr.method == HE_COMPRESS_METHOD_STORED && body_length == original_length)
+    {
+        memmove(payload, payload + sizeof(he_compress_hdr_t), original_length);
+    }
+    else if (hdr.method == HE_COMPRESS_METHOD_LZ4 && original_length <= sizeof(compress->scratch) &&
+             he_decompress_block(payload + sizeof(he_compress_hdr_t), body_length,
+                                 compress->scratch, original_length) == original_length)
+    {
+        memcpy(payload, compress->scratch, original_length);
+        compress->stats.decompressed++;
+    }
+    else
+    {
+        compress->stats.dropped++;
+        return HE_PLUGIN_DROP;
+    }
+
+    *protocol = hdr.protocol;
+    *length = header_length + original_length;
+    he_compress_set_ip_length(packet, *length);
+
+    return HE_PLUGIN_SUCCESS;
+}
+
+void he_compress_plugin_init(he_compress_plugin_t *compress)
+{
+    memset(compress, 0, sizeof(he_compress_plugin_t));
+    compress->plugin.do_ingress = he_compress_ingress;
+    compress->plugin.do_egress = he_compress_egress;
+    compress->plugin.data = compress;
+}
+
+he_compress_plugin_t *he_compress_plugin_create(void)
+{
+    he_compress_plugin_t *compress = malloc(sizeof(he_compress_plugin_t));
+    if (compress)
+    {
+        he_compress_plugin_init(compress);
+    }
+    return compress;
+}
+
+void he_compress_plugin_destroy(he_compress_plugin_t *compress)
+{
+    free(compress);
+}
@@ -0,0 +1,123 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "he.h"
+
+/**
+ * Inside packet compression
+ *
+ * A plugin for the inside chain that compresses the payload of IP packets on egress and
+ * restores it on ingress, using the LZ4 block format. Both ends of a connection must register
+ * it: nothing is negotiated.
+ *
+ * The IP header stays as it is so the packet can still be padded and unpadded by its length.
+ * Only the protocol (IPv4) or next header (IPv6) becomes HE_COMPRESS_IP_PROTOCOL and the length
+ * is that of the compressed packet. A he_compress_hdr_t follows the IP header with what is needed
+ * to put them back. Packets that already use HE_COMPRESS_IP_PROTOCOL are wrapped uncompressed so
+ * the peer never mistakes one for ours.
+ *
+ * Before compressing, a sample of the payload is checked for how many distinct byte values it
+ * has. Payloads that look random, as anything encrypted or already compressed does, are passed
+ * on untouched after looking at a few dozen bytes. So are payloads that don't shrink by at least
+ * HE_COMPRESS_MIN_SAVING, compression gives up as soon as its output gets that long.
+ *
+ * Each packet is compressed on its own, records can be lost or reordered so there is no
+ * dictionary shared between packets. The hash table and scratch buffer live in the plugin, one
+ * per connection, so nothing is allocated per packet.
+ */
+
+/// Experimental protocol number from RFC 3692 marking compressed packets
+#define HE_COMPRESS_IP_PROTOCOL 253
+
+/// Payloads shorter than this aren't worth compressing
+#define HE_COMPRESS_MIN_PAYLOAD 64
+
+/// Compressed payloads must be at least this much shorter, header included
+#define HE_COMPRESS_MIN_SAVING 16
+
+/// Bytes of the payload sampled to decide whether it is worth compressing
+#define HE_COMPRESS_SAMPLE_SIZE 64
+/// Samples with at least this many distinct bytes are taken to be random. 64 random bytes have
+/// around 57, text and most headers well under 40.
+#define HE_COMPRESS_RANDOM_DISTINCT 48
+
+/// Size of the match finder's hash table as a power of two
+#define HE_COMPRESS_HASH_BITS 12
+
+typedef enum he_compress_method
+{
+    /// The payload is unchanged, only used to wrap packets that use our protocol number
+    HE_COMPRESS_METHOD_STORED = 0,
+    /// The payload is an LZ4 block
+    HE_COMPRESS_METHOD_LZ4 = 1,
+} he_compress_method_t;
+
+/// Follows the IP header of a compressed packet
+typedef struct he_compress_hdr
+{
+    /// Protocol or next header of the original packet
+    uint8_t protocol;
+    uint8_t method;
+    /// Length of the original payload, big endian
+    uint8_t length[2];
+} he_compress_hdr_t;
+
+typedef struct he_compress_stats
+{
+    /// Packets sent compressed, and their payload bytes before and after
+    uint64_t compressed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    /// Packets sent as they were because they looked random
+    uint64_t skipped_random;
+    /// Packets sent as they were because compression didn't save enough
+    uint64_t skipped_incompressible;
+    /// Packets received compressed and restored
+    uint64_t decompressed;
+    /// Compressed packets received that were corrupt or didn't fit and were dropped
+    uint64_t dropped;
+} he_compress_stats_t;
+
+typedef struct he_compress_plugin
+{
+    /// Register this with the connection's inside plugin chain
+    plugin_struct_t plugin;
+    he_compress_stats_t stats;
+    /// Table entries below this are left over from earlier packets
+    uint32_t generation;
+    /// Where each hash was last seen, offset by generation
+    uint32_t table[1 << HE_COMPRESS_HASH_BITS];
+    uint8_t scratch[HE_MAX_MTU];
+} he_compress_plugin_t;
+
+/**
+ * @brief Allocate a compression plugin for one connection
+ * @return The plugin, or NULL if it couldn't be allocated
+ */
+he_compress_plugin_t *he_compress_plugin_create(void);
+
+/**
+ * @brief Set up a compression plugin in storage owned by the caller
+ */
+void he_compress_plugin_init(he_compress_plugin_t *compress);
+
+/**
+ * @brief Free a plugin from he_compress_plugin_create(), after removing it from its chain
+ */
+void he_compress_plugin_destroy(he_compress_plugin_t *compress);
+
+/**
+ * @brief Compress a buffer into the LZ4 block format
+ * @return The compressed length, or 0 if it would be longer than limit
+ */
+size_t he_compress_block(he_compress_plugin_t *compress, const uint8_t *src, size_t length,
+                         uint8_t *dst, size_t limit);
+
+/**
+ * @brief Decompress an LZ4 block
+ * @return The decompressed length, or SIZE_MAX if the block is corrupt or needs more than
+ *         capacity
+ */
+size_t he_decompress_block(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+#endif // COMPRESS_H
@@ -34,19 +34,27 @@ he_return_code_t he_internal_set_config_string(char *field, const char *value)
         return HE_ERR_NULL_POINTER;
     }
 
-    if (he_internal_config_is_empty_string(value))
+    // One bounded scan answers both checks
+    size_t len = strnlen(value, HE_CONFIG_TEXT_FIELD_LENGTH + 1);
+
+    if (len == 0)
     {
         return HE_ERR_EMPTY_STRING;
     }
 
-    if (he_internal_config_is_string_too_long(value))
+    if (len > HE_CONFIG_TEXT_FIELD_LENGTH)
     {
         return HE_ERR_STRING_TOO_LONG;
     }
 
-    // Copy the value into the field
-    strncpy(field, value, HE_CONFIG_TEXT_FIELD_LENGTH);
-    field[HE_CONFIG_TEXT_FIELD_LENGTH - 1] = '\0';
+    // Copy the value into the field, fields may be only HE_CONFIG_TEXT_FIELD_LENGTH bytes long.
+    // Unlike strncpy this doesn't zero the rest of the field.
+    if (len > HE_CONFIG_TEXT_FIELD_LENGTH - 1)
+    {
+        len = HE_CONFIG_TEXT_FIELD_LENGTH - 1;
+    }
+    memcpy(field, value, len);
+    field[len] = '\0';
 
     return HE_SUCCESS;
 }
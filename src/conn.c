@@ -0,0 +1,1120 @@
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "core.h"
+#include "fec.h"
+#include "plugin_chain.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "timers.h"
+#include "trace.h"
+
+/// Decrypted packets waiting for the inside write callbacks during a batched receive
+typedef struct he_inside_write_batch {
+  uint8_t *packets[HE_RECEIVE_BATCH_SIZE];
+  size_t lengths[HE_RECEIVE_BATCH_SIZE];
+  size_t capacities[HE_RECEIVE_BATCH_SIZE];
+  he_plugin_return_code_t verdicts[HE_RECEIVE_BATCH_SIZE];
+  size_t num_packets;
+  uint8_t buffers[HE_RECEIVE_BATCH_SIZE][HE_MAX_WIRE_MTU];
+} he_inside_write_batch_t;
+
+// The batch is always drained before he_conn_outside_data_received_batch returns, so one per
+// thread is enough no matter how many connections the thread serves
+static HE_THREAD_LOCAL he_inside_write_batch_t he_inside_write_batch;
+
+he_conn_t *he_conn_create(void) {
+  return calloc(1, sizeof(he_conn_t));
+}
+
+void he_conn_destroy(he_conn_t *conn) {
+  if(!conn) {
+    return;
+  }
+
+  if(conn->wolf_ssl) {
+    wolfSSL_free(conn->wolf_ssl);
+  }
+
+  if(conn->wolf_rng) {
+    wc_FreeRng(conn->wolf_rng);
+    free(conn->wolf_rng);
+  }
+
+  he_internal_release_conn_state(conn);
+  free(conn);
+}
+
+he_return_code_t he_conn_set_username(he_conn_t *conn, const char *username) {
+  if(!conn || !username) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_conn_auth_t *auth = he_internal_get_auth(conn);
+  if(!auth) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  return he_internal_set_config_string(auth->username, username);
+}
+
+const char *he_conn_get_username(const he_conn_t *conn) {
+  if(!conn || !conn->auth) {
+    return NULL;
+  }
+
+  return conn->auth->username;
+}
+
+he_return_code_t he_conn_set_password(he_conn_t *conn, const char *password) {
+  if(!conn || !password) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_conn_auth_t *auth = he_internal_get_auth(conn);
+  if(!auth) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  return he_internal_set_config_string(auth->password, password);
+}
+
+he_return_code_t he_conn_set_auth_buffer(he_conn_t *conn, uint8_t auth_type, const void *buffer,
+                                         uint16_t length) {
+  if(!conn || !buffer) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length > HE_MAX_MTU) {
+    return HE_ERR_STRING_TOO_LONG;
+  }
+
+  he_conn_auth_t *auth = he_internal_get_auth(conn);
+  if(!auth) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  auth->auth_type = auth_type;
+  memcpy(auth->auth_buffer, buffer, length);
+  auth->auth_buffer_length = length;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_in_place_receive(he_conn_t *conn, bool enabled) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  conn->in_place_receive = enabled;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_session_shard(he_conn_t *conn, size_t shard) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(shard >= HE_MAX_SHARDS) {
+    return HE_ERR_INVALID_SHARD;
+  }
+
+  conn->use_session_shard = true;
+  conn->session_shard = (uint16_t)shard;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_padding_type(he_conn_t *conn, he_padding_type_t padding_type) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  he_conn_settings_t *settings = he_conn_edit_settings(conn);
+  if(!settings) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  settings->padding_type = padding_type;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_template(he_conn_t *conn, he_conn_template_t *tmpl) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  // Don't lose anything that was queued under the old callback
+  he_internal_flush_outside_writes(conn);
+
+  // Take the new reference first in case the old and new templates are the same
+  he_conn_template_t *old = conn->conn_template;
+  conn->conn_template = he_internal_template_acquire(tmpl);
+  he_conn_template_release(old);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_get_stats(const he_conn_t *conn, he_conn_stats_t *stats) {
+  if(!conn || !stats) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  *stats = conn->stats;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_get_resumption_data(he_conn_t *conn, uint8_t *buffer, size_t *length) {
+  if(!conn || !buffer || !length) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!conn->wolf_ssl) {
+    return HE_ERR_NEVER_CONNECTED;
+  }
+
+  WOLFSSL_SESSION *session = wolfSSL_get1_session(conn->wolf_ssl);
+  if(!session) {
+    return HE_ERR_INVALID_CONN_STATE;
+  }
+
+  he_return_code_t res = HE_SUCCESS;
+  int needed = wolfSSL_i2d_SSL_SESSION(session, NULL);
+  if(needed <= 0) {
+    res = HE_ERR_SSL_ERROR;
+  } else if((size_t)needed > *length) {
+    res = HE_ERR_BUFFER_TOO_SMALL;
+  } else if(wolfSSL_i2d_SSL_SESSION(session, &buffer) != needed) {
+    res = HE_ERR_SSL_ERROR;
+  }
+
+  if(needed > 0) {
+    *length = (size_t)needed;
+  }
+
+  wolfSSL_SESSION_free(session);
+
+  return res;
+}
+
+he_return_code_t he_conn_set_resumption_data(he_conn_t *conn, const uint8_t *data, size_t length) {
+  if(!conn || !data) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(length == 0) {
+    return HE_ERR_ZERO_SIZE;
+  }
+
+  if(!conn->wolf_ssl) {
+    return HE_ERR_NEVER_CONNECTED;
+  }
+
+  WOLFSSL_SESSION *session = wolfSSL_d2i_SSL_SESSION(NULL, &data, (long)length);
+  if(!session) {
+    return HE_ERR_SSL_ERROR;
+  }
+
+  // wolfSSL takes its own copy
+  int res = wolfSSL_set_session(conn->wolf_ssl, session);
+  wolfSSL_SESSION_free(session);
+
+  return res == WOLFSSL_SUCCESS ? HE_SUCCESS : HE_ERR_SSL_ERROR;
+}
+
+bool he_conn_is_resumed(const he_conn_t *conn) {
+  return conn && conn->wolf_ssl && wolfSSL_session_reused(conn->wolf_ssl) == 1;
+}
+
+he_return_code_t he_conn_set_outside_write_batch_cb(he_conn_t *conn,
+                                                   he_outside_write_batch_cb_t batch_cb) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(he_internal_settings(conn)->outside_write_batch_cb == batch_cb) {
+    return HE_SUCCESS;
+  }
+
+  he_conn_settings_t *settings = he_conn_edit_settings(conn);
+  if(!settings) {
+    return HE_ERR_NO_MEMORY;
+  }
+
+  // Don't lose anything that was queued under the old callback
+  he_internal_flush_outside_writes(conn);
+  settings->outside_write_batch_cb = batch_cb;
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_fec(he_conn_t *conn, bool enabled) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!enabled) {
+    free(conn->fec);
+    conn->fec = NULL;
+    return HE_SUCCESS;
+  }
+
+  if(!conn->fec) {
+    conn->fec = calloc(1, sizeof(he_fec_t));
+    if(!conn->fec) {
+      return HE_ERR_NO_MEMORY;
+    }
+  }
+
+  return HE_SUCCESS;
+}
+
+static void he_internal_arm_nudge_timer(he_conn_t *conn, uint64_t delay_ms) {
+  if(conn->is_nudge_timer_running) {
+    return;
+  }
+
+  if(conn->timers) {
+    if(he_timers_arm(conn, delay_ms) == HE_SUCCESS) {
+      conn->is_nudge_timer_running = true;
+    }
+  } else {
+    conn->is_nudge_timer_running = true;
+    he_internal_settings(conn)->nudge_time_cb(conn, (int)delay_ms, conn->data);
+  }
+}
+
+static void he_internal_update_timeout(he_conn_t *conn) {
+  const he_conn_settings_t *settings = he_internal_settings(conn);
+
+  // Nobody is listening, don't bother asking wolfSSL
+  if(!conn->timers && !settings->nudge_time_cb) {
+    return;
+  }
+
+  if(settings->connection_type != HE_CONNECTION_TYPE_DATAGRAM || !conn->wolf_ssl) {
+    return;
+  }
+
+  // Once the handshake is done wolfSSL only retransmits during a renegotiation, the timer is
+  // left to PMTU discovery if it is on
+  if(conn->state == HE_STATE_ONLINE && !conn->renegotiation_in_progress) {
+    uint64_t delay_ms = 0;
+    if(he_internal_pmtu_next_timeout(conn, &delay_ms)) {
+      he_internal_arm_nudge_timer(conn, delay_ms);
+    } else {
+      he_timers_cancel(conn);
+    }
+    return;
+  }
+
+  conn->wolf_timeout = wolfSSL_dtls_get_current_timeout(conn->wolf_ssl) * 1000;
+  he_internal_arm_nudge_timer(conn, (uint64_t)conn->wolf_timeout);
+}
+
+he_return_code_t he_conn_set_pmtu_discovery(he_conn_t *conn, bool enabled) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!enabled) {
+    he_internal_pmtu_disable(conn);
+    return HE_SUCCESS;
+  }
+
+  if(!conn->pmtu) {
+    conn->pmtu = calloc(1, sizeof(he_pmtu_t));
+    if(!conn->pmtu) {
+      return HE_ERR_NO_MEMORY;
+    }
+  }
+
+  // Start searching now rather than whenever the connection next hears from its peer
+  if(conn->state == HE_STATE_ONLINE) {
+    he_internal_update_timeout(conn);
+  }
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_set_coalescing(he_conn_t *conn, bool enabled) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!enabled) {
+    // Whatever is queued still goes out
+    he_return_code_t ret = he_internal_coalesce_flush(conn);
+    free(conn->coalesce);
+    conn->coalesce = NULL;
+    return ret;
+  }
+
+  if(!conn->coalesce) {
+    conn->coalesce = calloc(1, sizeof(he_coalesce_t));
+    if(!conn->coalesce) {
+      return HE_ERR_NO_MEMORY;
+    }
+    conn->coalesce->deadline_us = HE_COALESCE_DEADLINE_US;
+  }
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_flush_inside_packets(he_conn_t *conn) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  return he_internal_coalesce_flush(conn);
+}
+
+size_t he_conn_get_inside_mtu(const he_conn_t *conn) {
+  if(!conn) {
+    return 0;
+  }
+
+  return he_internal_inside_mtu(conn);
+}
+
+int he_conn_get_nudge_time(he_conn_t *conn) {
+  if(!conn) {
+    return 0;
+  }
+
+  return conn->wolf_timeout;
+}
+
+he_return_code_t he_conn_nudge(he_conn_t *conn) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  // Whether the timer went off or the host is nudging early, it is no longer pending
+  conn->is_nudge_timer_running = false;
+  he_internal_timer_unlink(conn);
+
+  if(!conn->wolf_ssl) {
+    return HE_ERR_NEVER_CONNECTED;
+  }
+
+  // TLS relies on TCP for retransmits
+  if(he_internal_settings(conn)->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_SUCCESS;
+  }
+
+  if(conn->state == HE_STATE_ONLINE && !conn->renegotiation_in_progress) {
+    // wolfSSL has nothing to retransmit, the timer was PMTU discovery's
+    he_internal_pmtu_poll(conn);
+  } else if(wolfSSL_dtls_got_timeout(conn->wolf_ssl) == SSL_FATAL_ERROR) {
+    return HE_ERR_CONNECT_FAILED;
+  }
+
+  he_internal_update_timeout(conn);
+
+  return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_start_renegotiation(he_conn_t *conn) {
+  if(!conn) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(!conn->wolf_ssl) {
+    return HE_ERR_NEVER_CONNECTED;
+  }
+
+  if(conn->state != HE_STATE_ONLINE) {
+    return HE_ERR_INVALID_CONN_STATE;
+  }
+
+  if(conn->renegotiation_in_progress) {
+    return HE_SUCCESS;
+  }
+
+  int res = wolfSSL_Rehandshake(conn->wolf_ssl);
+  if(res != SSL_SUCCESS) {
+    // Non-blocking, so the handshake normally carries on as the peer's replies come in
+    int error = wolfSSL_get_error(conn->wolf_ssl, res);
+    if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+      return HE_ERR_SSL_ERROR;
+    }
+  }
+
+  conn->renegotiation_due = false;
+  conn->renegotiation_in_progress = true;
+
+  // The new handshake's flight needs retransmitting like the first one did, not waiting on
+  // whatever PMTU discovery had the timer set for
+  he_timers_cancel(conn);
+  he_internal_update_timeout(conn);
+
+  // Last, the callback may destroy the connection
+  he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+  if(event_cb) {
+    event_cb(conn, HE_EVENT_SECURE_RENEGOTIATION_STARTED, conn->data);
+  }
+
+  return HE_SUCCESS;
+}
+
+static void he_internal_check_renegotiation(he_conn_t *conn) {
+  if(!conn->renegotiation_in_progress || !conn->wolf_ssl) {
+    return;
+  }
+
+  if(wolfSSL_SSL_renegotiate_pending(conn->wolf_ssl)) {
+    return;
+  }
+
+  conn->renegotiation_in_progress = false;
+
+  he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+  if(event_cb) {
+    event_cb(conn, HE_EVENT_SECURE_RENEGOTIATION_COMPLETED, conn->data);
+  }
+}
+
+static he_return_code_t he_internal_check_wire_header(he_conn_t *conn, uint8_t *buffer,
+                                                      size_t length) {
+  if(length < sizeof(he_wire_hdr_t)) {
+    return HE_ERR_PACKET_TOO_SMALL;
+  }
+
+  // The datagram may sit at any alignment in the caller's receive buffer, read it byte by byte
+  if(buffer[offsetof(he_wire_hdr_t, he)] != 'H' || buffer[offsetof(he_wire_hdr_t, he) + 1] != 'e') {
+    return HE_ERR_NOT_HE_PACKET;
+  }
+
+  // Servers accept whatever version the client asks for on the first packet
+  uint8_t major_version = buffer[offsetof(he_wire_hdr_t, major_version)];
+  if(conn->protocol_version.major_version &&
+     major_version != conn->protocol_version.major_version) {
+    return HE_ERR_INCORRECT_PROTOCOL_VERSION;
+  }
+
+  return HE_SUCCESS;
+}
+
+// Packets in a coalesced record can only be handed on where they lie if no inside plugin will
+// want to grow them into the next one
+static inline bool he_internal_has_inside_ingress(he_conn_t *conn) {
+  return conn->inside_plugins && conn->inside_plugins->num_ingress;
+}
+
+// Passes a decrypted packet through the inside plugins and on to the inside write callback
+static he_return_code_t he_internal_deliver_packet(he_conn_t *conn, uint8_t *packet,
+                                                   size_t length, size_t capacity) {
+  he_return_code_t ret = he_plugin_ingress(conn->inside_plugins, packet, &length, capacity);
+  if(ret != HE_SUCCESS) {
+    he_internal_stats_drop(conn, ret, 1);
+    return ret == HE_ERR_PLUGIN_DROP ? HE_SUCCESS : ret;
+  }
+
+  he_internal_stats_packet(conn, HE_STATS_INSIDE_OUT, length);
+  he_inside_write_cb_t inside_write_cb = he_internal_settings(conn)->inside_write_cb;
+  if(inside_write_cb) {
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_INSIDE_WRITE, 0, length);
+    inside_write_cb(conn, packet, length, conn->data);
+    HE_TRACE_END(conn->session_id, HE_TRACE_INSIDE_WRITE, 0, length, HE_SUCCESS);
+  }
+
+  return HE_SUCCESS;
+}
+
+static he_return_code_t he_internal_read_packets(he_conn_t *conn, uint8_t *packet,
+                                                 size_t capacity) {
+  for(;;) {
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_DECRYPT, 0, 0);
+    int res = wolfSSL_read(conn->wolf_ssl, packet, (int)capacity);
+    HE_TRACE_END(conn->session_id, HE_TRACE_DECRYPT, 0, res > 0 ? res : 0, res);
+
+    if(res <= 0) {
+      int error = wolfSSL_get_error(conn->wolf_ssl, res);
+      if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        // Everything we were given has been consumed
+        return HE_SUCCESS;
+      }
+
+      // A bad datagram shouldn't kill the connection, a corrupt stream should
+      he_return_code_t ret =
+          he_internal_settings(conn)->connection_type == HE_CONNECTION_TYPE_DATAGRAM
+              ? HE_ERR_SSL_ERROR_NONFATAL
+              : HE_ERR_SSL_ERROR;
+      he_internal_stats_drop(conn, ret, 1);
+      return ret;
+    }
+
+    // Path MTU probes and their acknowledgements are for us, not the inside
+    if(he_internal_pmtu_is_control(packet, (size_t)res)) {
+      he_internal_pmtu_receive(conn, packet, (size_t)res);
+      continue;
+    }
+
+    if(he_internal_coalesce_is_record(packet, (size_t)res)) {
+      // Each packet is handed on where it lies, unless the plugins need room to grow it
+      bool unpack = he_internal_has_inside_ingress(conn);
+      size_t offset = 0;
+      size_t length = 0;
+      uint8_t *inner;
+      while((inner = he_internal_coalesce_next(packet, (size_t)res, &offset, &length))) {
+        he_return_code_t ret;
+        if(unpack) {
+          uint8_t *unpacked = he_internal_get_unpack_scratch();
+          memcpy(unpacked, inner, length);
+          ret = he_internal_deliver_packet(conn, unpacked, length, HE_MAX_WIRE_MTU);
+        } else {
+          ret = he_internal_deliver_packet(conn, inner, length, length);
+        }
+        if(ret != HE_SUCCESS) {
+          return ret;
+        }
+      }
+      continue;
+    }
+
+    size_t length = he_internal_strip_padding(packet, (size_t)res);
+    he_return_code_t ret = he_internal_deliver_packet(conn, packet, length, capacity);
+    if(ret != HE_SUCCESS) {
+      return ret;
+    }
+  }
+}
+
+static inline size_t he_internal_tls_record_body_length(const uint8_t *hdr) {
+  return ((size_t)hdr[3] << 8) | hdr[4];
+}
+
+// Hands wolfSSL exactly length bytes at data and collects everything it can decrypt from them
+static he_return_code_t he_internal_stream_feed(he_conn_t *conn, uint8_t *data, size_t length,
+                                                uint8_t *packet, size_t capacity) {
+  conn->incoming_data_read_offset_ptr = data;
+  conn->incoming_data_left_to_read = length;
+
+  return he_internal_read_packets(conn, packet, capacity);
+}
+
+// Works out how much of the data belongs to the record that crosses the end of a read
+static size_t he_internal_stream_partial_take(he_conn_t *conn, const uint8_t *data,
+                                              size_t length) {
+  size_t take = 0;
+
+  while(conn->stream_record_hdr_length < HE_TLS_RECORD_HEADER_SIZE && take < length) {
+    conn->stream_record_hdr[conn->stream_record_hdr_length++] = data[take++];
+    if(conn->stream_record_hdr_length == HE_TLS_RECORD_HEADER_SIZE) {
+      conn->stream_record_remaining = he_internal_tls_record_body_length(conn->stream_record_hdr);
+    }
+  }
+
+  size_t body = length - take;
+  if(body > conn->stream_record_remaining) {
+    body = conn->stream_record_remaining;
+  }
+  conn->stream_record_remaining -= body;
+  take += body;
+
+  // Back on a record boundary
+  if(conn->stream_record_hdr_length == HE_TLS_RECORD_HEADER_SIZE &&
+     conn->stream_record_remaining == 0) {
+    conn->stream_record_hdr_length = 0;
+  }
+
+  return take;
+}
+
+static he_return_code_t he_internal_read_stream(he_conn_t *conn, uint8_t *buffer, size_t length) {
+  he_return_code_t ret = he_internal_setup_stream_state(conn, buffer, length);
+  if(ret != HE_SUCCESS) {
+    return ret;
+  }
+
+  uint8_t *data = buffer;
+  uint8_t *end = buffer + length;
+
+  while(data < end) {
+    size_t available = (size_t)(end - data);
+
+    // Complete records are fed to wolfSSL one at a time. TLS reads exactly the record it is
+    // working on, so once it has consumed the record the record's bytes can take the plaintext.
+    if(conn->stream_record_hdr_length == 0 && available >= HE_TLS_RECORD_HEADER_SIZE) {
+      size_t record_length = HE_TLS_RECORD_HEADER_SIZE + he_internal_tls_record_body_length(data);
+      if(record_length <= available) {
+        if(conn->in_place_receive && !he_internal_has_inside_ingress(conn)) {
+          ret = he_internal_stream_feed(conn, data, record_length, data, record_length);
+        } else {
+          ret = he_internal_stream_feed(conn, data, record_length, he_internal_get_read_scratch(),
+                                        HE_MAX_WIRE_MTU);
+        }
+        if(ret != HE_SUCCESS) {
+          return ret;
+        }
+        data += record_length;
+        continue;
+      }
+    }
+
+    // Either the tail of a record wolfSSL already holds the start of, or the start of one that
+    // finishes in a later read. wolfSSL keeps partial records in its own input buffer, so only
+    // those bytes are ever held back between reads.
+    size_t take = he_internal_stream_partial_take(conn, data, available);
+    ret = he_internal_stream_feed(conn, data, take, he_internal_get_read_scratch(),
+                                  HE_MAX_WIRE_MTU);
+    if(ret != HE_SUCCESS) {
+      return ret;
+    }
+    data += take;
+  }
+
+  return HE_SUCCESS;
+}
+
+static he_return_code_t he_internal_outside_data_received(he_conn_t *conn, uint8_t *buffer,
+                                                          size_t length) {
+  if(length == 0) {
+    return HE_ERR_EMPTY_PACKET;
+  }
+
+  he_internal_stats_packet(conn, HE_STATS_OUTSIDE_IN, length);
+
+  // Note that the parallel call to egress is in wolf.c:he_wolf_dtls_write
+  size_t post_plugin_length = length;
+  he_return_code_t ret =
+      he_plugin_ingress(conn->outside_plugins, buffer, &post_plugin_length, length);
+  if(ret != HE_SUCCESS) {
+    he_internal_stats_drop(conn, ret, 1);
+    return ret == HE_ERR_PLUGIN_DROP ? HE_SUCCESS : ret;
+  }
+
+  // Where decrypted packets are written to
+  uint8_t *packet = he_internal_get_read_scratch();
+  size_t capacity = HE_MAX_WIRE_MTU;
+
+  bool is_stream = he_internal_settings(conn)->connection_type == HE_CONNECTION_TYPE_STREAM;
+  if(!is_stream) {
+    ret = he_internal_check_wire_header(conn, buffer, post_plugin_length);
+    if(ret != HE_SUCCESS) {
+      he_internal_stats_drop(conn, ret, 1);
+      return ret;
+    }
+
+    // Parity that had nothing to rebuild ends here, parity that did is now the lost record
+    if(conn->fec && !he_internal_fec_receive(conn, buffer, &post_plugin_length)) {
+      return HE_SUCCESS;
+    }
+
+    conn->incoming_data = buffer + sizeof(he_wire_hdr_t);
+    conn->incoming_data_length = post_plugin_length - sizeof(he_wire_hdr_t);
+    conn->packet_seen = false;
+
+    // wolfSSL copies the whole datagram into its input buffer before decrypting any of it, and
+    // the plaintext is always shorter than the record, so the datagram can take the plaintext.
+    // Not if an inside plugin may grow the packet past it, though.
+    if(conn->in_place_receive && !he_internal_has_inside_ingress(conn)) {
+      packet = buffer;
+      capacity = post_plugin_length;
+    }
+  }
+
+  if(!conn->first_message_received) {
+    conn->first_message_received = true;
+    he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+    if(event_cb) {
+      event_cb(conn, HE_EVENT_FIRST_MESSAGE_RECEIVED, conn->data);
+    }
+  }
+
+  // Anything wolfSSL sends while we work through the input goes out in one batch at the end
+  conn->in_input_burst = true;
+  if(is_stream) {
+    // Streams don't carry a wire header, wolfSSL reads straight from the caller's buffer
+    ret = he_internal_read_stream(conn, buffer, post_plugin_length);
+  } else {
+    ret = he_internal_read_packets(conn, packet, capacity);
+  }
+  conn->in_input_burst = false;
+
+  he_return_code_t flush_ret = he_internal_flush_outside_writes(conn);
+  if(ret == HE_SUCCESS) {
+    ret = flush_ret;
+  }
+
+  // Never hold on to the caller's buffer after we return
+  conn->incoming_data = NULL;
+  conn->incoming_data_length = 0;
+  conn->incoming_data_left_to_read = 0;
+  conn->incoming_data_read_offset_ptr = NULL;
+
+  he_internal_check_renegotiation(conn);
+  he_internal_pmtu_poll(conn);
+
+  // wolfSSL backs off after every retransmit, so the timeout may have changed
+  he_internal_update_timeout(conn);
+
+  return ret;
+}
+
+he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length) {
+  if(!conn || !buffer) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_RECEIVE, 0, length);
+  he_return_code_t ret = he_internal_outside_data_received(conn, buffer, length);
+  HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_RECEIVE, 0, length, ret);
+
+  return ret;
+}
+
+static he_return_code_t he_internal_inside_packet_received(he_conn_t *conn, uint8_t *packet,
+                                                           size_t length, size_t capacity) {
+  if(length == 0) {
+    return HE_ERR_EMPTY_PACKET;
+  }
+
+  // Path MTU discovery may have found room for more than HE_MAX_MTU
+  size_t inside_mtu = he_internal_inside_mtu(conn);
+  if(length > inside_mtu || length > capacity) {
+    return HE_ERR_PACKET_TOO_LARGE;
+  }
+
+  if(conn->state != HE_STATE_ONLINE || !conn->wolf_ssl) {
+    return HE_ERR_INVALID_CONN_STATE;
+  }
+
+  he_internal_stats_packet(conn, HE_STATS_INSIDE_IN, length);
+
+  // Note that the parallel call to ingress is in he_internal_read_packets
+  size_t post_plugin_length = length;
+  he_return_code_t ret =
+      he_plugin_egress(conn->inside_plugins, packet, &post_plugin_length, capacity);
+  if(ret == HE_SUCCESS && post_plugin_length > inside_mtu) {
+    ret = HE_ERR_PACKET_TOO_LARGE;
+  }
+  if(ret != HE_SUCCESS) {
+    he_internal_stats_drop(conn, ret, 1);
+    return ret == HE_ERR_PLUGIN_DROP ? HE_SUCCESS : ret;
+  }
+
+  if(conn->coalesce) {
+    if(post_plugin_length <= HE_COALESCE_MAX_PACKET &&
+       post_plugin_length + HE_COALESCE_FRAME_HEADER < inside_mtu) {
+      return he_internal_coalesce_add(conn, packet, post_plugin_length);
+    }
+
+    // Anything queued was sent first, so it has to go out first. If that fails this packet is
+    // still worth sending.
+    ret = he_internal_coalesce_flush(conn);
+  }
+
+  // Pad into the room behind the packet, only copying if the caller didn't leave enough
+  size_t padded_length =
+      he_internal_get_padded_length(he_internal_settings(conn)->padding_type, post_plugin_length);
+  if(padded_length > inside_mtu) {
+    // Padding must not push the record past what the path takes
+    padded_length = inside_mtu;
+  }
+  if(padded_length > capacity) {
+    uint8_t *scratch = he_internal_get_padding_scratch();
+    memcpy(scratch, packet, post_plugin_length);
+    packet = scratch;
+  }
+  he_internal_pad_packet(packet, post_plugin_length, padded_length);
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_ENCRYPT, 0, padded_length);
+  int res = wolfSSL_write(conn->wolf_ssl, packet, (int)padded_length);
+  HE_TRACE_END(conn->session_id, HE_TRACE_ENCRYPT, 0, padded_length, res);
+  if(res <= 0) {
+    he_internal_stats_drop(conn, HE_ERR_SSL_ERROR, 1);
+    return HE_ERR_SSL_ERROR;
+  }
+
+  return ret;
+}
+
+he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet, size_t length,
+                                                size_t capacity) {
+  if(!conn || !packet) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_INSIDE_RECEIVE, 0, length);
+  he_return_code_t ret = he_internal_inside_packet_received(conn, packet, length, capacity);
+  HE_TRACE_END(conn->session_id, HE_TRACE_INSIDE_RECEIVE, 0, length, ret);
+
+  return ret;
+}
+
+static he_return_code_t he_internal_flush_inside_writes(he_conn_t *conn,
+                                                        he_inside_write_batch_t *batch) {
+  size_t count = batch->num_packets;
+  batch->num_packets = 0;
+
+  if(count == 0) {
+    return HE_SUCCESS;
+  }
+
+  he_return_code_t ret = he_plugin_ingress_batch(conn->inside_plugins, batch->packets,
+                                                 batch->lengths, batch->capacities,
+                                                 batch->verdicts, count);
+  if(ret != HE_SUCCESS) {
+    he_internal_stats_drop(conn, ret, count);
+    return ret;
+  }
+
+  // Squeeze out anything the plugins dropped or failed
+  size_t live = 0;
+  for(size_t i = 0; i < count; i++) {
+    if(batch->verdicts[i] == HE_PLUGIN_FAIL) {
+      ret = HE_ERR_FAILED;
+      he_internal_stats_drop(conn, HE_ERR_FAILED, 1);
+    } else if(batch->verdicts[i] == HE_PLUGIN_DROP) {
+      he_internal_stats_drop(conn, HE_ERR_PLUGIN_DROP, 1);
+    } else {
+      batch->packets[live] = batch->packets[i];
+      batch->lengths[live] = batch->lengths[i];
+      he_internal_stats_packet(conn, HE_STATS_INSIDE_OUT, batch->lengths[live]);
+      live++;
+    }
+  }
+
+  // Traced as one write of live packets however many calls it takes
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_INSIDE_WRITE, 0, live);
+  const he_conn_settings_t *settings = he_internal_settings(conn);
+  if(settings->inside_write_batch_cb) {
+    if(live) {
+      settings->inside_write_batch_cb(conn, batch->packets, batch->lengths, live, conn->data);
+    }
+  } else if(settings->inside_write_cb) {
+    for(size_t i = 0; i < live; i++) {
+      settings->inside_write_cb(conn, batch->packets[i], batch->lengths[i], conn->data);
+    }
+  }
+  HE_TRACE_END(conn->session_id, HE_TRACE_INSIDE_WRITE, 0, live, ret);
+
+  return ret;
+}
+
+static he_return_code_t he_internal_read_packets_batch(he_conn_t *conn,
+                                                       he_inside_write_batch_t *batch) {
+  he_return_code_t ret = HE_SUCCESS;
+
+  for(;;) {
+    if(batch->num_packets == HE_RECEIVE_BATCH_SIZE) {
+      he_return_code_t flush_ret = he_internal_flush_inside_writes(conn, batch);
+      if(ret == HE_SUCCESS) {
+        ret = flush_ret;
+      }
+    }
+
+    size_t slot = batch->num_packets;
+    batch->packets[slot] = batch->buffers[slot];
+    batch->capacities[slot] = sizeof(batch->buffers[slot]);
+
+    size_t index_before = conn->incoming_queue_index;
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_DECRYPT, 0, 0);
+    int res = wolfSSL_read(conn->wolf_ssl, batch->packets[slot], (int)batch->capacities[slot]);
+    HE_TRACE_END(conn->session_id, HE_TRACE_DECRYPT, 0, res > 0 ? res : 0, res);
+
+    if(res <= 0) {
+      int error = wolfSSL_get_error(conn->wolf_ssl, res);
+      if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return ret;
+      }
+
+      // A bad datagram must not stop the rest of the burst from being processed, but if
+      // wolfSSL didn't consume anything it would only fail the same way again
+      he_internal_stats_drop(conn, HE_ERR_SSL_ERROR_NONFATAL, 1);
+      if(ret == HE_SUCCESS) {
+        ret = HE_ERR_SSL_ERROR_NONFATAL;
+      }
+      if(conn->incoming_queue_index == index_before ||
+         conn->incoming_queue_index == conn->incoming_queue_count) {
+        return ret;
+      }
+      continue;
+    }
+
+    if(he_internal_pmtu_is_control(batch->packets[slot], (size_t)res)) {
+      he_internal_pmtu_receive(conn, batch->packets[slot], (size_t)res);
+      continue;
+    }
+
+    if(he_internal_coalesce_is_record(batch->packets[slot], (size_t)res)) {
+      uint8_t *record = batch->packets[slot];
+      bool unpack = he_internal_has_inside_ingress(conn);
+      size_t offset = 0;
+      size_t length = 0;
+      bool flushed = false;
+      uint8_t *inner;
+
+      // The plugins need each packet in a slot buffer of its own, and the first of those is where
+      // the record is now
+      if(unpack) {
+        memcpy(he_internal_get_unpack_scratch(), record, (size_t)res);
+        record = he_internal_get_unpack_scratch();
+      }
+
+      // Each packet takes a slot of its own, otherwise it stays where it lies in the record
+      while((inner = he_internal_coalesce_next(record, (size_t)res, &offset, &length))) {
+        if(batch->num_packets == HE_RECEIVE_BATCH_SIZE) {
+          he_return_code_t flush_ret = he_internal_flush_inside_writes(conn, batch);
+          if(ret == HE_SUCCESS) {
+            ret = flush_ret;
+          }
+          flushed = true;
+        }
+
+        size_t next = batch->num_packets++;
+        if(unpack) {
+          memcpy(batch->buffers[next], inner, length);
+          batch->packets[next] = batch->buffers[next];
+          batch->capacities[next] = sizeof(batch->buffers[next]);
+        } else {
+          batch->packets[next] = inner;
+          batch->capacities[next] = length;
+        }
+        batch->lengths[next] = length;
+      }
+
+      // The next read may land in the record's buffer, hand on what still points into it first
+      if(flushed && !unpack) {
+        he_return_code_t flush_ret = he_internal_flush_inside_writes(conn, batch);
+        if(ret == HE_SUCCESS) {
+          ret = flush_ret;
+        }
+      }
+      continue;
+    }
+
+    batch->lengths[slot] = he_internal_strip_padding(batch->packets[slot], (size_t)res);
+    batch->num_packets++;
+  }
+}
+
+he_return_code_t he_conn_outside_data_received_batch(he_conn_t *conn, uint8_t **buffers,
+                                                     size_t *lengths, size_t count) {
+  if(!conn || !buffers || !lengths) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  if(he_internal_settings(conn)->connection_type != HE_CONNECTION_TYPE_DATAGRAM) {
+    return HE_ERR_INVALID_CONNECTION_TYPE;
+  }
+
+  he_inside_write_batch_t *batch = &he_inside_write_batch;
+  he_return_code_t ret = HE_SUCCESS;
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_RECEIVE, 0, count);
+
+  uint8_t *queue[HE_RECEIVE_BATCH_SIZE];
+  size_t queue_lengths[HE_RECEIVE_BATCH_SIZE];
+  he_plugin_return_code_t verdicts[HE_RECEIVE_BATCH_SIZE];
+
+  conn->in_input_burst = true;
+
+  for(size_t offset = 0; offset < count; offset += HE_RECEIVE_BATCH_SIZE) {
+    size_t chunk = count - offset;
+    if(chunk > HE_RECEIVE_BATCH_SIZE) {
+      chunk = HE_RECEIVE_BATCH_SIZE;
+    }
+
+    // Plugins may shrink a datagram but never grow it past what the caller gave us
+    size_t capacities[HE_RECEIVE_BATCH_SIZE];
+    for(size_t i = 0; i < chunk; i++) {
+      capacities[i] = lengths[offset + i];
+      he_internal_stats_packet(conn, HE_STATS_OUTSIDE_IN, lengths[offset + i]);
+    }
+
+    he_return_code_t plugin_ret =
+        he_plugin_ingress_batch(conn->outside_plugins, &buffers[offset], &lengths[offset],
+                                capacities, verdicts, chunk);
+    if(plugin_ret != HE_SUCCESS) {
+      he_internal_stats_drop(conn, plugin_ret, chunk);
+      if(ret == HE_SUCCESS) {
+        ret = plugin_ret;
+      }
+      break;
+    }
+
+    // Queue up every datagram that survived the plugins and carries a valid header
+    size_t queued = 0;
+    for(size_t i = 0; i < chunk; i++) {
+      if(verdicts[i] != HE_PLUGIN_SUCCESS) {
+        he_internal_stats_drop(conn,
+                               verdicts[i] == HE_PLUGIN_DROP ? HE_ERR_PLUGIN_DROP : HE_ERR_FAILED,
+                               1);
+        continue;
+      }
+
+      if(lengths[offset + i] == 0) {
+        continue;
+      }
+
+      he_return_code_t hdr_ret =
+          he_internal_check_wire_header(conn, buffers[offset + i], lengths[offset + i]);
+      if(hdr_ret != HE_SUCCESS) {
+        he_internal_stats_drop(conn, hdr_ret, 1);
+        if(ret == HE_SUCCESS) {
+          ret = hdr_ret;
+        }
+        continue;
+      }
+
+      if(conn->fec && !he_internal_fec_receive(conn, buffers[offset + i], &lengths[offset + i])) {
+        continue;
+      }
+
+      queue[queued] = buffers[offset + i] + sizeof(he_wire_hdr_t);
+      queue_lengths[queued] = lengths[offset + i] - sizeof(he_wire_hdr_t);
+      queued++;
+    }
+
+    if(queued == 0) {
+      continue;
+    }
+
+    if(!conn->first_message_received) {
+      conn->first_message_received = true;
+      he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+      if(event_cb) {
+        event_cb(conn, HE_EVENT_FIRST_MESSAGE_RECEIVED, conn->data);
+      }
+    }
+
+    conn->incoming_queue = queue;
+    conn->incoming_queue_lengths = queue_lengths;
+    conn->incoming_queue_count = queued;
+    conn->incoming_queue_index = 0;
+
+    he_return_code_t read_ret = he_internal_read_packets_batch(conn, batch);
+    he_return_code_t flush_ret = he_internal_flush_inside_writes(conn, batch);
+
+    conn->incoming_queue = NULL;
+    conn->incoming_queue_lengths = NULL;
+    conn->incoming_queue_count = 0;
+    conn->incoming_queue_index = 0;
+
+    if(ret == HE_SUCCESS) {
+      ret = read_ret != HE_SUCCESS ? read_ret : flush_ret;
+    }
+  }
+
+  conn->in_input_burst = false;
+
+  he_return_code_t flush_ret = he_internal_flush_outside_writes(conn);
+  if(ret == HE_SUCCESS) {
+    ret = flush_ret;
+  }
+
+  he_internal_check_renegotiation(conn);
+  he_internal_pmtu_poll(conn);
+  he_internal_update_timeout(conn);
+
+  HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_RECEIVE, 0, count, ret);
+
+  return ret;
+}
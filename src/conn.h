@@ -0,0 +1,356 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "he.h"
+
+/**
+ * @brief Allocate a zeroed connection
+ * @return A pointer to the connection, or NULL if it could not be allocated
+ *
+ * Only the hot fields live in the connection itself. Credentials and the RNG are allocated when
+ * first needed, and packet buffers are per-thread scratch space.
+ * Settings and callbacks are shared with other connections through he_conn_set_template().
+ */
+he_conn_t *he_conn_create(void);
+
+/**
+ * @brief Free a connection and everything it has allocated, including its WOLFSSL object
+ */
+void he_conn_destroy(he_conn_t *conn);
+
+/**
+ * @brief Set the username sent in the auth message
+ * @return HE_SUCCESS if the username was set
+ * @return HE_ERR_NULL_POINTER if conn or username is NULL
+ * @return HE_ERR_EMPTY_STRING if username is empty
+ * @return HE_ERR_STRING_TOO_LONG if username is longer than HE_CONFIG_TEXT_FIELD_LENGTH
+ * @return HE_ERR_NO_MEMORY if the credentials could not be allocated
+ *
+ * Credentials are wiped and freed once the connection is online or disconnected, so they must
+ * be set again before reconnecting.
+ */
+he_return_code_t he_conn_set_username(he_conn_t *conn, const char *username);
+
+/**
+ * @brief Get the username sent in the auth message
+ * @return The username, or NULL if no credentials are held
+ */
+const char *he_conn_get_username(const he_conn_t *conn);
+
+/**
+ * @brief Set the password sent in the auth message
+ * @return The same as he_conn_set_username()
+ */
+he_return_code_t he_conn_set_password(he_conn_t *conn, const char *password);
+
+/**
+ * @brief Set an opaque auth message to send instead of a username and password
+ * @return HE_SUCCESS if the buffer was copied
+ * @return HE_ERR_NULL_POINTER if conn or buffer is NULL
+ * @return HE_ERR_STRING_TOO_LONG if length is larger than HE_MAX_MTU
+ * @return HE_ERR_NO_MEMORY if the credentials could not be allocated
+ */
+he_return_code_t he_conn_set_auth_buffer(he_conn_t *conn, uint8_t auth_type, const void *buffer,
+                                         uint16_t length);
+
+/**
+ * @brief Enable or disable in-place decryption of received datagrams
+ * @param conn A pointer to a valid connection
+ * @param enabled Whether decrypted packets should be written back into the caller's buffer
+ * @return HE_SUCCESS if the setting was applied
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ *
+ * In datagram mode wolfSSL consumes the whole datagram before it decrypts anything, so the
+ * caller's buffer is free to receive the plaintext. With this enabled, the inside write callback
+ * is handed a pointer into the buffer passed to he_conn_outside_data_received() rather than into
+ * the thread's read scratch buffer, saving a full copy of every packet received.
+ *
+ * In stream mode the same applies to every TLS record that is wholly contained in the buffer.
+ * Records that straddle two reads are still decrypted into the read scratch buffer.
+ *
+ * Connections with inside plugins that have ingress hooks always decrypt into the read scratch
+ * buffer, as those plugins may grow a packet past the end of the record it came in.
+ *
+ * @note The contents of the caller's buffer are overwritten. It must not be reused for anything
+ * else until he_conn_outside_data_received() returns.
+ */
+he_return_code_t he_conn_set_in_place_receive(he_conn_t *conn, bool enabled);
+
+/**
+ * @brief Pin the connection to a shard by encoding it in every session ID it is given
+ * @param conn A pointer to a valid connection
+ * @param shard The index of the shard (e.g. the core) that owns the connection
+ * @return HE_SUCCESS if the shard was set
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_INVALID_SHARD if shard is not below HE_MAX_SHARDS
+ *
+ * Session IDs generated afterwards carry the shard index in their top HE_SESSION_SHARD_BITS, so
+ * whichever core receives a datagram can find the owner with HE_SESSION_SHARD() on the wire
+ * header. The remaining bits are still random.
+ */
+he_return_code_t he_conn_set_session_shard(he_conn_t *conn, size_t shard);
+
+/**
+ * @brief Set how inside packets are padded before they are encrypted
+ * @return HE_SUCCESS if the padding type was set
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NO_MEMORY if the connection's shared settings could not be copied
+ *
+ * Padding hides the size of the packets inside the tunnel at the cost of sending more bytes.
+ * The peer strips it whatever its own setting is.
+ */
+he_return_code_t he_conn_set_padding_type(he_conn_t *conn, he_padding_type_t padding_type);
+
+/**
+ * @brief Get a copy of the packet counters of a connection
+ * @return HE_SUCCESS if the counters were copied
+ * @return HE_ERR_NULL_POINTER if conn or stats is NULL
+ *
+ * Counters are only written by the thread serving the connection, call this from that thread.
+ * Totals over every connection are available from he_stats_get_global().
+ */
+he_return_code_t he_conn_get_stats(const he_conn_t *conn, he_conn_stats_t *stats);
+
+/**
+ * @brief Save a client connection's session so a later connection can resume it
+ * @param conn A pointer to a valid connection
+ * @param buffer Where to write the session
+ * @param length The size of buffer, set to the length of the session
+ * @return HE_SUCCESS if the session was written
+ * @return HE_ERR_NULL_POINTER if any pointer is NULL
+ * @return HE_ERR_NEVER_CONNECTED if the connection has no WOLFSSL object yet
+ * @return HE_ERR_INVALID_CONN_STATE if the handshake hasn't finished
+ * @return HE_ERR_BUFFER_TOO_SMALL if the session doesn't fit, length is set to the size needed
+ * @return HE_ERR_SSL_ERROR if wolfSSL could not serialise the session
+ *
+ * A buffer of HE_MAX_SESSION_DATA bytes is always large enough. The data holds the session's
+ * master secret, keep it as safe as any other key.
+ */
+he_return_code_t he_conn_get_resumption_data(he_conn_t *conn, uint8_t *buffer, size_t *length);
+
+/**
+ * @brief Offer a saved session to the server on the next handshake
+ * @param conn A pointer to a valid connection with its WOLFSSL object, before it connects
+ * @param data A session from he_conn_get_resumption_data()
+ * @param length The length of data
+ * @return HE_SUCCESS if the session will be offered
+ * @return HE_ERR_NULL_POINTER if conn or data is NULL
+ * @return HE_ERR_ZERO_SIZE if length is zero
+ * @return HE_ERR_NEVER_CONNECTED if the connection has no WOLFSSL object yet
+ * @return HE_ERR_SSL_ERROR if wolfSSL rejected the session
+ *
+ * If the server no longer has the session the handshake quietly falls back to a full one,
+ * he_conn_is_resumed() tells which happened.
+ */
+he_return_code_t he_conn_set_resumption_data(he_conn_t *conn, const uint8_t *data, size_t length);
+
+/**
+ * @brief Whether the connection's last handshake resumed a session rather than doing a full one
+ */
+bool he_conn_is_resumed(const he_conn_t *conn);
+
+/**
+ * @brief Start a D/TLS renegotiation to refresh the connection's keys
+ * @param conn A pointer to a valid, online connection
+ * @return HE_SUCCESS if the renegotiation started or one is already running
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NEVER_CONNECTED if the connection has no WOLFSSL object
+ * @return HE_ERR_INVALID_CONN_STATE if the connection isn't online
+ * @return HE_ERR_SSL_ERROR if wolfSSL refused, e.g. secure renegotiation wasn't enabled on the
+ *         WOLFSSL object with wolfSSL_UseSecureRenegotiation() before the first handshake
+ *
+ * Fires HE_EVENT_SECURE_RENEGOTIATION_STARTED, and HE_EVENT_SECURE_RENEGOTIATION_COMPLETED once
+ * the peer's replies finish it. The event callback may destroy the connection, nothing touches it
+ * after the event. Data keeps flowing under the old keys meanwhile. Rather than
+ * calling this on a fixed period, attach the connection to a rekey scheduler, see rekey.h.
+ */
+he_return_code_t he_conn_start_renegotiation(he_conn_t *conn);
+
+/**
+ * @brief Point a connection at a template
+ * @param conn The connection
+ * @param tmpl The template, NULL to go back to the defaults
+ * @return HE_SUCCESS if the connection now uses the template
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ *
+ * The connection takes its own reference and drops the one to its previous template, including
+ * any private copy made by he_conn_edit_settings().
+ *
+ * @note Don't call this from one of the connection's own callbacks.
+ */
+he_return_code_t he_conn_set_template(he_conn_t *conn, he_conn_template_t *tmpl);
+
+/**
+ * @brief Turn forward error correction on or off for a datagram connection
+ * @param conn A pointer to a valid connection
+ * @param enabled Whether to send parity and rebuild lost records
+ * @return HE_SUCCESS if FEC was turned on or off
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NO_MEMORY if the FEC state could not be allocated
+ *
+ * Once online, a connection with FEC on follows every few records with a parity datagram from
+ * which any one of them can be rebuilt, for 20-50% more traffic depending on the loss the peer
+ * reports. Parity is only sent once the peer shows it has FEC on too, and never in aggressive
+ * mode. Ignored on stream connections.
+ */
+he_return_code_t he_conn_set_fec(he_conn_t *conn, bool enabled);
+
+/**
+ * @brief Turn path MTU discovery on or off for a datagram connection
+ * @param conn A pointer to a valid connection
+ * @param enabled Whether to probe for the largest datagram the path takes
+ * @return HE_SUCCESS if discovery was turned on or off
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NO_MEMORY if the discovery state could not be allocated
+ *
+ * Once online, the connection searches for the largest datagram that reaches the peer, up to the
+ * outside MTU if one was set, and sizes its records to it. Each time that changes how much inside
+ * data fits in a datagram, HE_EVENT_PMTU_CHANGED fires; set the TUN device's MTU and the one
+ * pushed to the client from he_conn_get_inside_mtu(). See pmtu.h for how the search works.
+ * Turning it off goes back to the default sizes. Ignored on stream connections.
+ */
+he_return_code_t he_conn_set_pmtu_discovery(he_conn_t *conn, bool enabled);
+
+/**
+ * @brief Turn coalescing of small inside packets on or off
+ * @param conn A pointer to a valid connection
+ * @param enabled Whether to pack small inside packets into shared records
+ * @return HE_SUCCESS if coalescing was turned on or off
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NO_MEMORY if the coalescing state could not be allocated
+ * @return HE_ERR_SSL_ERROR if turning it off failed to send the packets still queued
+ *
+ * With coalescing on, he_conn_inside_packet_received() queues packets of up to
+ * HE_COALESCE_MAX_PACKET bytes and sends several of them in one record, cutting the records and
+ * datagrams an ACK-heavy flow costs severalfold. Call he_conn_flush_inside_packets() each time
+ * the inside has nothing more to read so no packet waits for company that isn't coming. See
+ * coalesce.h for when records are sent. The peer must run a version that understands coalesced
+ * records.
+ */
+he_return_code_t he_conn_set_coalescing(he_conn_t *conn, bool enabled);
+
+/**
+ * @brief Send the inside packets coalescing has queued
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS if they were sent, or nothing was queued
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_SSL_ERROR if wolfSSL failed to send them, they are dropped
+ */
+he_return_code_t he_conn_flush_inside_packets(he_conn_t *conn);
+
+/**
+ * @brief Get the largest inside packet the connection will send
+ * @param conn A pointer to a valid connection
+ * @return The inside MTU, HE_MAX_MTU unless path MTU discovery found otherwise, or 0 if conn is
+ *         NULL
+ */
+size_t he_conn_get_inside_mtu(const he_conn_t *conn);
+
+/**
+ * @brief Set or clear the batched outside write callback
+ * @param conn A pointer to a valid connection
+ * @param batch_cb The callback to use, or NULL to go back to the per-packet callbacks
+ * @return HE_SUCCESS if the callback was set
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NO_MEMORY if a copy of the connection's shared settings could not be allocated
+ *
+ * While set, this callback takes precedence over outside_write_cb and outside_write_gather_cb.
+ * Records generated while he_conn_outside_data_received() runs are queued and flushed in one
+ * call when it returns; records generated at any other time are flushed immediately. The queue
+ * belongs to the thread rather than the connection. Records a callback sends on another
+ * connection flush what is queued first, and records the batch callback itself causes are
+ * handed to it in a batch of their own.
+ */
+he_return_code_t he_conn_set_outside_write_batch_cb(he_conn_t *conn,
+                                                   he_outside_write_batch_cb_t batch_cb);
+
+/**
+ * @brief Encrypt a packet received on the inside (i.e. the tun device) and send it to the peer
+ * @param conn A pointer to a valid connection
+ * @param packet A pointer to the packet
+ * @param length The length of the packet
+ * @param capacity The size of the buffer holding the packet
+ * @return HE_SUCCESS if the packet was sent, or dropped by a plugin
+ * @return HE_ERR_NULL_POINTER if conn or packet is NULL
+ * @return HE_ERR_EMPTY_PACKET if length is zero
+ * @return HE_ERR_PACKET_TOO_LARGE if the packet is larger than he_conn_get_inside_mtu() or capacity
+ * @return HE_ERR_INVALID_CONN_STATE if the connection is not online
+ * @return HE_ERR_SSL_ERROR if wolfSSL failed to send the packet
+ *
+ * The packet is passed through the inside plugins, then padded according to the connection's
+ * padding type by zeroing the buffer behind it. Give at least HE_MAX_MTU bytes of capacity so
+ * this happens in place; with less the packet is copied into a per-thread buffer to be padded.
+ * With coalescing on, small packets are copied into a queued record instead, see
+ * he_conn_set_coalescing().
+ *
+ * @note The contents of the buffer after length may be overwritten.
+ */
+he_return_code_t he_conn_inside_packet_received(he_conn_t *conn, uint8_t *packet, size_t length,
+                                                size_t capacity);
+
+/**
+ * @brief Tell Helium that the nudge timer has gone off
+ * @param conn A pointer to a valid connection
+ * @return HE_SUCCESS if wolfSSL handled the timeout, retransmitting if it needed to
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_NEVER_CONNECTED if the connection has no WOLFSSL object
+ * @return HE_ERR_CONNECT_FAILED if wolfSSL has given up retransmitting
+ *
+ * Connections attached to a timer wheel are nudged by he_timers_advance() and never need this.
+ */
+he_return_code_t he_conn_nudge(he_conn_t *conn);
+
+/**
+ * @brief Get the number of milliseconds to wait before calling he_conn_nudge()
+ * @return The latest timeout wolfSSL reported, 0 if there is none
+ */
+int he_conn_get_nudge_time(he_conn_t *conn);
+
+/**
+ * @brief Feed data received on the outside (i.e. a socket) into Helium
+ * @param conn A pointer to a valid connection
+ * @param buffer A pointer to the received data
+ * @param length The length of the received data
+ * @return HE_SUCCESS if the data was processed, including packets dropped by plugins
+ * @return HE_ERR_NULL_POINTER if conn or buffer is NULL
+ * @return HE_ERR_EMPTY_PACKET if length is zero
+ * @return HE_ERR_PACKET_TOO_SMALL if a datagram is shorter than the wire header
+ * @return HE_ERR_NOT_HE_PACKET if a datagram does not start with the Helium header
+ * @return HE_ERR_INCORRECT_PROTOCOL_VERSION if the datagram's major version doesn't match
+ * @return HE_ERR_SSL_ERROR_NONFATAL if wolfSSL rejected a datagram
+ * @return HE_ERR_SSL_ERROR if wolfSSL failed on a stream connection
+ * @return HE_ERR_CALLBACK_FAILED if the batched outside write callback failed
+ *
+ * Every packet decrypted from the data has any padding stripped, then is passed through the
+ * inside plugins and on to the inside write callback. Packets the peer coalesced are handed on
+ * one by one, each pointing into the decrypted record.
+ */
+he_return_code_t he_conn_outside_data_received(he_conn_t *conn, uint8_t *buffer, size_t length);
+
+/**
+ * @brief Feed a burst of datagrams received on the outside into Helium in one call
+ * @param conn A pointer to a valid datagram connection
+ * @param buffers An array of pointers to the received datagrams
+ * @param lengths An array holding the length of each datagram, updated by outside plugins
+ * @param count The number of datagrams
+ * @return HE_SUCCESS if every datagram was processed
+ * @return HE_ERR_FAILED if an inside plugin failed a decrypted packet
+ * @return HE_ERR_NULL_POINTER if conn, buffers or lengths is NULL
+ * @return HE_ERR_INVALID_CONNECTION_TYPE if the connection is not in datagram mode
+ * @return HE_ERR_NOT_HE_PACKET, HE_ERR_PACKET_TOO_SMALL or HE_ERR_INCORRECT_PROTOCOL_VERSION if
+ * at least one datagram had a bad header; the others are still processed
+ * @return HE_ERR_SSL_ERROR_NONFATAL if wolfSSL rejected at least one datagram; the others are
+ * still processed
+ *
+ * Errors only affect the datagram they occurred on, the first one is returned.
+ *
+ * This is the equivalent of calling he_conn_outside_data_received() for each datagram in turn
+ * (e.g. as returned by recvmmsg()), but the datagrams are fed to wolfSSL from a queue in a single
+ * read loop, the inside plugins see the decrypted packets as a batch, and they are delivered
+ * through the inside write batch callback if one is set. Outside writes triggered by the burst
+ * are flushed once at the end.
+ */
+he_return_code_t he_conn_outside_data_received_batch(he_conn_t *conn, uint8_t **buffers,
+                                                     size_t *lengths, size_t count);
+
+#endif // CONN_H
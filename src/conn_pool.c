@@ -0,0 +1,216 @@
+#include "conn_pool.h"
+#include "conn_template.h"
+#include "core.h"
+#include "plugin_chain.h"
+
+struct he_conn_pool
+{
+    he_conn_t *conns;
+    /// Two chains per connection, inside then outside
+    he_plugin_chain_t *chains;
+    /// Backing arrays for the chains, three per chain
+    plugin_struct_t **chain_storage;
+    size_t plugins_per_chain;
+    /// Stack of the indices of free connections
+    size_t *free_list;
+    size_t num_free;
+    /// Guards against a connection being released twice
+    bool *acquired;
+    /// Shared by every connection in the pool, which is fine as the pool is single threaded
+    RNG rng;
+    bool rng_initialised;
+    uint8_t *wolf_memory;
+    size_t wolf_memory_size;
+    he_conn_pool_stats_t stats;
+};
+
+he_conn_pool_t *he_conn_pool_create(size_t max_connections, size_t plugins_per_chain,
+                                    size_t wolf_memory_size)
+{
+    // Each connection has two chains of three arrays, the slab for them must not overflow
+    if (max_connections == 0 || plugins_per_chain == 0 ||
+        plugins_per_chain > SIZE_MAX / 6 / max_connections)
+    {
+        return NULL;
+    }
+
+    he_conn_pool_t *pool = calloc(1, sizeof(he_conn_pool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->conns = calloc(max_connections, sizeof(he_conn_t));
+    pool->chains = calloc(max_connections * 2, sizeof(he_plugin_chain_t));
+    pool->chain_storage =
+        calloc(max_connections * 2 * plugins_per_chain * 3, sizeof(plugin_struct_t *));
+    pool->free_list = calloc(max_connections, sizeof(size_t));
+    pool->acquired = calloc(max_connections, sizeof(bool));
+    if (wolf_memory_size)
+    {
+        pool->wolf_memory = calloc(1, wolf_memory_size);
+    }
+
+    if (pool->conns == NULL || pool->chains == NULL || pool->chain_storage == NULL ||
+        pool->free_list == NULL || pool->acquired == NULL ||
+        (wolf_memory_size && pool->wolf_memory == NULL))
+    {
+        he_conn_pool_destroy(pool);
+        return NULL;
+    }
+
+    if (wc_InitRng(&pool->rng) != 0)
+    {
+        he_conn_pool_destroy(pool);
+        return NULL;
+    }
+    pool->rng_initialised = true;
+
+    pool->plugins_per_chain = plugins_per_chain;
+    pool->wolf_memory_size = wolf_memory_size;
+    pool->stats.capacity = max_connections;
+
+    // Hand out the lowest indices first
+    for (size_t i = 0; i < max_connections; i++)
+    {
+        pool->free_list[i] = max_connections - 1 - i;
+    }
+    pool->num_free = max_connections;
+
+    return pool;
+}
+
+void he_conn_pool_destroy(he_conn_pool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    if (pool->rng_initialised)
+    {
+        wc_FreeRng(&pool->rng);
+    }
+
+    free(pool->conns);
+    free(pool->chains);
+    free(pool->chain_storage);
+    free(pool->free_list);
+    free(pool->acquired);
+    free(pool->wolf_memory);
+    free(pool);
+}
+
+#ifdef WOLFSSL_STATIC_MEMORY
+he_return_code_t he_conn_pool_create_ssl_ctx(he_conn_pool_t *pool, wolfSSL_method_func method,
+                                             WOLFSSL_CTX **ctx)
+{
+    if (pool == NULL || method == NULL || ctx == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (pool->wolf_memory == NULL)
+    {
+        return HE_ERR_NO_MEMORY;
+    }
+
+    // wolfSSL creates the context itself when handed a NULL one
+    *ctx = NULL;
+    int res = wolfSSL_CTX_load_static_memory(ctx, method, pool->wolf_memory,
+                                             (unsigned int)pool->wolf_memory_size,
+                                             WOLFMEM_GENERAL, (int)pool->stats.capacity);
+    if (res != WOLFSSL_SUCCESS)
+    {
+        *ctx = NULL;
+        return HE_ERR_INIT_FAILED;
+    }
+
+    return HE_SUCCESS;
+}
+#endif
+
+he_conn_t *he_conn_pool_acquire(he_conn_pool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    if (pool->num_free == 0)
+    {
+        pool->stats.exhausted++;
+        return NULL;
+    }
+
+    size_t index = pool->free_list[--pool->num_free];
+    he_conn_t *conn = &pool->conns[index];
+    memset(conn, 0, sizeof(he_conn_t));
+
+    size_t slots = pool->plugins_per_chain * 3;
+    he_plugin_chain_t *inside = &pool->chains[index * 2];
+    he_plugin_chain_t *outside = &pool->chains[index * 2 + 1];
+    he_plugin_chain_init_with_storage(inside, pool->chain_storage + index * 2 * slots,
+                                      pool->plugins_per_chain);
+    he_plugin_chain_init_with_storage(outside, pool->chain_storage + (index * 2 + 1) * slots,
+                                      pool->plugins_per_chain);
+
+    conn->inside_plugins = inside;
+    conn->outside_plugins = outside;
+    conn->wolf_rng = &pool->rng;
+
+    pool->acquired[index] = true;
+    pool->stats.in_use++;
+    if (pool->stats.in_use > pool->stats.peak_in_use)
+    {
+        pool->stats.peak_in_use = pool->stats.in_use;
+    }
+
+    return conn;
+}
+
+he_return_code_t he_conn_pool_release(he_conn_pool_t *pool, he_conn_t *conn)
+{
+    if (pool == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (conn < pool->conns || conn >= pool->conns + pool->stats.capacity)
+    {
+        return HE_ERR_FAILED;
+    }
+
+    size_t index = (size_t)(conn - pool->conns);
+    if (!pool->acquired[index])
+    {
+        return HE_ERR_FAILED;
+    }
+
+    // With static memory this goes back to the pool's buckets rather than the heap
+    if (conn->wolf_ssl)
+    {
+        wolfSSL_free(conn->wolf_ssl);
+        conn->wolf_ssl = NULL;
+    }
+
+    he_internal_release_conn_state(conn);
+
+    pool->acquired[index] = false;
+    pool->free_list[pool->num_free++] = index;
+    pool->stats.in_use--;
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_conn_pool_get_stats(const he_conn_pool_t *pool, he_conn_pool_stats_t *stats)
+{
+    if (pool == NULL || stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    *stats = pool->stats;
+
+    return HE_SUCCESS;
+}
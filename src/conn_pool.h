@@ -0,0 +1,95 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include "he.h"
+
+/**
+ * @brief A fixed set of connections reserved up front
+ *
+ * Everything a connection needs on the data path is carved out of slabs when the pool is created:
+ * the he_conn_t itself, its inside and outside plugin chains and the RNG used for session IDs.
+ * With WOLFSSL_STATIC_MEMORY, he_conn_pool_create_ssl_ctx() also sends every allocation wolfSSL
+ * makes for a WOLFSSL object and its handshake into memory owned by the pool. Acquiring and
+ * releasing a connection then never calls the system allocator, so a burst of reconnects doesn't
+ * turn into a fight over the heap.
+ *
+ * Client credentials, FEC, path MTU discovery and coalescing state are still allocated on demand
+ * if used, and freed again when the connection is released.
+ *
+ * A pool is not thread safe. Give each shard its own pool, sized for the connections it serves.
+ */
+typedef struct he_conn_pool he_conn_pool_t;
+
+typedef struct he_conn_pool_stats
+{
+    /// Number of connections the pool was created with
+    size_t capacity;
+    /// Connections currently acquired
+    size_t in_use;
+    /// Highest value in_use has reached
+    size_t peak_in_use;
+    /// Acquires that failed because every connection was in use
+    size_t exhausted;
+} he_conn_pool_stats_t;
+
+/**
+ * @brief Create a pool
+ * @param max_connections The number of connections to reserve
+ * @param plugins_per_chain The number of plugins each of a connection's chains can hold
+ * @param wolf_memory_size Bytes to reserve for wolfSSL's static memory, 0 if not used
+ * @return A pointer to the pool, or NULL if the arguments are invalid or it could not be set up
+ */
+he_conn_pool_t *he_conn_pool_create(size_t max_connections, size_t plugins_per_chain,
+                                    size_t wolf_memory_size);
+
+/**
+ * @brief Free the pool and everything reserved for it
+ *
+ * Every connection must have been released, and every WOLFSSL_CTX created over the pool's
+ * static memory freed, before this is called.
+ */
+void he_conn_pool_destroy(he_conn_pool_t *pool);
+
+#ifdef WOLFSSL_STATIC_MEMORY
+/**
+ * @brief Create the WOLFSSL_CTX for the pool's connections over the pool's static memory
+ * @param method The wolfSSL method, e.g. wolfDTLSv1_2_server_method_ex
+ * @param ctx Set to the new context
+ * @return HE_SUCCESS if the context was created
+ * @return HE_ERR_NULL_POINTER if pool, method or ctx is NULL
+ * @return HE_ERR_NO_MEMORY if the pool was created without wolfSSL memory
+ * @return HE_ERR_INIT_FAILED if wolfSSL rejected the memory
+ *
+ * wolfSSL allows at most as many concurrent WOLFSSL objects on the context as the pool has
+ * connections. Create each connection's WOLFSSL object from this context with wolfSSL_new().
+ */
+he_return_code_t he_conn_pool_create_ssl_ctx(he_conn_pool_t *pool, wolfSSL_method_func method,
+                                             WOLFSSL_CTX **ctx);
+#endif
+
+/**
+ * @brief Take a zeroed connection from the pool
+ * @return The connection, or NULL if every connection is in use
+ *
+ * The connection comes with empty inside and outside plugin chains and the pool's RNG attached.
+ */
+he_conn_t *he_conn_pool_acquire(he_conn_pool_t *pool);
+
+/**
+ * @brief Hand a connection back to the pool
+ * @return HE_SUCCESS if the connection was released
+ * @return HE_ERR_NULL_POINTER if pool or conn is NULL
+ * @return HE_ERR_FAILED if conn did not come from this pool or was already released
+ *
+ * Frees the connection's WOLFSSL object and anything it allocated on demand. Use this instead of
+ * he_conn_destroy() for pooled connections.
+ */
+he_return_code_t he_conn_pool_release(he_conn_pool_t *pool, he_conn_t *conn);
+
+/**
+ * @brief Report how full the pool is
+ * @return HE_ERR_NULL_POINTER if pool or stats is NULL
+ */
+he_return_code_t he_conn_pool_get_stats(const he_conn_pool_t *pool, he_conn_pool_stats_t *stats);
+
+#endif // CONN_POOL_H
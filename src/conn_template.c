@@ -0,0 +1,80 @@
+#include "conn_template.h"
+
+#include <stdlib.h>
+
+const he_conn_settings_t he_conn_default_settings = {0};
+
+he_conn_template_t *he_conn_template_create(const he_conn_settings_t *settings)
+{
+    he_conn_template_t *tmpl = malloc(sizeof(he_conn_template_t));
+    if (tmpl == NULL)
+    {
+        return NULL;
+    }
+
+    tmpl->settings = settings ? *settings : he_conn_default_settings;
+    atomic_init(&tmpl->refs, 1);
+
+    return tmpl;
+}
+
+void he_conn_template_release(he_conn_template_t *tmpl)
+{
+    if (tmpl == NULL)
+    {
+        return;
+    }
+
+    // Whoever drops the last reference must see every write made through the others
+    if (atomic_fetch_sub_explicit(&tmpl->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(tmpl);
+    }
+}
+
+const he_conn_settings_t *he_conn_template_get_settings(const he_conn_template_t *tmpl)
+{
+    if (tmpl == NULL)
+    {
+        return NULL;
+    }
+
+    return &tmpl->settings;
+}
+
+const he_conn_settings_t *he_conn_get_settings(const he_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+
+    return he_internal_settings(conn);
+}
+
+he_conn_settings_t *he_conn_edit_settings(he_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+
+    he_conn_template_t *tmpl = conn->conn_template;
+
+    // Nobody else can see a template we hold the only reference to, change it in place
+    if (tmpl && atomic_load_explicit(&tmpl->refs, memory_order_acquire) == 1)
+    {
+        return &tmpl->settings;
+    }
+
+    he_conn_template_t *copy = he_conn_template_create(he_internal_settings(conn));
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+    conn->conn_template = copy;
+    he_conn_template_release(tmpl);
+
+    return &copy->settings;
+}
@@ -0,0 +1,90 @@
+#ifndef CONN_TEMPLATE_H
+#define CONN_TEMPLATE_H
+
+#include "he.h"
+
+#include <stdatomic.h>
+
+/**
+ * Shared connection settings
+ *
+ * A host application usually runs every connection with the same connection type, padding,
+ * MTU and callbacks. Those live in a template that any number of connections point at, so
+ * creating a connection is a calloc and a reference count increment however many settings there
+ * are, and each connection costs a pointer rather than a copy of them.
+ *
+ * A template is never changed once it is shared. The per-connection setters such as
+ * he_conn_set_padding_type() go through he_conn_edit_settings(), which gives the connection a
+ * private copy the first time it changes anything, so overriding one connection never affects
+ * the others.
+ *
+ * References are counted atomically, so connections sharing a template can be destroyed from
+ * different threads.
+ */
+struct he_conn_template
+{
+    he_conn_settings_t settings;
+    /// Connections pointing at the template, plus one for whoever created it
+    _Atomic size_t refs;
+};
+
+/// What a connection without a template runs with: all zero, so datagram mode and no callbacks
+extern const he_conn_settings_t he_conn_default_settings;
+
+/**
+ * @brief Create a template
+ * @param settings The settings to share, copied into the template. NULL for the defaults.
+ * @return The template holding one reference for the caller, or NULL if out of memory
+ */
+he_conn_template_t *he_conn_template_create(const he_conn_settings_t *settings);
+
+/**
+ * @brief Drop a reference to a template, freeing it with the last one
+ *
+ * The creator can release its reference as soon as the template has been given to every
+ * connection that needs it.
+ */
+void he_conn_template_release(he_conn_template_t *tmpl);
+
+/**
+ * @brief The settings in a template
+ * @return The settings, or NULL if tmpl is NULL
+ */
+const he_conn_settings_t *he_conn_template_get_settings(const he_conn_template_t *tmpl);
+
+/**
+ * @brief The settings a connection runs with
+ * @return The settings, or NULL if conn is NULL
+ */
+const he_conn_settings_t *he_conn_get_settings(const he_conn_t *conn);
+
+/**
+ * @brief Get settings a connection can change without affecting any other
+ * @return Settings that belong to this connection alone, or NULL if conn is NULL or out of memory
+ *
+ * The first call on a connection whose template is shared copies it. The pointer stays valid
+ * until the connection's template changes.
+ *
+ * @note Use he_conn_set_outside_write_batch_cb() rather than setting outside_write_batch_cb
+ *       here, it also flushes anything queued under the old callback. Don't call this from one
+ *       of the connection's own callbacks.
+ */
+he_conn_settings_t *he_conn_edit_settings(he_conn_t *conn);
+
+/// The settings a connection runs with, for the data path where conn is known to be valid
+static inline const he_conn_settings_t *he_internal_settings(const he_conn_t *conn)
+{
+    return conn->conn_template ? &conn->conn_template->settings : &he_conn_default_settings;
+}
+
+/// Take a reference to a template for a connection
+static inline he_conn_template_t *he_internal_template_acquire(he_conn_template_t *tmpl)
+{
+    if (tmpl)
+    {
+        atomic_fetch_add_explicit(&tmpl->refs, 1, memory_order_relaxed);
+    }
+    return tmpl;
+}
+
+#endif // CONN_TEMPLATE_H
@@ -1,4 +1,88 @@
 #include "core.h"
+#include "conn_template.h"
+#include "stats.h"
+#include "trace.h"
+
+/// Packet buffers shared by every connection served from a thread
+typedef struct he_scratch {
+  /// Where decrypted packets land unless they are decrypted in place
+  uint8_t read_packet[HE_MAX_WIRE_MTU];
+  /// Where the wire header and ciphertext are assembled for the outside write callback
+  uint8_t write_buffer[HE_MAX_WIRE_MTU];
+  /// Where inside packets are padded if the caller's buffer has no room behind them
+  uint8_t padded_packet[HE_MAX_MTU];
+  /// Where coalesced records are unpacked when the inside plugins need room to work
+  uint8_t unpacked_packet[HE_MAX_WIRE_MTU];
+} he_scratch_t;
+
+static HE_THREAD_LOCAL he_scratch_t he_scratch;
+
+static HE_THREAD_LOCAL he_outside_write_batch_t he_outside_write_batch;
+
+uint8_t *he_internal_get_read_scratch(void) {
+  return he_scratch.read_packet;
+}
+
+uint8_t *he_internal_get_write_scratch(void) {
+  return he_scratch.write_buffer;
+}
+
+uint8_t *he_internal_get_padding_scratch(void) {
+  return he_scratch.padded_packet;
+}
+
+uint8_t *he_internal_get_unpack_scratch(void) {
+  return he_scratch.unpacked_packet;
+}
+
+he_outside_write_batch_t *he_internal_get_outside_write_batch(void) {
+  return &he_outside_write_batch;
+}
+
+size_t he_internal_get_padded_length(he_padding_type_t padding_type, size_t length) {
+  if(length >= HE_MAX_MTU) {
+    return length;
+  }
+
+  switch(padding_type) {
+    case HE_PADDING_FULL:
+      return HE_MAX_MTU;
+    case HE_PADDING_450: {
+      // HE_MAX_MTU is a multiple of 450 so this never goes past it
+      size_t rounded = (length + 449) / 450 * 450;
+      return rounded > HE_MAX_MTU ? HE_MAX_MTU : rounded;
+    }
+    default:
+      return length;
+  }
+}
+
+void he_internal_pad_packet(uint8_t *packet, size_t length, size_t padded_length) {
+  if(padded_length > length) {
+    memset(packet + length, 0, padded_length - length);
+  }
+}
+
+size_t he_internal_strip_padding(const uint8_t *packet, size_t length) {
+  size_t ip_length = 0;
+
+  if(length >= 20 && (packet[0] >> 4) == 4) {
+    ip_length = ((size_t)packet[2] << 8) | packet[3];
+  } else if(length >= 40 && (packet[0] >> 4) == 6) {
+    size_t payload_length = ((size_t)packet[4] << 8) | packet[5];
+    // A payload length of zero is a jumbogram, which is never padded
+    if(payload_length) {
+      ip_length = 40 + payload_length;
+    }
+  }
+
+  // Anything that doesn't parse is passed on as it is
+  if(ip_length == 0 || ip_length > length) {
+    return length;
+  }
+
+  return ip_length;
+}
 
 he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data, size_t length) {
   if(conn->incoming_data_left_to_read != 0) {
@@ -16,3 +100,200 @@ he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data,
 
   return HE_SUCCESS;
 }
+
+void he_internal_write_packet_header(he_conn_t *conn, he_wire_hdr_t *hdr) {
+  // First two bytes to contain the 'H' and 'e'
+  hdr->he[0] = 'H';
+  hdr->he[1] = 'e';
+
+  // Version of the wire protocol
+  hdr->major_version = conn->protocol_version.major_version;
+  hdr->minor_version = conn->protocol_version.minor_version;
+
+  // Request aggressive mode from the other side
+  hdr->aggressive_mode = he_internal_settings(conn)->use_aggressive_mode;
+
+  // Reserved bytes must be zero
+  memset(hdr->reserved, 0, sizeof(hdr->reserved));
+
+  // Session identifier
+  hdr->session = conn->session_id;
+}
+
+const he_wire_hdr_t *he_internal_get_wire_header(he_conn_t *conn) {
+  he_wire_hdr_t *hdr = &conn->wire_hdr;
+
+  // Only rebuild the header when one of the fields it carries has changed. A zeroed connection
+  // has no 'H' in the cache, so the first call always builds it.
+  if(hdr->he[0] != 'H' || hdr->session != conn->session_id ||
+     hdr->major_version != conn->protocol_version.major_version ||
+     hdr->minor_version != conn->protocol_version.minor_version ||
+     hdr->aggressive_mode != he_internal_settings(conn)->use_aggressive_mode) {
+    he_internal_write_packet_header(conn, hdr);
+  }
+
+  return hdr;
+}
+
+he_return_code_t he_internal_flush_outside_writes(he_conn_t *conn) {
+  he_outside_write_batch_t *batch = &he_outside_write_batch;
+
+  // A write made from inside the callback must not send the datagrams a second time
+  if(batch->conn != conn || batch->num_datagrams == 0 || batch->flushing) {
+    return HE_SUCCESS;
+  }
+
+  he_return_code_t res = HE_SUCCESS;
+  he_outside_write_batch_cb_t batch_cb = he_internal_settings(conn)->outside_write_batch_cb;
+  if(batch_cb) {
+    batch->flushing = true;
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, batch->num_datagrams);
+    res = batch_cb(conn, batch->datagrams, batch->num_datagrams, conn->data);
+    HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, batch->num_datagrams, res);
+    batch->flushing = false;
+  }
+
+  // Duplicates of a record are queued right behind it and share its buffer
+  for(size_t i = 0; i < batch->num_datagrams; i++) {
+    he_outside_datagram_t *datagram = &batch->datagrams[i];
+    if(i > 0 && datagram->packet == batch->datagrams[i - 1].packet) {
+      he_internal_stats_duplicates(conn, 1);
+    } else if(res == HE_SUCCESS) {
+      he_internal_stats_packet(conn, HE_STATS_OUTSIDE_OUT, datagram->length);
+    } else {
+      he_internal_stats_drop(conn, HE_ERR_CALLBACK_FAILED, 1);
+    }
+  }
+
+  // The queue is emptied even on failure, the records are gone either way
+  batch->num_datagrams = 0;
+  batch->num_buffers = 0;
+  batch->conn = NULL;
+
+  return res == HE_SUCCESS ? HE_SUCCESS : HE_ERR_CALLBACK_FAILED;
+}
+
+he_return_code_t he_internal_generate_session_id(he_conn_t *conn, uint64_t *session_id_out) {
+  if(!conn || !session_id_out) {
+    return HE_ERR_NULL_POINTER;
+  }
+
+  // Only connections that are handed session IDs ever need an RNG
+  if(!conn->wolf_rng) {
+    RNG *rng = calloc(1, sizeof(RNG));
+    if(!rng) {
+      return HE_ERR_NO_MEMORY;
+    }
+    if(wc_InitRng(rng) != 0) {
+      free(rng);
+      return HE_ERR_RNG_FAILURE;
+    }
+    conn->wolf_rng = rng;
+  }
+
+  uint64_t session = 0;
+
+  // 0 and UINT64_MAX are reserved, keep drawing until we get something else
+  do {
+    int res = wc_RNG_GenerateBlock(conn->wolf_rng, (byte *)&session, sizeof(session));
+    if(res != 0) {
+      return HE_ERR_RNG_FAILURE;
+    }
+
+    if(conn->use_session_shard) {
+      // Keep the random bits below the shard so any core can find the owner from the header
+      session &= (UINT64_MAX >> HE_SESSION_SHARD_BITS);
+      session |= (uint64_t)conn->session_shard << HE_SESSION_SHARD_SHIFT;
+    }
+  } while(session == 0 || session == UINT64_MAX);
+
+  *session_id_out = session;
+  return HE_SUCCESS;
+}
+
+he_conn_auth_t *he_internal_get_auth(he_conn_t *conn) {
+  if(!conn->auth) {
+    conn->auth = calloc(1, sizeof(he_conn_auth_t));
+  }
+
+  return conn->auth;
+}
+
+void he_internal_release_auth(he_conn_t *conn) {
+  if(!conn->auth) {
+    return;
+  }
+
+  // Don't leave credentials lying around in freed memory
+  volatile uint8_t *p = (volatile uint8_t *)conn->auth;
+  for(size_t i = 0; i < sizeof(he_conn_auth_t); i++) {
+    p[i] = 0;
+  }
+
+  free(conn->auth);
+  conn->auth = NULL;
+}
+
+void he_internal_release_conn_state(he_conn_t *conn) {
+  he_internal_timer_unlink(conn);
+  he_internal_rekey_unlink(conn);
+  he_internal_release_auth(conn);
+  free(conn->fec);
+  conn->fec = NULL;
+  free(conn->pmtu);
+  conn->pmtu = NULL;
+  free(conn->coalesce);
+  conn->coalesce = NULL;
+  he_conn_template_release(conn->conn_template);
+  conn->conn_template = NULL;
+}
+
+void he_internal_timer_unlink(he_conn_t *conn) {
+  if(!conn->timer_pprev) {
+    return;
+  }
+
+  *conn->timer_pprev = conn->timer_next;
+  if(conn->timer_next) {
+    conn->timer_next->timer_pprev = conn->timer_pprev;
+  }
+  conn->timer_next = NULL;
+  conn->timer_pprev = NULL;
+}
+
+void he_internal_rekey_unlink(he_conn_t *conn) {
+  if(!conn->rekey_pprev) {
+    return;
+  }
+
+  *conn->rekey_pprev = conn->rekey_next;
+  if(conn->rekey_next) {
+    conn->rekey_next->rekey_pprev = conn->rekey_pprev;
+  }
+  conn->rekey_next = NULL;
+  conn->rekey_pprev = NULL;
+}
+
+void he_internal_change_conn_state(he_conn_t *conn, he_conn_state_t dst) {
+  if(conn->state == dst) {
+    return;
+  }
+
+  conn->state = dst;
+
+  // Credentials are only sent during authentication, drop them once that is over either way
+  if(dst == HE_STATE_ONLINE || dst == HE_STATE_DISCONNECTED) {
+    he_internal_release_auth(conn);
+  }
+
+  // A disconnected connection has nothing left to retransmit
+  if(dst == HE_STATE_DISCONNECTED) {
+    he_internal_timer_unlink(conn);
+    conn->is_nudge_timer_running = false;
+  }
+
+  he_state_change_cb_t state_change_cb = he_internal_settings(conn)->state_change_cb;
+  if(state_change_cb) {
+    state_change_cb(conn, dst, conn->data);
+  }
+}
@@ -3,9 +3,153 @@
 
 #include "he.h"
 
+/// Storage class for per-thread scratch state
+#if defined(_MSC_VER)
+#define HE_THREAD_LOCAL __declspec(thread)
+#else
+#define HE_THREAD_LOCAL __thread
+#endif
+
+/**
+ * @brief Get this thread's scratch buffer for decrypted packets
+ *
+ * HE_MAX_WIRE_MTU bytes, shared by every connection on the thread. Anything written to it is
+ * only good until control returns to Helium.
+ */
+uint8_t *he_internal_get_read_scratch(void);
+
+/**
+ * @brief Get this thread's scratch buffer for assembling outgoing packets
+ *
+ * HE_MAX_WIRE_MTU bytes, shared by every connection on the thread.
+ */
+uint8_t *he_internal_get_write_scratch(void);
+
+/**
+ * @brief Get this thread's buffer for padding inside packets that have no room to be padded in place
+ *
+ * HE_MAX_MTU bytes, shared by every connection on the thread.
+ */
+uint8_t *he_internal_get_padding_scratch(void);
+
+/**
+ * @brief Get this thread's buffer for packets taken out of a coalesced record
+ *
+ * HE_MAX_WIRE_MTU bytes, shared by every connection on the thread. Packets in a coalesced record
+ * sit back to back, so ingress plugins that grow a packet (e.g. decompression) need it copied
+ * somewhere with room first.
+ */
+uint8_t *he_internal_get_unpack_scratch(void);
+
+/**
+ * @brief Work out how long an inside packet will be once padded
+ * @return The padded length, never more than HE_MAX_MTU unless length already is
+ *
+ * HE_PADDING_FULL pads to HE_MAX_MTU, HE_PADDING_450 rounds up to the next multiple of 450.
+ */
+size_t he_internal_get_padded_length(he_padding_type_t padding_type, size_t length);
+
+/**
+ * @brief Zero the bytes between length and padded_length
+ *
+ * The buffer must be at least padded_length bytes long.
+ */
+void he_internal_pad_packet(uint8_t *packet, size_t length, size_t padded_length);
+
+/**
+ * @brief Get the length of a decrypted inside packet with any padding removed
+ * @return The length from the IPv4 or IPv6 header, or length if the packet doesn't parse
+ *
+ * Padding is only ever added behind an IP packet, so its own length field says where the padding
+ * starts and nothing needs to be scanned. Unpadded packets come back unchanged, which means the
+ * receiver doesn't need to know whether its peer pads.
+ */
+size_t he_internal_strip_padding(const uint8_t *packet, size_t length);
+
 /**
  * @brief Setup the pointers and counters for reading from a TCP stream
  */
 he_return_code_t he_internal_setup_stream_state(he_conn_t *conn, uint8_t *data, size_t length);
 
+/**
+ * @brief Write the Helium wire header for this connection into hdr
+ */
+void he_internal_write_packet_header(he_conn_t *conn, he_wire_hdr_t *hdr);
+
+/**
+ * @brief Get the cached wire header for this connection, rebuilding it if it is stale
+ */
+const he_wire_hdr_t *he_internal_get_wire_header(he_conn_t *conn);
+
+/**
+ * @brief Get this thread's queue of records for the batch write callback
+ *
+ * The queue is always flushed before control returns to the host, so one per thread is enough
+ * no matter how many connections the thread serves. It holds one connection's records at a time.
+ */
+he_outside_write_batch_t *he_internal_get_outside_write_batch(void);
+
+/**
+ * @brief Hand every outside datagram queued for this connection to the batch write callback in
+ *        one call
+ * @return HE_SUCCESS if nothing was queued for this connection
+ * @return HE_ERR_CALLBACK_FAILED if the callback reported an error
+ */
+he_return_code_t he_internal_flush_outside_writes(he_conn_t *conn);
+
+/**
+ * @brief Draw a new random session ID for this connection from its RNG
+ * @return HE_ERR_NO_MEMORY if the RNG could not be allocated
+ * @return HE_ERR_RNG_FAILURE if the RNG failed
+ *
+ * If the connection has a session shard set, the shard index is encoded in the top
+ * HE_SESSION_SHARD_BITS of the ID. The reserved IDs 0 and UINT64_MAX are never returned.
+ * Uniqueness is not checked here, see he_session_table_insert_new().
+ */
+he_return_code_t he_internal_generate_session_id(he_conn_t *conn, uint64_t *session_id_out);
+
+/**
+ * @brief Get the connection's credentials, allocating them if they haven't been set yet
+ * @return NULL if they could not be allocated
+ */
+he_conn_auth_t *he_internal_get_auth(he_conn_t *conn);
+
+/**
+ * @brief Wipe and free the connection's credentials
+ */
+void he_internal_release_auth(he_conn_t *conn);
+
+/**
+ * @brief Take the connection's nudge timer off whichever timer wheel slot it is armed in
+ *
+ * Does nothing if the timer isn't armed. The wheel itself is not needed, so this is safe to call
+ * on a connection that is being torn down.
+ */
+void he_internal_timer_unlink(he_conn_t *conn);
+
+/**
+ * @brief Take the connection off whichever rekey scheduler list it is on
+ *
+ * Like he_internal_timer_unlink() this doesn't need the scheduler, so it is safe on teardown.
+ */
+void he_internal_rekey_unlink(he_conn_t *conn);
+
+/**
+ * @brief Release everything a connection picks up while it is in use
+ *
+ * Takes it off its timer wheel and rekey scheduler, and frees its credentials, FEC, path MTU
+ * discovery and coalescing state and its reference to its template. The WOLFSSL object, RNG and
+ * plugin chains are left to the caller, he_conn_destroy() and he_conn_pool_release() own them
+ * differently.
+ */
+void he_internal_release_conn_state(he_conn_t *conn);
+
+/**
+ * @brief Move the connection to a new state and tell the state change callback
+ *
+ * Credentials are released when the connection goes online or disconnects, and the nudge timer
+ * is cancelled when it disconnects.
+ */
+void he_internal_change_conn_state(he_conn_t *conn, he_conn_state_t dst);
+
 #endif // CORE_H
@@ -0,0 +1,256 @@
+#include "dispatch.h"
+
+#include <stdatomic.h>
+
+/// Keeps the producer and consumer positions of a queue off each other's cache line
+#define HE_DISPATCH_CACHE_LINE 64
+
+typedef struct he_dispatch_cell
+{
+    /// Equals the position the cell is free for, or that position + 1 once it holds a datagram
+    _Atomic size_t sequence;
+    size_t length;
+    uint8_t packet[HE_MAX_WIRE_MTU];
+} he_dispatch_cell_t;
+
+typedef struct he_dispatch_queue
+{
+    _Alignas(HE_DISPATCH_CACHE_LINE) _Atomic size_t push_pos;
+    /// Only touched by the owning shard
+    _Alignas(HE_DISPATCH_CACHE_LINE) size_t drain_pos;
+    he_dispatch_cell_t *cells;
+    size_t mask;
+} he_dispatch_queue_t;
+
+struct he_dispatcher
+{
+    he_dispatch_queue_t *queues;
+    size_t num_shards;
+};
+
+he_dispatcher_t *he_dispatcher_create(size_t num_shards, size_t queue_depth)
+{
+    if (num_shards == 0 || num_shards > HE_MAX_SHARDS || queue_depth == 0)
+    {
+        return NULL;
+    }
+
+    size_t depth = 2;
+    while (depth < queue_depth)
+    {
+        depth *= 2;
+    }
+
+    he_dispatcher_t *dispatcher = calloc(1, sizeof(he_dispatcher_t));
+    if (dispatcher == NULL)
+    {
+        return NULL;
+    }
+
+    // sizeof a struct with aligned members is a multiple of the alignment, as aligned_alloc wants
+    dispatcher->queues = aligned_alloc(HE_DISPATCH_CACHE_LINE, num_shards * sizeof(he_dispatch_queue_t));
+    if (dispatcher->queues == NULL)
+    {
+        free(dispatcher);
+        return NULL;
+    }
+    memset(dispatcher->queues, 0, num_shards * sizeof(he_dispatch_queue_t));
+    dispatcher->num_shards = num_shards;
+
+    for (size_t s = 0; s < num_shards; s++)
+    {
+        he_dispatch_queue_t *queue = &dispatcher->queues[s];
+
+        queue->cells = calloc(depth, sizeof(he_dispatch_cell_t));
+        if (queue->cells == NULL)
+        {
+            he_dispatcher_destroy(dispatcher);
+            return NULL;
+        }
+
+        queue->mask = depth - 1;
+        atomic_init(&queue->push_pos, 0);
+        for (size_t i = 0; i < depth; i++)
+        {
+            atomic_init(&queue->cells[i].sequence, i);
+        }
+    }
+
+    return dispatcher;
+}
+
+void he_dispatcher_destroy(he_dispatcher_t *dispatcher)
+{
+    if (dispatcher)
+    {
+        for (size_t s = 0; s < dispatcher->num_shards; s++)
+        {
+            free(dispatcher->queues[s].cells);
+        }
+        free(dispatcher->queues);
+        free(dispatcher);
+    }
+}
+
+he_return_code_t he_dispatcher_shard_for_packet(const he_dispatcher_t *dispatcher,
+                                                const uint8_t *packet, size_t length,
+                                                size_t *shard)
+{
+    if (dispatcher == NULL || packet == NULL || shard == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (length < sizeof(he_wire_hdr_t))
+    {
+        return HE_ERR_PACKET_TOO_SMALL;
+    }
+
+    if (packet[0] != 'H' || packet[1] != 'e')
+    {
+        return HE_ERR_NOT_HE_PACKET;
+    }
+
+    // The datagram may sit at any alignment in the caller's receive buffer
+    uint64_t session;
+    memcpy(&session, packet + offsetof(he_wire_hdr_t, session), sizeof(session));
+
+    if (session == 0)
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    size_t owner = HE_SESSION_SHARD(session);
+    if (owner >= dispatcher->num_shards)
+    {
+        return HE_ERR_INVALID_SHARD;
+    }
+
+    *shard = owner;
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_dispatcher_push(he_dispatcher_t *dispatcher, size_t shard,
+                                    const uint8_t *packet, size_t length)
+{
+    if (dispatcher == NULL || packet == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (shard >= dispatcher->num_shards)
+    {
+        return HE_ERR_INVALID_SHARD;
+    }
+
+    if (length > HE_MAX_WIRE_MTU)
+    {
+        return HE_ERR_PACKET_TOO_LARGE;
+    }
+
+    he_dispatch_queue_t *queue = &dispatcher->queues[shard];
+    he_dispatch_cell_t *cell = NULL;
+    size_t pos = atomic_load_explicit(&queue->push_pos, memory_order_relaxed);
+
+    // Claim a cell by moving push_pos past it, the cell's sequence says whether it is free yet
+    for (;;)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->push_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // The cell still holds a datagram from a lap ago, the owner has fallen behind
+            return HE_ERR_QUEUE_FULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->push_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell->packet, packet, length);
+    cell->length = length;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_dispatcher_route(he_dispatcher_t *dispatcher, size_t local_shard,
+                                     const uint8_t *packet, size_t length, bool *queued)
+{
+    if (queued == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    *queued = false;
+
+    size_t owner = 0;
+    he_return_code_t res = he_dispatcher_shard_for_packet(dispatcher, packet, length, &owner);
+    if (res == HE_ERR_UNKNOWN_SESSION)
+    {
+        return HE_SUCCESS;
+    }
+
+    if (res != HE_SUCCESS)
+    {
+        return res;
+    }
+
+    if (owner == local_shard)
+    {
+        return HE_SUCCESS;
+    }
+
+    res = he_dispatcher_push(dispatcher, owner, packet, length);
+    if (res != HE_SUCCESS)
+    {
+        return res;
+    }
+
+    *queued = true;
+    return HE_SUCCESS;
+}
+
+size_t he_dispatcher_drain(he_dispatcher_t *dispatcher, size_t shard, size_t max,
+                           he_dispatch_cb_t cb, void *context)
+{
+    if (dispatcher == NULL || cb == NULL || shard >= dispatcher->num_shards)
+    {
+        return 0;
+    }
+
+    he_dispatch_queue_t *queue = &dispatcher->queues[shard];
+    size_t drained = 0;
+
+    while (drained < max)
+    {
+        size_t pos = queue->drain_pos;
+        he_dispatch_cell_t *cell = &queue->cells[pos & queue->mask];
+
+        if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1)
+        {
+            // Empty, or a producer has claimed the cell but not filled it yet
+            break;
+        }
+
+        cb(cell->packet, cell->length, context);
+
+        // Hand the cell back to producers for the next lap
+        atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+        queue->drain_pos = pos + 1;
+        drained++;
+    }
+
+    return drained;
+}
@@ -0,0 +1,84 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "he.h"
+
+/**
+ * @brief Hands datagrams to the shard (i.e. core) that owns their session
+ *
+ * Meant for a shared-nothing server where each core runs its own connections and session table,
+ * and every core receives datagrams for any session (e.g. through SO_REUSEPORT). Connections are
+ * pinned with he_conn_set_session_shard(), so the owner of a datagram is read straight from the
+ * session ID in its wire header.
+ *
+ * Each shard has a bounded lock-free queue. Any thread may push onto it, only the owning shard
+ * may drain it. Datagrams are copied into the queue, so the receive buffer can be reused as soon
+ * as a push returns.
+ */
+typedef struct he_dispatcher he_dispatcher_t;
+
+/// Called by he_dispatcher_drain() for every queued datagram, the packet may be modified in place
+typedef void (*he_dispatch_cb_t)(uint8_t *packet, size_t length, void *context);
+
+/**
+ * @brief Create a dispatcher
+ * @param num_shards The number of shards, at most HE_MAX_SHARDS
+ * @param queue_depth The number of datagrams each shard can have waiting, rounded up to a power
+ * of two
+ * @return A pointer to the dispatcher, or NULL if the arguments are invalid or it could not be
+ * allocated
+ */
+he_dispatcher_t *he_dispatcher_create(size_t num_shards, size_t queue_depth);
+
+void he_dispatcher_destroy(he_dispatcher_t *dispatcher);
+
+/**
+ * @brief Work out which shard owns a datagram from its wire header
+ * @return HE_SUCCESS if shard was set
+ * @return HE_ERR_PACKET_TOO_SMALL if the datagram is shorter than the wire header
+ * @return HE_ERR_NOT_HE_PACKET if the datagram does not start with the Helium header
+ * @return HE_ERR_UNKNOWN_SESSION if the datagram has no session yet (i.e. a new connection)
+ * @return HE_ERR_INVALID_SHARD if the session names a shard this dispatcher doesn't have
+ */
+he_return_code_t he_dispatcher_shard_for_packet(const he_dispatcher_t *dispatcher,
+                                                const uint8_t *packet, size_t length,
+                                                size_t *shard);
+
+/**
+ * @brief Queue a copy of a datagram for a shard
+ * @return HE_ERR_INVALID_SHARD if shard is out of range
+ * @return HE_ERR_PACKET_TOO_LARGE if the datagram is larger than HE_MAX_WIRE_MTU
+ * @return HE_ERR_QUEUE_FULL if the shard's queue is full, the datagram is dropped
+ *
+ * Safe to call from any number of threads at once.
+ */
+he_return_code_t he_dispatcher_push(he_dispatcher_t *dispatcher, size_t shard,
+                                    const uint8_t *packet, size_t length);
+
+/**
+ * @brief Decide where a freshly received datagram should be handled
+ * @param local_shard The shard of the calling thread
+ * @param queued Set to true if the datagram was handed to another shard, or false if the
+ * caller should process it itself
+ * @return HE_SUCCESS if the datagram was routed
+ * @return Any error from he_dispatcher_shard_for_packet() or he_dispatcher_push() other than
+ * HE_ERR_UNKNOWN_SESSION; the datagram should be dropped
+ *
+ * Datagrams without a session belong to whichever shard receives them, which then becomes the
+ * owner of the new connection.
+ */
+he_return_code_t he_dispatcher_route(he_dispatcher_t *dispatcher, size_t local_shard,
+                                     const uint8_t *packet, size_t length, bool *queued);
+
+/**
+ * @brief Process datagrams queued for a shard
+ * @param max The most datagrams to process, so one shard can't starve its own socket
+ * @return The number of datagrams passed to cb
+ *
+ * Must only be called by the thread that owns the shard. The packet pointer is only valid until
+ * cb returns.
+ */
+size_t he_dispatcher_drain(he_dispatcher_t *dispatcher, size_t shard, size_t max,
+                           he_dispatch_cb_t cb, void *context);
+
+#endif // DISPATCH_H
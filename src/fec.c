@@ -0,0 +1,290 @@
+#include "fec.h"
+#include "conn_template.h"
+
+#include <string.h>
+
+/// Weight of the newest group in the loss average, as a shift
+#define HE_FEC_LOSS_SMOOTHING 3
+
+/// Groups that went missing altogether count as lost, up to this many at a time
+#define HE_FEC_MAX_MISSING_GROUPS 8
+
+static void he_fec_xor(uint8_t *dst, const uint8_t *src, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+/**
+ * @brief Pick K for a new group from the loss the peer reports, the more loss the more parity
+ */
+static uint8_t he_fec_group_size(uint8_t peer_loss)
+{
+    // peer_loss is in 1/32ths
+    if (peer_loss <= 1)
+    {
+        return 5;
+    }
+    if (peer_loss <= 2)
+    {
+        return 4;
+    }
+    if (peer_loss <= 4)
+    {
+        return 3;
+    }
+    return HE_FEC_MIN_GROUP;
+}
+
+static void he_fec_record_loss(he_fec_t *fec, size_t lost, size_t expected)
+{
+    if (expected == 0)
+    {
+        return;
+    }
+
+    int32_t sample = (int32_t)(lost * 256 / expected);
+    int32_t loss = fec->loss;
+    loss += (sample - loss) >> HE_FEC_LOSS_SMOOTHING;
+    fec->loss = (uint16_t)(loss < 0 ? 0 : loss);
+}
+
+bool he_internal_fec_stamp(he_conn_t *conn, he_wire_hdr_t *hdr)
+{
+    he_fec_t *fec = conn->fec;
+
+    uint8_t loss = (uint8_t)(fec->loss >> 3);
+    if (loss > (HE_FEC_LOSS_MASK >> HE_FEC_LOSS_SHIFT))
+    {
+        loss = HE_FEC_LOSS_MASK >> HE_FEC_LOSS_SHIFT;
+    }
+    hdr->reserved[0] = HE_FEC_CAPABLE | (uint8_t)(loss << HE_FEC_LOSS_SHIFT);
+
+    // Handshake records are already sent three times, as is everything in aggressive mode
+    const he_conn_settings_t *settings = he_internal_settings(conn);
+    if (!fec->peer_capable || conn->state != HE_STATE_ONLINE || settings->use_aggressive_mode ||
+        settings->connection_type != HE_CONNECTION_TYPE_DATAGRAM)
+    {
+        return false;
+    }
+
+    if (fec->index == 0)
+    {
+        // Clear what was left of the previous group's parity
+        memset(fec->parity, 0, HE_FEC_LENGTH_SIZE + fec->max_length);
+        fec->max_length = 0;
+        fec->k = he_fec_group_size(fec->peer_loss);
+    }
+
+    hdr->reserved[0] |= HE_FEC_TYPE_DATA;
+    hdr->reserved[1] = fec->group;
+    hdr->reserved[2] = (uint8_t)(fec->k << 4 | fec->index);
+
+    return true;
+}
+
+size_t he_internal_fec_add(he_conn_t *conn, const he_wire_hdr_t *hdr, const uint8_t *record,
+                           size_t length, he_wire_hdr_t *parity_hdr, const uint8_t **parity)
+{
+    he_fec_t *fec = conn->fec;
+
+    // Callers check the record fits in a datagram, so it fits in the parity too
+    he_fec_xor(fec->parity + HE_FEC_LENGTH_SIZE, record, length);
+    fec->parity[0] ^= (uint8_t)(length >> 8);
+    fec->parity[1] ^= (uint8_t)length;
+    if (length > fec->max_length)
+    {
+        fec->max_length = (uint16_t)length;
+    }
+
+    if (++fec->index < fec->k)
+    {
+        return 0;
+    }
+
+    fec->index = 0;
+    fec->group++;
+
+    size_t parity_length = HE_FEC_LENGTH_SIZE + fec->max_length;
+    if (parity_length > HE_FEC_MAX_RECORD)
+    {
+        // Full size records leave no room for the length XOR, this group goes unprotected
+        return 0;
+    }
+
+    *parity_hdr = *hdr;
+    parity_hdr->reserved[0] =
+        (uint8_t)((hdr->reserved[0] & ~HE_FEC_TYPE_MASK) | HE_FEC_TYPE_PARITY);
+    *parity = fec->parity;
+    fec->parity_sent++;
+
+    return parity_length;
+}
+
+/**
+ * @brief Account for a group leaving the window and free its slot for another
+ */
+static void he_fec_retire(he_fec_t *fec, he_fec_group_t *slot)
+{
+    size_t arrived = (size_t)__builtin_popcount(slot->arrived);
+    he_fec_record_loss(fec, slot->k - arrived, slot->k);
+
+    // Only as much of the XOR as the longest record touched needs clearing
+    memset(slot->xor, 0, slot->max_length);
+    slot->active = false;
+    slot->parity_seen = false;
+    slot->arrived = 0;
+    slot->have = 0;
+    slot->length_xor = 0;
+    slot->max_length = 0;
+}
+
+/**
+ * @brief Find the slot for a group, retiring whatever older group was in it
+ * @return The slot, or NULL if the group is too old to still be tracked
+ */
+static he_fec_group_t *he_fec_group(he_fec_t *fec, uint8_t group, uint8_t k)
+{
+    if (fec->seen_group)
+    {
+        uint8_t ahead = (uint8_t)(group - fec->last_group);
+        if (ahead >= 128)
+        {
+            // Behind the newest group, only any use if its slot still holds it
+            if ((uint8_t)(fec->last_group - group) >= HE_FEC_WINDOW)
+            {
+                return NULL;
+            }
+        }
+        else if (ahead > 0)
+        {
+            // Whole groups that never showed up, not even their parity
+            size_t missing = ahead - 1;
+            if (missing > HE_FEC_MAX_MISSING_GROUPS)
+            {
+                missing = HE_FEC_MAX_MISSING_GROUPS;
+            }
+            for (size_t i = 0; i < missing; i++)
+            {
+                he_fec_record_loss(fec, 1, 1);
+            }
+            fec->last_group = group;
+        }
+    }
+    else
+    {
+        fec->seen_group = true;
+        fec->last_group = group;
+    }
+
+    he_fec_group_t *slot = &fec->groups[group & (HE_FEC_WINDOW - 1)];
+    if (slot->active && (slot->group != group || slot->k != k))
+    {
+        he_fec_retire(fec, slot);
+    }
+
+    if (!slot->active)
+    {
+        slot->active = true;
+        slot->group = group;
+        slot->k = k;
+    }
+
+    return slot;
+}
+
+bool he_internal_fec_receive(he_conn_t *conn, uint8_t *datagram, size_t *length)
+{
+    he_fec_t *fec = conn->fec;
+    // The datagram may sit at any alignment in the caller's receive buffer
+    uint8_t *reserved = datagram + offsetof(he_wire_hdr_t, reserved);
+
+    uint8_t flags = reserved[0];
+    fec->peer_capable = (flags & HE_FEC_CAPABLE) != 0;
+    fec->peer_loss = (uint8_t)((flags & HE_FEC_LOSS_MASK) >> HE_FEC_LOSS_SHIFT);
+
+    uint8_t type = flags & HE_FEC_TYPE_MASK;
+    if (type == HE_FEC_TYPE_NONE)
+    {
+        return true;
+    }
+
+    uint8_t k = reserved[2] >> 4;
+    uint8_t index = reserved[2] & 0x0f;
+    if (k < HE_FEC_MIN_GROUP || k > HE_FEC_MAX_GROUP || index >= k)
+    {
+        // Not something we would send, let wolfSSL judge the record
+        return type == HE_FEC_TYPE_DATA;
+    }
+
+    uint8_t *payload = datagram + sizeof(he_wire_hdr_t);
+    size_t payload_length = *length - sizeof(he_wire_hdr_t);
+    if (payload_length > HE_FEC_MAX_RECORD)
+    {
+        return type == HE_FEC_TYPE_DATA;
+    }
+
+    he_fec_group_t *slot = he_fec_group(fec, reserved[1], k);
+    if (slot == NULL)
+    {
+        return type == HE_FEC_TYPE_DATA;
+    }
+
+    if (type == HE_FEC_TYPE_DATA)
+    {
+        uint16_t bit = (uint16_t)(1u << index);
+        if (slot->have & bit)
+        {
+            // Already have it, wolfSSL will throw the copy away as a replay
+            return true;
+        }
+
+        slot->arrived |= bit;
+        slot->have |= bit;
+        slot->length_xor ^= (uint16_t)payload_length;
+        he_fec_xor(slot->xor, payload, payload_length);
+        if (payload_length > slot->max_length)
+        {
+            slot->max_length = (uint16_t)payload_length;
+        }
+        return true;
+    }
+
+    if (type != HE_FEC_TYPE_PARITY || slot->parity_seen || payload_length < HE_FEC_LENGTH_SIZE)
+    {
+        return false;
+    }
+    slot->parity_seen = true;
+
+    // Only one missing record can be rebuilt, and none need to be if nothing is missing
+    uint16_t all = (uint16_t)((1u << k) - 1);
+    uint16_t missing = all & ~slot->have;
+    if (missing == 0 || (missing & (missing - 1)) != 0)
+    {
+        return false;
+    }
+
+    uint16_t record_length =
+        (uint16_t)(((uint16_t)payload[0] << 8 | payload[1]) ^ slot->length_xor);
+    if (record_length == 0 || record_length > payload_length - HE_FEC_LENGTH_SIZE)
+    {
+        return false;
+    }
+
+    // The parity XOR the records we have is the one we don't. Build it in place at the front
+    // of the payload, which moves it back by the length XOR it no longer needs.
+    uint8_t *record = payload + HE_FEC_LENGTH_SIZE;
+    he_fec_xor(record, slot->xor, record_length);
+    memmove(payload, record, record_length);
+
+    slot->have |= missing;
+    fec->recovered++;
+
+    reserved[0] = (uint8_t)((flags & ~HE_FEC_TYPE_MASK) | HE_FEC_TYPE_DATA);
+    reserved[2] = (uint8_t)(k << 4 | __builtin_ctz(missing));
+    *length = sizeof(he_wire_hdr_t) + record_length;
+
+    return true;
+}
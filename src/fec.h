@@ -0,0 +1,141 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include "he.h"
+
+/**
+ * Forward error correction for datagram connections
+ *
+ * A cheaper way than aggressive mode to ride out loss. Records are sent once, in groups of K,
+ * and after each group a parity datagram carrying the XOR of the group's records. Any one
+ * record lost from a group is rebuilt from the others and the parity, for an overhead of 1/K
+ * rather than aggressive mode's 200%.
+ *
+ * Each side measures how many records it is missing and reports it in the header of everything
+ * it sends. K follows the loss the peer reports, from HE_FEC_MAX_GROUP (20% overhead) on a
+ * clean link down to HE_FEC_MIN_GROUP (50%) on a bad one.
+ *
+ * Everything rides in the reserved bytes of he_wire_hdr_t, which older peers leave zero and
+ * ignore:
+ *
+ *  - reserved[0]: HE_FEC_CAPABLE, the loss the sender is seeing and the datagram type
+ *  - reserved[1]: group sequence number
+ *  - reserved[2]: position in the group in the low nibble, K in the high nibble
+ *
+ * Parity is only sent once the peer has said it is capable, so nothing changes on the wire
+ * unless both ends enable FEC. A parity datagram carries the XOR of the group's record lengths
+ * (two bytes, big endian) followed by the XOR of the records zero padded to the longest.
+ *
+ * Groups are only closed by traffic: the last records before a quiet spell are unprotected
+ * until K records have gone out. Aggressive mode, when on, takes precedence.
+ */
+
+/// Smallest and largest group sizes, 50% and 20% overhead
+#define HE_FEC_MIN_GROUP 2
+#define HE_FEC_MAX_GROUP 5
+
+/// Groups the receiver tracks at once, must be a power of two
+#define HE_FEC_WINDOW 4
+
+/// Set in reserved[0] of everything sent by a connection with FEC enabled
+#define HE_FEC_CAPABLE 0x80
+/// Loss the sender sees from the peer, in 1/32ths
+#define HE_FEC_LOSS_MASK 0x7c
+#define HE_FEC_LOSS_SHIFT 2
+#define HE_FEC_TYPE_MASK 0x03
+
+typedef enum he_fec_type
+{
+    /// Not part of a group
+    HE_FEC_TYPE_NONE = 0,
+    /// A record in a group
+    HE_FEC_TYPE_DATA = 1,
+    /// The parity of a group
+    HE_FEC_TYPE_PARITY = 2,
+} he_fec_type_t;
+
+/// Largest record that fits behind the wire header
+#define HE_FEC_MAX_RECORD (HE_MAX_WIRE_MTU - sizeof(he_wire_hdr_t))
+/// The XOR of the record lengths in front of the record XOR in a parity payload
+#define HE_FEC_LENGTH_SIZE 2
+
+/// A group the receiver is collecting
+typedef struct he_fec_group
+{
+    bool active;
+    uint8_t group;
+    uint8_t k;
+    bool parity_seen;
+    /// Records that arrived, and records that arrived or were rebuilt
+    uint16_t arrived;
+    uint16_t have;
+    uint16_t length_xor;
+    /// Length of the longest record received so far
+    uint16_t max_length;
+    /// XOR of every record received so far, zero padded
+    uint8_t xor[HE_FEC_MAX_RECORD];
+} he_fec_group_t;
+
+typedef struct he_fec
+{
+    // Sending
+
+    /// Group being built, its size and the next position in it
+    uint8_t group;
+    uint8_t k;
+    uint8_t index;
+    /// Length of the longest record in the group
+    uint16_t max_length;
+    /// Parity of the group so far, the length XOR followed by the record XOR
+    uint8_t parity[HE_FEC_LENGTH_SIZE + HE_FEC_MAX_RECORD];
+
+    // Receiving
+
+    /// The peer has FEC enabled
+    bool peer_capable;
+    /// Loss the peer sees from us, in 1/32ths
+    uint8_t peer_loss;
+    /// Loss we see from the peer, in 1/256ths, averaged over recent groups
+    uint16_t loss;
+    /// Newest group seen, to count groups that went missing entirely
+    bool seen_group;
+    uint8_t last_group;
+    he_fec_group_t groups[HE_FEC_WINDOW];
+
+    // Counters
+
+    uint64_t parity_sent;
+    uint64_t recovered;
+} he_fec_t;
+
+/**
+ * @brief Fill in the FEC fields of the header for a record about to be sent
+ * @param hdr A copy of the connection's wire header, updated in place
+ * @return true if the record is part of a group and must be passed to he_internal_fec_add()
+ *         once sent
+ */
+bool he_internal_fec_stamp(he_conn_t *conn, he_wire_hdr_t *hdr);
+
+/**
+ * @brief Add a sent record to the parity of its group
+ * @param hdr The header the record was sent with
+ * @param parity_hdr Set to the header for the parity datagram if the group is complete
+ * @param parity Set to the parity payload, good until the next call
+ * @return The length of the parity payload to send, 0 if the group isn't complete yet
+ */
+size_t he_internal_fec_add(he_conn_t *conn, const he_wire_hdr_t *hdr, const uint8_t *record,
+                           size_t length, he_wire_hdr_t *parity_hdr, const uint8_t **parity);
+
+/**
+ * @brief Look at the FEC fields of a received datagram
+ * @param datagram The datagram, wire header included, after the outside plugins
+ * @param length Its length, updated if the datagram is rewritten
+ * @return true if the datagram should be processed, false if it was parity with nothing to
+ *         rebuild and has been consumed
+ *
+ * When parity completes a group with one record missing, the datagram is rewritten in place
+ * into the missing record, which is always shorter than the parity that carried it.
+ */
+bool he_internal_fec_receive(he_conn_t *conn, uint8_t *datagram, size_t *length);
+
+#endif // FEC_H
@@ -0,0 +1,625 @@
+#include "handshake_pool.h"
+#include "conn.h"
+#include "core.h"
+#include "timers.h"
+#include "wolf.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define HE_HANDSHAKE_POOL_CACHE_LINE 64
+
+/// Set in a ticket's owner while the pool has the connection, the low bits count its datagrams
+/// queued but not yet processed
+#define HE_HANDSHAKE_IN_POOL (1u << 31)
+/// The handshake thread has let go of the connection, it's waiting to be taken back
+#define HE_HANDSHAKE_RETURNING (1u << 30)
+
+/// Follows a connection from the moment the pool takes it until it is collected
+typedef struct he_handshake_ticket
+{
+    /// Decides who may touch the connection, see HE_HANDSHAKE_IN_POOL. Zero once taken back.
+    _Atomic uint32_t owner;
+    he_conn_t *conn;
+    /// The data-plane thread's wheel the connection goes back on
+    struct he_timers *return_timers;
+    size_t worker;
+    size_t shard;
+    /// Only touched by the handshake thread until it lets go of the connection
+    bool finished;
+    he_return_code_t result;
+    size_t live_index;
+} he_handshake_ticket_t;
+
+typedef struct he_handshake_job
+{
+    he_handshake_ticket_t *ticket;
+    /// First datagram for the connection, the handshake thread takes it over first
+    bool adopt;
+    size_t length;
+    uint8_t packet[HE_MAX_WIRE_MTU];
+} he_handshake_job_t;
+
+typedef struct he_handshake_worker
+{
+    _Alignas(HE_HANDSHAKE_POOL_CACHE_LINE) pthread_mutex_t lock;
+    pthread_cond_t wake;
+    he_handshake_job_t *jobs;
+    size_t head;
+    size_t count;
+    bool stopping;
+    bool started;
+    pthread_t thread;
+    /// Only touched by the handshake thread
+    he_timers_t *timers;
+    he_handshake_ticket_t **live;
+    size_t num_live;
+    struct he_handshake_pool *pool;
+} he_handshake_worker_t;
+
+/// Connections handed back to one data-plane thread
+typedef struct he_handshake_shard
+{
+    _Alignas(HE_HANDSHAKE_POOL_CACHE_LINE) pthread_mutex_t lock;
+    he_handshake_ticket_t **done;
+    size_t head;
+    size_t count;
+} he_handshake_shard_t;
+
+struct he_handshake_pool
+{
+    he_handshake_worker_t *workers;
+    size_t num_workers;
+    he_handshake_shard_t *shards;
+    size_t num_shards;
+    size_t max_handshakes;
+    size_t queue_depth;
+
+    _Atomic size_t in_flight;
+    _Atomic size_t next_worker;
+    _Atomic uint64_t adopted;
+    _Atomic uint64_t completed;
+    _Atomic uint64_t failed;
+    _Atomic uint64_t declined;
+    _Atomic uint64_t dropped;
+};
+
+static uint64_t he_handshake_pool_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static bool he_handshake_pool_is_handshaking(const he_conn_t *conn)
+{
+    return conn->state == HE_STATE_CONNECTING || conn->state == HE_STATE_AUTHENTICATING;
+}
+
+/// Put the connection back on its data-plane thread's wheel, once, on that thread
+static void he_handshake_pool_reclaim(he_handshake_ticket_t *ticket)
+{
+    if (atomic_load_explicit(&ticket->owner, memory_order_acquire) != HE_HANDSHAKE_RETURNING)
+    {
+        return;
+    }
+
+    if (ticket->return_timers)
+    {
+        he_timers_attach(ticket->return_timers, ticket->conn);
+    }
+    atomic_store_explicit(&ticket->owner, 0, memory_order_relaxed);
+}
+
+static void he_handshake_pool_hand_back(he_handshake_worker_t *worker,
+                                        he_handshake_ticket_t *ticket)
+{
+    he_handshake_pool_t *pool = worker->pool;
+
+    // Off this thread's wheel before letting go, the data-plane thread may take it at once
+    he_timers_detach(ticket->conn);
+
+    uint32_t expected = HE_HANDSHAKE_IN_POOL;
+    if (!atomic_compare_exchange_strong_explicit(&ticket->owner, &expected, HE_HANDSHAKE_RETURNING,
+                                                 memory_order_acq_rel, memory_order_relaxed))
+    {
+        // More datagrams are queued for it, keep it until they have been processed
+        he_timers_attach(worker->timers, ticket->conn);
+        return;
+    }
+
+    // The connection must not be touched from here on, the ticket stays ours until collected
+    worker->num_live--;
+    he_handshake_ticket_t *last = worker->live[worker->num_live];
+    worker->live[ticket->live_index] = last;
+    last->live_index = ticket->live_index;
+
+    atomic_fetch_add_explicit(&pool->completed, 1, memory_order_relaxed);
+    if (ticket->result != HE_SUCCESS)
+    {
+        atomic_fetch_add_explicit(&pool->failed, 1, memory_order_relaxed);
+    }
+
+    // Never full, it has room for every connection the pool can hold
+    he_handshake_shard_t *shard = &pool->shards[ticket->shard];
+    pthread_mutex_lock(&shard->lock);
+    shard->done[(shard->head + shard->count) % pool->max_handshakes] = ticket;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void he_handshake_pool_check(he_handshake_ticket_t *ticket, he_return_code_t res)
+{
+    he_conn_t *conn = ticket->conn;
+
+    if (conn->state == HE_STATE_DISCONNECTED || res == HE_ERR_SSL_ERROR)
+    {
+        ticket->result = res != HE_SUCCESS ? res : HE_ERR_CONNECT_FAILED;
+        ticket->finished = true;
+        he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
+        return;
+    }
+
+    if (he_handshake_pool_is_handshaking(conn) && wolfSSL_is_init_finished(conn->wolf_ssl))
+    {
+        he_internal_change_conn_state(conn, HE_STATE_LINK_UP);
+    }
+
+    // Also covers a state change callback moving the connection on by itself
+    if (!he_handshake_pool_is_handshaking(conn))
+    {
+        ticket->result = conn->state == HE_STATE_DISCONNECTED ? HE_ERR_CONNECT_FAILED : HE_SUCCESS;
+        ticket->finished = true;
+    }
+}
+
+static void he_handshake_pool_process(he_handshake_worker_t *worker, he_handshake_job_t *job)
+{
+    he_handshake_ticket_t *ticket = job->ticket;
+
+    if (job->adopt)
+    {
+        he_timers_attach(worker->timers, ticket->conn);
+        ticket->live_index = worker->num_live;
+        worker->live[worker->num_live++] = ticket;
+    }
+
+    he_return_code_t res = he_conn_outside_data_received(ticket->conn, job->packet, job->length);
+    if (!ticket->finished)
+    {
+        he_handshake_pool_check(ticket, res);
+    }
+
+    atomic_fetch_sub_explicit(&ticket->owner, 1, memory_order_release);
+
+    if (ticket->finished)
+    {
+        he_handshake_pool_hand_back(worker, ticket);
+    }
+}
+
+static void he_handshake_pool_run_timers(he_handshake_worker_t *worker)
+{
+    if (he_timers_advance(worker->timers, he_handshake_pool_now_ms()) == 0)
+    {
+        return;
+    }
+
+    // A retransmit timer that ran out has disconnected its connection
+    for (size_t i = 0; i < worker->num_live;)
+    {
+        he_handshake_ticket_t *ticket = worker->live[i];
+        if (!ticket->finished && ticket->conn->state == HE_STATE_DISCONNECTED)
+        {
+            ticket->result = HE_ERR_CONNECT_FAILED;
+            ticket->finished = true;
+            he_handshake_pool_hand_back(worker, ticket);
+            // Handing back moves the last ticket into this slot
+            if (worker->live[i] != ticket)
+            {
+                continue;
+            }
+        }
+        i++;
+    }
+}
+
+static void *he_handshake_pool_worker_main(void *arg)
+{
+    he_handshake_worker_t *worker = arg;
+    size_t depth = worker->pool->queue_depth;
+
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->stopping)
+    {
+        if (worker->count == 0)
+        {
+            uint64_t expiry = he_timers_next_expiry(worker->timers);
+            if (expiry == UINT64_MAX)
+            {
+                pthread_cond_wait(&worker->wake, &worker->lock);
+            }
+            else
+            {
+                struct timespec until = {.tv_sec = (time_t)(expiry / 1000),
+                                         .tv_nsec = (long)(expiry % 1000) * 1000000};
+                pthread_cond_timedwait(&worker->wake, &worker->lock, &until);
+            }
+        }
+
+        if (worker->count == 0 || worker->stopping)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            he_handshake_pool_run_timers(worker);
+            pthread_mutex_lock(&worker->lock);
+            continue;
+        }
+
+        // Only this thread takes jobs off the queue, so the cell stays put while it is unlocked
+        he_handshake_job_t *job = &worker->jobs[worker->head];
+        pthread_mutex_unlock(&worker->lock);
+
+        he_handshake_pool_process(worker, job);
+        he_handshake_pool_run_timers(worker);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->head = (worker->head + 1) % depth;
+        worker->count--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+/// Queue a datagram, taking the connection over first if ticket isn't in the pool yet
+static he_return_code_t he_handshake_pool_push(he_handshake_pool_t *pool,
+                                               he_handshake_ticket_t *ticket, bool adopt,
+                                               const uint8_t *packet, size_t length)
+{
+    he_handshake_worker_t *worker = &pool->workers[ticket->worker];
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->count == pool->queue_depth)
+    {
+        pthread_mutex_unlock(&worker->lock);
+        return HE_ERR_QUEUE_FULL;
+    }
+
+    he_handshake_job_t *job = &worker->jobs[(worker->head + worker->count) % pool->queue_depth];
+    job->ticket = ticket;
+    job->adopt = adopt;
+    job->length = length;
+    memcpy(job->packet, packet, length);
+
+    if (adopt)
+    {
+        // The handshake thread can't see the job until the lock is dropped
+        he_conn_t *conn = ticket->conn;
+        ticket->return_timers = conn->timers;
+        he_timers_detach(conn);
+        conn->handshake = ticket;
+        atomic_store_explicit(&ticket->owner, HE_HANDSHAKE_IN_POOL | 1, memory_order_relaxed);
+    }
+
+    worker->count++;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    return HE_SUCCESS;
+}
+
+static void he_handshake_pool_adopt(he_handshake_pool_t *pool, size_t shard, he_conn_t *conn,
+                                    const uint8_t *packet, size_t length, bool *queued)
+{
+    if (atomic_fetch_add_explicit(&pool->in_flight, 1, memory_order_relaxed) >=
+        pool->max_handshakes)
+    {
+        atomic_fetch_sub_explicit(&pool->in_flight, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->declined, 1, memory_order_relaxed);
+        return;
+    }
+
+    he_handshake_ticket_t *ticket = calloc(1, sizeof(he_handshake_ticket_t));
+    if (ticket)
+    {
+        ticket->conn = conn;
+        ticket->shard = shard;
+        ticket->worker =
+            atomic_fetch_add_explicit(&pool->next_worker, 1, memory_order_relaxed) %
+            pool->num_workers;
+
+        if (he_handshake_pool_push(pool, ticket, true, packet, length) == HE_SUCCESS)
+        {
+            atomic_fetch_add_explicit(&pool->adopted, 1, memory_order_relaxed);
+            *queued = true;
+            return;
+        }
+        free(ticket);
+    }
+
+    // Nothing has changed hands, the caller handshakes it as it would without a pool
+    atomic_fetch_sub_explicit(&pool->in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->declined, 1, memory_order_relaxed);
+}
+
+he_return_code_t he_handshake_pool_route(he_handshake_pool_t *pool, size_t shard, he_conn_t *conn,
+                                         const uint8_t *packet, size_t length, bool *queued)
+{
+    if (pool == NULL || conn == NULL || packet == NULL || queued == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    *queued = false;
+
+    if (shard >= pool->num_shards)
+    {
+        return HE_ERR_INVALID_SHARD;
+    }
+
+    if (length > HE_MAX_WIRE_MTU)
+    {
+        return HE_ERR_PACKET_TOO_LARGE;
+    }
+
+    he_handshake_ticket_t *ticket = conn->handshake;
+    if (ticket == NULL)
+    {
+        if (conn->wolf_ssl && he_handshake_pool_is_handshaking(conn))
+        {
+            he_handshake_pool_adopt(pool, shard, conn, packet, length, queued);
+        }
+        return HE_SUCCESS;
+    }
+
+    // Count the datagram against the connection so the handshake thread keeps it until it is
+    // processed. That fails once the thread has let go.
+    uint32_t owner = atomic_load_explicit(&ticket->owner, memory_order_acquire);
+    while (owner & HE_HANDSHAKE_IN_POOL)
+    {
+        if (atomic_compare_exchange_weak_explicit(&ticket->owner, &owner, owner + 1,
+                                                  memory_order_acquire, memory_order_acquire))
+        {
+            he_return_code_t res = he_handshake_pool_push(pool, ticket, false, packet, length);
+            if (res != HE_SUCCESS)
+            {
+                atomic_fetch_sub_explicit(&ticket->owner, 1, memory_order_release);
+                atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+                return res;
+            }
+            *queued = true;
+            return HE_SUCCESS;
+        }
+    }
+
+    he_handshake_pool_reclaim(ticket);
+
+    return HE_SUCCESS;
+}
+
+size_t he_handshake_pool_collect(he_handshake_pool_t *pool, size_t shard, size_t max,
+                                 he_handshake_done_cb_t cb, void *context)
+{
+    if (pool == NULL || cb == NULL || shard >= pool->num_shards)
+    {
+        return 0;
+    }
+
+    he_handshake_shard_t *done = &pool->shards[shard];
+    size_t collected = 0;
+
+    while (collected < max)
+    {
+        pthread_mutex_lock(&done->lock);
+        if (done->count == 0)
+        {
+            pthread_mutex_unlock(&done->lock);
+            break;
+        }
+        he_handshake_ticket_t *ticket = done->done[done->head];
+        done->head = (done->head + 1) % pool->max_handshakes;
+        done->count--;
+        pthread_mutex_unlock(&done->lock);
+
+        he_handshake_pool_reclaim(ticket);
+
+        he_conn_t *conn = ticket->conn;
+        he_return_code_t result = ticket->result;
+        conn->handshake = NULL;
+        free(ticket);
+        atomic_fetch_sub_explicit(&pool->in_flight, 1, memory_order_relaxed);
+
+        cb(conn, result, context);
+        collected++;
+    }
+
+    return collected;
+}
+
+bool he_handshake_pool_owns(const he_conn_t *conn)
+{
+    return conn && conn->handshake &&
+           atomic_load_explicit(&conn->handshake->owner, memory_order_acquire) &
+               HE_HANDSHAKE_IN_POOL;
+}
+
+he_return_code_t he_handshake_pool_get_stats(he_handshake_pool_t *pool,
+                                             he_handshake_pool_stats_t *stats)
+{
+    if (pool == NULL || stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    stats->in_flight = atomic_load_explicit(&pool->in_flight, memory_order_relaxed);
+    stats->adopted = atomic_load_explicit(&pool->adopted, memory_order_relaxed);
+    stats->completed = atomic_load_explicit(&pool->completed, memory_order_relaxed);
+    stats->failed = atomic_load_explicit(&pool->failed, memory_order_relaxed);
+    stats->declined = atomic_load_explicit(&pool->declined, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&pool->dropped, memory_order_relaxed);
+
+    return HE_SUCCESS;
+}
+
+static bool he_handshake_pool_start_worker(he_handshake_pool_t *pool,
+                                           he_handshake_worker_t *worker)
+{
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
+    {
+        return false;
+    }
+    // Timed waits are for the timer wheel, which runs on the monotonic clock
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int res = pthread_cond_init(&worker->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (res != 0)
+    {
+        return false;
+    }
+
+    if (pthread_mutex_init(&worker->lock, NULL) != 0)
+    {
+        pthread_cond_destroy(&worker->wake);
+        return false;
+    }
+
+    worker->pool = pool;
+    worker->jobs = calloc(pool->queue_depth, sizeof(he_handshake_job_t));
+    worker->live = calloc(pool->max_handshakes, sizeof(he_handshake_ticket_t *));
+    worker->timers = he_timers_create(he_handshake_pool_now_ms());
+    worker->started = worker->jobs && worker->live && worker->timers &&
+                      pthread_create(&worker->thread, NULL, he_handshake_pool_worker_main,
+                                     worker) == 0;
+
+    return worker->started;
+}
+
+static void he_handshake_pool_stop_worker(he_handshake_worker_t *worker)
+{
+    if (worker->pool == NULL)
+    {
+        return;
+    }
+
+    if (worker->started)
+    {
+        pthread_mutex_lock(&worker->lock);
+        worker->stopping = true;
+        pthread_cond_signal(&worker->wake);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+    }
+
+    // Let go of everything still here, so no connection points at freed memory
+    for (size_t i = 0; i < worker->num_live; i++)
+    {
+        he_timers_detach(worker->live[i]->conn);
+        worker->live[i]->conn->handshake = NULL;
+        free(worker->live[i]);
+    }
+    for (size_t i = 0; i < worker->count; i++)
+    {
+        he_handshake_job_t *job = &worker->jobs[(worker->head + i) % worker->pool->queue_depth];
+        if (job->adopt)
+        {
+            job->ticket->conn->handshake = NULL;
+            free(job->ticket);
+        }
+    }
+
+    he_timers_destroy(worker->timers);
+    free(worker->jobs);
+    free(worker->live);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+}
+
+he_handshake_pool_t *he_handshake_pool_create(size_t num_threads, size_t num_shards,
+                                              size_t max_handshakes, size_t queue_depth)
+{
+    if (num_threads == 0 || num_shards == 0 || num_shards > HE_MAX_SHARDS ||
+        max_handshakes == 0 || queue_depth == 0)
+    {
+        return NULL;
+    }
+
+    he_handshake_pool_t *pool = calloc(1, sizeof(he_handshake_pool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->max_handshakes = max_handshakes;
+    pool->queue_depth = queue_depth;
+
+    size_t workers_size = num_threads * sizeof(he_handshake_worker_t);
+    size_t shards_size = num_shards * sizeof(he_handshake_shard_t);
+    pool->workers = aligned_alloc(HE_HANDSHAKE_POOL_CACHE_LINE, workers_size);
+    pool->shards = aligned_alloc(HE_HANDSHAKE_POOL_CACHE_LINE, shards_size);
+    if (pool->workers == NULL || pool->shards == NULL)
+    {
+        free(pool->workers);
+        free(pool->shards);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, workers_size);
+    memset(pool->shards, 0, shards_size);
+
+    for (size_t i = 0; i < num_shards; i++)
+    {
+        pool->shards[i].done = calloc(max_handshakes, sizeof(he_handshake_ticket_t *));
+        pool->num_shards++;
+        if (pool->shards[i].done == NULL || pthread_mutex_init(&pool->shards[i].lock, NULL) != 0)
+        {
+            // The mutex of a shard whose array failed is never used, destroying it is harmless
+            he_handshake_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        pool->num_workers++;
+        if (!he_handshake_pool_start_worker(pool, &pool->workers[i]))
+        {
+            he_handshake_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void he_handshake_pool_destroy(he_handshake_pool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < pool->num_workers; i++)
+    {
+        he_handshake_pool_stop_worker(&pool->workers[i]);
+    }
+
+    for (size_t i = 0; i < pool->num_shards; i++)
+    {
+        he_handshake_shard_t *shard = &pool->shards[i];
+        for (size_t j = 0; j < shard->count; j++)
+        {
+            he_handshake_ticket_t *ticket = shard->done[(shard->head + j) % pool->max_handshakes];
+            ticket->conn->handshake = NULL;
+            free(ticket);
+        }
+        free(shard->done);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(pool->workers);
+    free(pool->shards);
+    free(pool);
+}
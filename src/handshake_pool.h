@@ -0,0 +1,123 @@
+#ifndef HANDSHAKE_POOL_H
+#define HANDSHAKE_POOL_H
+
+#include "he.h"
+
+/**
+ * @brief Threads that run D/TLS handshakes away from the data-plane threads
+ *
+ * A full handshake costs milliseconds of signing, verifying and key exchange, and whichever
+ * thread feeds the connection its datagrams pays for it. On a data-plane thread that stalls every
+ * established connection the thread serves. With a pool, the data-plane thread passes each
+ * datagram for a connection that is still handshaking to he_handshake_pool_route(), which copies
+ * it onto a handshake thread's queue. The handshake thread runs the connection until wolfSSL
+ * finishes the handshake, moves it to HE_STATE_LINK_UP and hands it back, and the data-plane
+ * thread picks it up again with he_handshake_pool_collect().
+ *
+ * Connections in HE_STATE_CONNECTING or HE_STATE_AUTHENTICATING are taken by the pool on their
+ * next datagram. While the pool owns a connection the data-plane thread must not call anything
+ * else on it or nudge it, and he_handshake_pool_owns() tells it which ones those are. Datagrams
+ * that arrive before the hand-back are processed by the handshake thread, so none are lost in
+ * it. A connection must not be destroyed until he_handshake_pool_collect() has reported it, even
+ * if a datagram for it was already routed back to the data-plane thread.
+ *
+ * While the pool owns a connection its callbacks (outside writes, state changes, auth) run on a
+ * handshake thread, and its nudge timer runs on that thread's own timer wheel. The connection is
+ * put back on the data-plane thread's wheel, if it had one, when it is handed back.
+ *
+ * At most max_handshakes connections are in the pool at once. Beyond that, or when a handshake
+ * thread's queue is full, connections stay on their data-plane thread and handshake there as
+ * before, so a pool never makes a handshake fail.
+ */
+typedef struct he_handshake_pool he_handshake_pool_t;
+
+/**
+ * @brief Called by he_handshake_pool_collect() for each connection handed back
+ * @param conn The connection, owned by the calling thread again
+ * @param result HE_SUCCESS if the connection reached HE_STATE_LINK_UP, otherwise why the
+ *        handshake failed. Failed connections are in HE_STATE_DISCONNECTED.
+ */
+typedef void (*he_handshake_done_cb_t)(he_conn_t *conn, he_return_code_t result, void *context);
+
+typedef struct he_handshake_pool_stats
+{
+    /// Connections in the pool, including finished ones waiting to be collected
+    size_t in_flight;
+    /// Connections taken by the pool
+    uint64_t adopted;
+    /// Connections handed back, and how many of those failed their handshake
+    uint64_t completed;
+    uint64_t failed;
+    /// Connections left to handshake on their own thread because the pool was full
+    uint64_t declined;
+    /// Datagrams dropped because a handshake thread's queue was full
+    uint64_t dropped;
+} he_handshake_pool_stats_t;
+
+/**
+ * @brief Create a pool and start its threads
+ * @param num_threads The number of handshake threads
+ * @param num_shards The number of data-plane threads that will route to the pool, at most
+ *        HE_MAX_SHARDS
+ * @param max_handshakes The most connections in the pool at once
+ * @param queue_depth The number of datagrams each handshake thread can have waiting
+ * @return A pointer to the pool, or NULL if an argument is zero or out of range or it could not
+ *         be created
+ */
+he_handshake_pool_t *he_handshake_pool_create(size_t num_threads, size_t num_shards,
+                                              size_t max_handshakes, size_t queue_depth);
+
+/**
+ * @brief Stop the threads and free the pool
+ *
+ * Collect every connection first. Any still in the pool are left where their handshake got to,
+ * detached from the pool's timer wheels.
+ */
+void he_handshake_pool_destroy(he_handshake_pool_t *pool);
+
+/**
+ * @brief Decide where a datagram for a connection should be processed
+ * @param shard The data-plane thread's shard, where the connection will be handed back
+ * @param conn The connection the datagram is for
+ * @param queued Set to true if the pool took the datagram, or false if the caller should pass it
+ *        to he_conn_outside_data_received() itself. False also hands back a connection whose
+ *        handshake is over and that hasn't been collected yet.
+ * @return HE_SUCCESS if the datagram was routed
+ * @return HE_ERR_NULL_POINTER if an argument is NULL
+ * @return HE_ERR_INVALID_SHARD if shard is out of range
+ * @return HE_ERR_PACKET_TOO_LARGE if the datagram is larger than HE_MAX_WIRE_MTU
+ * @return HE_ERR_QUEUE_FULL if the pool owns the connection but its thread's queue is full, the
+ *         datagram is dropped and the peer will retransmit
+ *
+ * Only call this from the data-plane thread serving the connection. The datagram is copied, so
+ * the buffer can be reused as soon as this returns.
+ */
+he_return_code_t he_handshake_pool_route(he_handshake_pool_t *pool, size_t shard, he_conn_t *conn,
+                                         const uint8_t *packet, size_t length, bool *queued);
+
+/**
+ * @brief Take back connections whose handshake is over
+ * @param shard The calling data-plane thread's shard
+ * @param max The most connections to take back in this call
+ * @return The number of connections passed to cb
+ *
+ * Must only be called by the thread that routes for shard, e.g. once per event loop iteration.
+ */
+size_t he_handshake_pool_collect(he_handshake_pool_t *pool, size_t shard, size_t max,
+                                 he_handshake_done_cb_t cb, void *context);
+
+/**
+ * @brief Whether the pool owns a connection, i.e. the caller must leave it alone
+ *
+ * Only meaningful on the data-plane thread serving the connection.
+ */
+bool he_handshake_pool_owns(const he_conn_t *conn);
+
+/**
+ * @brief Get the pool's counters
+ * @return HE_ERR_NULL_POINTER if pool or stats is NULL
+ */
+he_return_code_t he_handshake_pool_get_stats(he_handshake_pool_t *pool,
+                                             he_handshake_pool_stats_t *stats);
+
+#endif // HANDSHAKE_POOL_H
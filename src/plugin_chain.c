@@ -1,19 +1,70 @@
 #include "plugin_chain.h"
+#include "trace.h"
+
+/// Number of slots allocated on the first registration
+#define HE_PLUGIN_CHAIN_INITIAL_CAPACITY 4
 
 he_plugin_chain_t *he_plugin_chain_create(void)
 {
     return calloc(1, sizeof(he_plugin_chain_t));
 }
 
+void he_plugin_chain_init_with_storage(he_plugin_chain_t *chain, plugin_struct_t **storage,
+                                       size_t capacity)
+{
+    memset(chain, 0, sizeof(he_plugin_chain_t));
+
+    chain->plugins = storage;
+    chain->ingress = storage + capacity;
+    chain->egress = storage + capacity * 2;
+    chain->capacity = capacity;
+    chain->fixed_storage = true;
+}
+
 void he_plugin_destroy_chain(he_plugin_chain_t *chain)
 {
-    if (chain)
+    if (chain && !chain->fixed_storage)
     {
-        he_plugin_destroy_chain(chain->next);
+        // The ingress and egress arrays share the allocation made for plugins
+        free(chain->plugins);
         free(chain);
     }
 }
 
+static he_return_code_t he_plugin_chain_grow(he_plugin_chain_t *chain)
+{
+    if (chain->fixed_storage)
+    {
+        return HE_ERR_NO_MEMORY;
+    }
+
+    size_t capacity = chain->capacity ? chain->capacity * 2 : HE_PLUGIN_CHAIN_INITIAL_CAPACITY;
+
+    plugin_struct_t **slots = calloc(capacity * 3, sizeof(plugin_struct_t *));
+    if (slots == NULL)
+    {
+        return HE_ERR_INIT_FAILED;
+    }
+
+    plugin_struct_t **ingress = slots + capacity;
+    plugin_struct_t **egress = slots + capacity * 2;
+
+    if (chain->plugins)
+    {
+        memcpy(slots, chain->plugins, chain->num_plugins * sizeof(plugin_struct_t *));
+        memcpy(ingress, chain->ingress, chain->num_ingress * sizeof(plugin_struct_t *));
+        memcpy(egress, chain->egress, chain->num_egress * sizeof(plugin_struct_t *));
+        free(chain->plugins);
+    }
+
+    chain->plugins = slots;
+    chain->ingress = ingress;
+    chain->egress = egress;
+    chain->capacity = capacity;
+
+    return HE_SUCCESS;
+}
+
 he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin)
 {
     if (chain == NULL || plugin == NULL)
@@ -21,22 +72,47 @@ he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_stru
         return HE_ERR_NULL_POINTER;
     }
 
-    if (chain->plugin == NULL)
+    if (chain->num_plugins == chain->capacity)
     {
-        chain->plugin = plugin;
-        return HE_SUCCESS;
+        he_return_code_t res = he_plugin_chain_grow(chain);
+        if (res != HE_SUCCESS)
+        {
+            return res;
+        }
     }
 
-    if (chain->next == NULL)
+    chain->plugins[chain->num_plugins++] = plugin;
+
+    if (plugin->do_ingress || plugin->do_ingress_batch)
     {
-        chain->next = he_plugin_chain_create();
-        if (chain->next == NULL)
-        {
-            return HE_ERR_INIT_FAILED;
-        }
+        chain->ingress[chain->num_ingress++] = plugin;
+    }
+
+    if (plugin->do_egress || plugin->do_egress_batch)
+    {
+        chain->egress[chain->num_egress++] = plugin;
+    }
+
+    return HE_SUCCESS;
+}
+
+// Ingress and egress hooks share a signature, so these helpers serve both directions
+static he_plugin_return_code_t he_plugin_call(plugin_do_ingress single, plugin_do_ingress_batch batch,
+                                             void *data, uint8_t *packet, size_t *length, size_t capacity)
+{
+    if (single)
+    {
+        return single(packet, length, capacity, data);
+    }
+
+    // Batch-only plugin, run it as a batch of one
+    he_plugin_return_code_t verdict = HE_PLUGIN_SUCCESS;
+    if (batch(&packet, length, &capacity, &verdict, 1, data) == HE_PLUGIN_FAIL)
+    {
+        return HE_PLUGIN_FAIL;
     }
 
-    return he_plugin_register_plugin(chain->next, plugin);
+    return verdict;
 }
 
 he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length, size_t capacity)
@@ -46,10 +122,14 @@ he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, si
         return HE_SUCCESS;
     }
 
-    plugin_struct_t *plugin = chain->plugin;
-    if (plugin && plugin->do_ingress)
+    // Ingress runs in registration order
+    for (size_t i = 0; i < chain->num_ingress; i++)
     {
-        he_plugin_return_code_t rc = plugin->do_ingress(packet, length, capacity, plugin->data);
+        plugin_struct_t *plugin = chain->ingress[i];
+        HE_TRACE_BEGIN(0, HE_TRACE_PLUGIN_INGRESS, i, *length);
+        he_plugin_return_code_t rc = he_plugin_call(plugin->do_ingress, plugin->do_ingress_batch, plugin->data,
+                                                    packet, length, capacity);
+        HE_TRACE_END(0, HE_TRACE_PLUGIN_INGRESS, i, *length, rc);
         if (rc == HE_PLUGIN_FAIL)
         {
             return HE_ERR_FAILED;
@@ -61,7 +141,7 @@ he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, si
         }
     }
 
-    return he_plugin_ingress(chain->next, packet, length, capacity);
+    return HE_SUCCESS;
 }
 
 he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length, size_t capacity)
@@ -71,16 +151,14 @@ he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, siz
         return HE_SUCCESS;
     }
 
-    he_return_code_t res = he_plugin_egress(chain->next, packet, length, capacity);
-    if (res != HE_SUCCESS)
-    {
-        return res;
-    }
-
-    plugin_struct_t *plugin = chain->plugin;
-    if (plugin && plugin->do_egress)
+    // Egress runs in the opposite order so the plugins unwind what ingress did
+    for (size_t i = chain->num_egress; i > 0; i--)
     {
-        he_plugin_return_code_t rc = plugin->do_egress(packet, length, capacity, plugin->data);
+        plugin_struct_t *plugin = chain->egress[i - 1];
+        HE_TRACE_BEGIN(0, HE_TRACE_PLUGIN_EGRESS, i - 1, *length);
+        he_plugin_return_code_t rc = he_plugin_call(plugin->do_egress, plugin->do_egress_batch, plugin->data,
+                                                    packet, length, capacity);
+        HE_TRACE_END(0, HE_TRACE_PLUGIN_EGRESS, i - 1, *length, rc);
         if (rc == HE_PLUGIN_FAIL)
         {
             return HE_ERR_FAILED;
@@ -95,3 +173,95 @@ he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, siz
     return HE_SUCCESS;
 }
 
+static void he_plugin_call_batch(plugin_do_ingress single, plugin_do_ingress_batch batch, void *data,
+                                 uint8_t **packets, size_t *lengths, const size_t *capacities,
+                                 he_plugin_return_code_t *verdicts, size_t count)
+{
+    if (batch)
+    {
+        if (batch(packets, lengths, capacities, verdicts, count, data) == HE_PLUGIN_FAIL)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (verdicts[i] == HE_PLUGIN_SUCCESS)
+                {
+                    verdicts[i] = HE_PLUGIN_FAIL;
+                }
+            }
+        }
+        return;
+    }
+
+    // No batch hook, fall back to calling the per-packet hook on every live packet
+    for (size_t i = 0; i < count; i++)
+    {
+        if (verdicts[i] != HE_PLUGIN_SUCCESS)
+        {
+            continue;
+        }
+
+        he_plugin_return_code_t rc = single(packets[i], &lengths[i], capacities[i], data);
+        if (rc == HE_PLUGIN_FAIL || rc == HE_PLUGIN_DROP)
+        {
+            verdicts[i] = rc;
+        }
+    }
+}
+
+he_return_code_t he_plugin_ingress_batch(he_plugin_chain_t *chain, uint8_t **packets, size_t *lengths,
+                                         const size_t *capacities, he_plugin_return_code_t *verdicts,
+                                         size_t count)
+{
+    if (packets == NULL || lengths == NULL || capacities == NULL || verdicts == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        verdicts[i] = HE_PLUGIN_SUCCESS;
+    }
+
+    if (chain == NULL)
+    {
+        return HE_SUCCESS;
+    }
+
+    for (size_t i = 0; i < chain->num_ingress; i++)
+    {
+        plugin_struct_t *plugin = chain->ingress[i];
+        he_plugin_call_batch(plugin->do_ingress, plugin->do_ingress_batch, plugin->data,
+                             packets, lengths, capacities, verdicts, count);
+    }
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_plugin_egress_batch(he_plugin_chain_t *chain, uint8_t **packets, size_t *lengths,
+                                        const size_t *capacities, he_plugin_return_code_t *verdicts,
+                                        size_t count)
+{
+    if (packets == NULL || lengths == NULL || capacities == NULL || verdicts == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        verdicts[i] = HE_PLUGIN_SUCCESS;
+    }
+
+    if (chain == NULL)
+    {
+        return HE_SUCCESS;
+    }
+
+    for (size_t i = chain->num_egress; i > 0; i--)
+    {
+        plugin_struct_t *plugin = chain->egress[i - 1];
+        he_plugin_call_batch(plugin->do_egress, plugin->do_egress_batch, plugin->data,
+                             packets, lengths, capacities, verdicts, count);
+    }
+
+    return HE_SUCCESS;
+}
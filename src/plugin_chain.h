@@ -5,8 +5,41 @@
 
 he_plugin_chain_t *he_plugin_chain_create(void);
 void he_plugin_destroy_chain(he_plugin_chain_t *chain);
+
+/**
+ * @brief Set up a chain over storage owned by the caller
+ * @param storage Room for capacity * 3 plugin pointers
+ *
+ * The chain never allocates: registering more than capacity plugins fails with
+ * HE_ERR_NO_MEMORY, and he_plugin_destroy_chain() leaves both the chain and the storage alone.
+ */
+void he_plugin_chain_init_with_storage(he_plugin_chain_t *chain, plugin_struct_t **storage,
+                                       size_t capacity);
 he_return_code_t he_plugin_register_plugin(he_plugin_chain_t *chain, plugin_struct_t *plugin);
 he_return_code_t he_plugin_ingress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length, size_t capacity);
 he_return_code_t he_plugin_egress(he_plugin_chain_t *chain, uint8_t *packet, size_t *length, size_t capacity);
 
+/**
+ * @brief Run a batch of packets through the ingress side of the chain
+ * @param verdicts Output array receiving HE_PLUGIN_SUCCESS, HE_PLUGIN_DROP or HE_PLUGIN_FAIL for
+ * each packet
+ * @return HE_SUCCESS if the batch was processed, even if some packets were dropped or failed
+ * @return HE_ERR_NULL_POINTER if any of the arrays is NULL
+ *
+ * Plugins with a batch hook are called once for the whole batch; other plugins fall back to their
+ * per-packet hook for every packet that is still live. A packet that is dropped or failed is not
+ * seen by any later plugin.
+ */
+he_return_code_t he_plugin_ingress_batch(he_plugin_chain_t *chain, uint8_t **packets, size_t *lengths,
+                                         const size_t *capacities, he_plugin_return_code_t *verdicts,
+                                         size_t count);
+
+/**
+ * @brief Run a batch of packets through the egress side of the chain
+ * @see he_plugin_ingress_batch
+ */
+he_return_code_t he_plugin_egress_batch(he_plugin_chain_t *chain, uint8_t **packets, size_t *lengths,
+                                        const size_t *capacities, he_plugin_return_code_t *verdicts,
+                                        size_t count);
+
 #endif // PLUGIN_CHAIN_H
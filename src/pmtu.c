@@ -0,0 +1,314 @@
+#include "pmtu.h"
+#include "conn_template.h"
+#include "timers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t he_pmtu_now_ms(const he_conn_t *conn)
+{
+    // A wheel's time is whatever clock the host drives it with, stick to it so deadlines and
+    // the timers that wait for them agree
+    if (conn->timers)
+    {
+        return he_timers_now(conn->timers);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static bool he_pmtu_active(const he_conn_t *conn)
+{
+    return conn->pmtu && conn->wolf_ssl && conn->state == HE_STATE_ONLINE &&
+           !conn->renegotiation_in_progress &&
+           he_internal_settings(conn)->connection_type == HE_CONNECTION_TYPE_DATAGRAM;
+}
+
+static uint16_t he_pmtu_ceiling(const he_conn_t *conn)
+{
+    int outside_mtu = he_internal_settings(conn)->outside_mtu;
+    if (outside_mtu <= 0 || outside_mtu > HE_MAX_WIRE_MTU)
+    {
+        return HE_MAX_WIRE_MTU;
+    }
+    return outside_mtu < HE_PMTU_MIN ? HE_PMTU_MIN : (uint16_t)outside_mtu;
+}
+
+static void he_pmtu_set_record_limit(he_conn_t *conn, size_t datagram)
+{
+    wolfSSL_dtls_set_mtu(conn->wolf_ssl, (unsigned short)(datagram - sizeof(he_wire_hdr_t)));
+}
+
+/**
+ * @brief Find the largest plaintext whose record fits in a datagram of the given size
+ * @return The length, or zero if not even a probe header fits
+ *
+ * wolfSSL's record limit must already allow records that big.
+ */
+static size_t he_pmtu_plaintext_for(he_conn_t *conn, size_t datagram)
+{
+    int room = (int)(datagram - sizeof(he_wire_hdr_t));
+    int overhead = wolfSSL_GetOutputSize(conn->wolf_ssl, HE_PMTU_HEADER_SIZE);
+    if (overhead <= 0)
+    {
+        return 0;
+    }
+    overhead -= HE_PMTU_HEADER_SIZE;
+
+    // Exact for AEAD suites, CBC padding can put it out by up to a block either way
+    int plaintext = room - overhead;
+    while (plaintext >= HE_PMTU_HEADER_SIZE)
+    {
+        int size = wolfSSL_GetOutputSize(conn->wolf_ssl, plaintext);
+        if (size > 0 && size <= room)
+        {
+            break;
+        }
+        plaintext--;
+    }
+    if (plaintext < HE_PMTU_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    for (;;)
+    {
+        int size = wolfSSL_GetOutputSize(conn->wolf_ssl, plaintext + 1);
+        if (size <= 0 || size > room)
+        {
+            break;
+        }
+        plaintext++;
+    }
+
+    return (size_t)plaintext;
+}
+
+static void he_pmtu_apply(he_conn_t *conn, uint16_t datagram)
+{
+    he_pmtu_t *pmtu = conn->pmtu;
+
+    pmtu->current = datagram;
+    he_pmtu_set_record_limit(conn, datagram);
+
+    size_t inside_mtu = he_pmtu_plaintext_for(conn, datagram);
+    if (inside_mtu == pmtu->inside_mtu)
+    {
+        return;
+    }
+    pmtu->inside_mtu = (uint16_t)inside_mtu;
+
+    he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+    if (event_cb)
+    {
+        event_cb(conn, HE_EVENT_PMTU_CHANGED, conn->data);
+    }
+}
+
+static void he_pmtu_send_probe(he_conn_t *conn, uint64_t now_ms)
+{
+    he_pmtu_t *pmtu = conn->pmtu;
+    uint16_t size = pmtu->probe_size;
+
+    // wolfSSL refuses records past its limit, so lift it for the probe alone
+    he_pmtu_set_record_limit(conn, size);
+
+    size_t length = he_pmtu_plaintext_for(conn, size);
+    if (length)
+    {
+        uint8_t probe[HE_MAX_WIRE_MTU];
+        probe[0] = HE_PMTU_MARKER;
+        probe[1] = HE_PMTU_TYPE_PROBE;
+        probe[2] = (uint8_t)(size >> 8);
+        probe[3] = (uint8_t)size;
+        memset(probe + HE_PMTU_HEADER_SIZE, 0, length - HE_PMTU_HEADER_SIZE);
+
+        // A failed write is a lost probe as far as the search is concerned
+        (void)wolfSSL_write(conn->wolf_ssl, probe, (int)length);
+    }
+
+    he_pmtu_set_record_limit(conn, pmtu->current ? pmtu->current : HE_MAX_WIRE_MTU);
+
+    pmtu->attempts++;
+    pmtu->deadline = now_ms + HE_PMTU_PROBE_TIMEOUT_MS;
+}
+
+static void he_pmtu_start_search(he_conn_t *conn)
+{
+    he_pmtu_t *pmtu = conn->pmtu;
+    uint16_t ceiling = he_pmtu_ceiling(conn);
+
+    pmtu->searching = true;
+    pmtu->high = ceiling + 1;
+
+    if (pmtu->current && pmtu->current <= ceiling)
+    {
+        pmtu->verifying = true;
+        pmtu->low = pmtu->current;
+    }
+    else
+    {
+        pmtu->verifying = false;
+        pmtu->low = HE_PMTU_MIN;
+    }
+}
+
+static void he_pmtu_next(he_conn_t *conn, uint64_t now_ms)
+{
+    he_pmtu_t *pmtu = conn->pmtu;
+    uint16_t size;
+
+    if (pmtu->verifying)
+    {
+        size = pmtu->current;
+    }
+    else if (!pmtu->peer_answers && pmtu->high - pmtu->low <= HE_PMTU_RESOLUTION &&
+             pmtu->high > HE_PMTU_MIN)
+    {
+        // Nothing has been answered, which may be a path that takes hardly anything or a peer
+        // that doesn't know probes. Only one that got through at the minimum tells them apart.
+        size = HE_PMTU_MIN;
+    }
+    else if (pmtu->high - pmtu->low <= HE_PMTU_RESOLUTION)
+    {
+        pmtu->searching = false;
+        pmtu->probe_size = 0;
+        pmtu->deadline = now_ms + HE_PMTU_REPROBE_MS;
+        if (pmtu->peer_answers)
+        {
+            he_pmtu_apply(conn, pmtu->low);
+        }
+        return;
+    }
+    else if (pmtu->high > he_pmtu_ceiling(conn))
+    {
+        // Clean paths are the common case, one probe settles them
+        size = pmtu->high - 1;
+    }
+    else
+    {
+        size = (uint16_t)((pmtu->low + pmtu->high) / 2);
+    }
+
+    pmtu->probe_size = size;
+    pmtu->attempts = 0;
+    he_pmtu_send_probe(conn, now_ms);
+}
+
+void he_internal_pmtu_poll(he_conn_t *conn)
+{
+    if (!he_pmtu_active(conn))
+    {
+        return;
+    }
+
+    he_pmtu_t *pmtu = conn->pmtu;
+    uint64_t now_ms = he_pmtu_now_ms(conn);
+    if (now_ms < pmtu->deadline)
+    {
+        return;
+    }
+
+    if (pmtu->probe_size)
+    {
+        if (pmtu->attempts < HE_PMTU_MAX_PROBES)
+        {
+            he_pmtu_send_probe(conn, now_ms);
+            return;
+        }
+
+        if (pmtu->verifying)
+        {
+            // The path shrank, fall back to what always gets through and search up from there
+            pmtu->verifying = false;
+            pmtu->high = pmtu->current;
+            pmtu->low = HE_PMTU_MIN;
+            he_pmtu_apply(conn, HE_PMTU_MIN);
+        }
+        else
+        {
+            pmtu->high = pmtu->probe_size;
+        }
+        pmtu->probe_size = 0;
+    }
+    else if (!pmtu->searching)
+    {
+        he_pmtu_start_search(conn);
+    }
+
+    he_pmtu_next(conn, now_ms);
+}
+
+void he_internal_pmtu_receive(he_conn_t *conn, const uint8_t *record, size_t length)
+{
+    (void)length;
+    uint16_t size = (uint16_t)((record[2] << 8) | record[3]);
+
+    if (record[1] == HE_PMTU_TYPE_PROBE)
+    {
+        // It got here, which is all the sender wants to know
+        uint8_t ack[HE_PMTU_HEADER_SIZE] = {HE_PMTU_MARKER, HE_PMTU_TYPE_ACK, record[2], record[3]};
+        (void)wolfSSL_write(conn->wolf_ssl, ack, sizeof(ack));
+        return;
+    }
+
+    he_pmtu_t *pmtu = conn->pmtu;
+    if (!he_pmtu_active(conn) || !pmtu->probe_size || size != pmtu->probe_size)
+    {
+        // Late, for a probe that has already been given up on
+        return;
+    }
+    pmtu->peer_answers = true;
+
+    if (pmtu->verifying)
+    {
+        pmtu->verifying = false;
+    }
+    else
+    {
+        pmtu->low = size;
+    }
+    pmtu->probe_size = 0;
+
+    he_pmtu_next(conn, he_pmtu_now_ms(conn));
+}
+
+bool he_internal_pmtu_next_timeout(he_conn_t *conn, uint64_t *delay_ms)
+{
+    if (!he_pmtu_active(conn))
+    {
+        return false;
+    }
+
+    uint64_t now_ms = he_pmtu_now_ms(conn);
+    *delay_ms = conn->pmtu->deadline > now_ms ? conn->pmtu->deadline - now_ms : 0;
+
+    return true;
+}
+
+void he_internal_pmtu_disable(he_conn_t *conn)
+{
+    he_pmtu_t *pmtu = conn->pmtu;
+    if (pmtu == NULL)
+    {
+        return;
+    }
+
+    bool changed = pmtu->inside_mtu && pmtu->inside_mtu != HE_MAX_MTU;
+    if (pmtu->current && conn->wolf_ssl)
+    {
+        he_pmtu_set_record_limit(conn, HE_MAX_WIRE_MTU);
+    }
+
+    free(pmtu);
+    conn->pmtu = NULL;
+
+    he_event_cb_t event_cb = he_internal_settings(conn)->event_cb;
+    if (changed && event_cb)
+    {
+        event_cb(conn, HE_EVENT_PMTU_CHANGED, conn->data);
+    }
+}
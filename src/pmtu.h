@@ -0,0 +1,120 @@
+#ifndef PMTU_H
+#define PMTU_H
+
+#include "he.h"
+
+/**
+ * Path MTU discovery for datagram connections
+ *
+ * Too large a datagram is dropped somewhere along the path without a word, too small a one
+ * wastes throughput. Rather than trusting a fixed size, a connection with discovery on sends
+ * probe records padded to the datagram size it wants to try and waits for the peer to
+ * acknowledge them. Probes are regular records on the D/TLS channel, so they see the path
+ * exactly as data does and can't be forged.
+ *
+ * A search probes the ceiling first, which settles the common clean path in one round trip,
+ * then halves the gap between the largest size that got through and the smallest that didn't
+ * until they are HE_PMTU_RESOLUTION apart. A probe counts as lost after HE_PMTU_PROBE_TIMEOUT_MS
+ * and a size as too large after HE_PMTU_MAX_PROBES probes are lost. The outcome sets the largest
+ * record wolfSSL builds and the connection's inside MTU, see he_conn_get_inside_mtu().
+ *
+ * Every HE_PMTU_REPROBE_MS the search runs again, first checking that the size in use still
+ * gets through. If it doesn't, the connection drops straight to HE_PMTU_MIN and searches up from
+ * there, so a path that shrinks stops blackholing within a few probe timeouts.
+ *
+ * Probes and acknowledgements are records whose first byte is HE_PMTU_MARKER. That is IP
+ * version 0, so they can't be mistaken for inside packets. Both ends always answer probes, only
+ * the end that wants to know has to turn discovery on. A peer running a version that doesn't
+ * know them never answers, which looks just like a path that takes nothing. So until the peer
+ * has acknowledged a probe the outcome of a search isn't applied: a search that gets no answer
+ * at all, not even to a probe of HE_PMTU_MIN, leaves the defaults in place and tries again after
+ * HE_PMTU_REPROBE_MS.
+ *
+ * The search runs while the connection is online and not renegotiating, paced by its nudge
+ * timer. Its clock is the connection's timer wheel if it is attached to one, otherwise
+ * CLOCK_MONOTONIC.
+ */
+
+/// Smallest datagram assumed to get through any path, searches never go below it
+#define HE_PMTU_MIN 576
+/// Searches stop once the bounds are this close
+#define HE_PMTU_RESOLUTION 16
+#define HE_PMTU_PROBE_TIMEOUT_MS 1000
+#define HE_PMTU_MAX_PROBES 3
+#define HE_PMTU_REPROBE_MS 600000
+
+/// First byte of a probe or acknowledgement record
+#define HE_PMTU_MARKER 0x00
+/// Second byte, what the record is
+#define HE_PMTU_TYPE_PROBE 0x01
+#define HE_PMTU_TYPE_ACK 0x02
+/// Marker, type and the probed datagram size (two bytes, big endian). Probes are zero padded.
+#define HE_PMTU_HEADER_SIZE 4
+
+typedef struct he_pmtu
+{
+    /// Datagram size in use, zero until the first search finishes
+    uint16_t current;
+    /// Inside MTU that follows from current
+    uint16_t inside_mtu;
+    /// Largest datagram that got through in this search, and smallest that didn't
+    uint16_t low;
+    uint16_t high;
+    /// Size of the probe waiting for an acknowledgement, zero if none
+    uint16_t probe_size;
+    /// Times it has been sent
+    uint8_t attempts;
+    bool searching;
+    /// Set while the search checks that current still gets through
+    bool verifying;
+    /// Set once the peer has acknowledged a probe, until then nothing is applied
+    bool peer_answers;
+    /// When the outstanding probe counts as lost, or the next search is due
+    uint64_t deadline;
+} he_pmtu_t;
+
+/**
+ * @brief Whether a decrypted record is a probe or an acknowledgement rather than an inside packet
+ */
+static inline bool he_internal_pmtu_is_control(const uint8_t *record, size_t length)
+{
+    return length >= HE_PMTU_HEADER_SIZE && record[0] == HE_PMTU_MARKER &&
+           (record[1] == HE_PMTU_TYPE_PROBE || record[1] == HE_PMTU_TYPE_ACK);
+}
+
+/**
+ * @brief Answer a probe or take in an acknowledgement
+ *
+ * Only call this for records he_internal_pmtu_is_control() accepted.
+ */
+void he_internal_pmtu_receive(he_conn_t *conn, const uint8_t *record, size_t length);
+
+/**
+ * @brief Send the next probe or give up on a lost one if its time has come
+ *
+ * Does nothing unless discovery is on and the connection is online and not renegotiating.
+ */
+void he_internal_pmtu_poll(he_conn_t *conn);
+
+/**
+ * @brief How long until he_internal_pmtu_poll() has something to do
+ * @return false if discovery is off
+ */
+bool he_internal_pmtu_next_timeout(he_conn_t *conn, uint64_t *delay_ms);
+
+/**
+ * @brief Free the discovery state and go back to the default record limit and inside MTU
+ *
+ * Fires HE_EVENT_PMTU_CHANGED if that changes the inside MTU.
+ */
+void he_internal_pmtu_disable(he_conn_t *conn);
+
+/**
+ * @brief The largest inside packet the connection sends, HE_MAX_MTU until discovery finds out
+ */
+static inline size_t he_internal_inside_mtu(const he_conn_t *conn)
+{
+    return conn->pmtu && conn->pmtu->inside_mtu ? conn->pmtu->inside_mtu : HE_MAX_MTU;
+}
+
+#endif // PMTU_H
@@ -0,0 +1,135 @@
+#include "prometheus.h"
+#include "utils.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static const char *const he_prometheus_direction_names[HE_STATS_DIRECTIONS] = {
+    "inside_in",
+    "inside_out",
+    "outside_in",
+    "outside_out",
+};
+
+typedef struct he_prometheus_writer
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+} he_prometheus_writer_t;
+
+static void he_prometheus_printf(he_prometheus_writer_t *writer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    size_t offset = writer->length < writer->size ? writer->length : writer->size;
+    char *buffer = writer->size ? writer->buffer + offset : NULL;
+    int written = vsnprintf(buffer, writer->size - offset, format, args);
+    if (written > 0)
+    {
+        writer->length += (size_t)written;
+    }
+
+    va_end(args);
+}
+
+static void he_prometheus_typed_header(he_prometheus_writer_t *writer, const char *name,
+                                       const char *help, const char *type)
+{
+    he_prometheus_printf(writer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void he_prometheus_header(he_prometheus_writer_t *writer, const char *name, const char *help)
+{
+    he_prometheus_typed_header(writer, name, help, "counter");
+}
+
+size_t he_prometheus_write_stats(const he_stats_t *stats, char *buffer, size_t size)
+{
+    if (stats == NULL || (buffer == NULL && size != 0))
+    {
+        return 0;
+    }
+
+    he_prometheus_writer_t writer = {.buffer = buffer, .size = size, .length = 0};
+    if (size != 0)
+    {
+        buffer[0] = '\0';
+    }
+
+    he_prometheus_header(&writer, "helium_packets_total", "Packets handled by Helium.");
+    for (size_t i = 0; i < HE_STATS_DIRECTIONS; i++)
+    {
+        he_prometheus_printf(&writer, "helium_packets_total{direction=\"%s\"} %llu\n",
+                             he_prometheus_direction_names[i],
+                             (unsigned long long)stats->packets[i]);
+    }
+
+    he_prometheus_header(&writer, "helium_bytes_total", "Bytes handled by Helium.");
+    for (size_t i = 0; i < HE_STATS_DIRECTIONS; i++)
+    {
+        he_prometheus_printf(&writer, "helium_bytes_total{direction=\"%s\"} %llu\n",
+                             he_prometheus_direction_names[i],
+                             (unsigned long long)stats->bytes[i]);
+    }
+
+    he_prometheus_header(&writer, "helium_aggressive_duplicates_total",
+                         "Extra copies of records sent in aggressive mode.");
+    he_prometheus_printf(&writer, "helium_aggressive_duplicates_total %llu\n",
+                         (unsigned long long)stats->aggressive_duplicates);
+
+    he_prometheus_header(&writer, "helium_drops_total", "Packets dropped, by reason.");
+    for (size_t i = 0; i < HE_STATS_MAX_REASONS; i++)
+    {
+        if (stats->drops[i] == 0)
+        {
+            continue;
+        }
+        he_prometheus_printf(&writer, "helium_drops_total{reason=\"%s\"} %llu\n",
+                             he_return_code_name((he_return_code_t)(-(int)i)),
+                             (unsigned long long)stats->drops[i]);
+    }
+
+    return writer.length;
+}
+
+size_t he_prometheus_write_session_cache(const he_session_cache_stats_t *stats, char *buffer,
+                                         size_t size)
+{
+    if (stats == NULL || (buffer == NULL && size != 0))
+    {
+        return 0;
+    }
+
+    he_prometheus_writer_t writer = {.buffer = buffer, .size = size, .length = 0};
+    if (size != 0)
+    {
+        buffer[0] = '\0';
+    }
+
+    he_prometheus_typed_header(&writer, "helium_session_cache_entries",
+                               "Sessions held for resumption.", "gauge");
+    he_prometheus_printf(&writer, "helium_session_cache_entries %zu\n", stats->entries);
+
+    he_prometheus_header(&writer, "helium_session_cache_lookups_total",
+                         "Handshakes that tried to resume a session.");
+    he_prometheus_printf(&writer, "helium_session_cache_lookups_total %llu\n",
+                         (unsigned long long)stats->lookups);
+
+    he_prometheus_header(&writer, "helium_session_cache_hits_total",
+                         "Handshakes whose session was found.");
+    he_prometheus_printf(&writer, "helium_session_cache_hits_total %llu\n",
+                         (unsigned long long)stats->hits);
+
+    he_prometheus_header(&writer, "helium_session_cache_stores_total", "Sessions stored.");
+    he_prometheus_printf(&writer, "helium_session_cache_stores_total %llu\n",
+                         (unsigned long long)stats->stores);
+
+    he_prometheus_header(&writer, "helium_session_cache_evictions_total",
+                         "Sessions dropped to make room.");
+    he_prometheus_printf(&writer, "helium_session_cache_evictions_total %llu\n",
+                         (unsigned long long)stats->evictions);
+
+    return writer.length;
+}
@@ -0,0 +1,31 @@
+#ifndef PROMETHEUS_H
+#define PROMETHEUS_H
+
+#include "session_cache.h"
+#include "stats.h"
+
+/**
+ * @brief Write the counters in the Prometheus text exposition format
+ * @param stats The counters to write, e.g. from he_stats_get_global()
+ * @param buffer Where to write the text, always NUL terminated if size isn't 0
+ * @param size The size of the buffer
+ * @return The length of the full text, if it is size or more the output was truncated
+ *
+ * Metrics are helium_packets_total and helium_bytes_total labelled by direction,
+ * helium_aggressive_duplicates_total, and helium_drops_total labelled by reason (the
+ * he_return_code_t name). Reasons with no drops are left out.
+ */
+size_t he_prometheus_write_stats(const he_stats_t *stats, char *buffer, size_t size);
+
+/**
+ * @brief Write session cache counters in the Prometheus text exposition format
+ * @param stats The counters to write, from he_session_cache_get_stats()
+ * @return The same as he_prometheus_write_stats()
+ *
+ * Metrics are the helium_session_cache_entries gauge and helium_session_cache_lookups_total,
+ * _hits_total, _stores_total and _evictions_total. The hit rate is hits over lookups.
+ */
+size_t he_prometheus_write_session_cache(const he_session_cache_stats_t *stats, char *buffer,
+                                         size_t size);
+
+#endif // PROMETHEUS_H
@@ -0,0 +1,354 @@
+#include "rekey.h"
+#include "conn.h"
+#include "core.h"
+
+#define HE_REKEY_SLOT_MASK ((uint64_t)HE_REKEY_SLOTS - 1)
+
+struct he_rekey
+{
+    he_rekey_config_t config;
+    /// The next tick to process
+    uint64_t current;
+    /// The time of the last poll, new due times are counted from it
+    uint64_t now;
+    /// State of the generator that picks each connection's place in the jitter window
+    uint64_t random;
+    he_rekey_stats_t stats;
+    /// Connections whose renegotiation is running, each holding one of the max_in_progress places
+    he_conn_t *running;
+    /// Connections waiting for their rekey_at, by tick. A slot holds every turn of the ring.
+    he_conn_t *slots[HE_REKEY_SLOTS];
+};
+
+static inline uint64_t he_rekey_after(uint64_t now_ms, uint64_t delay_ms)
+{
+    return delay_ms > UINT64_MAX - now_ms ? UINT64_MAX : now_ms + delay_ms;
+}
+
+/// splitmix64, plenty for spreading due times and needs no locking or entropy
+static uint64_t he_rekey_random(he_rekey_t *rekey)
+{
+    uint64_t z = (rekey->random += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void he_rekey_link(he_conn_t **head, he_conn_t *conn)
+{
+    conn->rekey_next = *head;
+    if (*head)
+    {
+        (*head)->rekey_pprev = &conn->rekey_next;
+    }
+    conn->rekey_pprev = head;
+    *head = conn;
+}
+
+static he_conn_t **he_rekey_slot_of(he_rekey_t *rekey, uint64_t at_ms)
+{
+    // Never behind the tick being processed, or the connection would wait a whole turn
+    uint64_t tick = at_ms / HE_REKEY_TICK_MS;
+    if (tick < rekey->current)
+    {
+        tick = rekey->current;
+    }
+
+    return &rekey->slots[tick & HE_REKEY_SLOT_MASK];
+}
+
+static void he_rekey_insert(he_rekey_t *rekey, he_conn_t *conn, uint64_t at_ms)
+{
+    conn->rekey_at = at_ms;
+    he_rekey_link(he_rekey_slot_of(rekey, at_ms), conn);
+}
+
+static void he_rekey_schedule(he_rekey_t *rekey, he_conn_t *conn, uint64_t now_ms)
+{
+    uint64_t delay = rekey->config.interval_ms;
+    if (rekey->config.jitter_ms)
+    {
+        delay = he_rekey_after(delay, he_rekey_random(rekey) % (rekey->config.jitter_ms + 1));
+    }
+
+    conn->renegotiation_due = false;
+    he_rekey_insert(rekey, conn, he_rekey_after(now_ms, delay));
+}
+
+static size_t he_rekey_reap(he_rekey_t *rekey, uint64_t now_ms)
+{
+    size_t running = 0;
+    he_conn_t *conn = rekey->running;
+
+    while (conn)
+    {
+        he_conn_t *next = conn->rekey_next;
+
+        if (conn->state != HE_STATE_ONLINE)
+        {
+            rekey->stats.failed++;
+        }
+        else if (!conn->renegotiation_in_progress)
+        {
+            rekey->stats.completed++;
+        }
+        else if (rekey->config.timeout_ms && now_ms - conn->rekey_at >= rekey->config.timeout_ms)
+        {
+            // Hand the place to a connection whose peer is answering, this one finishes in its
+            // own time
+            rekey->stats.timed_out++;
+        }
+        else
+        {
+            running++;
+            conn = next;
+            continue;
+        }
+
+        he_internal_rekey_unlink(conn);
+        he_rekey_schedule(rekey, conn, now_ms);
+        conn = next;
+    }
+
+    return running;
+}
+
+/**
+ * @brief Deal with a connection whose rekey_at has passed
+ * @return false if it should start renegotiating but every place is taken, it is left unlinked
+ */
+static bool he_rekey_visit(he_rekey_t *rekey, he_conn_t *conn, uint64_t now_ms, size_t *running,
+                           size_t *started)
+{
+    // A connection in a handshake pool is being written by another thread, and it isn't online
+    // anyway. Neither is one that is renegotiating because the host asked it to.
+    if (conn->handshake || conn->state != HE_STATE_ONLINE || conn->renegotiation_in_progress)
+    {
+        he_rekey_schedule(rekey, conn, now_ms);
+        return true;
+    }
+
+    const he_rekey_config_t *config = &rekey->config;
+    uint64_t bytes = conn->stats.bytes[HE_STATS_INSIDE_IN] + conn->stats.bytes[HE_STATS_INSIDE_OUT];
+
+    if (!conn->renegotiation_due)
+    {
+        conn->renegotiation_due = true;
+        conn->rekey_deadline = he_rekey_after(now_ms, config->max_postpone_ms);
+
+        if (config->bulk_bytes)
+        {
+            conn->rekey_bytes = bytes;
+            he_rekey_insert(rekey, conn, he_rekey_after(now_ms, config->bulk_window_ms));
+            return true;
+        }
+    }
+    else if (config->bulk_bytes && bytes - conn->rekey_bytes >= config->bulk_bytes &&
+             now_ms < conn->rekey_deadline)
+    {
+        rekey->stats.postponed++;
+        conn->rekey_bytes = bytes;
+        he_rekey_insert(rekey, conn, he_rekey_after(now_ms, config->bulk_window_ms));
+        return true;
+    }
+
+    if (*running >= config->max_in_progress)
+    {
+        return false;
+    }
+
+    // Take the place before starting, the event callback may destroy the connection
+    conn->rekey_at = now_ms;
+    he_rekey_link(&rekey->running, conn);
+    (*running)++;
+
+    if (he_conn_start_renegotiation(conn) != HE_SUCCESS)
+    {
+        rekey->stats.failed++;
+        he_internal_rekey_unlink(conn);
+        (*running)--;
+        he_rekey_schedule(rekey, conn, now_ms);
+        return true;
+    }
+
+    rekey->stats.started++;
+    (*started)++;
+
+    return true;
+}
+
+/**
+ * @return false if the slot still holds due connections because every place is taken
+ */
+static bool he_rekey_process_slot(he_rekey_t *rekey, uint64_t tick, uint64_t now_ms,
+                                  size_t *running, size_t *started)
+{
+    he_conn_t **head = &rekey->slots[tick & HE_REKEY_SLOT_MASK];
+    he_conn_t *later = NULL;
+    bool finished = true;
+
+    // Take one at a time, starting a renegotiation runs callbacks that may destroy connections
+    while (*head)
+    {
+        he_conn_t *conn = *head;
+        he_internal_rekey_unlink(conn);
+
+        if (conn->rekey_at > now_ms)
+        {
+            // Due on a later turn of the ring, or later in a tick the clock is still in
+            he_conn_t **slot = he_rekey_slot_of(rekey, conn->rekey_at);
+            he_rekey_link(slot == head ? &later : slot, conn);
+            continue;
+        }
+
+        if (!he_rekey_visit(rekey, conn, now_ms, running, started))
+        {
+            he_rekey_link(head, conn);
+            finished = false;
+            break;
+        }
+    }
+
+    while (later)
+    {
+        he_conn_t *conn = later;
+        he_internal_rekey_unlink(conn);
+        he_rekey_link(head, conn);
+    }
+
+    return finished;
+}
+
+he_rekey_t *he_rekey_create(const he_rekey_config_t *config, uint64_t now_ms)
+{
+    if (config == NULL || config->interval_ms == 0 || config->max_in_progress == 0)
+    {
+        return NULL;
+    }
+
+    he_rekey_t *rekey = calloc(1, sizeof(he_rekey_t));
+    if (rekey == NULL)
+    {
+        return NULL;
+    }
+
+    rekey->config = *config;
+    rekey->current = now_ms / HE_REKEY_TICK_MS;
+    rekey->now = now_ms;
+    // Only needs to differ between schedulers, not to be unpredictable
+    rekey->random = now_ms ^ (uint64_t)(uintptr_t)rekey;
+
+    return rekey;
+}
+
+static void he_rekey_release_list(he_conn_t *conn)
+{
+    while (conn)
+    {
+        he_conn_t *next = conn->rekey_next;
+        conn->rekey_next = NULL;
+        conn->rekey_pprev = NULL;
+        conn->rekey = NULL;
+        conn->renegotiation_due = false;
+        conn = next;
+    }
+}
+
+void he_rekey_destroy(he_rekey_t *rekey)
+{
+    if (rekey == NULL)
+    {
+        return;
+    }
+
+    for (size_t slot = 0; slot < HE_REKEY_SLOTS; slot++)
+    {
+        he_rekey_release_list(rekey->slots[slot]);
+    }
+    he_rekey_release_list(rekey->running);
+
+    free(rekey);
+}
+
+he_return_code_t he_rekey_attach(he_rekey_t *rekey, he_conn_t *conn)
+{
+    if (rekey == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (conn->rekey == rekey)
+    {
+        return HE_SUCCESS;
+    }
+
+    he_rekey_detach(conn);
+    conn->rekey = rekey;
+    he_rekey_schedule(rekey, conn, rekey->now);
+
+    return HE_SUCCESS;
+}
+
+void he_rekey_detach(he_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    he_internal_rekey_unlink(conn);
+    conn->rekey = NULL;
+    conn->renegotiation_due = false;
+}
+
+size_t he_rekey_poll(he_rekey_t *rekey, uint64_t now_ms)
+{
+    if (rekey == NULL)
+    {
+        return 0;
+    }
+
+    if (now_ms < rekey->now)
+    {
+        now_ms = rekey->now;
+    }
+    rekey->now = now_ms;
+
+    size_t running = he_rekey_reap(rekey, now_ms);
+    size_t started = 0;
+    uint64_t target = now_ms / HE_REKEY_TICK_MS;
+
+    // After a long gap one turn of the ring is enough, every overdue connection is in some slot
+    if (target >= rekey->current + HE_REKEY_SLOTS)
+    {
+        rekey->current = target - HE_REKEY_SLOTS + 1;
+    }
+
+    while (rekey->current <= target)
+    {
+        uint64_t tick = rekey->current++;
+        if (!he_rekey_process_slot(rekey, tick, now_ms, &running, &started))
+        {
+            // Pick up from the same connection once a place frees up
+            rekey->current = tick;
+            rekey->stats.throttled++;
+            break;
+        }
+    }
+
+    rekey->stats.in_progress = running;
+
+    return started;
+}
+
+he_return_code_t he_rekey_get_stats(he_rekey_t *rekey, he_rekey_stats_t *stats)
+{
+    if (rekey == NULL || stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    *stats = rekey->stats;
+
+    return HE_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#ifndef REKEY_H
+#define REKEY_H
+
+#include "he.h"
+
+/**
+ * @brief Decides when the connections of one data-plane thread renegotiate their keys
+ *
+ * A renegotiation is a full handshake's worth of CPU. Connections that came up together, e.g.
+ * after a restart, would all hit a fixed rekey period together and the thread would stall for
+ * each wave. The scheduler gives every connection its own due time, a random point in a jitter
+ * window after the rekey interval, so over time the rekeys are spread evenly and their CPU cost
+ * looks like a flat background load.
+ *
+ * On top of that it smooths out what is left:
+ *
+ * - At most max_in_progress renegotiations run at once. Due connections beyond that wait, in
+ *   order, until one finishes.
+ * - A due connection is watched for bulk_window_ms first. If it moved bulk_bytes or more of
+ *   inside traffic in that time it is left alone for another window, so a renegotiation doesn't
+ *   cut into a transfer. After max_postpone_ms it renegotiates regardless, so the keys are never
+ *   kept for much longer than intended.
+ *
+ * The host calls he_rekey_poll() from its event loop, e.g. alongside he_timers_advance(). The
+ * scheduler keeps connections in a ring of HE_REKEY_SLOTS slots of HE_REKEY_TICK_MS each, so a
+ * poll only looks at the slots the clock moved past.
+ *
+ * The connections' WOLFSSL objects need secure renegotiation enabled, see
+ * he_conn_start_renegotiation(). A scheduler is not thread safe. Give each data-plane thread its
+ * own and only attach the connections that thread serves.
+ */
+typedef struct he_rekey he_rekey_t;
+
+#define HE_REKEY_TICK_MS 100
+#define HE_REKEY_SLOT_BITS 10
+#define HE_REKEY_SLOTS (1 << HE_REKEY_SLOT_BITS)
+
+typedef struct he_rekey_config
+{
+    /// Shortest time between two renegotiations of a connection
+    uint64_t interval_ms;
+    /// Each renegotiation falls due at a random point up to this long after the interval. As
+    /// long as the interval is, for a flat load.
+    uint64_t jitter_ms;
+    /// Most renegotiations running at once on this scheduler
+    size_t max_in_progress;
+    /// Inside bytes within bulk_window_ms that put a due renegotiation off, 0 to never put off
+    uint64_t bulk_bytes;
+    uint64_t bulk_window_ms;
+    /// Longest a due renegotiation is put off for bulk traffic
+    uint64_t max_postpone_ms;
+    /// A renegotiation still running after this long gives up its place, 0 to wait for it
+    uint64_t timeout_ms;
+} he_rekey_config_t;
+
+typedef struct he_rekey_stats
+{
+    /// Renegotiations running as of the last poll
+    size_t in_progress;
+    /// Renegotiations started, and how many of those finished
+    uint64_t started;
+    uint64_t completed;
+    /// Renegotiations that wolfSSL refused or that ended with the connection going offline
+    uint64_t failed;
+    /// Renegotiations that gave up their place after timeout_ms
+    uint64_t timed_out;
+    /// Times a due renegotiation was put off for bulk traffic
+    uint64_t postponed;
+    /// Polls that left due renegotiations waiting because max_in_progress were running
+    uint64_t throttled;
+} he_rekey_stats_t;
+
+/**
+ * @brief Create a scheduler
+ * @param config The schedule, copied
+ * @param now_ms The current time in milliseconds, from the clock later passed to he_rekey_poll()
+ * @return A pointer to the scheduler, or NULL if config is NULL, interval_ms or max_in_progress is
+ *         zero or it could not be allocated
+ */
+he_rekey_t *he_rekey_create(const he_rekey_config_t *config, uint64_t now_ms);
+
+/**
+ * @brief Free the scheduler, detaching every connection still attached to it
+ */
+void he_rekey_destroy(he_rekey_t *rekey);
+
+/**
+ * @brief Attach a connection so the scheduler renegotiates it
+ * @return HE_SUCCESS if the connection was attached
+ * @return HE_ERR_NULL_POINTER if rekey or conn is NULL
+ *
+ * Its first renegotiation falls due interval_ms plus jitter after the last poll. A connection
+ * that isn't online yet when it falls due is given a fresh due time, so it can be attached as
+ * soon as it is created. Destroying the connection detaches it.
+ */
+he_return_code_t he_rekey_attach(he_rekey_t *rekey, he_conn_t *conn);
+
+/**
+ * @brief Stop scheduling renegotiations for the connection
+ *
+ * A renegotiation that is already running carries on.
+ */
+void he_rekey_detach(he_conn_t *conn);
+
+/**
+ * @brief Move the scheduler forward to now_ms, starting any renegotiations that are due
+ * @return The number of renegotiations started
+ *
+ * Connections are renegotiated with he_conn_start_renegotiation(), so their event callbacks run
+ * inside this call.
+ */
+size_t he_rekey_poll(he_rekey_t *rekey, uint64_t now_ms);
+
+/**
+ * @brief Get the scheduler's counters
+ * @return HE_ERR_NULL_POINTER if rekey or stats is NULL
+ */
+he_return_code_t he_rekey_get_stats(he_rekey_t *rekey, he_rekey_stats_t *stats);
+
+#endif // REKEY_H
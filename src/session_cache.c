@@ -0,0 +1,565 @@
+#include "session_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HE_SESSION_CACHE_CACHE_LINE 64
+
+/// Marks the end of a bucket chain, the LRU list and the free list
+#define HE_SESSION_CACHE_NONE UINT32_MAX
+
+typedef struct he_session_cache_entry
+{
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    uint8_t id_length;
+    /// Serialised session, NULL while the entry is free
+    uint8_t *data;
+    size_t length;
+    /// Next entry in the same bucket, or in the free list
+    uint32_t next;
+    /// Neighbours in the LRU list, prev is towards the most recently used end
+    uint32_t lru_prev;
+    uint32_t lru_next;
+} he_session_cache_entry_t;
+
+typedef struct he_session_cache_shard
+{
+    pthread_mutex_t lock;
+    he_session_cache_entry_t *entries;
+    uint32_t *buckets;
+    size_t bucket_mask;
+    size_t capacity;
+    size_t count;
+    uint32_t free_head;
+    /// Most and least recently used entries
+    uint32_t lru_head;
+    uint32_t lru_tail;
+
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t removals;
+    uint64_t too_large;
+} he_session_cache_shard_t;
+
+/// Shards sit on their own cache lines so threads working on different shards don't contend
+typedef struct he_session_cache_padded_shard
+{
+    _Alignas(HE_SESSION_CACHE_CACHE_LINE) he_session_cache_shard_t shard;
+} he_session_cache_padded_shard_t;
+
+struct he_session_cache
+{
+    he_session_cache_padded_shard_t *shards;
+    size_t num_shards;
+};
+
+static uint64_t he_session_cache_hash(const uint8_t *id, size_t id_length)
+{
+    // FNV-1a. IDs are generated by the server, so they can't be chosen to collide.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < id_length; i++)
+    {
+        hash ^= id[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static he_session_cache_shard_t *he_session_cache_shard_for(he_session_cache_t *cache,
+                                                           uint64_t hash)
+{
+    // The low bits pick the bucket, use the high bits for the shard
+    return &cache->shards[(hash >> 32) % cache->num_shards].shard;
+}
+
+static void he_session_cache_lru_unlink(he_session_cache_shard_t *shard, uint32_t index)
+{
+    he_session_cache_entry_t *entry = &shard->entries[index];
+
+    if (entry->lru_prev != HE_SESSION_CACHE_NONE)
+    {
+        shard->entries[entry->lru_prev].lru_next = entry->lru_next;
+    }
+    else
+    {
+        shard->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next != HE_SESSION_CACHE_NONE)
+    {
+        shard->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void he_session_cache_lru_push(he_session_cache_shard_t *shard, uint32_t index)
+{
+    he_session_cache_entry_t *entry = &shard->entries[index];
+
+    entry->lru_prev = HE_SESSION_CACHE_NONE;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != HE_SESSION_CACHE_NONE)
+    {
+        shard->entries[shard->lru_head].lru_prev = index;
+    }
+    else
+    {
+        shard->lru_tail = index;
+    }
+    shard->lru_head = index;
+}
+
+/// Find an entry, leaving link pointing at whatever refers to it so it can be unlinked
+static uint32_t he_session_cache_lookup(he_session_cache_shard_t *shard, uint64_t hash,
+                                        const uint8_t *id, size_t id_length, uint32_t **link)
+{
+    uint32_t *next = &shard->buckets[hash & shard->bucket_mask];
+
+    while (*next != HE_SESSION_CACHE_NONE)
+    {
+        he_session_cache_entry_t *entry = &shard->entries[*next];
+        if (entry->id_length == id_length && memcmp(entry->id, id, id_length) == 0)
+        {
+            if (link)
+            {
+                *link = next;
+            }
+            return *next;
+        }
+        next = &entry->next;
+    }
+
+    return HE_SESSION_CACHE_NONE;
+}
+
+// Serialised sessions carry the master secret, don't leave them lying around in freed memory
+static void he_session_cache_wipe(uint8_t *data, size_t length)
+{
+    volatile uint8_t *p = (volatile uint8_t *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        p[i] = 0;
+    }
+}
+
+static void he_session_cache_free_data(uint8_t *data, size_t length)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+
+    he_session_cache_wipe(data, length);
+    free(data);
+}
+
+/// Unlink an entry and put it on the free list, returning its data for the caller to free
+static uint8_t *he_session_cache_release(he_session_cache_shard_t *shard, uint32_t index,
+                                         uint32_t *link, size_t *length)
+{
+    he_session_cache_entry_t *entry = &shard->entries[index];
+    uint8_t *data = entry->data;
+    *length = entry->length;
+
+    *link = entry->next;
+    he_session_cache_lru_unlink(shard, index);
+
+    entry->data = NULL;
+    entry->length = 0;
+    entry->next = shard->free_head;
+    shard->free_head = index;
+    shard->count--;
+
+    return data;
+}
+
+static bool he_session_cache_shard_init(he_session_cache_shard_t *shard, size_t capacity)
+{
+    size_t buckets = 16;
+    while (buckets < capacity)
+    {
+        buckets *= 2;
+    }
+
+    shard->entries = calloc(capacity, sizeof(he_session_cache_entry_t));
+    shard->buckets = malloc(buckets * sizeof(uint32_t));
+    if (shard->entries == NULL || shard->buckets == NULL ||
+        pthread_mutex_init(&shard->lock, NULL) != 0)
+    {
+        free(shard->entries);
+        free(shard->buckets);
+        shard->entries = NULL;
+        shard->buckets = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < buckets; i++)
+    {
+        shard->buckets[i] = HE_SESSION_CACHE_NONE;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        shard->entries[i].next = i + 1 < capacity ? (uint32_t)(i + 1) : HE_SESSION_CACHE_NONE;
+    }
+
+    shard->bucket_mask = buckets - 1;
+    shard->capacity = capacity;
+    shard->free_head = 0;
+    shard->lru_head = HE_SESSION_CACHE_NONE;
+    shard->lru_tail = HE_SESSION_CACHE_NONE;
+
+    return true;
+}
+
+he_session_cache_t *he_session_cache_create(size_t max_sessions, size_t num_shards)
+{
+    if (max_sessions == 0 || num_shards == 0 || num_shards > max_sessions ||
+        max_sessions / num_shards >= HE_SESSION_CACHE_NONE)
+    {
+        return NULL;
+    }
+
+    he_session_cache_t *cache = calloc(1, sizeof(he_session_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    size_t size = num_shards * sizeof(he_session_cache_padded_shard_t);
+    cache->shards = aligned_alloc(HE_SESSION_CACHE_CACHE_LINE, size);
+    if (cache->shards == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->shards, 0, size);
+
+    for (size_t i = 0; i < num_shards; i++)
+    {
+        // Spread the remainder so the shards add up to max_sessions exactly
+        size_t capacity = max_sessions / num_shards + (i < max_sessions % num_shards);
+        if (!he_session_cache_shard_init(&cache->shards[i].shard, capacity))
+        {
+            cache->num_shards = i;
+            he_session_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    cache->num_shards = num_shards;
+
+    return cache;
+}
+
+void he_session_cache_destroy(he_session_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->num_shards; i++)
+    {
+        he_session_cache_shard_t *shard = &cache->shards[i].shard;
+        for (size_t j = 0; j < shard->capacity; j++)
+        {
+            he_session_cache_free_data(shard->entries[j].data, shard->entries[j].length);
+        }
+        free(shard->entries);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache->shards);
+    free(cache);
+}
+
+he_return_code_t he_session_cache_store(he_session_cache_t *cache, const uint8_t *id,
+                                        size_t id_length, const uint8_t *data, size_t length)
+{
+    if (cache == NULL || id == NULL || data == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (id_length == 0 || length == 0)
+    {
+        return HE_ERR_ZERO_SIZE;
+    }
+
+    uint64_t hash = he_session_cache_hash(id, id_length);
+    he_session_cache_shard_t *shard = he_session_cache_shard_for(cache, hash);
+
+    if (id_length > HE_SESSION_CACHE_MAX_ID || length > HE_SESSION_CACHE_MAX_DATA)
+    {
+        pthread_mutex_lock(&shard->lock);
+        shard->too_large++;
+        pthread_mutex_unlock(&shard->lock);
+        return HE_ERR_STRING_TOO_LONG;
+    }
+
+    // Copy before taking the lock, and free whatever this replaces after dropping it
+    uint8_t *copy = malloc(length);
+    if (copy == NULL)
+    {
+        return HE_ERR_NO_MEMORY;
+    }
+    memcpy(copy, data, length);
+    uint8_t *old = NULL;
+    size_t old_length = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    uint32_t index = he_session_cache_lookup(shard, hash, id, id_length, NULL);
+    if (index != HE_SESSION_CACHE_NONE)
+    {
+        he_session_cache_lru_unlink(shard, index);
+        old = shard->entries[index].data;
+        old_length = shard->entries[index].length;
+    }
+    else
+    {
+        if (shard->free_head == HE_SESSION_CACHE_NONE)
+        {
+            he_session_cache_entry_t *victim = &shard->entries[shard->lru_tail];
+            uint32_t *link = NULL;
+            he_session_cache_lookup(shard, he_session_cache_hash(victim->id, victim->id_length),
+                                    victim->id, victim->id_length, &link);
+            old = he_session_cache_release(shard, shard->lru_tail, link, &old_length);
+            shard->evictions++;
+        }
+
+        index = shard->free_head;
+        he_session_cache_entry_t *entry = &shard->entries[index];
+        shard->free_head = entry->next;
+
+        memcpy(entry->id, id, id_length);
+        entry->id_length = (uint8_t)id_length;
+        uint32_t *bucket = &shard->buckets[hash & shard->bucket_mask];
+        entry->next = *bucket;
+        *bucket = index;
+        shard->count++;
+    }
+
+    shard->entries[index].data = copy;
+    shard->entries[index].length = length;
+    he_session_cache_lru_push(shard, index);
+    shard->stores++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    he_session_cache_free_data(old, old_length);
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_session_cache_find(he_session_cache_t *cache, const uint8_t *id,
+                                       size_t id_length, uint8_t *buffer, size_t *length)
+{
+    if (cache == NULL || id == NULL || buffer == NULL || length == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    uint64_t hash = he_session_cache_hash(id, id_length);
+    he_session_cache_shard_t *shard = he_session_cache_shard_for(cache, hash);
+    he_return_code_t res = HE_ERR_UNKNOWN_SESSION;
+
+    pthread_mutex_lock(&shard->lock);
+    shard->lookups++;
+
+    uint32_t index = he_session_cache_lookup(shard, hash, id, id_length, NULL);
+    if (index != HE_SESSION_CACHE_NONE)
+    {
+        he_session_cache_entry_t *entry = &shard->entries[index];
+        if (entry->length > *length)
+        {
+            res = HE_ERR_BUFFER_TOO_SMALL;
+        }
+        else
+        {
+            memcpy(buffer, entry->data, entry->length);
+            he_session_cache_lru_unlink(shard, index);
+            he_session_cache_lru_push(shard, index);
+            shard->hits++;
+            res = HE_SUCCESS;
+        }
+        *length = entry->length;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return res;
+}
+
+he_return_code_t he_session_cache_remove(he_session_cache_t *cache, const uint8_t *id,
+                                         size_t id_length)
+{
+    if (cache == NULL || id == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    uint64_t hash = he_session_cache_hash(id, id_length);
+    he_session_cache_shard_t *shard = he_session_cache_shard_for(cache, hash);
+    uint8_t *old = NULL;
+    size_t old_length = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    uint32_t *link = NULL;
+    uint32_t index = he_session_cache_lookup(shard, hash, id, id_length, &link);
+    if (index != HE_SESSION_CACHE_NONE)
+    {
+        old = he_session_cache_release(shard, index, link, &old_length);
+        shard->removals++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (old == NULL)
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    he_session_cache_free_data(old, old_length);
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_session_cache_get_stats(he_session_cache_t *cache,
+                                            he_session_cache_stats_t *stats)
+{
+    if (cache == NULL || stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < cache->num_shards; i++)
+    {
+        he_session_cache_shard_t *shard = &cache->shards[i].shard;
+
+        pthread_mutex_lock(&shard->lock);
+        stats->capacity += shard->capacity;
+        stats->entries += shard->count;
+        stats->lookups += shard->lookups;
+        stats->hits += shard->hits;
+        stats->stores += shard->stores;
+        stats->evictions += shard->evictions;
+        stats->removals += shard->removals;
+        stats->too_large += shard->too_large;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return HE_SUCCESS;
+}
+
+static he_session_cache_t *he_session_cache_from_ctx(WOLFSSL_CTX *ctx)
+{
+    return ctx ? wolfSSL_CTX_get_ex_data(ctx, HE_SESSION_CACHE_EX_DATA_INDEX) : NULL;
+}
+
+static int he_session_cache_new_cb(WOLFSSL *ssl, WOLFSSL_SESSION *session)
+{
+    he_session_cache_t *cache = he_session_cache_from_ctx(wolfSSL_get_SSL_CTX(ssl));
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    unsigned int id_length = 0;
+    const unsigned char *id = wolfSSL_SESSION_get_id(session, &id_length);
+    int length = wolfSSL_i2d_SSL_SESSION(session, NULL);
+    if (id == NULL || length <= 0)
+    {
+        return 0;
+    }
+
+    uint8_t data[HE_SESSION_CACHE_MAX_DATA];
+    if ((size_t)length > sizeof(data))
+    {
+        // Let the cache count it
+        he_session_cache_store(cache, id, id_length, data, (size_t)length);
+        return 0;
+    }
+
+    unsigned char *out = data;
+    if (wolfSSL_i2d_SSL_SESSION(session, &out) == length)
+    {
+        he_session_cache_store(cache, id, id_length, data, (size_t)length);
+    }
+    he_session_cache_wipe(data, (size_t)length);
+
+    // The session is stored serialised, wolfSSL keeps its own reference
+    return 0;
+}
+
+static WOLFSSL_SESSION *he_session_cache_get_cb(WOLFSSL *ssl, const unsigned char *id,
+                                                int id_length, int *copy)
+{
+    // The session is made for wolfSSL here and is wolfSSL's to free
+    *copy = 0;
+
+    he_session_cache_t *cache = he_session_cache_from_ctx(wolfSSL_get_SSL_CTX(ssl));
+    if (cache == NULL || id_length <= 0)
+    {
+        return NULL;
+    }
+
+    uint8_t data[HE_SESSION_CACHE_MAX_DATA];
+    size_t length = sizeof(data);
+    if (he_session_cache_find(cache, id, (size_t)id_length, data, &length) != HE_SUCCESS)
+    {
+        return NULL;
+    }
+
+    const unsigned char *in = data;
+    WOLFSSL_SESSION *session = wolfSSL_d2i_SSL_SESSION(NULL, &in, (long)length);
+    he_session_cache_wipe(data, length);
+
+    return session;
+}
+
+static void he_session_cache_remove_cb(WOLFSSL_CTX *ctx, WOLFSSL_SESSION *session)
+{
+    he_session_cache_t *cache = he_session_cache_from_ctx(ctx);
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    unsigned int id_length = 0;
+    const unsigned char *id = wolfSSL_SESSION_get_id(session, &id_length);
+    if (id != NULL)
+    {
+        he_session_cache_remove(cache, id, id_length);
+    }
+}
+
+he_return_code_t he_session_cache_attach(he_session_cache_t *cache, WOLFSSL_CTX *ctx)
+{
+    if (cache == NULL || ctx == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (wolfSSL_CTX_set_ex_data(ctx, HE_SESSION_CACHE_EX_DATA_INDEX, cache) != WOLFSSL_SUCCESS)
+    {
+        return HE_ERR_INIT_FAILED;
+    }
+
+    wolfSSL_CTX_set_session_cache_mode(ctx,
+                                       WOLFSSL_SESS_CACHE_SERVER | WOLFSSL_SESS_CACHE_NO_INTERNAL);
+    wolfSSL_CTX_sess_set_new_cb(ctx, he_session_cache_new_cb);
+    wolfSSL_CTX_sess_set_get_cb(ctx, he_session_cache_get_cb);
+    wolfSSL_CTX_sess_set_remove_cb(ctx, he_session_cache_remove_cb);
+
+    return HE_SUCCESS;
+}
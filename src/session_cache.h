@@ -0,0 +1,121 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include "he.h"
+#include "wolf.h"
+
+/**
+ * @brief A server side cache of D/TLS sessions for resumption
+ *
+ * A client that reconnects with a session the server still has skips the certificate exchange
+ * and the asymmetric crypto of a full handshake, which is most of its CPU cost. When a POP fails
+ * over and every client reconnects at once, that is the difference between minutes of pinned
+ * cores and seconds.
+ *
+ * Sessions are stored serialised, keyed by session ID, and spread over independently locked
+ * shards so worker threads sharing one WOLFSSL_CTX rarely contend. Each shard holds a fixed
+ * number of sessions and evicts the least recently used one when full. wolfSSL still checks a
+ * resumed session's lifetime itself, so an expired session that hasn't been evicted yet is never
+ * resumed.
+ *
+ * The cache is safe to use from any number of threads.
+ */
+typedef struct he_session_cache he_session_cache_t;
+
+/// Largest serialised session the cache keeps, larger sessions are skipped
+#define HE_SESSION_CACHE_MAX_DATA HE_MAX_SESSION_DATA
+
+/// Longest session ID, as in TLS
+#define HE_SESSION_CACHE_MAX_ID 32
+
+/// Slot in the WOLFSSL_CTX's ex data the cache is attached in
+#define HE_SESSION_CACHE_EX_DATA_INDEX 0
+
+typedef struct he_session_cache_stats
+{
+    /// Sessions the cache can hold, and holds now
+    size_t capacity;
+    size_t entries;
+    /// Resumption attempts, and how many found their session. hits / lookups is the hit rate.
+    uint64_t lookups;
+    uint64_t hits;
+    /// Sessions stored, including ones that replaced an older copy
+    uint64_t stores;
+    /// Sessions dropped to make room
+    uint64_t evictions;
+    /// Sessions wolfSSL asked to forget, e.g. after a fatal alert
+    uint64_t removals;
+    /// Sessions too large to store
+    uint64_t too_large;
+} he_session_cache_stats_t;
+
+/**
+ * @brief Create a session cache
+ * @param max_sessions The most sessions the cache holds, split evenly across the shards
+ * @param num_shards How many independently locked shards to use, e.g. the number of worker
+ *        threads
+ * @return A pointer to the cache, or NULL if an argument is zero, there are more shards than
+ *         sessions or it could not be allocated
+ */
+he_session_cache_t *he_session_cache_create(size_t max_sessions, size_t num_shards);
+
+/**
+ * @brief Free the cache and every session in it
+ *
+ * Every WOLFSSL_CTX it is attached to must have been freed first.
+ */
+void he_session_cache_destroy(he_session_cache_t *cache);
+
+/**
+ * @brief Have a server WOLFSSL_CTX keep its sessions in the cache instead of its own
+ * @return HE_SUCCESS if the cache was attached
+ * @return HE_ERR_NULL_POINTER if cache or ctx is NULL
+ * @return HE_ERR_INIT_FAILED if wolfSSL would not take the cache
+ *
+ * Needs wolfSSL built with HAVE_EXT_CACHE. wolfSSL's internal cache is turned off for the
+ * context. Several contexts, e.g. one per worker, can share one cache.
+ */
+he_return_code_t he_session_cache_attach(he_session_cache_t *cache, WOLFSSL_CTX *ctx);
+
+/**
+ * @brief Store a serialised session
+ * @return HE_SUCCESS if the session was stored, replacing any with the same ID
+ * @return HE_ERR_NULL_POINTER if cache, id or data is NULL
+ * @return HE_ERR_ZERO_SIZE if id_length or length is zero
+ * @return HE_ERR_STRING_TOO_LONG if the ID is longer than HE_SESSION_CACHE_MAX_ID or the data
+ *         longer than HE_SESSION_CACHE_MAX_DATA
+ * @return HE_ERR_NO_MEMORY if the data could not be copied
+ */
+he_return_code_t he_session_cache_store(he_session_cache_t *cache, const uint8_t *id,
+                                        size_t id_length, const uint8_t *data, size_t length);
+
+/**
+ * @brief Copy out a stored session, marking it as recently used
+ * @param buffer Where to copy the session
+ * @param length The size of buffer, set to the length of the session
+ * @return HE_SUCCESS if the session was found and copied
+ * @return HE_ERR_NULL_POINTER if any pointer is NULL
+ * @return HE_ERR_UNKNOWN_SESSION if there is no session with that ID
+ * @return HE_ERR_BUFFER_TOO_SMALL if the session is longer than the buffer, length is set to
+ *         the size needed
+ *
+ * A buffer of HE_SESSION_CACHE_MAX_DATA bytes is always large enough.
+ */
+he_return_code_t he_session_cache_find(he_session_cache_t *cache, const uint8_t *id,
+                                       size_t id_length, uint8_t *buffer, size_t *length);
+
+/**
+ * @brief Forget a stored session
+ * @return HE_ERR_UNKNOWN_SESSION if there is no session with that ID
+ */
+he_return_code_t he_session_cache_remove(he_session_cache_t *cache, const uint8_t *id,
+                                         size_t id_length);
+
+/**
+ * @brief Get the counters of every shard added together
+ * @return HE_ERR_NULL_POINTER if cache or stats is NULL
+ */
+he_return_code_t he_session_cache_get_stats(he_session_cache_t *cache,
+                                            he_session_cache_stats_t *stats);
+
+#endif // SESSION_CACHE_H
@@ -0,0 +1,408 @@
+#include "session_table.h"
+#include "core.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define HE_SESSION_EMPTY 0
+#define HE_SESSION_RESERVED UINT64_MAX
+
+/// Fresh IDs to try before giving up, collisions should be vanishingly rare with random IDs
+#define HE_SESSION_MAX_ATTEMPTS 8
+
+typedef struct he_session_slot
+{
+    _Atomic uint64_t session;
+    _Atomic(he_conn_t *) conn;
+} he_session_slot_t;
+
+struct he_session_table
+{
+    he_session_slot_t *slots;
+    size_t mask;
+    size_t count;
+    size_t max_entries;
+    /// Odd while a writer is moving entries around, readers retry if it changes under them
+    _Atomic uint64_t generation;
+    pthread_mutex_t lock;
+};
+
+static inline bool he_session_is_reserved(uint64_t session)
+{
+    return session == HE_SESSION_EMPTY || session == HE_SESSION_RESERVED;
+}
+
+static inline size_t he_session_home(const he_session_table_t *table, uint64_t session)
+{
+    // Session IDs may carry structure (e.g. a shard index), so mix all the bits before masking
+    session ^= session >> 33;
+    session *= 0xff51afd7ed558ccdULL;
+    session ^= session >> 33;
+    session *= 0xc4ceb9fe1a85ec53ULL;
+    session ^= session >> 33;
+    return (size_t)session & table->mask;
+}
+
+he_session_table_t *he_session_table_create(size_t max_entries)
+{
+    if (max_entries == 0)
+    {
+        return NULL;
+    }
+
+    he_session_table_t *table = calloc(1, sizeof(he_session_table_t));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    // Keep the load factor at or below one half so probe sequences stay short
+    size_t capacity = 16;
+    while (capacity < max_entries * 2)
+    {
+        capacity *= 2;
+    }
+
+    table->slots = calloc(capacity, sizeof(he_session_slot_t));
+    if (table->slots == NULL || pthread_mutex_init(&table->lock, NULL) != 0)
+    {
+        free(table->slots);
+        free(table);
+        return NULL;
+    }
+
+    table->mask = capacity - 1;
+    table->max_entries = max_entries;
+    atomic_init(&table->generation, 0);
+
+    return table;
+}
+
+void he_session_table_destroy(he_session_table_t *table)
+{
+    if (table)
+    {
+        pthread_mutex_destroy(&table->lock);
+        free(table->slots);
+        free(table);
+    }
+}
+
+// Must be called with the lock held. Returns the slot holding session, or the empty slot that
+// ends its probe sequence.
+static size_t he_session_find_slot(const he_session_table_t *table, uint64_t session)
+{
+    size_t i = he_session_home(table, session);
+
+    for (;;)
+    {
+        uint64_t key = atomic_load_explicit(&table->slots[i].session, memory_order_relaxed);
+        if (key == session || key == HE_SESSION_EMPTY)
+        {
+            return i;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+static inline void he_session_store(he_session_slot_t *slot, uint64_t session, he_conn_t *conn)
+{
+    // The connection must be visible before the key that makes readers look at it
+    atomic_store_explicit(&slot->conn, conn, memory_order_relaxed);
+    atomic_store_explicit(&slot->session, session, memory_order_release);
+}
+
+// Must be called with the lock held and inside a generation bump. Backward shift deletion keeps
+// every probe sequence intact without leaving tombstones behind.
+static void he_session_erase_slot(he_session_table_t *table, size_t i)
+{
+    size_t j = i;
+
+    for (;;)
+    {
+        j = (j + 1) & table->mask;
+
+        uint64_t key = atomic_load_explicit(&table->slots[j].session, memory_order_relaxed);
+        if (key == HE_SESSION_EMPTY)
+        {
+            break;
+        }
+
+        // Entries whose home lies cyclically in (i, j] are still reachable, leave them be
+        size_t home = he_session_home(table, key);
+        bool reachable = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (reachable)
+        {
+            continue;
+        }
+
+        he_conn_t *conn = atomic_load_explicit(&table->slots[j].conn, memory_order_relaxed);
+        he_session_store(&table->slots[i], key, conn);
+        i = j;
+    }
+
+    atomic_store_explicit(&table->slots[i].session, HE_SESSION_EMPTY, memory_order_relaxed);
+    atomic_store_explicit(&table->slots[i].conn, NULL, memory_order_relaxed);
+    table->count--;
+}
+
+static inline void he_session_write_begin(he_session_table_t *table)
+{
+    uint64_t generation = atomic_load_explicit(&table->generation, memory_order_relaxed);
+    atomic_store_explicit(&table->generation, generation + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void he_session_write_end(he_session_table_t *table)
+{
+    uint64_t generation = atomic_load_explicit(&table->generation, memory_order_relaxed);
+    atomic_store_explicit(&table->generation, generation + 1, memory_order_release);
+}
+
+he_return_code_t he_session_table_insert(he_session_table_t *table, uint64_t session,
+                                         he_conn_t *conn)
+{
+    if (table == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (he_session_is_reserved(session))
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    he_return_code_t res = HE_SUCCESS;
+    pthread_mutex_lock(&table->lock);
+
+    size_t i = he_session_find_slot(table, session);
+    if (atomic_load_explicit(&table->slots[i].session, memory_order_relaxed) == session)
+    {
+        res = HE_ERR_SESSION_EXISTS;
+    }
+    else if (table->count == table->max_entries)
+    {
+        res = HE_ERR_NO_MEMORY;
+    }
+    else
+    {
+        // Filling the empty slot at the end of the probe sequence never moves anything, so
+        // readers don't need to be told
+        he_session_store(&table->slots[i], session, conn);
+        table->count++;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return res;
+}
+
+he_return_code_t he_session_table_insert_new(he_session_table_t *table, he_conn_t *conn)
+{
+    if (table == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    for (int attempt = 0; attempt < HE_SESSION_MAX_ATTEMPTS; attempt++)
+    {
+        uint64_t session = 0;
+        he_return_code_t res = he_internal_generate_session_id(conn, &session);
+        if (res != HE_SUCCESS)
+        {
+            return res;
+        }
+
+        // The insert is the uniqueness check, so two threads can never claim the same ID
+        res = he_session_table_insert(table, session, conn);
+        if (res == HE_SUCCESS)
+        {
+            conn->session_id = session;
+            return HE_SUCCESS;
+        }
+
+        if (res != HE_ERR_SESSION_EXISTS)
+        {
+            return res;
+        }
+    }
+
+    return HE_ERR_SESSION_EXISTS;
+}
+
+he_return_code_t he_session_table_remove(he_session_table_t *table, uint64_t session)
+{
+    if (table == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (he_session_is_reserved(session))
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    he_return_code_t res = HE_SUCCESS;
+    pthread_mutex_lock(&table->lock);
+
+    size_t i = he_session_find_slot(table, session);
+    if (atomic_load_explicit(&table->slots[i].session, memory_order_relaxed) != session)
+    {
+        res = HE_ERR_UNKNOWN_SESSION;
+    }
+    else
+    {
+        he_session_write_begin(table);
+        he_session_erase_slot(table, i);
+        he_session_write_end(table);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return res;
+}
+
+he_return_code_t he_session_table_rekey(he_session_table_t *table, uint64_t old_session,
+                                        uint64_t new_session)
+{
+    if (table == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (he_session_is_reserved(old_session) || he_session_is_reserved(new_session))
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    he_return_code_t res = HE_SUCCESS;
+    pthread_mutex_lock(&table->lock);
+
+    size_t old_slot = he_session_find_slot(table, old_session);
+    size_t new_slot = he_session_find_slot(table, new_session);
+
+    if (atomic_load_explicit(&table->slots[old_slot].session, memory_order_relaxed) != old_session)
+    {
+        res = HE_ERR_UNKNOWN_SESSION;
+    }
+    else if (atomic_load_explicit(&table->slots[new_slot].session, memory_order_relaxed) ==
+             new_session)
+    {
+        res = HE_ERR_SESSION_EXISTS;
+    }
+    else
+    {
+        he_conn_t *conn = atomic_load_explicit(&table->slots[old_slot].conn, memory_order_relaxed);
+
+        // Both changes happen inside one generation so no reader can see the connection under
+        // both IDs or under neither
+        he_session_write_begin(table);
+        he_session_erase_slot(table, old_slot);
+        // The erase may have shifted entries, so look for the empty slot again
+        new_slot = he_session_find_slot(table, new_session);
+        he_session_store(&table->slots[new_slot], new_session, conn);
+        table->count++;
+        he_session_write_end(table);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return res;
+}
+
+he_return_code_t he_session_table_promote_pending(he_session_table_t *table, he_conn_t *conn)
+{
+    if (table == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (conn->pending_session_id == 0)
+    {
+        return HE_ERR_UNKNOWN_SESSION;
+    }
+
+    he_return_code_t res = he_session_table_rekey(table, conn->session_id, conn->pending_session_id);
+    if (res != HE_SUCCESS)
+    {
+        return res;
+    }
+
+    conn->session_id = conn->pending_session_id;
+    conn->pending_session_id = 0;
+
+    return HE_SUCCESS;
+}
+
+he_conn_t *he_session_table_lookup(he_session_table_t *table, uint64_t session)
+{
+    if (table == NULL || he_session_is_reserved(session))
+    {
+        return NULL;
+    }
+
+    for (;;)
+    {
+        uint64_t generation = atomic_load_explicit(&table->generation, memory_order_acquire);
+        if (generation & 1)
+        {
+            // A writer is moving entries, it will be done shortly
+            continue;
+        }
+
+        he_conn_t *found = NULL;
+        size_t i = he_session_home(table, session);
+
+        for (;;)
+        {
+            uint64_t key = atomic_load_explicit(&table->slots[i].session, memory_order_acquire);
+            if (key == session)
+            {
+                found = atomic_load_explicit(&table->slots[i].conn, memory_order_relaxed);
+                break;
+            }
+            if (key == HE_SESSION_EMPTY)
+            {
+                break;
+            }
+            i = (i + 1) & table->mask;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&table->generation, memory_order_relaxed) == generation)
+        {
+            return found;
+        }
+    }
+}
+
+he_conn_t *he_session_table_lookup_packet(he_session_table_t *table, const uint8_t *packet,
+                                          size_t length)
+{
+    if (packet == NULL || length < sizeof(he_wire_hdr_t))
+    {
+        return NULL;
+    }
+
+    if (packet[0] != 'H' || packet[1] != 'e')
+    {
+        return NULL;
+    }
+
+    // The datagram may sit at any alignment in the caller's receive buffer
+    uint64_t session;
+    memcpy(&session, packet + offsetof(he_wire_hdr_t, session), sizeof(session));
+
+    return he_session_table_lookup(table, session);
+}
+
+size_t he_session_table_count(he_session_table_t *table)
+{
+    if (table == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    size_t count = table->count;
+    pthread_mutex_unlock(&table->lock);
+
+    return count;
+}
@@ -0,0 +1,96 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include "he.h"
+
+/**
+ * @brief Maps wire header session IDs to connections on a server
+ *
+ * An open addressing table with linear probing over 16 byte slots, sized once at creation so it
+ * never has to grow. Writers serialise on an internal mutex; lookups take no lock at all and may
+ * run on any number of threads while writers update the table.
+ *
+ * Session IDs 0 and UINT64_MAX are reserved and can never be stored.
+ *
+ * @note The table does not own the connections. A connection removed from the table may still be
+ * returned to a lookup that started before the removal, so it must not be freed until every
+ * thread that could have been looking it up has moved on.
+ */
+typedef struct he_session_table he_session_table_t;
+
+/**
+ * @brief Create a session table
+ * @param max_entries The maximum number of sessions the table will ever hold
+ * @return A pointer to the table, or NULL if it could not be allocated
+ */
+he_session_table_t *he_session_table_create(size_t max_entries);
+
+void he_session_table_destroy(he_session_table_t *table);
+
+/**
+ * @brief Add a session to the table
+ * @return HE_SUCCESS if the session was added
+ * @return HE_ERR_NULL_POINTER if table or conn is NULL
+ * @return HE_ERR_UNKNOWN_SESSION if the session ID is reserved
+ * @return HE_ERR_SESSION_EXISTS if the session ID is already in the table
+ * @return HE_ERR_NO_MEMORY if the table already holds max_entries sessions
+ */
+he_return_code_t he_session_table_insert(he_session_table_t *table, uint64_t session,
+                                         he_conn_t *conn);
+
+/**
+ * @brief Give a connection a fresh random session ID and add it to the table
+ * @return HE_SUCCESS if conn->session_id was set and the session added
+ * @return HE_ERR_RNG_FAILURE if the connection's RNG failed
+ * @return HE_ERR_SESSION_EXISTS if every ID drawn was already taken
+ * @return HE_ERR_NO_MEMORY if the table already holds max_entries sessions
+ *
+ * IDs come from he_internal_generate_session_id(), so they carry the connection's shard if it
+ * has one.
+ */
+he_return_code_t he_session_table_insert_new(he_session_table_t *table, he_conn_t *conn);
+
+/**
+ * @brief Remove a session from the table
+ * @return HE_ERR_UNKNOWN_SESSION if the session is not in the table
+ */
+he_return_code_t he_session_table_remove(he_session_table_t *table, uint64_t session);
+
+/**
+ * @brief Move a connection from one session ID to another in a single step
+ * @return HE_ERR_UNKNOWN_SESSION if old_session is not in the table or new_session is reserved
+ * @return HE_ERR_SESSION_EXISTS if new_session is already in the table
+ *
+ * Concurrent lookups see either the old mapping or the new one, never both or neither.
+ */
+he_return_code_t he_session_table_rekey(he_session_table_t *table, uint64_t old_session,
+                                        uint64_t new_session);
+
+/**
+ * @brief Promote a connection's pending session ID to its current session ID
+ * @return HE_ERR_UNKNOWN_SESSION if the connection has no pending session
+ *
+ * Rekeys the table from conn->session_id to conn->pending_session_id, then updates the
+ * connection to match.
+ */
+he_return_code_t he_session_table_promote_pending(he_session_table_t *table, he_conn_t *conn);
+
+/**
+ * @brief Find the connection for a session ID without taking any lock
+ * @return The connection, or NULL if the session is not in the table
+ */
+he_conn_t *he_session_table_lookup(he_session_table_t *table, uint64_t session);
+
+/**
+ * @brief Find the connection a datagram belongs to, straight from its wire header
+ * @return The connection, or NULL if the datagram is not Helium or its session is unknown
+ *
+ * Intended as the server's first step for every datagram, before any crypto is done.
+ */
+he_conn_t *he_session_table_lookup_packet(he_session_table_t *table, const uint8_t *packet,
+                                          size_t length);
+
+/// Number of sessions currently in the table
+size_t he_session_table_count(he_session_table_t *table);
+
+#endif // SESSION_TABLE_H
@@ -0,0 +1,85 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+HE_THREAD_LOCAL he_stats_block_t *he_thread_stats = NULL;
+
+// Where a thread counts if its block could not be allocated. Never merged into the totals.
+static HE_THREAD_LOCAL he_stats_block_t he_stats_fallback;
+
+static pthread_mutex_t he_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static he_stats_block_t *he_stats_blocks = NULL;
+
+he_stats_block_t *he_internal_stats_register(void)
+{
+    // A plain allocation could put the start of this block in the line that ends another thread's
+    he_stats_block_t *block = aligned_alloc(HE_STATS_CACHE_LINE, sizeof(he_stats_block_t));
+    if (block == NULL)
+    {
+        he_thread_stats = &he_stats_fallback;
+        return he_thread_stats;
+    }
+    memset(block, 0, sizeof(he_stats_block_t));
+
+    pthread_mutex_lock(&he_stats_lock);
+    block->next = he_stats_blocks;
+    he_stats_blocks = block;
+    pthread_mutex_unlock(&he_stats_lock);
+
+    he_thread_stats = block;
+    return block;
+}
+
+static void he_stats_merge(he_stats_t *stats, he_stats_block_t *block)
+{
+    for (size_t i = 0; i < HE_STATS_DIRECTIONS; i++)
+    {
+        stats->packets[i] += atomic_load_explicit(&block->packets[i], memory_order_relaxed);
+        stats->bytes[i] += atomic_load_explicit(&block->bytes[i], memory_order_relaxed);
+    }
+
+    stats->aggressive_duplicates +=
+        atomic_load_explicit(&block->aggressive_duplicates, memory_order_relaxed);
+
+    for (size_t i = 0; i < HE_STATS_MAX_REASONS; i++)
+    {
+        stats->drops[i] += atomic_load_explicit(&block->drops[i], memory_order_relaxed);
+    }
+}
+
+he_return_code_t he_stats_get_thread(he_stats_t *stats)
+{
+    if (stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    memset(stats, 0, sizeof(he_stats_t));
+    if (he_thread_stats != NULL)
+    {
+        he_stats_merge(stats, he_thread_stats);
+    }
+
+    return HE_SUCCESS;
+}
+
+he_return_code_t he_stats_get_global(he_stats_t *stats)
+{
+    if (stats == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    memset(stats, 0, sizeof(he_stats_t));
+
+    pthread_mutex_lock(&he_stats_lock);
+    for (he_stats_block_t *block = he_stats_blocks; block != NULL; block = block->next)
+    {
+        he_stats_merge(stats, block);
+    }
+    pthread_mutex_unlock(&he_stats_lock);
+
+    return HE_SUCCESS;
+}
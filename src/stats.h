@@ -0,0 +1,123 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "he.h"
+#include "core.h"
+
+#include <stdatomic.h>
+
+/// Drop reasons are indexed by the negated return code, anything beyond this is not counted
+#define HE_STATS_MAX_REASONS 64
+
+/// Blocks start on, and fill, whole cache lines of this size
+#define HE_STATS_CACHE_LINE 64
+
+/**
+ * @brief Data-plane counters aggregated over every connection served by a thread
+ *
+ * Each thread that runs Helium gets its own block the first time it counts anything. Only that
+ * thread ever writes to it, so counting is a plain add with no atomic read-modify-write. Blocks
+ * are aligned to and padded out to whole cache lines, so no two threads' blocks share one.
+ * Readers merge the blocks of every thread on demand with he_stats_get_global().
+ *
+ * Blocks are kept after their thread exits so nothing counted is ever lost.
+ */
+typedef struct he_stats
+{
+    /// Indexed by he_stats_direction_t
+    uint64_t packets[HE_STATS_DIRECTIONS];
+    uint64_t bytes[HE_STATS_DIRECTIONS];
+    /// Extra copies of records sent while connecting or in aggressive mode
+    uint64_t aggressive_duplicates;
+    /// Packets dropped, indexed by the negated reason, e.g. drops[-HE_ERR_PLUGIN_DROP]
+    uint64_t drops[HE_STATS_MAX_REASONS];
+} he_stats_t;
+
+/// A thread's own counters, laid out like he_stats_t. The alignment pads the size to whole lines.
+typedef struct he_stats_block
+{
+    _Alignas(HE_STATS_CACHE_LINE) _Atomic uint64_t packets[HE_STATS_DIRECTIONS];
+    _Atomic uint64_t bytes[HE_STATS_DIRECTIONS];
+    _Atomic uint64_t aggressive_duplicates;
+    _Atomic uint64_t drops[HE_STATS_MAX_REASONS];
+    /// Next block in the list of every thread's block
+    struct he_stats_block *next;
+} he_stats_block_t;
+
+/// This thread's block, NULL until it first counts something
+extern HE_THREAD_LOCAL he_stats_block_t *he_thread_stats;
+
+/**
+ * @brief Allocate and register this thread's block
+ * @return The block, never NULL; if allocation fails counts go to a block nobody reads
+ */
+he_stats_block_t *he_internal_stats_register(void);
+
+// Only the owning thread writes a block, so a relaxed load and store is enough for readers on
+// other threads to never see a torn value. Neither compiles to a locked instruction.
+static inline void he_internal_stats_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline he_stats_block_t *he_internal_thread_stats(void)
+{
+    he_stats_block_t *stats = he_thread_stats;
+    return stats ? stats : he_internal_stats_register();
+}
+
+/**
+ * @brief Count a packet of length bytes going in the given direction
+ */
+static inline void he_internal_stats_packet(he_conn_t *conn, he_stats_direction_t direction,
+                                            size_t length)
+{
+    he_stats_block_t *stats = he_internal_thread_stats();
+    he_internal_stats_add(&stats->packets[direction], 1);
+    he_internal_stats_add(&stats->bytes[direction], length);
+    conn->stats.packets[direction]++;
+    conn->stats.bytes[direction] += length;
+}
+
+/**
+ * @brief Count count packets dropped because of reason
+ */
+static inline void he_internal_stats_drop(he_conn_t *conn, he_return_code_t reason, size_t count)
+{
+    he_stats_block_t *stats = he_internal_thread_stats();
+    size_t index = (size_t)(-(int)reason);
+    if (index < HE_STATS_MAX_REASONS)
+    {
+        he_internal_stats_add(&stats->drops[index], count);
+    }
+    conn->stats.dropped += count;
+}
+
+/**
+ * @brief Count extra copies of a record sent in aggressive mode
+ */
+static inline void he_internal_stats_duplicates(he_conn_t *conn, size_t count)
+{
+    he_stats_block_t *stats = he_internal_thread_stats();
+    he_internal_stats_add(&stats->aggressive_duplicates, count);
+    conn->stats.aggressive_duplicates += count;
+}
+
+/**
+ * @brief Get a copy of the counters of the calling thread
+ * @return HE_ERR_NULL_POINTER if stats is NULL
+ */
+he_return_code_t he_stats_get_thread(he_stats_t *stats);
+
+/**
+ * @brief Sum the counters of every thread that has used Helium
+ * @return HE_ERR_NULL_POINTER if stats is NULL
+ *
+ * Safe to call from any thread at any time. Counters are read one at a time while their threads
+ * keep going, so the totals are not a single point in time snapshot, but each counter is exact
+ * as of when it was read.
+ */
+he_return_code_t he_stats_get_global(he_stats_t *stats);
+
+#endif // STATS_H
@@ -0,0 +1,334 @@
+#include "timers.h"
+#include "conn.h"
+#include "core.h"
+
+#define HE_TIMERS_SLOT_MASK ((uint64_t)HE_TIMERS_SLOTS - 1)
+/// Ticks covered by the whole wheel, anything further out goes on the overflow list
+#define HE_TIMERS_WHEEL_MASK (((uint64_t)1 << (HE_TIMERS_SLOT_BITS * HE_TIMERS_LEVELS)) - 1)
+
+struct he_timers
+{
+    /// The last tick that has been processed
+    uint64_t current;
+    /// Bit s is set if slots[level][s] may hold timers. A connection unlinked without the wheel
+    /// (e.g. when it is destroyed) leaves its bit set until the wheel reaches the slot.
+    uint64_t occupied[HE_TIMERS_LEVELS];
+    he_conn_t *slots[HE_TIMERS_LEVELS][HE_TIMERS_SLOTS];
+    /// Timers beyond the top level, sorted back into the wheel each time the top level wraps
+    he_conn_t *overflow;
+};
+
+static inline unsigned int he_timers_lowest_bit(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_ctzll(bits);
+#else
+    unsigned int bit = 0;
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static void he_timers_insert(he_timers_t *timers, he_conn_t *conn)
+{
+    // A timer goes in the lowest level on which it shares every higher digit with the current
+    // tick. Its digit on that level is then always ahead of the current tick's, so it is reached
+    // before the level wraps and never lands in the slot being processed.
+    uint64_t diff = conn->timer_expires ^ timers->current;
+    he_conn_t **head = &timers->overflow;
+
+    for (unsigned int level = 0; level < HE_TIMERS_LEVELS; level++)
+    {
+        unsigned int shift = level * HE_TIMERS_SLOT_BITS;
+        if ((diff >> (shift + HE_TIMERS_SLOT_BITS)) == 0)
+        {
+            uint64_t slot = (conn->timer_expires >> shift) & HE_TIMERS_SLOT_MASK;
+            head = &timers->slots[level][slot];
+            timers->occupied[level] |= (uint64_t)1 << slot;
+            break;
+        }
+    }
+
+    conn->timer_next = *head;
+    if (*head)
+    {
+        (*head)->timer_pprev = &conn->timer_next;
+    }
+    conn->timer_pprev = head;
+    *head = conn;
+}
+
+static void he_timers_unlink(he_timers_t *timers, he_conn_t *conn)
+{
+    he_conn_t **pprev = conn->timer_pprev;
+    he_internal_timer_unlink(conn);
+
+    // Keep the occupancy bits exact when the last timer leaves a slot, so next_expiry doesn't
+    // point at an empty one
+    he_conn_t **first = &timers->slots[0][0];
+    if (pprev >= first && pprev < first + HE_TIMERS_LEVELS * HE_TIMERS_SLOTS && *pprev == NULL)
+    {
+        size_t index = (size_t)(pprev - first);
+        timers->occupied[index / HE_TIMERS_SLOTS] &= ~((uint64_t)1 << (index % HE_TIMERS_SLOTS));
+    }
+}
+
+static void he_timers_cascade(he_timers_t *timers, he_conn_t **head)
+{
+    he_conn_t *conn = *head;
+    *head = NULL;
+
+    while (conn)
+    {
+        he_conn_t *next = conn->timer_next;
+        he_timers_insert(timers, conn);
+        conn = next;
+    }
+}
+
+static size_t he_timers_tick(he_timers_t *timers)
+{
+    uint64_t tick = ++timers->current;
+
+    if ((tick & HE_TIMERS_WHEEL_MASK) == 0)
+    {
+        he_timers_cascade(timers, &timers->overflow);
+    }
+
+    // Reaching the start of a slot on an upper level sorts its timers into the levels below,
+    // top down so a timer can fall through several levels at once
+    for (unsigned int level = HE_TIMERS_LEVELS - 1; level > 0; level--)
+    {
+        unsigned int shift = level * HE_TIMERS_SLOT_BITS;
+        if (tick & (((uint64_t)1 << shift) - 1))
+        {
+            continue;
+        }
+
+        uint64_t slot = (tick >> shift) & HE_TIMERS_SLOT_MASK;
+        timers->occupied[level] &= ~((uint64_t)1 << slot);
+        he_timers_cascade(timers, &timers->slots[level][slot]);
+    }
+
+    uint64_t slot = tick & HE_TIMERS_SLOT_MASK;
+    he_conn_t **head = &timers->slots[0][slot];
+    size_t fired = 0;
+
+    // Take one at a time, a nudge can re-arm or cancel other timers. Re-armed timers always go
+    // into a later slot.
+    while (*head)
+    {
+        he_conn_t *conn = *head;
+        he_internal_timer_unlink(conn);
+        fired++;
+
+        if (he_conn_nudge(conn) != HE_SUCCESS)
+        {
+            he_internal_change_conn_state(conn, HE_STATE_DISCONNECTED);
+        }
+    }
+    timers->occupied[0] &= ~((uint64_t)1 << slot);
+
+    return fired;
+}
+
+he_timers_t *he_timers_create(uint64_t now_ms)
+{
+    he_timers_t *timers = calloc(1, sizeof(he_timers_t));
+    if (timers == NULL)
+    {
+        return NULL;
+    }
+
+    timers->current = now_ms;
+
+    return timers;
+}
+
+static void he_timers_release_list(he_conn_t *conn)
+{
+    while (conn)
+    {
+        he_conn_t *next = conn->timer_next;
+        conn->timer_next = NULL;
+        conn->timer_pprev = NULL;
+        conn->timers = NULL;
+        conn->is_nudge_timer_running = false;
+        conn = next;
+    }
+}
+
+void he_timers_destroy(he_timers_t *timers)
+{
+    if (timers == NULL)
+    {
+        return;
+    }
+
+    for (size_t level = 0; level < HE_TIMERS_LEVELS; level++)
+    {
+        for (size_t slot = 0; slot < HE_TIMERS_SLOTS; slot++)
+        {
+            he_timers_release_list(timers->slots[level][slot]);
+        }
+    }
+    he_timers_release_list(timers->overflow);
+
+    free(timers);
+}
+
+he_return_code_t he_timers_attach(he_timers_t *timers, he_conn_t *conn)
+{
+    if (timers == NULL || conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    if (conn->timers != timers)
+    {
+        he_timers_detach(conn);
+        conn->timers = timers;
+    }
+
+    return HE_SUCCESS;
+}
+
+void he_timers_detach(he_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    he_timers_cancel(conn);
+    conn->timers = NULL;
+}
+
+he_return_code_t he_timers_arm(he_conn_t *conn, uint64_t delay_ms)
+{
+    if (conn == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    he_timers_t *timers = conn->timers;
+    if (timers == NULL)
+    {
+        return HE_ERR_FAILED;
+    }
+
+    he_timers_unlink(timers, conn);
+
+    if (delay_ms == 0)
+    {
+        delay_ms = 1;
+    }
+    if (delay_ms > UINT64_MAX - timers->current)
+    {
+        delay_ms = UINT64_MAX - timers->current;
+    }
+
+    conn->timer_expires = timers->current + delay_ms;
+    he_timers_insert(timers, conn);
+
+    return HE_SUCCESS;
+}
+
+void he_timers_cancel(he_conn_t *conn)
+{
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    if (conn->timers)
+    {
+        he_timers_unlink(conn->timers, conn);
+    }
+    else
+    {
+        he_internal_timer_unlink(conn);
+    }
+    conn->is_nudge_timer_running = false;
+}
+
+size_t he_timers_advance(he_timers_t *timers, uint64_t now_ms)
+{
+    if (timers == NULL)
+    {
+        return 0;
+    }
+
+    size_t fired = 0;
+
+    while (timers->current < now_ms)
+    {
+        // Nothing happens on the ticks in between, skip straight to the next one that matters
+        uint64_t next = he_timers_next_expiry(timers);
+        if (next > now_ms)
+        {
+            timers->current = now_ms;
+            break;
+        }
+        timers->current = next - 1;
+
+        fired += he_timers_tick(timers);
+    }
+
+    return fired;
+}
+
+uint64_t he_timers_now(const he_timers_t *timers)
+{
+    return timers ? timers->current : 0;
+}
+
+uint64_t he_timers_next_expiry(he_timers_t *timers)
+{
+    if (timers == NULL)
+    {
+        return UINT64_MAX;
+    }
+
+    uint64_t next = UINT64_MAX;
+
+    for (unsigned int level = 0; level < HE_TIMERS_LEVELS; level++)
+    {
+        unsigned int shift = level * HE_TIMERS_SLOT_BITS;
+        uint64_t digit = (timers->current >> shift) & HE_TIMERS_SLOT_MASK;
+        if (digit == HE_TIMERS_SLOT_MASK)
+        {
+            continue;
+        }
+
+        // Only slots ahead of the current tick's digit can hold timers
+        uint64_t pending = timers->occupied[level] & (~(uint64_t)0 << (digit + 1));
+        if (!pending)
+        {
+            continue;
+        }
+
+        unsigned int upper = shift + HE_TIMERS_SLOT_BITS;
+        uint64_t at = ((timers->current >> upper) << upper) |
+                      ((uint64_t)he_timers_lowest_bit(pending) << shift);
+        if (at < next)
+        {
+            next = at;
+        }
+    }
+
+    if (timers->overflow)
+    {
+        uint64_t at = (timers->current | HE_TIMERS_WHEEL_MASK) + 1;
+        if (at < next)
+        {
+            next = at;
+        }
+    }
+
+    return next;
+}
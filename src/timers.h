@@ -0,0 +1,98 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include "he.h"
+
+/**
+ * @brief A hierarchical timer wheel driving the nudge timers of many connections
+ *
+ * Instead of the host keeping one timer per connection and calling he_conn_nudge() when each one
+ * goes off, connections attached to a wheel arm their D/TLS retransmit timer on it directly and
+ * the host makes a single he_timers_advance() call from its event loop. Expired connections are
+ * nudged together in that call.
+ *
+ * The wheel has HE_TIMERS_LEVELS levels of HE_TIMERS_SLOTS slots with a resolution of one
+ * millisecond. A timer sits in the lowest level whose range covers it and drops down a level each
+ * time the wheel turns past the slot it is in, so arming and cancelling are O(1) regardless of how
+ * many timers are armed. Timers further out than the top level covers wait on an overflow list.
+ *
+ * A wheel is not thread safe. Give each event loop thread its own wheel and only attach the
+ * connections that thread serves.
+ */
+typedef struct he_timers he_timers_t;
+
+#define HE_TIMERS_SLOT_BITS 6
+#define HE_TIMERS_SLOTS (1 << HE_TIMERS_SLOT_BITS)
+#define HE_TIMERS_LEVELS 4
+
+/**
+ * @brief Create a timer wheel
+ * @param now_ms The current time in milliseconds, from the clock later passed to
+ * he_timers_advance()
+ * @return A pointer to the wheel, or NULL if it could not be allocated
+ */
+he_timers_t *he_timers_create(uint64_t now_ms);
+
+/**
+ * @brief Free the wheel, detaching every connection still attached to it
+ *
+ * Only connections with an armed timer are known to the wheel. Connections attached but not
+ * armed keep a dangling pointer and must be detached or destroyed first.
+ */
+void he_timers_destroy(he_timers_t *timers);
+
+/**
+ * @brief Attach a connection so its nudge timer is armed on the wheel
+ * @return HE_SUCCESS if the connection was attached
+ * @return HE_ERR_NULL_POINTER if timers or conn is NULL
+ *
+ * An attached connection never calls its nudge_time_cb.
+ */
+he_return_code_t he_timers_attach(he_timers_t *timers, he_conn_t *conn);
+
+/**
+ * @brief Cancel the connection's timer and go back to using its nudge_time_cb
+ */
+void he_timers_detach(he_conn_t *conn);
+
+/**
+ * @brief Arm, or re-arm, the connection's timer to go off after delay_ms
+ * @return HE_SUCCESS if the timer was armed
+ * @return HE_ERR_NULL_POINTER if conn is NULL
+ * @return HE_ERR_FAILED if the connection is not attached to a wheel
+ *
+ * A delay of 0 goes off on the next tick.
+ */
+he_return_code_t he_timers_arm(he_conn_t *conn, uint64_t delay_ms);
+
+/**
+ * @brief Cancel the connection's timer if it is armed
+ */
+void he_timers_cancel(he_conn_t *conn);
+
+/**
+ * @brief Move the wheel forward to now_ms and nudge every connection whose timer expired
+ * @return The number of connections nudged
+ *
+ * A connection whose nudge fails is moved to HE_STATE_DISCONNECTED, so the host finds out through
+ * its state change callback.
+ */
+size_t he_timers_advance(he_timers_t *timers, uint64_t now_ms);
+
+/**
+ * @brief Get the time the wheel has been advanced to, in milliseconds
+ *
+ * While he_timers_advance() nudges a connection this is the tick its timer was armed for.
+ */
+uint64_t he_timers_now(const he_timers_t *timers);
+
+/**
+ * @brief Get the earliest time he_timers_advance() may have work to do
+ * @return The time in milliseconds, or UINT64_MAX if no timers are armed
+ *
+ * Timers on the upper levels are only reported to the start of their slot, so this can be
+ * earlier than the next expiry but never later. It is meant for an event loop's poll timeout.
+ */
+uint64_t he_timers_next_expiry(he_timers_t *timers);
+
+#endif // TIMERS_H
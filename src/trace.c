@@ -0,0 +1,156 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Atomic bool he_trace_enabled = false;
+
+HE_THREAD_LOCAL he_trace_ring_t *he_thread_trace = NULL;
+
+static pthread_mutex_t he_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static he_trace_ring_t *he_trace_rings = NULL;
+static uint32_t he_trace_num_rings = 0;
+
+// Taken when recording is first enabled, paired with a second reading at dump time
+static uint64_t he_trace_start_ticks = 0;
+static uint64_t he_trace_start_ns = 0;
+
+static uint64_t he_trace_monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+he_trace_ring_t *he_internal_trace_register(void)
+{
+    // Once is enough, don't retry an allocation that failed on every tracepoint
+    static HE_THREAD_LOCAL bool failed = false;
+    if (failed)
+    {
+        return NULL;
+    }
+
+    he_trace_ring_t *ring = calloc(1, sizeof(he_trace_ring_t));
+    if (ring == NULL)
+    {
+        failed = true;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&he_trace_lock);
+    ring->thread = he_trace_num_rings++;
+    ring->next = he_trace_rings;
+    he_trace_rings = ring;
+    pthread_mutex_unlock(&he_trace_lock);
+
+    he_thread_trace = ring;
+    return ring;
+}
+
+void he_trace_set_enabled(bool enabled)
+{
+    pthread_mutex_lock(&he_trace_lock);
+    if (enabled && he_trace_start_ns == 0)
+    {
+        he_trace_start_ticks = he_trace_now();
+        he_trace_start_ns = he_trace_monotonic_ns();
+    }
+    pthread_mutex_unlock(&he_trace_lock);
+
+    atomic_store_explicit(&he_trace_enabled, enabled, memory_order_relaxed);
+}
+
+/**
+ * @brief Copy the records still in a ring, oldest first
+ * @return How many records were copied
+ */
+static size_t he_trace_copy_ring(he_trace_ring_t *ring, he_trace_record_t *records)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head > HE_TRACE_RING_RECORDS ? head - HE_TRACE_RING_RECORDS : 0;
+
+    for (uint64_t i = first; i < head; i++)
+    {
+        records[i - first] = ring->records[i & (HE_TRACE_RING_RECORDS - 1)];
+    }
+
+    // The owner kept going while we copied. Whatever it started writing since (including the
+    // record it may be halfway through) took the slot of the record HE_TRACE_RING_RECORDS
+    // older, so those are no good.
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = after >= HE_TRACE_RING_RECORDS ? after - HE_TRACE_RING_RECORDS + 1 : 0;
+    if (valid <= first)
+    {
+        return (size_t)(head - first);
+    }
+    if (valid >= head)
+    {
+        return 0;
+    }
+
+    size_t skip = (size_t)(valid - first);
+    memmove(records, records + skip, (size_t)(head - valid) * sizeof(he_trace_record_t));
+    return (size_t)(head - valid);
+}
+
+he_return_code_t he_trace_dump(FILE *file)
+{
+    if (file == NULL)
+    {
+        return HE_ERR_NULL_POINTER;
+    }
+
+    he_trace_record_t *records = malloc(HE_TRACE_RING_RECORDS * sizeof(he_trace_record_t));
+    if (records == NULL)
+    {
+        return HE_ERR_NO_MEMORY;
+    }
+
+    he_return_code_t ret = HE_SUCCESS;
+
+    pthread_mutex_lock(&he_trace_lock);
+
+    he_trace_dump_header_t header = {0};
+    memcpy(header.magic, HE_TRACE_DUMP_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(he_trace_record_t);
+    header.num_threads = he_trace_num_rings;
+    header.start_ticks = he_trace_start_ticks;
+    header.start_ns = he_trace_start_ns;
+    header.dump_ticks = he_trace_now();
+    header.dump_ns = he_trace_monotonic_ns();
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        ret = HE_ERR_FAILED;
+    }
+
+    for (he_trace_ring_t *ring = he_trace_rings; ring != NULL && ret == HE_SUCCESS;
+         ring = ring->next)
+    {
+        he_trace_dump_thread_t thread = {0};
+        thread.thread = ring->thread;
+        thread.num_records = (uint32_t)he_trace_copy_ring(ring, records);
+
+        if (fwrite(&thread, sizeof(thread), 1, file) != 1 ||
+            fwrite(records, sizeof(he_trace_record_t), thread.num_records, file) !=
+                thread.num_records)
+        {
+            ret = HE_ERR_FAILED;
+        }
+    }
+
+    pthread_mutex_unlock(&he_trace_lock);
+
+    free(records);
+
+    if (ret == HE_SUCCESS && fflush(file) != 0)
+    {
+        ret = HE_ERR_FAILED;
+    }
+
+    return ret;
+}
@@ -0,0 +1,222 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "he.h"
+#include "core.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/**
+ * Tracepoints on the data path
+ *
+ * Built with HE_ENABLE_TRACE defined, each HE_TRACE_BEGIN() / HE_TRACE_END() pair records when a
+ * packet entered and left a stage. Without it they compile to nothing and their arguments are
+ * never evaluated.
+ *
+ * Records go into a ring owned by the recording thread. It is written with plain stores and a
+ * single release store of the head, so recording takes no lock and touches no shared cache
+ * line. Once full, the oldest records are overwritten. Even when compiled in, nothing is
+ * recorded until he_trace_set_enabled() is called, so a build with tracepoints can be shipped
+ * everywhere and switched on for a few hosts at a time.
+ *
+ * he_trace_dump() writes every thread's ring to a file that tools/he_trace_dump turns into a
+ * Chrome trace or folded stacks for a flame graph.
+ */
+
+/// Records kept per thread, must be a power of two. 32 bytes each.
+#ifndef HE_TRACE_RING_RECORDS
+#define HE_TRACE_RING_RECORDS 16384
+#endif
+
+/// Where a packet is, stages nest e.g. a dtls read happens inside a decrypt
+typedef enum he_trace_stage
+{
+    /// he_conn_outside_data_received() and its batched variant (length is then the datagram
+    /// count), the whole receive
+    HE_TRACE_OUTSIDE_RECEIVE = 0,
+    /// wolfSSL_read(), decrypting a record
+    HE_TRACE_DECRYPT = 1,
+    /// he_wolf_dtls_read(), handing a datagram to wolfSSL
+    HE_TRACE_DTLS_READ = 2,
+    /// A single ingress plugin, index is its position in the chain
+    HE_TRACE_PLUGIN_INGRESS = 3,
+    /// A single egress plugin, index is its position in the chain
+    HE_TRACE_PLUGIN_EGRESS = 4,
+    /// The inside write callbacks, length is the packet count when delivering a batch
+    HE_TRACE_INSIDE_WRITE = 5,
+    /// he_conn_inside_packet_received(), the whole send
+    HE_TRACE_INSIDE_RECEIVE = 6,
+    /// wolfSSL_write(), encrypting a packet
+    HE_TRACE_ENCRYPT = 7,
+    /// he_wolf_dtls_write(), framing a record for the outside
+    HE_TRACE_DTLS_WRITE = 8,
+    /// The outside write callbacks, length is the datagram count when flushing a batch
+    HE_TRACE_OUTSIDE_WRITE = 9,
+    HE_TRACE_STAGES = 10
+} he_trace_stage_t;
+
+typedef enum he_trace_event
+{
+    HE_TRACE_EVENT_BEGIN = 0,
+    HE_TRACE_EVENT_END = 1,
+} he_trace_event_t;
+
+/// One tracepoint as stored in the ring and in dumps
+typedef struct he_trace_record
+{
+    /// Ticks of the clock read by he_trace_now()
+    uint64_t timestamp;
+    /// Session ID of the connection, 0 where the stage doesn't know it
+    uint64_t session;
+    /// Packet length in bytes at this point, see he_trace_stage_t for exceptions
+    uint32_t length;
+    /// What the stage returned, 0 on begin
+    int32_t rc;
+    uint8_t stage;
+    uint8_t event;
+    /// Plugin position for plugin stages
+    uint16_t index;
+    uint32_t reserved;
+} he_trace_record_t;
+
+typedef struct he_trace_ring
+{
+    /// Records written so far, the newest is at (head - 1) % HE_TRACE_RING_RECORDS
+    _Atomic uint64_t head;
+    /// Order the thread first recorded in, stands in for a thread ID in dumps
+    uint32_t thread;
+    /// Next ring in the list of every thread's ring
+    struct he_trace_ring *next;
+    he_trace_record_t records[HE_TRACE_RING_RECORDS];
+} he_trace_ring_t;
+
+/// Set by he_trace_set_enabled()
+extern _Atomic bool he_trace_enabled;
+
+/// This thread's ring, NULL until it first records something
+extern HE_THREAD_LOCAL he_trace_ring_t *he_thread_trace;
+
+/**
+ * @brief Allocate and register this thread's ring
+ * @return The ring, or NULL if it couldn't be allocated in which case nothing is recorded
+ */
+he_trace_ring_t *he_internal_trace_register(void);
+
+/**
+ * @brief Read the clock tracepoints are stamped with
+ *
+ * The TSC on x86, the virtual counter on AArch64, nanoseconds of the monotonic clock elsewhere.
+ * Dumps carry what it takes to turn ticks into time.
+ */
+static inline uint64_t he_trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Record a tracepoint, called through the HE_TRACE_ macros
+ */
+static inline void he_internal_trace(uint64_t session, he_trace_stage_t stage,
+                                     he_trace_event_t event, size_t index, size_t length,
+                                     int rc)
+{
+    if (!atomic_load_explicit(&he_trace_enabled, memory_order_relaxed))
+    {
+        return;
+    }
+
+    he_trace_ring_t *ring = he_thread_trace;
+    if (ring == NULL && (ring = he_internal_trace_register()) == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    he_trace_record_t *record = &ring->records[head & (HE_TRACE_RING_RECORDS - 1)];
+    record->timestamp = he_trace_now();
+    record->session = session;
+    record->length = (uint32_t)length;
+    record->rc = rc;
+    record->stage = (uint8_t)stage;
+    record->event = (uint8_t)event;
+    record->index = (uint16_t)index;
+    record->reserved = 0;
+
+    // Publishes the record to he_trace_dump()
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#ifdef HE_ENABLE_TRACE
+#define HE_TRACE_BEGIN(session, stage, index, length) \
+    he_internal_trace((session), (stage), HE_TRACE_EVENT_BEGIN, (index), (length), 0)
+#define HE_TRACE_END(session, stage, index, length, rc) \
+    he_internal_trace((session), (stage), HE_TRACE_EVENT_END, (index), (length), (int)(rc))
+#else
+#define HE_TRACE_BEGIN(session, stage, index, length) ((void)0)
+#define HE_TRACE_END(session, stage, index, length, rc) ((void)0)
+#endif
+
+/**
+ * @brief Start or stop recording on every thread
+ *
+ * Only has an effect on tracepoints compiled in with HE_ENABLE_TRACE. Each thread allocates
+ * its ring the first time it records.
+ */
+void he_trace_set_enabled(bool enabled);
+
+/**
+ * @brief Write what is in every thread's ring to a file
+ * @return HE_SUCCESS if the dump was written
+ * @return HE_ERR_NULL_POINTER if file is NULL
+ * @return HE_ERR_NO_MEMORY if there was no room to copy a ring into
+ * @return HE_ERR_FAILED if writing failed
+ *
+ * Safe to call while threads keep recording. Up to the newest HE_TRACE_RING_RECORDS - 1 records
+ * of each thread are dumped: the slot after the newest may be being overwritten at any moment,
+ * as may any other the owner reaches while the ring is copied, so those are left out rather
+ * than dumped half written.
+ *
+ * The format is a he_trace_dump_header_t followed by, for each thread, a
+ * he_trace_dump_thread_t and its records oldest first. Everything is in host byte order.
+ */
+he_return_code_t he_trace_dump(FILE *file);
+
+#define HE_TRACE_DUMP_MAGIC "HETRACE1"
+
+typedef struct he_trace_dump_header
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t num_threads;
+    /// The clock in ticks and in monotonic nanoseconds when recording was first enabled ...
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    /// ... and when the dump was taken, between them they give the tick rate
+    uint64_t dump_ticks;
+    uint64_t dump_ns;
+} he_trace_dump_header_t;
+
+typedef struct he_trace_dump_thread
+{
+    uint32_t thread;
+    uint32_t num_records;
+} he_trace_dump_thread_t;
+
+#endif // TRACE_H
@@ -1,28 +1,54 @@
 #include "he.h"
 #include "wolf.h"
 #include "plugin_chain.h"
+#include "conn_template.h"
+#include "core.h"
+#include "fec.h"
+#include "stats.h"
+#include "trace.h"
 
-int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
-  (void)ssl; /* will not need ssl context */
-
-  if(sz < 0) {
-    // Should never ever happen but we'll just abort
-    return WOLFSSL_CBIO_ERR_GENERAL;
+static int he_wolf_stream_read(he_conn_t *conn, char *buf, int sz) {
+  // Nothing left in the caller's buffer, tell wolfSSL to stop asking
+  if(conn->incoming_data_left_to_read == 0) {
+    return WOLFSSL_CBIO_ERR_WANT_READ;
   }
 
-  // Abort if any of the IO buffers are null pointers
-  if(!buf || !ctx) {
-    return WOLFSSL_CBIO_ERR_GENERAL;
+  // Serve wolfSSL straight from the caller's buffer at the current offset. A TLS record may
+  // be split across reads, wolfSSL keeps whatever it has already been given and asks again
+  // once more data arrives.
+  size_t length = conn->incoming_data_left_to_read;
+  if(length > (size_t)sz) {
+    length = (size_t)sz;
   }
 
-  // Get DTLS context
-  he_conn_t *conn = (he_conn_t *)ctx;
+  memcpy(buf, conn->incoming_data_read_offset_ptr, length);
+  conn->incoming_data_read_offset_ptr += length;
+  conn->incoming_data_left_to_read -= length;
 
-  // This can be null if no data has been received yet, tell wolfSSL to stop asking
-  if(!conn->incoming_data) {
-    return WOLFSSL_CBIO_ERR_WANT_READ;
+  return (int)length;
+}
+
+static int he_wolf_queue_read(he_conn_t *conn, char *buf, int sz) {
+  // Each call hands wolfSSL the next datagram in the queue, exactly as if they had arrived one
+  // by one
+  while(conn->incoming_queue_index < conn->incoming_queue_count) {
+    size_t index = conn->incoming_queue_index++;
+    size_t length = conn->incoming_queue_lengths[index];
+
+    if(length > (size_t)sz) {
+      // Can't be split, drop it and move on to the next one
+      he_internal_stats_drop(conn, HE_ERR_PACKET_TOO_LARGE, 1);
+      continue;
+    }
+
+    memcpy(buf, conn->incoming_queue[index], length);
+    return (int)length;
   }
 
+  return WOLFSSL_CBIO_ERR_WANT_READ;
+}
+
+static int he_wolf_datagram_read(he_conn_t *conn, char *buf, int sz) {
   // WolfSSL will call this function any time it wants to read. As we're using libuv
   // there will only ever be one packet per callback. WolfSSL will call this function
   // any time it wants to read, it doesn't know there's only ever one, so we need to
@@ -36,6 +62,7 @@ int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   // Check that we have enough space to write the packet
   if(conn->incoming_data_length > sz) {
     // We can't write this packet and split it - have to drop
+    he_internal_stats_drop(conn, HE_ERR_PACKET_TOO_LARGE, 1);
     conn->packet_seen = true;
     return 0;
   }
@@ -49,7 +76,7 @@ int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   return (int)conn->incoming_data_length;
 }
 
-int he_wolf_dtls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
+int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   (void)ssl; /* will not need ssl context */
 
   if(sz < 0) {
@@ -65,57 +92,318 @@ int he_wolf_dtls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
   // Get DTLS context
   he_conn_t *conn = (he_conn_t *)ctx;
 
-  // Check we have enough space
-  // @TODO: Take MTU settings into account
-  if(sz + sizeof(he_wire_hdr_t) > sizeof(conn->write_buffer)) {
+  // This can be null if no data has been received yet, tell wolfSSL to stop asking
+  if(!conn->incoming_queue && !conn->incoming_data) {
+    return WOLFSSL_CBIO_ERR_WANT_READ;
+  }
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_DTLS_READ, 0, sz);
+
+  int res;
+  if(conn->incoming_queue) {
+    // Batched receives queue several datagrams instead of setting incoming_data
+    res = he_wolf_queue_read(conn, buf, sz);
+  } else if(he_internal_settings(conn)->connection_type == HE_CONNECTION_TYPE_STREAM) {
+    res = he_wolf_stream_read(conn, buf, sz);
+  } else {
+    res = he_wolf_datagram_read(conn, buf, sz);
+  }
+
+  HE_TRACE_END(conn->session_id, HE_TRACE_DTLS_READ, 0, res > 0 ? res : 0, res);
+
+  return res;
+}
+
+// Datagrams carry the wire header in front of the record, streams carry wolfSSL's bytes as they
+// are (hdr is NULL)
+static inline size_t he_wolf_header_length(const he_wire_hdr_t *hdr) {
+  return hdr ? sizeof(he_wire_hdr_t) : 0;
+}
+
+// Datagrams are sent three times while connecting or in aggressive mode. Over a stream the
+// copies would land in the TLS byte stream and corrupt it.
+static inline bool he_wolf_send_duplicates(const he_conn_t *conn, const he_wire_hdr_t *hdr) {
+  return hdr &&
+         (conn->state != HE_STATE_ONLINE || he_internal_settings(conn)->use_aggressive_mode);
+}
+
+static int he_wolf_dtls_write_gather(he_conn_t *conn, const he_wire_hdr_t *hdr, char *buf,
+                                     int sz) {
+  const he_conn_settings_t *settings = he_internal_settings(conn);
+  size_t hdr_length = he_wolf_header_length(hdr);
+
+  if(sz + hdr_length > HE_MAX_WIRE_MTU) {
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, sz + hdr_length);
+  he_return_code_t res =
+      settings->outside_write_gather_cb(conn, (const uint8_t *)hdr, hdr_length,
+                                        (const uint8_t *)buf, (size_t)sz, conn->data);
+  HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, sz + hdr_length, res);
+  if(res != HE_SUCCESS) {
+    he_internal_stats_drop(conn, HE_ERR_CALLBACK_FAILED, 1);
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  he_internal_stats_packet(conn, HE_STATS_OUTSIDE_OUT, sz + hdr_length);
+
+  // Same best effort aggressive resend policy as the copying path
+  if(he_wolf_send_duplicates(conn, hdr)) {
+    he_internal_stats_duplicates(conn, 2);
+    (void)settings->outside_write_gather_cb(conn, (const uint8_t *)hdr, hdr_length,
+                                            (const uint8_t *)buf, (size_t)sz, conn->data);
+    (void)settings->outside_write_gather_cb(conn, (const uint8_t *)hdr, hdr_length,
+                                            (const uint8_t *)buf, (size_t)sz, conn->data);
+  }
+
+  return sz;
+}
+
+static int he_wolf_dtls_write_batch(he_conn_t *conn, const he_wire_hdr_t *hdr, char *buf,
+                                    int sz) {
+  he_outside_write_batch_t *batch = he_internal_get_outside_write_batch();
+  size_t hdr_length = he_wolf_header_length(hdr);
+
+  if(sz + hdr_length > HE_MAX_WIRE_MTU) {
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  // A callback sending on this connection while another's records are queued, e.g. a server
+  // forwarding between clients. Those go out first, they are that connection's to send.
+  if(batch->conn && batch->conn != conn) {
+    (void)he_internal_flush_outside_writes(batch->conn);
+  }
+
+  // Make room if the queue is full
+  if(batch->num_buffers == HE_OUTSIDE_WRITE_BATCH_SIZE) {
+    if(he_internal_flush_outside_writes(conn) != HE_SUCCESS) {
+      return WOLFSSL_CBIO_ERR_GENERAL;
+    }
+  }
+
+  // wolfSSL will reuse buf as soon as we return so the record has to be copied, build it
+  // straight into its queue slot
+  uint8_t *packet = batch->buffers[batch->num_buffers];
+  if(hdr) {
+    memcpy(packet, hdr, hdr_length);
+  }
+  memcpy(packet + hdr_length, buf, sz);
+
+  size_t post_plugin_length = sz + hdr_length;
+  he_return_code_t res =
+      he_plugin_egress(conn->outside_plugins, packet, &post_plugin_length, HE_MAX_WIRE_MTU);
+
+  if(res == HE_ERR_PLUGIN_DROP) {
+    he_internal_stats_drop(conn, HE_ERR_PLUGIN_DROP, 1);
+    return sz;
+  } else if(res != HE_SUCCESS || post_plugin_length > HE_MAX_WIRE_MTU) {
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  // Counted once the batch is flushed, see he_internal_flush_outside_writes
+  batch->conn = conn;
+  batch->num_buffers++;
+
+  // Aggressive duplicates share the queued record rather than being copied again
+  int copies = he_wolf_send_duplicates(conn, hdr) ? 3 : 1;
+  for(int i = 0; i < copies; i++) {
+    batch->datagrams[batch->num_datagrams].packet = packet;
+    batch->datagrams[batch->num_datagrams].length = post_plugin_length;
+    batch->num_datagrams++;
+  }
+
+  // Outside of an input burst (e.g. sending an inside packet) there is nothing to wait for
+  if(!conn->in_input_burst && he_internal_flush_outside_writes(conn) != HE_SUCCESS) {
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  return sz;
+}
+
+// Set while a copying write on this thread is using the write scratch
+static HE_THREAD_LOCAL bool he_wolf_write_scratch_busy;
+
+static int he_wolf_dtls_write_copy_into(he_conn_t *conn, const he_wire_hdr_t *hdr, char *buf,
+                                        int sz, uint8_t *write_buffer) {
+  size_t hdr_length = he_wolf_header_length(hdr);
+
+  // Check we have enough space. Path MTU discovery keeps records within the path with
+  // wolfSSL_dtls_set_mtu(), this only guards the buffer.
+  if(sz + hdr_length > HE_MAX_WIRE_MTU) {
     // We have to drop the packet as we can never send it (in theory this should never happen
     // due to earlier constraints)
     return WOLFSSL_CBIO_ERR_GENERAL;
   }
 
   // Initialise the write buffer
-  he_internal_write_packet_header(conn, (he_wire_hdr_t *)conn->write_buffer);
+  if(hdr) {
+    memcpy(write_buffer, hdr, hdr_length);
+  }
 
   // Copy in the data behind the header
-  // TODO Actively investigating why the analyzer thinks that conn->write_buffer is not the same
-  // as &conn->write_buffer[0]
-  memcpy((&conn->write_buffer[0]) + sizeof(he_wire_hdr_t), buf, sz);
+  memcpy(write_buffer + hdr_length, buf, sz);
 
-  // Note that the parallel call to ingress is in conn.c:he_internal_outside_data_received
-  size_t post_plugin_length = sz + sizeof(he_wire_hdr_t);
-  he_return_code_t res = he_plugin_egress(conn->outside_plugins, &conn->write_buffer[0],
-                                          &post_plugin_length, sizeof(conn->write_buffer));
+  // Note that the parallel call to ingress is in conn.c:he_conn_outside_data_received
+  size_t post_plugin_length = sz + hdr_length;
+  he_return_code_t res = he_plugin_egress(conn->outside_plugins, write_buffer,
+                                          &post_plugin_length, HE_MAX_WIRE_MTU);
 
   if(res == HE_ERR_PLUGIN_DROP) {
     // Plugin said to drop it, we drop it
     // Parallel to returning HE_SUCCESS on ingress
+    he_internal_stats_drop(conn, HE_ERR_PLUGIN_DROP, 1);
     return sz;
-  } else if(res != HE_SUCCESS || post_plugin_length > sizeof(conn->write_buffer)) {
+  } else if(res != HE_SUCCESS || post_plugin_length > HE_MAX_WIRE_MTU) {
     return WOLFSSL_CBIO_ERR_GENERAL;
   }
 
+  const he_conn_settings_t *settings = he_internal_settings(conn);
+  if(settings->outside_write_batch_cb) {
+    // Only reached when the batch callback causes a write, the record and its duplicates go to
+    // it in a batch of their own
+    he_outside_datagram_t datagrams[3];
+    size_t copies = he_wolf_send_duplicates(conn, hdr) ? 3 : 1;
+    for(size_t i = 0; i < copies; i++) {
+      datagrams[i].packet = write_buffer;
+      datagrams[i].length = post_plugin_length;
+    }
+
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, copies);
+    res = settings->outside_write_batch_cb(conn, datagrams, copies, conn->data);
+    HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, copies, res);
+    if(res != HE_SUCCESS) {
+      he_internal_stats_drop(conn, HE_ERR_CALLBACK_FAILED, 1);
+      return WOLFSSL_CBIO_ERR_GENERAL;
+    }
+
+    he_internal_stats_packet(conn, HE_STATS_OUTSIDE_OUT, post_plugin_length);
+    he_internal_stats_duplicates(conn, copies - 1);
+    return sz;
+  }
+
   // Call the write callback if set
-  if(conn->outside_write_cb) {
-    res = conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
+  if(settings->outside_write_cb) {
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, post_plugin_length);
+    res = settings->outside_write_cb(conn, write_buffer, post_plugin_length, conn->data);
+    HE_TRACE_END(conn->session_id, HE_TRACE_OUTSIDE_WRITE, 0, post_plugin_length, res);
     if(res != HE_SUCCESS) {
+      he_internal_stats_drop(conn, HE_ERR_CALLBACK_FAILED, 1);
       return WOLFSSL_CBIO_ERR_GENERAL;
     }
 
+    he_internal_stats_packet(conn, HE_STATS_OUTSIDE_OUT, post_plugin_length);
+
     // If we're not yet connected, be aggressive and send two more packets. If aggressive mode
     // is set, always be aggressive and send two more.
-    if(conn->state != HE_STATE_ONLINE || conn->use_aggressive_mode) {
-      conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
-      if(res != HE_SUCCESS) {
-        return WOLFSSL_CBIO_ERR_GENERAL;
-      }
-
-      conn->outside_write_cb(conn, conn->write_buffer, post_plugin_length, conn->data);
-      if(res != HE_SUCCESS) {
-        return WOLFSSL_CBIO_ERR_GENERAL;
-      }
+    // The duplicates are best effort: the record has already gone out once, so a failure here
+    // must not be reported to wolfSSL as a failed write.
+    if(he_wolf_send_duplicates(conn, hdr)) {
+      he_internal_stats_duplicates(conn, 2);
+      (void)settings->outside_write_cb(conn, write_buffer, post_plugin_length, conn->data);
+      (void)settings->outside_write_cb(conn, write_buffer, post_plugin_length, conn->data);
     }
   }
 
   // Return the size written
   return sz;
 }
+
+static int he_wolf_dtls_write_copy(he_conn_t *conn, const he_wire_hdr_t *hdr, char *buf,
+                                   int sz) {
+  // Connections don't carry their own write buffer, they borrow the thread's for the duration of
+  // the call. An outside write callback that sends on another connection re-enters here while
+  // the scratch still holds the record it is about to be called with again for the duplicates,
+  // so the nested write uses a buffer of its own.
+  if(he_wolf_write_scratch_busy) {
+    uint8_t write_buffer[HE_MAX_WIRE_MTU];
+    return he_wolf_dtls_write_copy_into(conn, hdr, buf, sz, write_buffer);
+  }
+
+  he_wolf_write_scratch_busy = true;
+  int res = he_wolf_dtls_write_copy_into(conn, hdr, buf, sz, he_internal_get_write_scratch());
+  he_wolf_write_scratch_busy = false;
+
+  return res;
+}
+
+static int he_wolf_dtls_send(he_conn_t *conn, const he_wire_hdr_t *hdr, char *buf, int sz) {
+  const he_conn_settings_t *settings = he_internal_settings(conn);
+
+  if(settings->outside_write_batch_cb) {
+    // The thread's queue is with the batch callback, which is sending on this thread right now
+    if(he_internal_get_outside_write_batch()->flushing) {
+      return he_wolf_dtls_write_copy(conn, hdr, buf, sz);
+    }
+    return he_wolf_dtls_write_batch(conn, hdr, buf, sz);
+  } else if(settings->outside_write_gather_cb &&
+            (!conn->outside_plugins || conn->outside_plugins->num_egress == 0)) {
+    // Without outside egress plugins nothing needs the packet in one contiguous buffer, so
+    // hand the header and wolfSSL's ciphertext to the gather callback as they are
+    return he_wolf_dtls_write_gather(conn, hdr, buf, sz);
+  } else {
+    return he_wolf_dtls_write_copy(conn, hdr, buf, sz);
+  }
+}
+
+int he_wolf_dtls_write(WOLFSSL *ssl, char *buf, int sz, void *ctx) {
+  (void)ssl; /* will not need ssl context */
+
+  if(sz < 0) {
+    // Should never ever happen but we'll just abort
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  // Abort if any of the IO buffers are null pointers
+  if(!buf || !ctx) {
+    return WOLFSSL_CBIO_ERR_GENERAL;
+  }
+
+  // Get DTLS context
+  he_conn_t *conn = (he_conn_t *)ctx;
+
+  if(he_internal_settings(conn)->connection_type == HE_CONNECTION_TYPE_STREAM) {
+    // The peer reads TLS records straight off the stream, so no wire header, no duplicates and
+    // no FEC. A stream can be cut anywhere, wolfSSL sends whatever is left in another call.
+    if(sz > HE_MAX_WIRE_MTU) {
+      sz = HE_MAX_WIRE_MTU;
+    }
+
+    HE_TRACE_BEGIN(conn->session_id, HE_TRACE_DTLS_WRITE, 0, sz);
+    int res = he_wolf_dtls_send(conn, NULL, buf, sz);
+    HE_TRACE_END(conn->session_id, HE_TRACE_DTLS_WRITE, 0, res > 0 ? res : 0, res);
+
+    return res;
+  }
+
+  const he_wire_hdr_t *hdr = he_internal_get_wire_header(conn);
+
+  // With FEC on, every record carries its place in a parity group in a copy of the header
+  he_wire_hdr_t fec_hdr;
+  bool fec_protected = false;
+  if(conn->fec) {
+    fec_hdr = *hdr;
+    fec_protected = he_internal_fec_stamp(conn, &fec_hdr);
+    hdr = &fec_hdr;
+  }
+
+  HE_TRACE_BEGIN(conn->session_id, HE_TRACE_DTLS_WRITE, 0, sz);
+
+  int res = he_wolf_dtls_send(conn, hdr, buf, sz);
+
+  if(fec_protected && res > 0) {
+    // Once the group is complete its parity follows it out. That is best effort like the
+    // aggressive duplicates, the records themselves have already gone.
+    he_wire_hdr_t parity_hdr;
+    const uint8_t *parity = NULL;
+    size_t parity_length =
+        he_internal_fec_add(conn, &fec_hdr, (const uint8_t *)buf, (size_t)sz, &parity_hdr, &parity);
+    if(parity_length) {
+      (void)he_wolf_dtls_send(conn, &parity_hdr, (char *)parity, (int)parity_length);
+    }
+  }
+
+  HE_TRACE_END(conn->session_id, HE_TRACE_DTLS_WRITE, 0, res > 0 ? res : 0, res);
+
+  return res;
+}
@@ -22,8 +22,11 @@
  *
  * This function simply copies data to WolfSSL's buffer and returns
  *
- * @note This function will be called twice per packet. This function will return
- * WOLFSSL_CBIO_ERR_WANT_READ on the second call.
+ * @note In datagram mode this function will be called twice per packet. This function will
+ * return WOLFSSL_CBIO_ERR_WANT_READ on the second call.
+ *
+ * @note In stream mode the data is served from incoming_data_read_offset_ptr, up to sz bytes
+ * at a time, until incoming_data_left_to_read reaches zero.
  *
  */
 int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx);
@@ -39,7 +42,9 @@ int he_wolf_dtls_read(WOLFSSL *ssl, char *buf, int sz, void *ctx);
  * Helium does not know about sockets and as such, neither can WolfSSL. Helium
  * overrides the standard socket calls with its own callback functions.
  *
- * This function simply calls the user provided write callback
+ * This function simply calls the user provided write callback. If a gather write callback is set
+ * and no outside plugin needs to see egress packets, the cached wire header and wolfSSL's own
+ * buffer are passed to it directly and no copy is made.
  *
  * @note The buffer is only valid until this function returns. As such the user provided write
  * callback must copy the data from the buffer if it needs it to persist after that time.
@@ -0,0 +1,168 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "classify.h"
+
+he_classified_burst_t burst;
+uint8_t storage[HE_CLASSIFY_MAX_BURST + 8][sizeof(he_wire_hdr_t) + 20];
+const uint8_t *packets[HE_CLASSIFY_MAX_BURST + 8];
+size_t lengths[HE_CLASSIFY_MAX_BURST + 8];
+
+static void make_packet(size_t i, uint8_t major_version, uint64_t session)
+{
+    he_wire_hdr_t hdr = {{'H', 'e'}, major_version, 0};
+    hdr.session = session;
+
+    // Off by one byte so the headers are misaligned, as they may be in a receive buffer
+    memcpy(storage[i] + 1, &hdr, sizeof(hdr));
+    packets[i] = storage[i] + 1;
+    lengths[i] = sizeof(hdr) + 10;
+}
+
+void setUp(void)
+{
+    memset(&burst, 0, sizeof(burst));
+    memset(storage, 0, sizeof(storage));
+}
+
+void tearDown(void)
+{
+}
+
+void test_valid_datagrams_are_grouped_by_session(void)
+{
+    make_packet(0, 1, 0xaaaa);
+    make_packet(1, 1, 0xbbbb);
+    make_packet(2, 1, 0xaaaa);
+    make_packet(3, 1, 0xcccc);
+    make_packet(4, 1, 0xbbbb);
+
+    TEST_ASSERT_EQUAL(5, he_classify_burst(packets, lengths, 5, 1, &burst));
+    TEST_ASSERT_EQUAL(5, burst.num_valid);
+    TEST_ASSERT_EQUAL(3, burst.num_groups);
+
+    TEST_ASSERT_EQUAL_UINT64(0xaaaa, burst.groups[0].session);
+    TEST_ASSERT_EQUAL(0, burst.groups[0].first);
+    TEST_ASSERT_EQUAL(2, burst.groups[0].count);
+    TEST_ASSERT_EQUAL_UINT64(0xbbbb, burst.groups[1].session);
+    TEST_ASSERT_EQUAL(2, burst.groups[1].first);
+    TEST_ASSERT_EQUAL(2, burst.groups[1].count);
+    TEST_ASSERT_EQUAL_UINT64(0xcccc, burst.groups[2].session);
+    TEST_ASSERT_EQUAL(4, burst.groups[2].first);
+
+    // Arrival order is kept within each group
+    uint8_t expected[] = {0, 2, 1, 4, 3};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, burst.order, 5);
+    for (size_t i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, burst.verdicts[i]);
+    }
+}
+
+void test_bad_datagrams_get_their_own_groups(void)
+{
+    make_packet(0, 1, 0xaaaa);
+    make_packet(1, 2, 0xaaaa);
+    make_packet(2, 1, 0xaaaa);
+    storage[2][1] = 'X';
+    make_packet(3, 1, 0xaaaa);
+    lengths[3] = sizeof(he_wire_hdr_t) - 1;
+    make_packet(4, 1, 0xbbbb);
+
+    TEST_ASSERT_EQUAL(5, he_classify_burst(packets, lengths, 5, 1, &burst));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, burst.verdicts[0]);
+    TEST_ASSERT_EQUAL(HE_ERR_INCORRECT_PROTOCOL_VERSION, burst.verdicts[1]);
+    TEST_ASSERT_EQUAL(HE_ERR_NOT_HE_PACKET, burst.verdicts[2]);
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL, burst.verdicts[3]);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, burst.verdicts[4]);
+
+    TEST_ASSERT_EQUAL(2, burst.num_valid);
+    TEST_ASSERT_EQUAL(1, burst.num_wrong_version);
+    TEST_ASSERT_EQUAL(2, burst.num_not_helium);
+
+    uint8_t expected[] = {0, 4, 1, 2, 3};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, burst.order, 5);
+}
+
+void test_version_zero_accepts_any_version(void)
+{
+    make_packet(0, 1, 0xaaaa);
+    make_packet(1, 2, 0xaaaa);
+    make_packet(2, 7, 0xaaaa);
+
+    TEST_ASSERT_EQUAL(3, he_classify_burst(packets, lengths, 3, 0, &burst));
+    TEST_ASSERT_EQUAL(3, burst.num_valid);
+    TEST_ASSERT_EQUAL(1, burst.num_groups);
+}
+
+void test_full_burst_matches_one_at_a_time(void)
+{
+    // Enough to go through every lane of the vector compare, in a mix of every verdict
+    for (size_t i = 0; i < HE_CLASSIFY_MAX_BURST; i++)
+    {
+        make_packet(i, (i % 5 == 1) ? 3 : 1, 0x1000 + i % 7);
+        if (i % 11 == 2)
+        {
+            storage[i][2] = 'E';
+        }
+        if (i % 13 == 3)
+        {
+            lengths[i] = i % 16;
+        }
+    }
+
+    TEST_ASSERT_EQUAL(HE_CLASSIFY_MAX_BURST,
+                      he_classify_burst(packets, lengths, HE_CLASSIFY_MAX_BURST, 1, &burst));
+
+    size_t valid = 0;
+    for (size_t i = 0; i < HE_CLASSIFY_MAX_BURST; i++)
+    {
+        he_return_code_t expected = HE_SUCCESS;
+        if (lengths[i] < sizeof(he_wire_hdr_t))
+        {
+            expected = HE_ERR_PACKET_TOO_SMALL;
+        }
+        else if (packets[i][1] != 'e')
+        {
+            expected = HE_ERR_NOT_HE_PACKET;
+        }
+        else if (packets[i][2] != 1)
+        {
+            expected = HE_ERR_INCORRECT_PROTOCOL_VERSION;
+        }
+        TEST_ASSERT_EQUAL(expected, burst.verdicts[i]);
+        valid += expected == HE_SUCCESS;
+    }
+
+    TEST_ASSERT_EQUAL(valid, burst.num_valid);
+    TEST_ASSERT_EQUAL(HE_CLASSIFY_MAX_BURST,
+                      burst.num_valid + burst.num_wrong_version + burst.num_not_helium);
+
+    // Every group holds only its own session
+    for (size_t g = 0; g < burst.num_groups; g++)
+    {
+        for (size_t j = 0; j < burst.groups[g].count; j++)
+        {
+            uint8_t index = burst.order[burst.groups[g].first + j];
+            TEST_ASSERT_EQUAL_UINT64(burst.groups[g].session, burst.sessions[index]);
+        }
+    }
+}
+
+void test_bursts_over_the_limit_are_split(void)
+{
+    for (size_t i = 0; i < HE_CLASSIFY_MAX_BURST + 8; i++)
+    {
+        make_packet(i, 1, 0xaaaa);
+    }
+
+    TEST_ASSERT_EQUAL(HE_CLASSIFY_MAX_BURST,
+                      he_classify_burst(packets, lengths, HE_CLASSIFY_MAX_BURST + 8, 1, &burst));
+    TEST_ASSERT_EQUAL(8, he_classify_burst(packets + HE_CLASSIFY_MAX_BURST,
+                                           lengths + HE_CLASSIFY_MAX_BURST, 8, 1, &burst));
+    TEST_ASSERT_EQUAL(8, burst.num_valid);
+}
+
+#endif // TEST
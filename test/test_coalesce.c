@@ -0,0 +1,366 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "coalesce.h"
+#include "compress.h"
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "core.h"
+#include "fec.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "timers.h"
+#include "wolf.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+#define MAX_RECORDS 8
+#define SMALL 40
+
+he_conn_t conn;
+uint8_t datagram[200];
+
+// Records wolfSSL_write was asked to send, and the ones wolfSSL_read hands back
+uint8_t records[MAX_RECORDS][HE_MAX_WIRE_MTU];
+size_t record_lengths[MAX_RECORDS];
+size_t num_records = 0;
+size_t next_record = 0;
+
+// Packets handed to the inside write callbacks
+uint8_t *delivered[HE_RECEIVE_BATCH_SIZE * 4];
+size_t delivered_lengths[HE_RECEIVE_BATCH_SIZE * 4];
+size_t num_delivered = 0;
+
+int capture_record(WOLFSSL *ssl, const void *data, int sz, int cmock_num_calls)
+{
+    TEST_ASSERT_TRUE(num_records < MAX_RECORDS);
+    memcpy(records[num_records], data, sz);
+    record_lengths[num_records++] = sz;
+    return sz;
+}
+
+int fail_write(WOLFSSL *ssl, const void *data, int sz, int cmock_num_calls)
+{
+    return SSL_FATAL_ERROR;
+}
+
+// Hands back the captured records one per call, as if each had been decrypted
+int read_captured(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    if (next_record == num_records)
+    {
+        return -1;
+    }
+    TEST_ASSERT_TRUE(sz >= (int)record_lengths[next_record]);
+    memcpy(buf, records[next_record], record_lengths[next_record]);
+    return (int)record_lengths[next_record++];
+}
+
+he_return_code_t capture_inside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    delivered[num_delivered] = packet;
+    delivered_lengths[num_delivered++] = length;
+    return HE_SUCCESS;
+}
+
+he_return_code_t capture_inside_write_batch(he_conn_t *conn, uint8_t **packets, size_t *lengths,
+                                            size_t count, void *context)
+{
+    // Batches are only valid during the call, check the contents while they still are
+    for (size_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x45, packets[i][0]);
+        TEST_ASSERT_EQUAL_HEX8((uint8_t)num_delivered, packets[i][1]);
+        delivered[num_delivered] = packets[i];
+        delivered_lengths[num_delivered++] = lengths[i];
+    }
+    return HE_SUCCESS;
+}
+
+/// An IPv4-looking packet whose second byte is seed
+static void make_packet(uint8_t *packet, size_t length, uint8_t seed)
+{
+    memset(packet, seed, length);
+    packet[0] = 0x45;
+    packet[1] = seed;
+}
+
+static he_return_code_t send_packet(size_t length, uint8_t seed)
+{
+    uint8_t packet[HE_MAX_MTU];
+    make_packet(packet, length, seed);
+    return he_conn_inside_packet_received(&conn, packet, length, sizeof(packet));
+}
+
+void setUp(void)
+{
+    memset(&conn, 0, sizeof(conn));
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+    he_conn_edit_settings(&conn)->inside_write_cb = capture_inside_write;
+    he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagram);
+    conn.state = HE_STATE_ONLINE;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+
+    num_records = 0;
+    next_record = 0;
+    num_delivered = 0;
+
+    wolfSSL_write_StubWithCallback(capture_record);
+    wolfSSL_read_StubWithCallback(read_captured);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_coalescing(&conn, true));
+    // Only the tests about the deadline want it, a slow run would flush the others early
+    conn.coalesce->deadline_us = UINT64_MAX;
+}
+
+void tearDown(void)
+{
+    free(conn.coalesce);
+    he_conn_template_release(conn.conn_template);
+}
+
+void test_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_coalescing(NULL, true));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_flush_inside_packets(NULL));
+}
+
+void test_flush_with_nothing_queued(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_flush_inside_packets(&conn));
+    TEST_ASSERT_EQUAL(0, num_records);
+}
+
+void test_small_packets_share_a_record(void)
+{
+    for (int i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, (uint8_t)i));
+    }
+    TEST_ASSERT_EQUAL(0, num_records);
+    TEST_ASSERT_EQUAL(10, conn.stats.packets[HE_STATS_INSIDE_IN]);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_flush_inside_packets(&conn));
+    TEST_ASSERT_EQUAL(1, num_records);
+    TEST_ASSERT_EQUAL(1 + 10 * (HE_COALESCE_FRAME_HEADER + SMALL), record_lengths[0]);
+    TEST_ASSERT_TRUE(he_internal_coalesce_is_record(records[0], record_lengths[0]));
+
+    size_t offset = 0;
+    size_t length = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        uint8_t *packet = he_internal_coalesce_next(records[0], record_lengths[0], &offset, &length);
+        TEST_ASSERT_NOT_NULL(packet);
+        TEST_ASSERT_EQUAL(SMALL, length);
+        TEST_ASSERT_EQUAL_HEX8(i, packet[1]);
+    }
+    TEST_ASSERT_NULL(he_internal_coalesce_next(records[0], record_lengths[0], &offset, &length));
+}
+
+void test_large_packet_goes_out_after_the_queue(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 2));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(HE_COALESCE_MAX_PACKET + 1, 3));
+
+    TEST_ASSERT_EQUAL(2, num_records);
+    TEST_ASSERT_TRUE(he_internal_coalesce_is_record(records[0], record_lengths[0]));
+    TEST_ASSERT_EQUAL(HE_COALESCE_MAX_PACKET + 1, record_lengths[1]);
+    TEST_ASSERT_EQUAL_HEX8(3, records[1][1]);
+}
+
+void test_full_record_is_sent_without_waiting(void)
+{
+    size_t fit = (HE_MAX_MTU - 1) / (HE_COALESCE_FRAME_HEADER + SMALL);
+    for (size_t i = 0; i < fit - 1; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, (uint8_t)i));
+    }
+    TEST_ASSERT_EQUAL(0, num_records);
+
+    // No room left for another packet, so there's nothing to wait for
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 0));
+    TEST_ASSERT_EQUAL(1, num_records);
+    TEST_ASSERT_TRUE(record_lengths[0] <= HE_MAX_MTU);
+    TEST_ASSERT_EQUAL(1 + fit * (HE_COALESCE_FRAME_HEADER + SMALL), record_lengths[0]);
+}
+
+void test_packet_past_the_deadline_sends_the_record(void)
+{
+    conn.coalesce->deadline_us = HE_COALESCE_DEADLINE_US;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 1));
+    conn.coalesce->first_queued_us -= HE_COALESCE_DEADLINE_US;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 2));
+    TEST_ASSERT_EQUAL(1, num_records);
+    TEST_ASSERT_EQUAL(1 + 2 * (HE_COALESCE_FRAME_HEADER + SMALL), record_lengths[0]);
+}
+
+void test_record_is_padded_with_zeroes(void)
+{
+    he_conn_edit_settings(&conn)->padding_type = HE_PADDING_450;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_flush_inside_packets(&conn));
+
+    TEST_ASSERT_EQUAL(450, record_lengths[0]);
+    size_t offset = 0;
+    size_t length = 0;
+    TEST_ASSERT_NOT_NULL(he_internal_coalesce_next(records[0], record_lengths[0], &offset, &length));
+    TEST_ASSERT_NULL(he_internal_coalesce_next(records[0], record_lengths[0], &offset, &length));
+}
+
+void test_disabling_sends_the_queue(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_coalescing(&conn, false));
+    TEST_ASSERT_NULL(conn.coalesce);
+    TEST_ASSERT_EQUAL(1, num_records);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 2));
+    TEST_ASSERT_EQUAL(2, num_records);
+    TEST_ASSERT_EQUAL(SMALL, record_lengths[1]);
+}
+
+void test_failed_write_drops_the_queue(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, 2));
+
+    wolfSSL_write_StubWithCallback(fail_write);
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, he_conn_flush_inside_packets(&conn));
+    TEST_ASSERT_EQUAL(2, conn.stats.dropped);
+    TEST_ASSERT_EQUAL(0, conn.coalesce->length);
+}
+
+void test_receive_splits_in_place(void)
+{
+    for (int i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL + i, (uint8_t)i));
+    }
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_flush_inside_packets(&conn));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(5, num_delivered);
+    TEST_ASSERT_EQUAL(5, conn.stats.packets[HE_STATS_INSIDE_OUT]);
+
+    // Each packet is where it lay in the decrypted record
+    uint8_t *scratch = he_internal_get_read_scratch();
+    size_t offset = 1;
+    for (int i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_EQUAL_PTR(scratch + offset + HE_COALESCE_FRAME_HEADER, delivered[i]);
+        TEST_ASSERT_EQUAL(SMALL + i, delivered_lengths[i]);
+        TEST_ASSERT_EQUAL_HEX8(i, delivered[i][1]);
+        offset += HE_COALESCE_FRAME_HEADER + SMALL + i;
+    }
+}
+
+void test_receive_batch_splits_across_batches(void)
+{
+    // A packet on its own takes the first slot, so the next record's packets run past the end
+    // of the batch while its buffer is still in use
+    size_t fit = (HE_MAX_MTU - 1) / (HE_COALESCE_FRAME_HEADER + SMALL);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(HE_COALESCE_MAX_PACKET + 1, 0));
+    for (size_t i = 1; i <= 2 * fit; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, send_packet(SMALL, (uint8_t)i));
+    }
+    TEST_ASSERT_EQUAL(3, num_records);
+    TEST_ASSERT_TRUE(fit == HE_RECEIVE_BATCH_SIZE);
+
+    he_conn_edit_settings(&conn)->inside_write_batch_cb = capture_inside_write_batch;
+    uint8_t *buffers[1] = {datagram};
+    size_t lengths[1] = {sizeof(datagram)};
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received_batch(&conn, buffers, lengths, 1));
+    TEST_ASSERT_EQUAL(2 * fit + 1, num_delivered);
+}
+
+/// An IPv4 UDP packet of length bytes whose payload compresses well
+static void make_text_packet(uint8_t *packet, size_t length, uint8_t seed)
+{
+    memset(packet, 0, 20);
+    packet[0] = 0x45;
+    packet[1] = seed;
+    packet[2] = (uint8_t)(length >> 8);
+    packet[3] = (uint8_t)length;
+    packet[9] = 17;
+    for (size_t i = 20; i < length; i++)
+    {
+        packet[i] = (uint8_t)("Accept: */*\r\n"[(i - 20) % 13]);
+    }
+}
+
+void test_receive_gives_plugins_room_to_decompress(void)
+{
+    he_compress_plugin_t compress;
+    he_compress_plugin_init(&compress);
+    conn.inside_plugins = he_plugin_chain_create();
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(conn.inside_plugins, &compress.plugin));
+
+    // Large packets that only become small enough to coalesce once compressed
+    uint8_t packets[3][1000];
+    for (int i = 0; i < 3; i++)
+    {
+        make_text_packet(packets[i], sizeof(packets[i]), (uint8_t)i);
+        uint8_t packet[HE_MAX_MTU];
+        memcpy(packet, packets[i], sizeof(packets[i]));
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&conn, packet, sizeof(packets[i]),
+                                                                     sizeof(packet)));
+    }
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_flush_inside_packets(&conn));
+    TEST_ASSERT_EQUAL(1, num_records);
+    TEST_ASSERT_EQUAL(3, compress.stats.compressed);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(3, num_delivered);
+    TEST_ASSERT_EQUAL(3, compress.stats.decompressed);
+    TEST_ASSERT_EQUAL(0, compress.stats.dropped);
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_EQUAL(sizeof(packets[i]), delivered_lengths[i]);
+    }
+    // Only the last is still where it was delivered, the rest were unpacked to the same buffer
+    TEST_ASSERT_EQUAL_MEMORY(packets[2], delivered[2], sizeof(packets[2]));
+
+    // The batched receive unpacks each packet into a slot of its own
+    next_record = 0;
+    num_delivered = 0;
+    he_conn_edit_settings(&conn)->inside_write_batch_cb = capture_inside_write_batch;
+    uint8_t *buffers[1] = {datagram};
+    size_t lengths[1] = {sizeof(datagram)};
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received_batch(&conn, buffers, lengths, 1));
+    TEST_ASSERT_EQUAL(3, num_delivered);
+    TEST_ASSERT_EQUAL(6, compress.stats.decompressed);
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_EQUAL(sizeof(packets[i]), delivered_lengths[i]);
+        TEST_ASSERT_EQUAL_MEMORY(packets[i], delivered[i], sizeof(packets[i]));
+    }
+
+    he_plugin_destroy_chain(conn.inside_plugins);
+}
+
+void test_malformed_record_stops_at_the_bad_length(void)
+{
+    uint8_t *record = records[0];
+    record[0] = HE_COALESCE_MARKER;
+    record[1] = 0;
+    record[2] = SMALL;
+    make_packet(record + 3, SMALL, 7);
+    // Claims more than is left
+    record[3 + SMALL] = 0x05;
+    record[4 + SMALL] = 0xdc;
+    record_lengths[0] = 5 + SMALL + 10;
+    num_records = 1;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(1, num_delivered);
+    TEST_ASSERT_EQUAL(SMALL, delivered_lengths[0]);
+}
+
+#endif
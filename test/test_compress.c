@@ -0,0 +1,215 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "compress.h"
+
+he_compress_plugin_t compress;
+uint8_t packet[HE_MAX_MTU];
+uint8_t original[HE_MAX_MTU];
+size_t length = 0;
+
+/// An IPv4 UDP packet whose payload is repetitive text
+static void make_ipv4_text(size_t total)
+{
+    static const char text[] = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n";
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x45;
+    packet[2] = (uint8_t)(total >> 8);
+    packet[3] = (uint8_t)total;
+    packet[9] = 17;
+    packet[10] = 0xbe;
+    packet[11] = 0xef;
+    for (size_t i = 20; i < total; i++)
+    {
+        packet[i] = (uint8_t)text[(i - 20) % (sizeof(text) - 1)];
+    }
+
+    length = total;
+    memcpy(original, packet, total);
+}
+
+/// An IPv6 TCP packet whose payload looks like ciphertext
+static void make_ipv6_random(size_t total)
+{
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x60;
+    packet[4] = (uint8_t)((total - 40) >> 8);
+    packet[5] = (uint8_t)(total - 40);
+    packet[6] = 6;
+
+    uint32_t state = 0x12345678;
+    for (size_t i = 40; i < total; i++)
+    {
+        state = state * 1103515245u + 12345u;
+        packet[i] = (uint8_t)(state >> 16);
+    }
+
+    length = total;
+    memcpy(original, packet, total);
+}
+
+static he_plugin_return_code_t egress(void)
+{
+    return compress.plugin.do_egress(packet, &length, sizeof(packet), compress.plugin.data);
+}
+
+static he_plugin_return_code_t ingress(void)
+{
+    return compress.plugin.do_ingress(packet, &length, sizeof(packet), compress.plugin.data);
+}
+
+void setUp(void)
+{
+    he_compress_plugin_init(&compress);
+}
+
+void tearDown(void)
+{
+}
+
+void test_compresses_and_restores_ipv4(void)
+{
+    make_ipv4_text(1200);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_LESS_THAN(600, length);
+    TEST_ASSERT_EQUAL(HE_COMPRESS_IP_PROTOCOL, packet[9]);
+    TEST_ASSERT_EQUAL(length, (size_t)packet[2] << 8 | packet[3]);
+    TEST_ASSERT_EQUAL(1, compress.stats.compressed);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, ingress());
+    TEST_ASSERT_EQUAL(1200, length);
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 1200);
+    TEST_ASSERT_EQUAL(1, compress.stats.decompressed);
+}
+
+void test_compresses_and_restores_ipv6(void)
+{
+    make_ipv4_text(1000);
+    // Same payload behind an IPv6 header
+    uint8_t payload[1000];
+    memcpy(payload, packet + 20, 980);
+    memset(packet, 0, 40);
+    packet[0] = 0x60;
+    packet[4] = (uint8_t)(980 >> 8);
+    packet[5] = (uint8_t)980;
+    packet[6] = 17;
+    memcpy(packet + 40, payload, 980);
+    length = 1020;
+    memcpy(original, packet, length);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_LESS_THAN(1020, length);
+    TEST_ASSERT_EQUAL(HE_COMPRESS_IP_PROTOCOL, packet[6]);
+    TEST_ASSERT_EQUAL(length - 40, (size_t)packet[4] << 8 | packet[5]);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, ingress());
+    TEST_ASSERT_EQUAL(1020, length);
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 1020);
+}
+
+void test_random_payloads_are_left_alone(void)
+{
+    make_ipv6_random(1300);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_EQUAL(1300, length);
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 1300);
+    TEST_ASSERT_EQUAL(1, compress.stats.skipped_random);
+
+    // And the peer passes them through
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, ingress());
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 1300);
+}
+
+void test_short_and_non_ip_packets_are_left_alone(void)
+{
+    make_ipv4_text(60);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 60);
+
+    make_ipv4_text(200);
+    packet[0] = 0x00;
+    memcpy(original, packet, 200);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_EQUAL(200, length);
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 200);
+}
+
+void test_packets_using_our_protocol_are_wrapped(void)
+{
+    make_ipv6_random(300);
+    packet[6] = HE_COMPRESS_IP_PROTOCOL;
+    memcpy(original, packet, 300);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+    TEST_ASSERT_EQUAL(300 + sizeof(he_compress_hdr_t), length);
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, ingress());
+    TEST_ASSERT_EQUAL(300, length);
+    TEST_ASSERT_EQUAL_MEMORY(original, packet, 300);
+}
+
+void test_corrupt_packets_are_dropped(void)
+{
+    make_ipv4_text(1200);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+
+    // Point the first match before the start of the output
+    packet[20 + sizeof(he_compress_hdr_t)] = 0x0f;
+    packet[20 + sizeof(he_compress_hdr_t) + 1] = 0xff;
+    packet[20 + sizeof(he_compress_hdr_t) + 2] = 0xff;
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, ingress());
+    TEST_ASSERT_EQUAL(1, compress.stats.dropped);
+}
+
+void test_decompressed_packets_must_fit(void)
+{
+    make_ipv4_text(1200);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, egress());
+
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP,
+                      compress.plugin.do_ingress(packet, &length, length, compress.plugin.data));
+}
+
+void test_block_round_trips_long_runs(void)
+{
+    static uint8_t src[HE_MAX_MTU];
+    static uint8_t dst[HE_MAX_MTU];
+    static uint8_t out[HE_MAX_MTU];
+
+    // Long literal and match lengths need the 255 byte extensions
+    for (size_t i = 0; i < 300; i++)
+    {
+        src[i] = (uint8_t)(i * 7 + (i >> 3));
+    }
+    memset(src + 300, 'a', 1000);
+    for (size_t i = 1300; i < sizeof(src); i++)
+    {
+        src[i] = (uint8_t)i;
+    }
+
+    size_t compressed = he_compress_block(&compress, src, sizeof(src), dst, sizeof(dst));
+    TEST_ASSERT_NOT_EQUAL(0, compressed);
+    TEST_ASSERT_LESS_THAN(sizeof(src), compressed);
+    TEST_ASSERT_EQUAL(sizeof(src), he_decompress_block(dst, compressed, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_MEMORY(src, out, sizeof(src));
+
+    // Every prefix of the block is either rejected or decodes within bounds
+    for (size_t i = 0; i < compressed; i++)
+    {
+        size_t decoded = he_decompress_block(dst, i, out, sizeof(out));
+        TEST_ASSERT_TRUE(decoded == SIZE_MAX || decoded <= sizeof(out));
+    }
+
+    // Too little room is an error, not an overflow
+    TEST_ASSERT_EQUAL(SIZE_MAX, he_decompress_block(dst, compressed, out, sizeof(src) - 1));
+
+    // And a limit it can't meet gives up
+    TEST_ASSERT_EQUAL(0, he_compress_block(&compress, src, sizeof(src), dst, 10));
+}
+
+#endif // TEST
@@ -0,0 +1,996 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "compress.h"
+#include "core.h"
+#include "fec.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "timers.h"
+#include "wolf.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+he_conn_t conn;
+uint8_t datagram[200];
+uint8_t *inside_packet = NULL;
+size_t inside_length = 0;
+int inside_count = 0;
+
+static const uint8_t plaintext[] = {0x45, 0x00, 0x00, 0x14, 0xde, 0xad, 0xbe, 0xef};
+
+he_return_code_t capture_inside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    inside_packet = packet;
+    inside_length = length;
+    inside_count++;
+    return HE_SUCCESS;
+}
+
+// Decrypts a single packet, then reports that wolfSSL wants more data
+int read_one_packet(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    if (cmock_num_calls > 0)
+    {
+        return -1;
+    }
+    TEST_ASSERT_TRUE(sz >= (int)sizeof(plaintext));
+    memcpy(buf, plaintext, sizeof(plaintext));
+    return sizeof(plaintext);
+}
+
+int batch_calls = 0;
+size_t batch_count = 0;
+
+he_return_code_t count_outside_write_batch(he_conn_t *conn, const he_outside_datagram_t *datagrams,
+                                           size_t count, void *context)
+{
+    batch_calls++;
+    batch_count = count;
+    return HE_SUCCESS;
+}
+
+// wolfSSL sends two records (e.g. handshake replies) while processing the input
+int read_and_reply_twice(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    char record[64] = {0};
+    he_wolf_dtls_write(ssl, record, sizeof(record), &conn);
+    he_wolf_dtls_write(ssl, record, sizeof(record), &conn);
+    return -1;
+}
+
+int inside_batch_calls = 0;
+size_t inside_batch_count = 0;
+size_t inside_batch_lengths[HE_RECEIVE_BATCH_SIZE];
+
+he_return_code_t capture_inside_write_batch(he_conn_t *conn, uint8_t **packets, size_t *lengths, size_t count,
+                                            void *context)
+{
+    inside_batch_calls++;
+    inside_batch_count = count;
+    memcpy(inside_batch_lengths, lengths, count * sizeof(size_t));
+    return HE_SUCCESS;
+}
+
+// An IPv4 packet with a 20 byte total length, padded out to 450 bytes by the sender
+int read_padded_packet(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    if (cmock_num_calls > 0)
+    {
+        return -1;
+    }
+    memset(buf, 0, 450);
+    ((uint8_t *)buf)[0] = 0x45;
+    ((uint8_t *)buf)[3] = 20;
+    return 450;
+}
+
+const void *written_packet = NULL;
+int written_length = 0;
+uint8_t written_copy[HE_MAX_MTU];
+
+int capture_write(WOLFSSL *ssl, const void *data, int sz, int cmock_num_calls)
+{
+    written_packet = data;
+    written_length = sz;
+    memcpy(written_copy, data, sz);
+    return sz;
+}
+
+// Behaves like wolfSSL with a null cipher: every datagram pulled through the read callback
+// decrypts to its own contents
+int read_through_callback(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    return he_wolf_dtls_read(ssl, buf, sz, &conn);
+}
+
+void setUp(void)
+{
+    memset(&conn, 0, sizeof(conn));
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+    he_conn_edit_settings(&conn)->inside_write_cb = capture_inside_write;
+    he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagram);
+
+    inside_packet = NULL;
+    inside_length = 0;
+    inside_count = 0;
+    batch_calls = 0;
+    batch_count = 0;
+    inside_batch_calls = 0;
+    inside_batch_count = 0;
+    written_packet = NULL;
+    written_length = 0;
+}
+
+void tearDown(void)
+{
+    he_internal_release_auth(&conn);
+    he_conn_template_release(conn.conn_template);
+}
+
+void test_create_and_destroy(void)
+{
+    he_conn_t *created = he_conn_create();
+    TEST_ASSERT_NOT_NULL(created);
+    TEST_ASSERT_EQUAL(HE_STATE_NONE, created->state);
+    TEST_ASSERT_NULL(created->auth);
+    TEST_ASSERT_NULL(created->wolf_rng);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_username(created, "user"));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_outside_write_batch_cb(created, count_outside_write_batch));
+
+    he_conn_destroy(created);
+    he_conn_destroy(NULL);
+}
+
+void test_credentials_are_allocated_on_demand(void)
+{
+    TEST_ASSERT_NULL(he_conn_get_username(&conn));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_username(&conn, "user"));
+    TEST_ASSERT_NOT_NULL(conn.auth);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_password(&conn, "pass"));
+
+    TEST_ASSERT_EQUAL_STRING("user", he_conn_get_username(&conn));
+    TEST_ASSERT_EQUAL_STRING("pass", conn.auth->password);
+}
+
+void test_set_template_shares_settings(void)
+{
+    he_conn_settings_t settings = {0};
+    settings.inside_write_cb = capture_inside_write;
+    settings.outside_write_batch_cb = count_outside_write_batch;
+    he_conn_template_t *tmpl = he_conn_template_create(&settings);
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_template(NULL, tmpl));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_template(&conn, tmpl));
+    TEST_ASSERT_EQUAL_PTR(tmpl, conn.conn_template);
+    TEST_ASSERT_EQUAL(2, atomic_load(&tmpl->refs));
+
+    // Setters only change this connection
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_padding_type(&conn, HE_PADDING_FULL));
+    TEST_ASSERT_TRUE(conn.conn_template != tmpl);
+    TEST_ASSERT_EQUAL(1, atomic_load(&tmpl->refs));
+    TEST_ASSERT_EQUAL(HE_PADDING_NONE, he_conn_template_get_settings(tmpl)->padding_type);
+    TEST_ASSERT_EQUAL(HE_PADDING_FULL, he_conn_get_settings(&conn)->padding_type);
+    TEST_ASSERT_EQUAL_PTR(capture_inside_write, he_conn_get_settings(&conn)->inside_write_cb);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_template(&conn, NULL));
+    TEST_ASSERT_NULL(conn.conn_template);
+
+    he_conn_template_release(tmpl);
+}
+
+void test_credentials_errors(void)
+{
+    static const uint8_t token[HE_MAX_MTU + 1] = {0};
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_username(NULL, "user"));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_password(&conn, NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_EMPTY_STRING, he_conn_set_username(&conn, ""));
+    TEST_ASSERT_EQUAL(HE_ERR_STRING_TOO_LONG, he_conn_set_auth_buffer(&conn, 1, token, sizeof(token)));
+}
+
+void test_set_auth_buffer(void)
+{
+    static const uint8_t token[] = {1, 2, 3, 4};
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_auth_buffer(&conn, 7, token, sizeof(token)));
+    TEST_ASSERT_EQUAL(7, conn.auth->auth_type);
+    TEST_ASSERT_EQUAL(sizeof(token), conn.auth->auth_buffer_length);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(token, conn.auth->auth_buffer, sizeof(token));
+}
+
+void test_set_session_shard(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_session_shard(NULL, 1));
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_SHARD, he_conn_set_session_shard(&conn, HE_MAX_SHARDS));
+    TEST_ASSERT_FALSE(conn.use_session_shard);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_session_shard(&conn, HE_MAX_SHARDS - 1));
+    TEST_ASSERT_TRUE(conn.use_session_shard);
+    TEST_ASSERT_EQUAL(HE_MAX_SHARDS - 1, conn.session_shard);
+}
+
+void test_outside_data_received_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_outside_data_received(NULL, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_outside_data_received(&conn, NULL, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(HE_ERR_EMPTY_PACKET, he_conn_outside_data_received(&conn, datagram, 0));
+}
+
+void test_outside_data_received_rejects_bad_headers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL,
+                      he_conn_outside_data_received(&conn, datagram, sizeof(he_wire_hdr_t) - 1));
+
+    datagram[0] = 'X';
+    TEST_ASSERT_EQUAL(HE_ERR_NOT_HE_PACKET, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+
+    conn.protocol_version.major_version = 1;
+    he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagram);
+    ((he_wire_hdr_t *)datagram)->major_version = 2;
+    TEST_ASSERT_EQUAL(HE_ERR_INCORRECT_PROTOCOL_VERSION,
+                      he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+
+    he_conn_stats_t stats;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_get_stats(&conn, &stats));
+    TEST_ASSERT_EQUAL(3, stats.packets[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(3, stats.dropped);
+}
+
+void test_get_stats_null_pointers(void)
+{
+    he_conn_stats_t stats;
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_get_stats(NULL, &stats));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_get_stats(&conn, NULL));
+}
+
+void test_outside_data_received_uses_read_scratch_by_default(void)
+{
+    wolfSSL_read_StubWithCallback(read_one_packet);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    he_return_code_t res = he_conn_outside_data_received(&conn, datagram, sizeof(datagram));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(1, inside_count);
+    TEST_ASSERT_EQUAL_PTR(he_internal_get_read_scratch(), inside_packet);
+    TEST_ASSERT_EQUAL(sizeof(plaintext), inside_length);
+    TEST_ASSERT_EQUAL_MEMORY(plaintext, inside_packet, sizeof(plaintext));
+    TEST_ASSERT_NULL(conn.incoming_data);
+
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(sizeof(datagram), conn.stats.bytes[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_INSIDE_OUT]);
+    TEST_ASSERT_EQUAL(sizeof(plaintext), conn.stats.bytes[HE_STATS_INSIDE_OUT]);
+}
+
+void test_outside_data_received_in_place(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_in_place_receive(&conn, true));
+    wolfSSL_read_StubWithCallback(read_one_packet);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    he_return_code_t res = he_conn_outside_data_received(&conn, datagram, sizeof(datagram));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(1, inside_count);
+    // The inside callback sees the plaintext in the caller's own buffer
+    TEST_ASSERT_EQUAL_PTR(datagram, inside_packet);
+    TEST_ASSERT_EQUAL_MEMORY(plaintext, datagram, sizeof(plaintext));
+}
+
+void test_outside_data_received_strips_padding(void)
+{
+    wolfSSL_read_StubWithCallback(read_padded_packet);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(1, inside_count);
+    TEST_ASSERT_EQUAL(20, inside_length);
+}
+
+void test_outside_data_received_ssl_error_is_nonfatal_for_datagrams(void)
+{
+    wolfSSL_read_ExpectAnyArgsAndReturn(-1);
+    wolfSSL_get_error_ExpectAnyArgsAndReturn(-1);
+
+    he_return_code_t res = he_conn_outside_data_received(&conn, datagram, sizeof(datagram));
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR_NONFATAL, res);
+    TEST_ASSERT_EQUAL(0, inside_count);
+    TEST_ASSERT_EQUAL(1, conn.stats.dropped);
+}
+
+// A TLS peer with a null cipher: records are pulled through the read callback exactly as
+// wolfSSL does (header first, then the body) and partial records are held until complete
+uint8_t tls_input[2048];
+size_t tls_input_length = 0;
+
+static int fake_tls_fill(WOLFSSL *ssl, size_t wanted)
+{
+    while (tls_input_length < wanted)
+    {
+        int res = he_wolf_dtls_read(ssl, (char *)tls_input + tls_input_length, wanted - tls_input_length, &conn);
+        if (res < 0)
+        {
+            return res;
+        }
+        tls_input_length += res;
+    }
+    return 0;
+}
+
+int fake_tls_read(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    for (;;)
+    {
+        if (fake_tls_fill(ssl, HE_TLS_RECORD_HEADER_SIZE) < 0)
+        {
+            return -1;
+        }
+        size_t body = (tls_input[3] << 8) | tls_input[4];
+        if (fake_tls_fill(ssl, HE_TLS_RECORD_HEADER_SIZE + body) < 0)
+        {
+            return -1;
+        }
+
+        tls_input_length = 0;
+        if (tls_input[0] != 0x17)
+        {
+            // Not application data, nothing to hand back
+            continue;
+        }
+
+        TEST_ASSERT_TRUE(body <= (size_t)sz);
+        memcpy(buf, tls_input + HE_TLS_RECORD_HEADER_SIZE, body);
+        return body;
+    }
+}
+
+uint8_t delivered[16][64];
+size_t delivered_lengths[16];
+uint8_t *delivered_ptrs[16];
+
+he_return_code_t collect_inside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    memcpy(delivered[inside_count], packet, length);
+    delivered_lengths[inside_count] = length;
+    delivered_ptrs[inside_count] = packet;
+    inside_count++;
+    return HE_SUCCESS;
+}
+
+static size_t build_stream(uint8_t *stream)
+{
+    // Application data of 10, 20 and 30 bytes with a handshake record in between
+    const uint8_t types[4] = {0x17, 0x16, 0x17, 0x17};
+    const size_t lengths[4] = {10, 7, 20, 30};
+    size_t offset = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        stream[offset++] = types[i];
+        stream[offset++] = 0x03;
+        stream[offset++] = 0x03;
+        stream[offset++] = 0;
+        stream[offset++] = lengths[i];
+        memset(stream + offset, 'a' + i, lengths[i]);
+        offset += lengths[i];
+    }
+
+    return offset;
+}
+
+void test_outside_data_received_stream_every_split_point(void)
+{
+    uint8_t stream[128];
+    uint8_t work[128];
+    size_t total = build_stream(stream);
+
+    wolfSSL_read_StubWithCallback(fake_tls_read);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    for (size_t split = 0; split <= total; split++)
+    {
+        setUp();
+        he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+        he_conn_edit_settings(&conn)->inside_write_cb = collect_inside_write;
+        tls_input_length = 0;
+
+        memcpy(work, stream, total);
+        if (split > 0)
+        {
+            TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, work, split));
+        }
+        if (split < total)
+        {
+            TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, work + split, total - split));
+        }
+
+        TEST_ASSERT_EQUAL(3, inside_count);
+        TEST_ASSERT_EQUAL(10, delivered_lengths[0]);
+        TEST_ASSERT_EQUAL(20, delivered_lengths[1]);
+        TEST_ASSERT_EQUAL(30, delivered_lengths[2]);
+        TEST_ASSERT_EACH_EQUAL_UINT8('a', delivered[0], 10);
+        TEST_ASSERT_EACH_EQUAL_UINT8('c', delivered[1], 20);
+        TEST_ASSERT_EACH_EQUAL_UINT8('d', delivered[2], 30);
+        TEST_ASSERT_EQUAL(0, conn.stream_record_hdr_length);
+        TEST_ASSERT_EQUAL(0, conn.stream_record_remaining);
+    }
+}
+
+void test_outside_data_received_stream_in_place(void)
+{
+    uint8_t stream[128];
+    size_t total = build_stream(stream);
+
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    he_conn_edit_settings(&conn)->inside_write_cb = collect_inside_write;
+    he_conn_set_in_place_receive(&conn, true);
+    tls_input_length = 0;
+    wolfSSL_read_StubWithCallback(fake_tls_read);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    // The last record is cut short, so only the first two are decrypted in place
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, stream, total - 10));
+    TEST_ASSERT_EQUAL(2, inside_count);
+    TEST_ASSERT_EQUAL_PTR(stream, delivered_ptrs[0]);
+    TEST_ASSERT_EQUAL_PTR(stream + 15 + 12, delivered_ptrs[1]);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, stream + total - 10, 10));
+    TEST_ASSERT_EQUAL(3, inside_count);
+    TEST_ASSERT_EQUAL_PTR(he_internal_get_read_scratch(), delivered_ptrs[2]);
+    TEST_ASSERT_EACH_EQUAL_UINT8('d', delivered[2], 30);
+}
+
+uint8_t compressed[HE_MAX_MTU];
+size_t compressed_length = 0;
+
+int read_compressed_packet(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    if (cmock_num_calls > 0)
+    {
+        return -1;
+    }
+    TEST_ASSERT_TRUE(sz >= (int)compressed_length);
+    memcpy(buf, compressed, compressed_length);
+    return (int)compressed_length;
+}
+
+void test_in_place_receive_gives_plugins_room_to_decompress(void)
+{
+    he_compress_plugin_t compress;
+    he_compress_plugin_init(&compress);
+    conn.inside_plugins = he_plugin_chain_create();
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(conn.inside_plugins, &compress.plugin));
+    he_conn_set_in_place_receive(&conn, true);
+
+    // An IPv4 UDP packet that compresses to a fraction of its length
+    uint8_t packet[1000] = {0x45, 0, sizeof(packet) >> 8, sizeof(packet) & 0xff};
+    packet[9] = 17;
+    for (size_t i = 20; i < sizeof(packet); i++)
+    {
+        packet[i] = (uint8_t)("Accept: */*\r\n"[(i - 20) % 13]);
+    }
+    memcpy(compressed, packet, sizeof(packet));
+    compressed_length = sizeof(packet);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_egress(conn.inside_plugins, compressed, &compressed_length,
+                                                   sizeof(compressed)));
+    TEST_ASSERT_EQUAL(1, compress.stats.compressed);
+    TEST_ASSERT_TRUE(compressed_length + sizeof(he_wire_hdr_t) <= sizeof(datagram));
+
+    // The datagram is far too short to take the packet once it is decompressed
+    wolfSSL_read_StubWithCallback(read_compressed_packet);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_EQUAL(1, inside_count);
+    TEST_ASSERT_EQUAL(sizeof(packet), inside_length);
+    TEST_ASSERT_EQUAL_MEMORY(packet, inside_packet, sizeof(packet));
+
+    // So is a stream record
+    uint8_t stream[HE_TLS_RECORD_HEADER_SIZE + sizeof(compressed)] = {
+        0x17, 0x03, 0x03, (uint8_t)(compressed_length >> 8), (uint8_t)compressed_length};
+    memcpy(stream + HE_TLS_RECORD_HEADER_SIZE, compressed, compressed_length);
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    tls_input_length = 0;
+    wolfSSL_read_StubWithCallback(fake_tls_read);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, stream,
+                                                                HE_TLS_RECORD_HEADER_SIZE + compressed_length));
+    TEST_ASSERT_EQUAL(2, inside_count);
+    TEST_ASSERT_EQUAL(sizeof(packet), inside_length);
+    TEST_ASSERT_EQUAL_MEMORY(packet, inside_packet, sizeof(packet));
+
+    TEST_ASSERT_EQUAL(2, compress.stats.decompressed);
+    TEST_ASSERT_EQUAL(0, compress.stats.dropped);
+    he_plugin_destroy_chain(conn.inside_plugins);
+}
+
+// The sending side of the same null cipher TLS peer: frames each write as one record
+he_conn_t stream_client;
+uint8_t stream_wire[512];
+size_t stream_wire_length = 0;
+
+static int fake_tls_send(uint8_t type, const void *data, int sz)
+{
+    uint8_t record[128] = {type, 0x03, 0x03, 0, (uint8_t)sz};
+    memcpy(record + HE_TLS_RECORD_HEADER_SIZE, data, sz);
+    int res = he_wolf_dtls_write(stream_client.wolf_ssl, (char *)record, HE_TLS_RECORD_HEADER_SIZE + sz,
+                                 &stream_client);
+    return res < 0 ? res : sz;
+}
+
+int fake_tls_write(WOLFSSL *ssl, const void *data, int sz, int cmock_num_calls)
+{
+    return fake_tls_send(0x17, data, sz);
+}
+
+he_return_code_t append_to_stream(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    TEST_ASSERT_TRUE(stream_wire_length + length <= sizeof(stream_wire));
+    memcpy(stream_wire + stream_wire_length, packet, length);
+    stream_wire_length += length;
+    return HE_SUCCESS;
+}
+
+void test_stream_round_trip_between_client_and_server(void)
+{
+    memset(&stream_client, 0, sizeof(stream_client));
+    stream_client.wolf_ssl = (WOLFSSL *)1;
+    stream_client.state = HE_STATE_CONNECTING;
+    he_conn_edit_settings(&stream_client)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    he_conn_edit_settings(&stream_client)->outside_write_cb = append_to_stream;
+    stream_wire_length = 0;
+
+    // A handshake record while connecting, when datagrams would be sent three times
+    const uint8_t finished[7] = {0x14};
+    TEST_ASSERT_EQUAL(sizeof(finished), fake_tls_send(0x16, finished, sizeof(finished)));
+    TEST_ASSERT_EQUAL(HE_TLS_RECORD_HEADER_SIZE + sizeof(finished), stream_wire_length);
+
+    stream_client.state = HE_STATE_ONLINE;
+    uint8_t packet[sizeof(plaintext)];
+    memcpy(packet, plaintext, sizeof(plaintext));
+    wolfSSL_write_StubWithCallback(fake_tls_write);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&stream_client, packet, sizeof(packet),
+                                                                 sizeof(packet)));
+    TEST_ASSERT_EQUAL(2 * HE_TLS_RECORD_HEADER_SIZE + sizeof(finished) + sizeof(plaintext), stream_wire_length);
+    TEST_ASSERT_EQUAL(0, stream_client.stats.aggressive_duplicates);
+
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    he_conn_edit_settings(&conn)->inside_write_cb = collect_inside_write;
+    tls_input_length = 0;
+    wolfSSL_read_StubWithCallback(fake_tls_read);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, stream_wire, stream_wire_length));
+    TEST_ASSERT_EQUAL(1, inside_count);
+    TEST_ASSERT_EQUAL(sizeof(plaintext), delivered_lengths[0]);
+    TEST_ASSERT_EQUAL_MEMORY(plaintext, delivered[0], sizeof(plaintext));
+    TEST_ASSERT_EQUAL(0, conn.stream_record_hdr_length);
+
+    he_conn_template_release(stream_client.conn_template);
+}
+
+void test_outside_data_received_flushes_writes_once_per_burst(void)
+{
+    conn.state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_outside_write_batch_cb(&conn, count_outside_write_batch));
+    wolfSSL_read_StubWithCallback(read_and_reply_twice);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    he_return_code_t res = he_conn_outside_data_received(&conn, datagram, sizeof(datagram));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(1, batch_calls);
+    TEST_ASSERT_EQUAL(2, batch_count);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_outside_write_batch_cb(&conn, NULL));
+    TEST_ASSERT_EQUAL(0, he_internal_get_outside_write_batch()->num_datagrams);
+}
+
+void test_outside_data_received_batch_null_pointers(void)
+{
+    uint8_t *buffers[1] = {datagram};
+    size_t lengths[1] = {sizeof(datagram)};
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_outside_data_received_batch(NULL, buffers, lengths, 1));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_outside_data_received_batch(&conn, NULL, lengths, 1));
+
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONNECTION_TYPE,
+                      he_conn_outside_data_received_batch(&conn, buffers, lengths, 1));
+}
+
+void test_outside_data_received_batch_delivers_in_one_call(void)
+{
+    uint8_t datagrams[3][104];
+    uint8_t *buffers[3];
+    size_t lengths[3];
+    for (int i = 0; i < 3; i++)
+    {
+        he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagrams[i]);
+        buffers[i] = datagrams[i];
+        lengths[i] = sizeof(he_wire_hdr_t) + 10 + i;
+    }
+    // The middle datagram isn't Helium at all
+    datagrams[1][0] = 'X';
+
+    he_conn_edit_settings(&conn)->inside_write_batch_cb = capture_inside_write_batch;
+    wolfSSL_read_StubWithCallback(read_through_callback);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    he_return_code_t res = he_conn_outside_data_received_batch(&conn, buffers, lengths, 3);
+    TEST_ASSERT_EQUAL(HE_ERR_NOT_HE_PACKET, res);
+    TEST_ASSERT_EQUAL(1, inside_batch_calls);
+    TEST_ASSERT_EQUAL(2, inside_batch_count);
+    TEST_ASSERT_EQUAL(10, inside_batch_lengths[0]);
+    TEST_ASSERT_EQUAL(12, inside_batch_lengths[1]);
+    TEST_ASSERT_EQUAL(0, inside_count);
+    TEST_ASSERT_NULL(conn.incoming_queue);
+}
+
+// The first datagram decrypts to a coalesced record with more packets than a batch holds, the
+// second is consumed but fails to decrypt
+int last_read_error = 0;
+
+int read_record_then_fail(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    int res = he_wolf_dtls_read(ssl, buf, sz, &conn);
+    last_read_error = res < 0 ? SSL_ERROR_WANT_READ : -1;
+    if (res < 0 || cmock_num_calls > 0)
+    {
+        return -1;
+    }
+
+    uint8_t *record = buf;
+    size_t length = 1;
+    record[0] = HE_COALESCE_MARKER;
+    for (int i = 0; i < HE_RECEIVE_BATCH_SIZE + 1; i++)
+    {
+        record[length++] = 0;
+        record[length++] = 20;
+        memset(record + length, i == 0 ? 'F' : 0x45, 20);
+        length += 20;
+    }
+    TEST_ASSERT_TRUE(length <= (size_t)sz);
+    return (int)length;
+}
+
+int get_last_read_error(WOLFSSL *ssl, int ret, int cmock_num_calls)
+{
+    return last_read_error;
+}
+
+he_plugin_return_code_t fail_marked_packet(uint8_t *packet, size_t *length, size_t capacity, void *data)
+{
+    return packet[0] == 'F' ? HE_PLUGIN_FAIL : HE_PLUGIN_SUCCESS;
+}
+
+void test_outside_data_received_batch_returns_the_first_error(void)
+{
+    uint8_t datagrams[2][64] = {{0}};
+    uint8_t *buffers[2];
+    size_t lengths[2];
+    for (int i = 0; i < 2; i++)
+    {
+        he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagrams[i]);
+        buffers[i] = datagrams[i];
+        lengths[i] = sizeof(datagrams[i]);
+    }
+
+    // The inside plugin fails the first packet when the full batch is flushed, before wolfSSL
+    // rejects the second datagram
+    plugin_struct_t plugin = {.do_ingress = fail_marked_packet};
+    conn.inside_plugins = he_plugin_chain_create();
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(conn.inside_plugins, &plugin));
+
+    wolfSSL_read_StubWithCallback(read_record_then_fail);
+    wolfSSL_get_error_StubWithCallback(get_last_read_error);
+
+    TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_conn_outside_data_received_batch(&conn, buffers, lengths, 2));
+    TEST_ASSERT_EQUAL(HE_RECEIVE_BATCH_SIZE, inside_count);
+    TEST_ASSERT_EQUAL(2, conn.stats.dropped);
+
+    he_plugin_destroy_chain(conn.inside_plugins);
+}
+
+void test_outside_data_received_batch_falls_back_to_inside_write_cb(void)
+{
+    uint8_t datagrams[HE_RECEIVE_BATCH_SIZE + 5][64] = {{0}};
+    uint8_t *buffers[HE_RECEIVE_BATCH_SIZE + 5];
+    size_t lengths[HE_RECEIVE_BATCH_SIZE + 5];
+    for (int i = 0; i < HE_RECEIVE_BATCH_SIZE + 5; i++)
+    {
+        he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagrams[i]);
+        buffers[i] = datagrams[i];
+        lengths[i] = sizeof(datagrams[i]);
+    }
+
+    wolfSSL_read_StubWithCallback(read_through_callback);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+
+    he_return_code_t res = he_conn_outside_data_received_batch(&conn, buffers, lengths, HE_RECEIVE_BATCH_SIZE + 5);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(HE_RECEIVE_BATCH_SIZE + 5, inside_count);
+    TEST_ASSERT_EQUAL(sizeof(datagrams[0]) - sizeof(he_wire_hdr_t), inside_length);
+}
+
+void test_inside_packet_received_errors(void)
+{
+    uint8_t packet[HE_MAX_MTU + 1] = {0};
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_inside_packet_received(NULL, packet, 20, sizeof(packet)));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_inside_packet_received(&conn, NULL, 20, sizeof(packet)));
+    TEST_ASSERT_EQUAL(HE_ERR_EMPTY_PACKET, he_conn_inside_packet_received(&conn, packet, 0, sizeof(packet)));
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE,
+                      he_conn_inside_packet_received(&conn, packet, HE_MAX_MTU + 1, sizeof(packet)));
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_conn_inside_packet_received(&conn, packet, 20, 10));
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONN_STATE, he_conn_inside_packet_received(&conn, packet, 20, sizeof(packet)));
+}
+
+void test_inside_packet_received_unpadded(void)
+{
+    uint8_t packet[64];
+    memset(packet, 0xaa, sizeof(packet));
+    conn.state = HE_STATE_ONLINE;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_write_StubWithCallback(capture_write);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&conn, packet, 20, sizeof(packet)));
+    TEST_ASSERT_EQUAL_PTR(packet, written_packet);
+    TEST_ASSERT_EQUAL(20, written_length);
+    TEST_ASSERT_EQUAL_HEX8(0xaa, packet[20]);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_INSIDE_IN]);
+    TEST_ASSERT_EQUAL(20, conn.stats.bytes[HE_STATS_INSIDE_IN]);
+}
+
+void test_inside_packet_received_pads_in_place(void)
+{
+    static uint8_t packet[HE_MAX_MTU];
+    memset(packet, 0xaa, sizeof(packet));
+    conn.state = HE_STATE_ONLINE;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_write_StubWithCallback(capture_write);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_padding_type(&conn, HE_PADDING_450));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&conn, packet, 500, sizeof(packet)));
+    TEST_ASSERT_EQUAL_PTR(packet, written_packet);
+    TEST_ASSERT_EQUAL(900, written_length);
+    TEST_ASSERT_EQUAL_HEX8(0xaa, written_copy[499]);
+    TEST_ASSERT_EQUAL_HEX8(0, written_copy[500]);
+    TEST_ASSERT_EQUAL_HEX8(0, written_copy[899]);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_padding_type(&conn, HE_PADDING_FULL));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&conn, packet, 20, sizeof(packet)));
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, written_length);
+}
+
+void test_inside_packet_received_pads_a_copy_without_room(void)
+{
+    uint8_t packet[64];
+    memset(packet, 0xaa, sizeof(packet));
+    conn.state = HE_STATE_ONLINE;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    he_conn_edit_settings(&conn)->padding_type = HE_PADDING_FULL;
+    wolfSSL_write_StubWithCallback(capture_write);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_inside_packet_received(&conn, packet, 40, sizeof(packet)));
+    TEST_ASSERT_EQUAL_PTR(he_internal_get_padding_scratch(), written_packet);
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, written_length);
+    TEST_ASSERT_EQUAL_HEX8(0xaa, written_copy[39]);
+    TEST_ASSERT_EQUAL_HEX8(0, written_copy[40]);
+    // The caller's buffer is left alone
+    TEST_ASSERT_EQUAL_HEX8(0xaa, packet[40]);
+}
+
+void test_inside_packet_received_ssl_error(void)
+{
+    uint8_t packet[64] = {0};
+    conn.state = HE_STATE_ONLINE;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_write_ExpectAnyArgsAndReturn(-1);
+
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, he_conn_inside_packet_received(&conn, packet, 20, sizeof(packet)));
+}
+
+static const uint8_t saved_session[] = "a saved session";
+
+static int serialise_saved_session(WOLFSSL_SESSION *session, unsigned char **out, int cmock_num_calls)
+{
+    if (out)
+    {
+        memcpy(*out, saved_session, sizeof(saved_session));
+        *out += sizeof(saved_session);
+    }
+    return sizeof(saved_session);
+}
+
+void test_get_resumption_data(void)
+{
+    uint8_t buffer[HE_MAX_SESSION_DATA];
+    size_t length = sizeof(buffer);
+    WOLFSSL_SESSION *session = (WOLFSSL_SESSION *)0x5678;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+
+    wolfSSL_get1_session_ExpectAndReturn(conn.wolf_ssl, session);
+    wolfSSL_i2d_SSL_SESSION_StubWithCallback(serialise_saved_session);
+    wolfSSL_SESSION_free_Expect(session);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_get_resumption_data(&conn, buffer, &length));
+    TEST_ASSERT_EQUAL(sizeof(saved_session), length);
+    TEST_ASSERT_EQUAL_MEMORY(saved_session, buffer, length);
+}
+
+void test_get_resumption_data_into_a_small_buffer(void)
+{
+    uint8_t buffer[4];
+    size_t length = sizeof(buffer);
+    WOLFSSL_SESSION *session = (WOLFSSL_SESSION *)0x5678;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+
+    wolfSSL_get1_session_ExpectAndReturn(conn.wolf_ssl, session);
+    wolfSSL_i2d_SSL_SESSION_ExpectAndReturn(session, NULL, sizeof(saved_session));
+    wolfSSL_SESSION_free_Expect(session);
+
+    TEST_ASSERT_EQUAL(HE_ERR_BUFFER_TOO_SMALL, he_conn_get_resumption_data(&conn, buffer, &length));
+    TEST_ASSERT_EQUAL(sizeof(saved_session), length);
+}
+
+void test_get_resumption_data_before_the_handshake(void)
+{
+    uint8_t buffer[16];
+    size_t length = sizeof(buffer);
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_get_resumption_data(&conn, buffer, NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NEVER_CONNECTED, he_conn_get_resumption_data(&conn, buffer, &length));
+
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_get1_session_ExpectAndReturn(conn.wolf_ssl, NULL);
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONN_STATE, he_conn_get_resumption_data(&conn, buffer, &length));
+}
+
+void test_set_resumption_data(void)
+{
+    WOLFSSL_SESSION *session = (WOLFSSL_SESSION *)0x5678;
+
+    TEST_ASSERT_EQUAL(HE_ERR_ZERO_SIZE, he_conn_set_resumption_data(&conn, saved_session, 0));
+    TEST_ASSERT_EQUAL(HE_ERR_NEVER_CONNECTED,
+                      he_conn_set_resumption_data(&conn, saved_session, sizeof(saved_session)));
+
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_d2i_SSL_SESSION_ExpectAnyArgsAndReturn(session);
+    wolfSSL_set_session_ExpectAndReturn(conn.wolf_ssl, session, WOLFSSL_SUCCESS);
+    wolfSSL_SESSION_free_Expect(session);
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_conn_set_resumption_data(&conn, saved_session, sizeof(saved_session)));
+
+    wolfSSL_d2i_SSL_SESSION_ExpectAnyArgsAndReturn(NULL);
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR,
+                      he_conn_set_resumption_data(&conn, saved_session, sizeof(saved_session)));
+}
+
+void test_is_resumed(void)
+{
+    TEST_ASSERT_FALSE(he_conn_is_resumed(NULL));
+    TEST_ASSERT_FALSE(he_conn_is_resumed(&conn));
+
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    wolfSSL_session_reused_ExpectAndReturn(conn.wolf_ssl, 1);
+    TEST_ASSERT_TRUE(he_conn_is_resumed(&conn));
+    wolfSSL_session_reused_ExpectAndReturn(conn.wolf_ssl, 0);
+    TEST_ASSERT_FALSE(he_conn_is_resumed(&conn));
+}
+
+he_conn_event_t events[4];
+int event_count = 0;
+
+he_return_code_t record_event(he_conn_t *conn, he_conn_event_t event, void *context)
+{
+    events[event_count++] = event;
+    return HE_SUCCESS;
+}
+
+void test_start_renegotiation_checks_the_connection(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_start_renegotiation(NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NEVER_CONNECTED, he_conn_start_renegotiation(&conn));
+
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    conn.state = HE_STATE_AUTHENTICATING;
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_CONN_STATE, he_conn_start_renegotiation(&conn));
+    TEST_ASSERT_FALSE(conn.renegotiation_in_progress);
+}
+
+void test_start_renegotiation(void)
+{
+    event_count = 0;
+    he_conn_edit_settings(&conn)->event_cb = record_event;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    conn.state = HE_STATE_ONLINE;
+    conn.renegotiation_due = true;
+
+    // The first flight is out and wolfSSL waits for the peer
+    wolfSSL_Rehandshake_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR);
+    wolfSSL_get_error_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR, SSL_ERROR_WANT_READ);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_start_renegotiation(&conn));
+    TEST_ASSERT_TRUE(conn.renegotiation_in_progress);
+    TEST_ASSERT_FALSE(conn.renegotiation_due);
+    TEST_ASSERT_EQUAL(1, event_count);
+    TEST_ASSERT_EQUAL(HE_EVENT_SECURE_RENEGOTIATION_STARTED, events[0]);
+
+    // Already running, nothing to do
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_start_renegotiation(&conn));
+    TEST_ASSERT_EQUAL(1, event_count);
+}
+
+he_return_code_t destroy_on_event(he_conn_t *conn, he_conn_event_t event, void *context)
+{
+    record_event(conn, event, context);
+    he_conn_destroy(conn);
+    return HE_SUCCESS;
+}
+
+void test_start_renegotiation_survives_the_callback_destroying_the_connection(void)
+{
+    event_count = 0;
+    he_timers_t *timers = he_timers_create(0);
+    he_conn_t *doomed = he_conn_create();
+    he_conn_edit_settings(doomed)->event_cb = destroy_on_event;
+    doomed->wolf_ssl = (WOLFSSL *)0x1234;
+    doomed->state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_attach(timers, doomed));
+
+    wolfSSL_Rehandshake_ExpectAndReturn(doomed->wolf_ssl, SSL_SUCCESS);
+    wolfSSL_dtls_get_current_timeout_IgnoreAndReturn(1);
+    wolfSSL_free_Ignore();
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_start_renegotiation(doomed));
+    TEST_ASSERT_EQUAL(1, event_count);
+    TEST_ASSERT_EQUAL(HE_EVENT_SECURE_RENEGOTIATION_STARTED, events[0]);
+
+    he_timers_destroy(timers);
+}
+
+void test_start_renegotiation_refused(void)
+{
+    event_count = 0;
+    he_conn_edit_settings(&conn)->event_cb = record_event;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    conn.state = HE_STATE_ONLINE;
+
+    wolfSSL_Rehandshake_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR);
+    wolfSSL_get_error_ExpectAndReturn(conn.wolf_ssl, SSL_FATAL_ERROR, -1);
+
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, he_conn_start_renegotiation(&conn));
+    TEST_ASSERT_FALSE(conn.renegotiation_in_progress);
+    TEST_ASSERT_EQUAL(0, event_count);
+}
+
+void test_renegotiation_completes_on_the_peers_reply(void)
+{
+    event_count = 0;
+    he_conn_edit_settings(&conn)->event_cb = record_event;
+    conn.wolf_ssl = (WOLFSSL *)0x1234;
+    conn.state = HE_STATE_ONLINE;
+    conn.first_message_received = true;
+    conn.renegotiation_in_progress = true;
+
+    wolfSSL_read_ExpectAnyArgsAndReturn(-1);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+    wolfSSL_SSL_renegotiate_pending_ExpectAndReturn(conn.wolf_ssl, 1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_TRUE(conn.renegotiation_in_progress);
+    TEST_ASSERT_EQUAL(0, event_count);
+
+    wolfSSL_read_ExpectAnyArgsAndReturn(-1);
+    wolfSSL_SSL_renegotiate_pending_ExpectAndReturn(conn.wolf_ssl, 0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_outside_data_received(&conn, datagram, sizeof(datagram)));
+    TEST_ASSERT_FALSE(conn.renegotiation_in_progress);
+    TEST_ASSERT_EQUAL(1, event_count);
+    TEST_ASSERT_EQUAL(HE_EVENT_SECURE_RENEGOTIATION_COMPLETED, events[0]);
+}
+
+#endif // TEST
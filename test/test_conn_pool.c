@@ -0,0 +1,140 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "conn_pool.h"
+#include "core.h"
+#include "conn_template.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+he_conn_pool_t *pool = NULL;
+
+he_plugin_return_code_t noop_hook(uint8_t *packet, size_t *length, size_t capacity, void *data)
+{
+    return HE_PLUGIN_SUCCESS;
+}
+
+void setUp(void)
+{
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_FreeRng_IgnoreAndReturn(0);
+    pool = he_conn_pool_create(2, 2, 0);
+}
+
+void tearDown(void)
+{
+    he_conn_pool_destroy(pool);
+    pool = NULL;
+}
+
+void test_create_rejects_bad_arguments(void)
+{
+    TEST_ASSERT_NULL(he_conn_pool_create(0, 2, 0));
+    TEST_ASSERT_NULL(he_conn_pool_create(2, 0, 0));
+    // Six times this wraps around to a chain slab of two pointers
+    TEST_ASSERT_NULL(he_conn_pool_create(1, SIZE_MAX / 6 + 1, 0));
+}
+
+void test_create_fails_if_rng_fails(void)
+{
+    wc_InitRng_ExpectAnyArgsAndReturn(-1);
+    TEST_ASSERT_NULL(he_conn_pool_create(2, 2, 0));
+}
+
+void test_acquire_gives_zeroed_conn_with_chains(void)
+{
+    he_conn_t *conn = he_conn_pool_acquire(pool);
+
+    TEST_ASSERT_NOT_NULL(conn);
+    TEST_ASSERT_EQUAL(HE_STATE_NONE, conn->state);
+    TEST_ASSERT_NOT_NULL(conn->inside_plugins);
+    TEST_ASSERT_NOT_NULL(conn->outside_plugins);
+    TEST_ASSERT_TRUE(conn->inside_plugins != conn->outside_plugins);
+    TEST_ASSERT_EQUAL(0, conn->inside_plugins->num_plugins);
+    TEST_ASSERT_NOT_NULL(conn->wolf_rng);
+}
+
+void test_acquire_until_exhausted(void)
+{
+    he_conn_pool_stats_t stats;
+
+    he_conn_t *a = he_conn_pool_acquire(pool);
+    he_conn_t *b = he_conn_pool_acquire(pool);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    TEST_ASSERT_TRUE(a != b);
+    TEST_ASSERT_NULL(he_conn_pool_acquire(pool));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_pool_get_stats(pool, &stats));
+    TEST_ASSERT_EQUAL(2, stats.capacity);
+    TEST_ASSERT_EQUAL(2, stats.in_use);
+    TEST_ASSERT_EQUAL(2, stats.peak_in_use);
+    TEST_ASSERT_EQUAL(1, stats.exhausted);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_pool_release(pool, a));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_pool_get_stats(pool, &stats));
+    TEST_ASSERT_EQUAL(1, stats.in_use);
+    TEST_ASSERT_EQUAL(2, stats.peak_in_use);
+
+    // The released connection is handed out again, cleaned up
+    a->state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL_PTR(a, he_conn_pool_acquire(pool));
+    TEST_ASSERT_EQUAL(HE_STATE_NONE, a->state);
+}
+
+void test_release_frees_wolfssl_and_credentials(void)
+{
+    he_conn_t *conn = he_conn_pool_acquire(pool);
+    conn->wolf_ssl = (WOLFSSL *)0x1234;
+    TEST_ASSERT_NOT_NULL(he_internal_get_auth(conn));
+
+    wolfSSL_free_Expect(conn->wolf_ssl);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_pool_release(pool, conn));
+    TEST_ASSERT_NULL(conn->wolf_ssl);
+    TEST_ASSERT_NULL(conn->auth);
+}
+
+void test_release_rejects_foreign_and_double_release(void)
+{
+    he_conn_t other;
+    he_conn_t *conn = he_conn_pool_acquire(pool);
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_pool_release(pool, NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_conn_pool_release(pool, &other));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_pool_release(pool, conn));
+    TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_conn_pool_release(pool, conn));
+}
+
+void test_pooled_chains_have_fixed_capacity(void)
+{
+    plugin_struct_t plugins[3] = {0};
+    he_conn_t *conn = he_conn_pool_acquire(pool);
+
+    for (int i = 0; i < 3; i++)
+    {
+        plugins[i].do_ingress = noop_hook;
+    }
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(conn->inside_plugins, &plugins[0]));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(conn->inside_plugins, &plugins[1]));
+    TEST_ASSERT_EQUAL(HE_ERR_NO_MEMORY, he_plugin_register_plugin(conn->inside_plugins, &plugins[2]));
+
+    // Each connection's chains have their own storage
+    he_conn_t *other = he_conn_pool_acquire(pool);
+    TEST_ASSERT_EQUAL(0, other->inside_plugins->num_plugins);
+    TEST_ASSERT_EQUAL(0, conn->outside_plugins->num_plugins);
+    TEST_ASSERT_EQUAL_PTR(&plugins[1], conn->inside_plugins->ingress[1]);
+}
+
+void test_get_stats_null_pointers(void)
+{
+    he_conn_pool_stats_t stats;
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_pool_get_stats(NULL, &stats));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_pool_get_stats(pool, NULL));
+}
+
+#endif // TEST
@@ -0,0 +1,146 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "conn_template.h"
+
+he_conn_t conn;
+he_conn_t other;
+
+he_return_code_t dummy_outside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    return HE_SUCCESS;
+}
+
+static size_t refs(he_conn_template_t *tmpl)
+{
+    return atomic_load(&tmpl->refs);
+}
+
+void setUp(void)
+{
+    memset(&conn, 0, sizeof(conn));
+    memset(&other, 0, sizeof(other));
+}
+
+void tearDown(void)
+{
+    he_conn_template_release(conn.conn_template);
+    he_conn_template_release(other.conn_template);
+}
+
+void test_create_copies_settings(void)
+{
+    he_conn_settings_t settings = {0};
+    settings.connection_type = HE_CONNECTION_TYPE_STREAM;
+    settings.outside_write_cb = dummy_outside_write;
+
+    he_conn_template_t *tmpl = he_conn_template_create(&settings);
+    TEST_ASSERT_NOT_NULL(tmpl);
+    TEST_ASSERT_EQUAL(1, refs(tmpl));
+
+    // Later changes to the caller's copy don't reach the template
+    settings.connection_type = HE_CONNECTION_TYPE_DATAGRAM;
+    const he_conn_settings_t *shared = he_conn_template_get_settings(tmpl);
+    TEST_ASSERT_EQUAL(HE_CONNECTION_TYPE_STREAM, shared->connection_type);
+    TEST_ASSERT_EQUAL_PTR(dummy_outside_write, shared->outside_write_cb);
+
+    he_conn_template_release(tmpl);
+}
+
+void test_create_with_null_gives_defaults(void)
+{
+    he_conn_template_t *tmpl = he_conn_template_create(NULL);
+    TEST_ASSERT_NOT_NULL(tmpl);
+    const he_conn_settings_t *settings = he_conn_template_get_settings(tmpl);
+    TEST_ASSERT_EQUAL(HE_CONNECTION_TYPE_DATAGRAM, settings->connection_type);
+    TEST_ASSERT_EQUAL(HE_PADDING_NONE, settings->padding_type);
+    TEST_ASSERT_NULL(settings->outside_write_cb);
+    he_conn_template_release(tmpl);
+}
+
+void test_connections_without_a_template_use_the_defaults(void)
+{
+    TEST_ASSERT_EQUAL_PTR(&he_conn_default_settings, he_conn_get_settings(&conn));
+    TEST_ASSERT_EQUAL(HE_CONNECTION_TYPE_DATAGRAM, he_internal_settings(&conn)->connection_type);
+    TEST_ASSERT_NULL(he_internal_settings(&conn)->outside_write_cb);
+}
+
+void test_null_pointers(void)
+{
+    TEST_ASSERT_NULL(he_conn_get_settings(NULL));
+    TEST_ASSERT_NULL(he_conn_edit_settings(NULL));
+    TEST_ASSERT_NULL(he_conn_template_get_settings(NULL));
+    he_conn_template_release(NULL);
+}
+
+void test_connections_share_one_template(void)
+{
+    he_conn_template_t *tmpl = he_conn_template_create(NULL);
+    conn.conn_template = he_internal_template_acquire(tmpl);
+    other.conn_template = he_internal_template_acquire(tmpl);
+    TEST_ASSERT_EQUAL(3, refs(tmpl));
+
+    TEST_ASSERT_EQUAL_PTR(he_conn_get_settings(&conn), he_conn_get_settings(&other));
+
+    // Creator's reference can go as soon as the connections have theirs
+    he_conn_template_release(tmpl);
+    TEST_ASSERT_EQUAL(2, refs(tmpl));
+}
+
+void test_edit_copies_a_shared_template(void)
+{
+    he_conn_template_t *tmpl = he_conn_template_create(NULL);
+    conn.conn_template = he_internal_template_acquire(tmpl);
+    other.conn_template = he_internal_template_acquire(tmpl);
+    he_conn_template_release(tmpl);
+
+    he_conn_settings_t *mine = he_conn_edit_settings(&conn);
+    TEST_ASSERT_NOT_NULL(mine);
+    mine->padding_type = HE_PADDING_FULL;
+
+    TEST_ASSERT_TRUE(tmpl != conn.conn_template);
+    TEST_ASSERT_EQUAL(1, refs(tmpl));
+    TEST_ASSERT_EQUAL(HE_PADDING_FULL, he_internal_settings(&conn)->padding_type);
+    TEST_ASSERT_EQUAL(HE_PADDING_NONE, he_internal_settings(&other)->padding_type);
+}
+
+void test_edit_changes_a_private_template_in_place(void)
+{
+    he_conn_settings_t *first = he_conn_edit_settings(&conn);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(conn.conn_template);
+    first->outside_write_cb = dummy_outside_write;
+
+    // Nobody else holds it, so no second copy
+    he_conn_template_t *tmpl = conn.conn_template;
+    TEST_ASSERT_EQUAL_PTR(first, he_conn_edit_settings(&conn));
+    TEST_ASSERT_EQUAL_PTR(tmpl, conn.conn_template);
+    TEST_ASSERT_EQUAL_PTR(dummy_outside_write, he_internal_settings(&conn)->outside_write_cb);
+
+    // And the defaults are left alone
+    TEST_ASSERT_NULL(he_conn_default_settings.outside_write_cb);
+}
+
+void test_copies_keep_every_setting(void)
+{
+    he_conn_settings_t settings = {0};
+    settings.connection_type = HE_CONNECTION_TYPE_STREAM;
+    settings.use_aggressive_mode = true;
+    settings.outside_mtu = 1280;
+    settings.outside_write_cb = dummy_outside_write;
+
+    he_conn_template_t *tmpl = he_conn_template_create(&settings);
+    conn.conn_template = he_internal_template_acquire(tmpl);
+
+    he_conn_settings_t *copy = he_conn_edit_settings(&conn);
+    TEST_ASSERT_TRUE(he_conn_template_get_settings(tmpl) != copy);
+    TEST_ASSERT_EQUAL(HE_CONNECTION_TYPE_STREAM, copy->connection_type);
+    TEST_ASSERT_TRUE(copy->use_aggressive_mode);
+    TEST_ASSERT_EQUAL(1280, copy->outside_mtu);
+    TEST_ASSERT_EQUAL_PTR(dummy_outside_write, copy->outside_write_cb);
+
+    he_conn_template_release(tmpl);
+}
+
+#endif // TEST
@@ -3,18 +3,247 @@
 #include "unity.h"
 
 #include "core.h"
+#include "conn_template.h"
+#include "stats.h"
+#include "mock_random.h"
+
+he_conn_t conn;
+uint8_t buffer[100];
 
 void setUp(void)
 {
+    memset(&conn, 0, sizeof(conn));
 }
 
 void tearDown(void)
 {
+    he_internal_release_auth(&conn);
+    free(conn.wolf_rng);
+    he_conn_template_release(conn.conn_template);
+}
+
+void test_setup_stream_state(void)
+{
+    he_return_code_t res = he_internal_setup_stream_state(&conn, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL_PTR(buffer, conn.incoming_data);
+    TEST_ASSERT_EQUAL_PTR(buffer, conn.incoming_data_read_offset_ptr);
+    TEST_ASSERT_EQUAL(sizeof(buffer), conn.incoming_data_length);
+    TEST_ASSERT_EQUAL(sizeof(buffer), conn.incoming_data_left_to_read);
+}
+
+void test_setup_stream_state_fails_with_unread_data(void)
+{
+    conn.incoming_data_left_to_read = 10;
+    he_return_code_t res = he_internal_setup_stream_state(&conn, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(HE_ERR_SSL_ERROR, res);
+}
+
+void test_write_packet_header(void)
+{
+    he_wire_hdr_t hdr;
+    memset(&hdr, 0xff, sizeof(hdr));
+    conn.protocol_version.major_version = 1;
+    conn.protocol_version.minor_version = 2;
+    he_conn_edit_settings(&conn)->use_aggressive_mode = true;
+    conn.session_id = 0x1122334455667788;
+
+    he_internal_write_packet_header(&conn, &hdr);
+
+    TEST_ASSERT_EQUAL('H', hdr.he[0]);
+    TEST_ASSERT_EQUAL('e', hdr.he[1]);
+    TEST_ASSERT_EQUAL(1, hdr.major_version);
+    TEST_ASSERT_EQUAL(2, hdr.minor_version);
+    TEST_ASSERT_EQUAL(1, hdr.aggressive_mode);
+    TEST_ASSERT_EACH_EQUAL_UINT8(0, hdr.reserved, sizeof(hdr.reserved));
+    TEST_ASSERT_EQUAL_UINT64(0x1122334455667788, hdr.session);
+}
+
+static int fill_with(byte *b, word32 sz, uint64_t value)
+{
+    TEST_ASSERT_EQUAL(sizeof(uint64_t), sz);
+    memcpy(b, &value, sizeof(value));
+    return 0;
+}
+
+int random_bits(WC_RNG *rng, byte *b, word32 sz, int cmock_num_calls)
+{
+    TEST_ASSERT_EQUAL_PTR(conn.wolf_rng, rng);
+    return fill_with(b, sz, 0xa5a5a5a5a5a5a5a5ULL);
+}
+
+// Hands out both reserved IDs before a usable one
+int reserved_then_random(WC_RNG *rng, byte *b, word32 sz, int cmock_num_calls)
+{
+    static const uint64_t values[] = {0, UINT64_MAX, 0x42};
+    return fill_with(b, sz, values[cmock_num_calls]);
+}
+
+void test_generate_session_id(void)
+{
+    uint64_t session = 0;
+    wc_InitRng_ExpectAnyArgsAndReturn(0);
+    wc_RNG_GenerateBlock_StubWithCallback(random_bits);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_generate_session_id(&conn, &session));
+    TEST_ASSERT_EQUAL_HEX64(0xa5a5a5a5a5a5a5a5ULL, session);
+    TEST_ASSERT_NOT_NULL(conn.wolf_rng);
+
+    // The RNG is only set up once
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_generate_session_id(&conn, &session));
+}
+
+void test_generate_session_id_encodes_shard(void)
+{
+    uint64_t session = 0;
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_StubWithCallback(random_bits);
+    conn.use_session_shard = true;
+    conn.session_shard = 0x17;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_generate_session_id(&conn, &session));
+    TEST_ASSERT_EQUAL_HEX64(0x17a5a5a5a5a5a5a5ULL, session);
+    TEST_ASSERT_EQUAL(0x17, HE_SESSION_SHARD(session));
+}
+
+void test_generate_session_id_skips_reserved_ids(void)
+{
+    uint64_t session = 0;
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_StubWithCallback(reserved_then_random);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_generate_session_id(&conn, &session));
+    TEST_ASSERT_EQUAL_HEX64(0x42, session);
+}
+
+void test_generate_session_id_rng_failure(void)
+{
+    uint64_t session = 7;
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_ExpectAnyArgsAndReturn(-1);
+
+    TEST_ASSERT_EQUAL(HE_ERR_RNG_FAILURE, he_internal_generate_session_id(&conn, &session));
+    TEST_ASSERT_EQUAL(7, session);
+}
+
+void test_generate_session_id_rng_init_failure(void)
+{
+    uint64_t session = 7;
+    wc_InitRng_ExpectAnyArgsAndReturn(-1);
+
+    TEST_ASSERT_EQUAL(HE_ERR_RNG_FAILURE, he_internal_generate_session_id(&conn, &session));
+    TEST_ASSERT_NULL(conn.wolf_rng);
+}
+
+he_conn_state_t reported_state = HE_STATE_NONE;
+int state_change_calls = 0;
+
+he_return_code_t record_state_change(he_conn_t *conn, he_conn_state_t new_state, void *context)
+{
+    reported_state = new_state;
+    state_change_calls++;
+    return HE_SUCCESS;
+}
+
+void test_change_conn_state_reports_changes_only(void)
+{
+    he_conn_edit_settings(&conn)->state_change_cb = record_state_change;
+    state_change_calls = 0;
+
+    he_internal_change_conn_state(&conn, HE_STATE_CONNECTING);
+    he_internal_change_conn_state(&conn, HE_STATE_CONNECTING);
+
+    TEST_ASSERT_EQUAL(HE_STATE_CONNECTING, conn.state);
+    TEST_ASSERT_EQUAL(HE_STATE_CONNECTING, reported_state);
+    TEST_ASSERT_EQUAL(1, state_change_calls);
+}
+
+void test_change_conn_state_releases_auth_when_online(void)
+{
+    TEST_ASSERT_NOT_NULL(he_internal_get_auth(&conn));
+
+    he_internal_change_conn_state(&conn, HE_STATE_AUTHENTICATING);
+    TEST_ASSERT_NOT_NULL(conn.auth);
+
+    he_internal_change_conn_state(&conn, HE_STATE_ONLINE);
+    TEST_ASSERT_NULL(conn.auth);
+}
+
+void test_change_conn_state_releases_auth_on_disconnect(void)
+{
+    TEST_ASSERT_NOT_NULL(he_internal_get_auth(&conn));
+
+    he_internal_change_conn_state(&conn, HE_STATE_DISCONNECTED);
+    TEST_ASSERT_NULL(conn.auth);
+}
+
+void test_read_and_write_scratch_are_separate(void)
+{
+    TEST_ASSERT_NOT_NULL(he_internal_get_read_scratch());
+    TEST_ASSERT_NOT_NULL(he_internal_get_write_scratch());
+    TEST_ASSERT_TRUE(he_internal_get_read_scratch() != he_internal_get_write_scratch());
+}
+
+void test_get_padded_length(void)
+{
+    TEST_ASSERT_EQUAL(100, he_internal_get_padded_length(HE_PADDING_NONE, 100));
+
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_internal_get_padded_length(HE_PADDING_FULL, 1));
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_internal_get_padded_length(HE_PADDING_FULL, HE_MAX_MTU));
+
+    TEST_ASSERT_EQUAL(450, he_internal_get_padded_length(HE_PADDING_450, 1));
+    TEST_ASSERT_EQUAL(450, he_internal_get_padded_length(HE_PADDING_450, 450));
+    TEST_ASSERT_EQUAL(900, he_internal_get_padded_length(HE_PADDING_450, 451));
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_internal_get_padded_length(HE_PADDING_450, 901));
+
+    // Never padded past the MTU, nor shrunk
+    TEST_ASSERT_EQUAL(HE_MAX_MTU + 10, he_internal_get_padded_length(HE_PADDING_450, HE_MAX_MTU + 10));
+}
+
+void test_pad_packet_zeroes_the_tail_only(void)
+{
+    uint8_t packet[64];
+    memset(packet, 0xaa, sizeof(packet));
+
+    he_internal_pad_packet(packet, 10, 50);
+    TEST_ASSERT_EQUAL_HEX8(0xaa, packet[9]);
+    TEST_ASSERT_EQUAL_HEX8(0, packet[10]);
+    TEST_ASSERT_EQUAL_HEX8(0, packet[49]);
+    TEST_ASSERT_EQUAL_HEX8(0xaa, packet[50]);
+}
+
+void test_strip_padding(void)
+{
+    uint8_t packet[100] = {0};
+
+    // IPv4, total length 28
+    packet[0] = 0x45;
+    packet[3] = 28;
+    TEST_ASSERT_EQUAL(28, he_internal_strip_padding(packet, sizeof(packet)));
+    TEST_ASSERT_EQUAL(28, he_internal_strip_padding(packet, 28));
+
+    // A length field past the end of the packet means it isn't ours to strip
+    TEST_ASSERT_EQUAL(27, he_internal_strip_padding(packet, 27));
+
+    // IPv6, payload length 8
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x60;
+    packet[5] = 8;
+    TEST_ASSERT_EQUAL(48, he_internal_strip_padding(packet, sizeof(packet)));
+
+    // Jumbograms and anything that isn't IP are left alone
+    packet[5] = 0;
+    TEST_ASSERT_EQUAL(sizeof(packet), he_internal_strip_padding(packet, sizeof(packet)));
+    packet[0] = 0x12;
+    TEST_ASSERT_EQUAL(sizeof(packet), he_internal_strip_padding(packet, sizeof(packet)));
+    TEST_ASSERT_EQUAL(5, he_internal_strip_padding(packet, 5));
 }
 
-void test_core_NeedToImplement(void)
+void test_conn_stays_small(void)
 {
-    TEST_IGNORE_MESSAGE("Need to Implement core");
+    // Guards the layout against buffers creeping back into the connection
+    TEST_ASSERT_TRUE(offsetof(he_conn_t, stream_record_hdr_length) <= 192);
+    TEST_ASSERT_TRUE(sizeof(he_conn_t) <= 512);
 }
 
 #endif // TEST
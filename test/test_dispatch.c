@@ -0,0 +1,223 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "dispatch.h"
+
+he_dispatcher_t *dispatcher = NULL;
+uint8_t packet[sizeof(he_wire_hdr_t) + 16];
+
+size_t drained_count = 0;
+size_t drained_lengths[64];
+uint8_t drained_first_bytes[64];
+
+static void make_packet(uint64_t session, uint8_t tag)
+{
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 'H';
+    packet[1] = 'e';
+    memcpy(packet + offsetof(he_wire_hdr_t, session), &session, sizeof(session));
+    packet[sizeof(he_wire_hdr_t)] = tag;
+}
+
+static uint64_t session_for_shard(size_t shard, uint64_t random)
+{
+    return ((uint64_t)shard << HE_SESSION_SHARD_SHIFT) | random;
+}
+
+static void record_packet(uint8_t *pkt, size_t length, void *context)
+{
+    TEST_ASSERT_EQUAL_PTR(&drained_count, context);
+    drained_lengths[drained_count] = length;
+    drained_first_bytes[drained_count] = pkt[sizeof(he_wire_hdr_t)];
+    drained_count++;
+}
+
+void setUp(void)
+{
+    drained_count = 0;
+    dispatcher = he_dispatcher_create(4, 8);
+}
+
+void tearDown(void)
+{
+    he_dispatcher_destroy(dispatcher);
+    dispatcher = NULL;
+}
+
+void test_create_rejects_bad_arguments(void)
+{
+    TEST_ASSERT_NULL(he_dispatcher_create(0, 8));
+    TEST_ASSERT_NULL(he_dispatcher_create(HE_MAX_SHARDS + 1, 8));
+    TEST_ASSERT_NULL(he_dispatcher_create(4, 0));
+}
+
+void test_shard_for_packet(void)
+{
+    size_t shard = 99;
+
+    make_packet(session_for_shard(3, 0x1234), 0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_shard_for_packet(dispatcher, packet, sizeof(packet), &shard));
+    TEST_ASSERT_EQUAL(3, shard);
+}
+
+void test_shard_for_packet_errors(void)
+{
+    size_t shard = 99;
+
+    make_packet(session_for_shard(1, 1), 0);
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_SMALL,
+                      he_dispatcher_shard_for_packet(dispatcher, packet, sizeof(he_wire_hdr_t) - 1, &shard));
+
+    make_packet(session_for_shard(4, 1), 0);
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_SHARD, he_dispatcher_shard_for_packet(dispatcher, packet, sizeof(packet), &shard));
+
+    make_packet(0, 0);
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_dispatcher_shard_for_packet(dispatcher, packet, sizeof(packet), &shard));
+
+    packet[0] = 'X';
+    TEST_ASSERT_EQUAL(HE_ERR_NOT_HE_PACKET, he_dispatcher_shard_for_packet(dispatcher, packet, sizeof(packet), &shard));
+    TEST_ASSERT_EQUAL(99, shard);
+}
+
+void test_route_local_packet_is_not_queued(void)
+{
+    bool queued = true;
+
+    make_packet(session_for_shard(2, 0x55), 0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_route(dispatcher, 2, packet, sizeof(packet), &queued));
+    TEST_ASSERT_FALSE(queued);
+    TEST_ASSERT_EQUAL(0, he_dispatcher_drain(dispatcher, 2, 10, record_packet, &drained_count));
+}
+
+void test_route_new_session_is_handled_locally(void)
+{
+    bool queued = true;
+
+    make_packet(0, 0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_route(dispatcher, 1, packet, sizeof(packet), &queued));
+    TEST_ASSERT_FALSE(queued);
+}
+
+void test_route_remote_packet_is_copied_to_owner(void)
+{
+    bool queued = false;
+
+    make_packet(session_for_shard(3, 0x55), 0xab);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_route(dispatcher, 0, packet, sizeof(packet), &queued));
+    TEST_ASSERT_TRUE(queued);
+
+    // The caller's buffer is free to be reused straight away
+    memset(packet, 0, sizeof(packet));
+
+    TEST_ASSERT_EQUAL(0, he_dispatcher_drain(dispatcher, 0, 10, record_packet, &drained_count));
+    TEST_ASSERT_EQUAL(1, he_dispatcher_drain(dispatcher, 3, 10, record_packet, &drained_count));
+    TEST_ASSERT_EQUAL(sizeof(packet), drained_lengths[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xab, drained_first_bytes[0]);
+}
+
+void test_push_rejects_oversized_packets(void)
+{
+    static uint8_t big[HE_MAX_WIRE_MTU + 1];
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE, he_dispatcher_push(dispatcher, 0, big, sizeof(big)));
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_SHARD, he_dispatcher_push(dispatcher, 4, packet, sizeof(packet)));
+}
+
+void test_queue_full_and_wraparound(void)
+{
+    make_packet(session_for_shard(1, 1), 0);
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        packet[sizeof(he_wire_hdr_t)] = i;
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_push(dispatcher, 1, packet, sizeof(packet)));
+    }
+    TEST_ASSERT_EQUAL(HE_ERR_QUEUE_FULL, he_dispatcher_push(dispatcher, 1, packet, sizeof(packet)));
+
+    // Drain part of the queue, then fill it again so the cells are reused
+    TEST_ASSERT_EQUAL(5, he_dispatcher_drain(dispatcher, 1, 5, record_packet, &drained_count));
+    for (uint8_t i = 8; i < 13; i++)
+    {
+        packet[sizeof(he_wire_hdr_t)] = i;
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_dispatcher_push(dispatcher, 1, packet, sizeof(packet)));
+    }
+
+    TEST_ASSERT_EQUAL(8, he_dispatcher_drain(dispatcher, 1, 100, record_packet, &drained_count));
+    for (uint8_t i = 0; i < 13; i++)
+    {
+        TEST_ASSERT_EQUAL(i, drained_first_bytes[i]);
+    }
+}
+
+#define PRODUCERS 4
+#define PER_PRODUCER 5000
+
+static void *producer(void *arg)
+{
+    uint8_t id = (uint8_t)(uintptr_t)arg;
+    uint8_t buf[sizeof(he_wire_hdr_t) + 8] = {'H', 'e'};
+
+    for (uint32_t seq = 0; seq < PER_PRODUCER; seq++)
+    {
+        buf[sizeof(he_wire_hdr_t)] = id;
+        memcpy(buf + sizeof(he_wire_hdr_t) + 1, &seq, sizeof(seq));
+        while (he_dispatcher_push(dispatcher, 0, buf, sizeof(buf)) == HE_ERR_QUEUE_FULL)
+        {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t next_seq[PRODUCERS];
+static size_t out_of_order = 0;
+
+static void check_order(uint8_t *pkt, size_t length, void *context)
+{
+    uint8_t id = pkt[sizeof(he_wire_hdr_t)];
+    uint32_t seq;
+    memcpy(&seq, pkt + sizeof(he_wire_hdr_t) + 1, sizeof(seq));
+
+    if (id >= PRODUCERS || seq != next_seq[id])
+    {
+        out_of_order++;
+        return;
+    }
+    next_seq[id]++;
+}
+
+void test_many_producers_one_consumer(void)
+{
+    pthread_t threads[PRODUCERS];
+    memset(next_seq, 0, sizeof(next_seq));
+    out_of_order = 0;
+
+    for (uintptr_t i = 0; i < PRODUCERS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer, (void *)i);
+    }
+
+    size_t total = 0;
+    while (total < PRODUCERS * PER_PRODUCER)
+    {
+        size_t drained = he_dispatcher_drain(dispatcher, 0, 16, check_order, NULL);
+        if (drained == 0)
+        {
+            sched_yield();
+        }
+        total += drained;
+    }
+
+    for (int i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL(PER_PRODUCER, next_seq[i]);
+    }
+    TEST_ASSERT_EQUAL(0, out_of_order);
+}
+
+#endif // TEST
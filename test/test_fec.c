@@ -0,0 +1,229 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "fec.h"
+#include "conn_template.h"
+
+he_conn_t sender;
+he_conn_t receiver;
+he_fec_t sender_fec;
+he_fec_t receiver_fec;
+
+// Everything the sender put on the wire, parity included
+uint8_t sent[(HE_FEC_MAX_GROUP + 1) * 2][HE_MAX_WIRE_MTU];
+size_t sent_lengths[(HE_FEC_MAX_GROUP + 1) * 2];
+size_t num_sent = 0;
+
+void setUp(void)
+{
+    memset(&sender, 0, sizeof(sender));
+    memset(&receiver, 0, sizeof(receiver));
+    memset(&sender_fec, 0, sizeof(sender_fec));
+    memset(&receiver_fec, 0, sizeof(receiver_fec));
+    sender.state = HE_STATE_ONLINE;
+    sender.fec = &sender_fec;
+    sender_fec.peer_capable = true;
+    receiver.state = HE_STATE_ONLINE;
+    receiver.fec = &receiver_fec;
+    num_sent = 0;
+}
+
+void tearDown(void)
+{
+}
+
+// Rows of sent aren't 8 byte aligned, so the header is read through its bytes
+static const uint8_t *reserved_of(size_t index)
+{
+    return sent[index] + offsetof(he_wire_hdr_t, reserved);
+}
+
+static void put_on_wire(const he_wire_hdr_t *hdr, const uint8_t *payload, size_t length)
+{
+    memcpy(sent[num_sent], hdr, sizeof(he_wire_hdr_t));
+    memcpy(sent[num_sent] + sizeof(he_wire_hdr_t), payload, length);
+    sent_lengths[num_sent] = sizeof(he_wire_hdr_t) + length;
+    num_sent++;
+}
+
+/// Send a record of the given length filled with seed, and its group's parity if it completes it
+static void send_record(size_t length, uint8_t seed)
+{
+    uint8_t record[HE_MAX_WIRE_MTU];
+    for (size_t i = 0; i < length; i++)
+    {
+        record[i] = (uint8_t)(seed + i);
+    }
+
+    he_wire_hdr_t hdr = {{'H', 'e'}, 1, 0};
+    TEST_ASSERT_TRUE(he_internal_fec_stamp(&sender, &hdr));
+    put_on_wire(&hdr, record, length);
+
+    he_wire_hdr_t parity_hdr;
+    const uint8_t *parity = NULL;
+    size_t parity_length =
+        he_internal_fec_add(&sender, &hdr, record, length, &parity_hdr, &parity);
+    if (parity_length)
+    {
+        put_on_wire(&parity_hdr, parity, parity_length);
+    }
+}
+
+static bool deliver(size_t index)
+{
+    return he_internal_fec_receive(&receiver, sent[index], &sent_lengths[index]);
+}
+
+void test_stamp_only_advertises_until_the_peer_is_capable(void)
+{
+    sender_fec.peer_capable = false;
+
+    he_wire_hdr_t hdr = {0};
+    TEST_ASSERT_FALSE(he_internal_fec_stamp(&sender, &hdr));
+    TEST_ASSERT_EQUAL(HE_FEC_CAPABLE, hdr.reserved[0]);
+    TEST_ASSERT_EQUAL(0, hdr.reserved[1]);
+    TEST_ASSERT_EQUAL(0, hdr.reserved[2]);
+}
+
+void test_stamp_leaves_handshakes_unprotected(void)
+{
+    sender.state = HE_STATE_CONNECTING;
+
+    he_wire_hdr_t hdr = {0};
+    TEST_ASSERT_FALSE(he_internal_fec_stamp(&sender, &hdr));
+}
+
+void test_parity_follows_every_group(void)
+{
+    for (int i = 0; i < HE_FEC_MAX_GROUP * 2; i++)
+    {
+        send_record(100, (uint8_t)i);
+    }
+
+    // Each group of five records on a clean link is followed by its parity
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP * 2 + 2, num_sent);
+    const uint8_t *parity = reserved_of(HE_FEC_MAX_GROUP);
+    TEST_ASSERT_EQUAL(HE_FEC_CAPABLE | HE_FEC_TYPE_PARITY, parity[0]);
+    TEST_ASSERT_EQUAL(0, parity[1]);
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP << 4 | (HE_FEC_MAX_GROUP - 1), parity[2]);
+    TEST_ASSERT_EQUAL(1, reserved_of(HE_FEC_MAX_GROUP + 1)[1]);
+    TEST_ASSERT_EQUAL(2, sender_fec.parity_sent);
+}
+
+void test_lost_record_is_rebuilt_from_parity(void)
+{
+    size_t lengths[HE_FEC_MAX_GROUP] = {60, 120, 90, 40, 100};
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        send_record(lengths[i], (uint8_t)(i * 31));
+    }
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP + 1, num_sent);
+
+    // Keep what the lost record looked like before the parity is rewritten over it
+    uint8_t lost[HE_MAX_WIRE_MTU];
+    size_t lost_length = sent_lengths[1];
+    memcpy(lost, sent[1], lost_length);
+
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        if (i != 1)
+        {
+            TEST_ASSERT_TRUE(deliver(i));
+        }
+    }
+
+    TEST_ASSERT_TRUE(deliver(HE_FEC_MAX_GROUP));
+    TEST_ASSERT_EQUAL(lost_length, sent_lengths[HE_FEC_MAX_GROUP]);
+    TEST_ASSERT_EQUAL_MEMORY(lost + sizeof(he_wire_hdr_t), sent[HE_FEC_MAX_GROUP] + sizeof(he_wire_hdr_t),
+                             lost_length - sizeof(he_wire_hdr_t));
+
+    const uint8_t *rebuilt = reserved_of(HE_FEC_MAX_GROUP);
+    TEST_ASSERT_EQUAL(HE_FEC_TYPE_DATA, rebuilt[0] & HE_FEC_TYPE_MASK);
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP << 4 | 1, rebuilt[2]);
+    TEST_ASSERT_EQUAL(1, receiver_fec.recovered);
+}
+
+void test_parity_is_consumed_when_nothing_is_missing(void)
+{
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        send_record(80, (uint8_t)i);
+    }
+
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        TEST_ASSERT_TRUE(deliver(i));
+    }
+    TEST_ASSERT_FALSE(deliver(HE_FEC_MAX_GROUP));
+    TEST_ASSERT_EQUAL(0, receiver_fec.recovered);
+}
+
+void test_parity_cannot_rebuild_two_lost_records(void)
+{
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        send_record(80, (uint8_t)i);
+    }
+
+    TEST_ASSERT_TRUE(deliver(0));
+    TEST_ASSERT_TRUE(deliver(3));
+    TEST_ASSERT_TRUE(deliver(4));
+    TEST_ASSERT_FALSE(deliver(HE_FEC_MAX_GROUP));
+    TEST_ASSERT_EQUAL(0, receiver_fec.recovered);
+}
+
+void test_receive_tracks_what_the_peer_advertises(void)
+{
+    he_wire_hdr_t hdr = {{'H', 'e'}, 1, 0};
+    hdr.reserved[0] = HE_FEC_CAPABLE | (7 << HE_FEC_LOSS_SHIFT);
+    size_t length = sizeof(hdr);
+
+    TEST_ASSERT_TRUE(he_internal_fec_receive(&receiver, (uint8_t *)&hdr, &length));
+    TEST_ASSERT_TRUE(receiver_fec.peer_capable);
+    TEST_ASSERT_EQUAL(7, receiver_fec.peer_loss);
+
+    // A peer that turns FEC off, or never had it, leaves the reserved bytes zero
+    memset(hdr.reserved, 0, sizeof(hdr.reserved));
+    TEST_ASSERT_TRUE(he_internal_fec_receive(&receiver, (uint8_t *)&hdr, &length));
+    TEST_ASSERT_FALSE(receiver_fec.peer_capable);
+    TEST_ASSERT_EQUAL(0, receiver_fec.peer_loss);
+}
+
+void test_group_size_follows_reported_loss(void)
+{
+    // Lose every other group outright on the way to the receiver
+    for (int group = 0; group < 32; group++)
+    {
+        num_sent = 0;
+        for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+        {
+            send_record(50, (uint8_t)i);
+        }
+        if (group % 2 == 0)
+        {
+            for (size_t i = 0; i < num_sent; i++)
+            {
+                deliver(i);
+            }
+        }
+    }
+    TEST_ASSERT_GREATER_THAN(64, receiver_fec.loss);
+
+    // The receiver reports it back in the header of what it sends...
+    he_wire_hdr_t hdr = {{'H', 'e'}, 1, 0};
+    receiver_fec.peer_capable = false;
+    he_internal_fec_stamp(&receiver, &hdr);
+    size_t length = sizeof(hdr);
+    TEST_ASSERT_TRUE(he_internal_fec_receive(&sender, (uint8_t *)&hdr, &length));
+
+    // ... and the sender's next group is as small as it gets
+    num_sent = 0;
+    for (int i = 0; i < HE_FEC_MIN_GROUP; i++)
+    {
+        send_record(50, (uint8_t)i);
+    }
+    TEST_ASSERT_EQUAL(HE_FEC_MIN_GROUP + 1, num_sent);
+}
+
+#endif // TEST
@@ -0,0 +1,328 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "handshake_pool.h"
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "core.h"
+#include "fec.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "timers.h"
+#include "wolf.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+he_handshake_pool_t *pool;
+he_timers_t *data_plane_timers;
+he_conn_t conn;
+he_conn_t other;
+uint8_t datagram[100];
+
+_Atomic int handshake_done;
+_Atomic int reads;
+_Atomic bool read_on_caller;
+pthread_t caller;
+
+he_conn_t *collected_conn;
+he_return_code_t collected_result;
+int collected_count;
+
+static int read_handshake(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    if (pthread_equal(pthread_self(), caller))
+    {
+        atomic_store(&read_on_caller, true);
+    }
+    atomic_fetch_add(&reads, 1);
+    return -1;
+}
+
+static int read_and_fail(WOLFSSL *ssl, void *buf, int sz, int cmock_num_calls)
+{
+    conn.state = HE_STATE_DISCONNECTED;
+    return -1;
+}
+
+static int init_finished(WOLFSSL *ssl, int cmock_num_calls)
+{
+    return atomic_load(&handshake_done);
+}
+
+static void on_done(he_conn_t *done, he_return_code_t result, void *context)
+{
+    collected_conn = done;
+    collected_result = result;
+    collected_count++;
+}
+
+static void wait_for_completed(uint64_t value)
+{
+    he_handshake_pool_stats_t stats = {0};
+    for (int i = 0; i < 2000 && stats.completed < value; i++)
+    {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+        he_handshake_pool_get_stats(pool, &stats);
+    }
+    TEST_ASSERT_EQUAL(value, stats.completed);
+}
+
+static size_t collect_one(void)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        if (he_handshake_pool_collect(pool, 0, 8, on_done, NULL))
+        {
+            return 1;
+        }
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+
+static void make_conn(he_conn_t *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->state = HE_STATE_CONNECTING;
+    c->wolf_ssl = (WOLFSSL *)0x1234;
+    he_timers_attach(data_plane_timers, c);
+}
+
+void setUp(void)
+{
+    caller = pthread_self();
+    atomic_store(&handshake_done, 0);
+    atomic_store(&reads, 0);
+    atomic_store(&read_on_caller, false);
+    collected_conn = NULL;
+    collected_count = 0;
+
+    data_plane_timers = he_timers_create(0);
+    make_conn(&conn);
+    he_internal_write_packet_header(&conn, (he_wire_hdr_t *)datagram);
+
+    wolfSSL_read_StubWithCallback(read_handshake);
+    wolfSSL_get_error_IgnoreAndReturn(SSL_ERROR_WANT_READ);
+    wolfSSL_is_init_finished_StubWithCallback(init_finished);
+    wolfSSL_dtls_get_current_timeout_IgnoreAndReturn(1);
+
+    pool = he_handshake_pool_create(1, 1, 4, 16);
+    TEST_ASSERT_NOT_NULL(pool);
+}
+
+void tearDown(void)
+{
+    he_handshake_pool_destroy(pool);
+    he_timers_destroy(data_plane_timers);
+}
+
+void test_create_rejects_bad_arguments(void)
+{
+    TEST_ASSERT_NULL(he_handshake_pool_create(0, 1, 4, 16));
+    TEST_ASSERT_NULL(he_handshake_pool_create(1, 0, 4, 16));
+    TEST_ASSERT_NULL(he_handshake_pool_create(1, HE_MAX_SHARDS + 1, 4, 16));
+    TEST_ASSERT_NULL(he_handshake_pool_create(1, 1, 0, 16));
+    TEST_ASSERT_NULL(he_handshake_pool_create(1, 1, 4, 0));
+    he_handshake_pool_destroy(NULL);
+}
+
+void test_route_bad_arguments(void)
+{
+    bool queued = true;
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                      he_handshake_pool_route(pool, 0, NULL, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_EQUAL(HE_ERR_INVALID_SHARD,
+                      he_handshake_pool_route(pool, 1, &conn, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_FALSE(queued);
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, HE_MAX_WIRE_MTU + 1, &queued));
+    TEST_ASSERT_EQUAL(0, he_handshake_pool_collect(pool, 1, 8, on_done, NULL));
+}
+
+void test_established_connections_stay_on_the_data_plane(void)
+{
+    bool queued = true;
+    conn.state = HE_STATE_ONLINE;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_FALSE(queued);
+    TEST_ASSERT_FALSE(he_handshake_pool_owns(&conn));
+
+    he_handshake_pool_stats_t stats;
+    he_handshake_pool_get_stats(pool, &stats);
+    TEST_ASSERT_EQUAL(0, stats.adopted);
+}
+
+void test_handshake_runs_on_the_pool_and_comes_back(void)
+{
+    bool queued = false;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_TRUE(queued);
+    TEST_ASSERT_TRUE(he_handshake_pool_owns(&conn));
+
+    // Nothing to collect while the handshake is still going
+    struct timespec pause = {0, 5000000};
+    nanosleep(&pause, NULL);
+    TEST_ASSERT_EQUAL(0, he_handshake_pool_collect(pool, 0, 8, on_done, NULL));
+    TEST_ASSERT_TRUE(he_handshake_pool_owns(&conn));
+
+    atomic_store(&handshake_done, 1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_TRUE(queued);
+
+    TEST_ASSERT_EQUAL(1, collect_one());
+    TEST_ASSERT_EQUAL_PTR(&conn, collected_conn);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, collected_result);
+    TEST_ASSERT_EQUAL(HE_STATE_LINK_UP, conn.state);
+    TEST_ASSERT_FALSE(he_handshake_pool_owns(&conn));
+    TEST_ASSERT_NULL(conn.handshake);
+    TEST_ASSERT_EQUAL_PTR(data_plane_timers, conn.timers);
+
+    // Every datagram was decrypted away from the data-plane thread
+    TEST_ASSERT_EQUAL(2, atomic_load(&reads));
+    TEST_ASSERT_FALSE(atomic_load(&read_on_caller));
+
+    he_handshake_pool_stats_t stats;
+    he_handshake_pool_get_stats(pool, &stats);
+    TEST_ASSERT_EQUAL(1, stats.adopted);
+    TEST_ASSERT_EQUAL(1, stats.completed);
+    TEST_ASSERT_EQUAL(0, stats.failed);
+    TEST_ASSERT_EQUAL(0, stats.in_flight);
+}
+
+void test_failed_handshake_comes_back_disconnected(void)
+{
+    bool queued = false;
+    wolfSSL_read_StubWithCallback(read_and_fail);
+
+    he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued);
+    TEST_ASSERT_TRUE(queued);
+
+    TEST_ASSERT_EQUAL(1, collect_one());
+    TEST_ASSERT_EQUAL(HE_ERR_CONNECT_FAILED, collected_result);
+    TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, conn.state);
+
+    he_handshake_pool_stats_t stats;
+    he_handshake_pool_get_stats(pool, &stats);
+    TEST_ASSERT_EQUAL(1, stats.failed);
+}
+
+void test_datagrams_after_the_hand_back_stay_on_the_data_plane(void)
+{
+    bool queued = false;
+    atomic_store(&handshake_done, 1);
+
+    he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued);
+    wait_for_completed(1);
+
+    // Handed back but not collected yet, the next datagram takes it back there and then
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued));
+    TEST_ASSERT_FALSE(queued);
+    TEST_ASSERT_FALSE(he_handshake_pool_owns(&conn));
+    TEST_ASSERT_EQUAL_PTR(data_plane_timers, conn.timers);
+
+    // And it is still reported exactly once
+    TEST_ASSERT_EQUAL(1, he_handshake_pool_collect(pool, 0, 8, on_done, NULL));
+    TEST_ASSERT_EQUAL_PTR(&conn, collected_conn);
+    TEST_ASSERT_EQUAL(0, he_handshake_pool_collect(pool, 0, 8, on_done, NULL));
+}
+
+void test_full_pool_leaves_handshakes_on_the_data_plane(void)
+{
+    he_handshake_pool_destroy(pool);
+    pool = he_handshake_pool_create(1, 1, 1, 16);
+    make_conn(&other);
+
+    bool queued = false;
+    he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued);
+    TEST_ASSERT_TRUE(queued);
+
+    he_handshake_pool_route(pool, 0, &other, datagram, sizeof(datagram), &queued);
+    TEST_ASSERT_FALSE(queued);
+    TEST_ASSERT_FALSE(he_handshake_pool_owns(&other));
+    TEST_ASSERT_EQUAL_PTR(data_plane_timers, other.timers);
+
+    he_handshake_pool_stats_t stats;
+    he_handshake_pool_get_stats(pool, &stats);
+    TEST_ASSERT_EQUAL(1, stats.adopted);
+    TEST_ASSERT_EQUAL(1, stats.declined);
+    TEST_ASSERT_EQUAL(1, stats.in_flight);
+}
+
+void test_destroy_lets_go_of_connections_still_in_the_pool(void)
+{
+    bool queued = false;
+    he_handshake_pool_route(pool, 0, &conn, datagram, sizeof(datagram), &queued);
+    TEST_ASSERT_TRUE(queued);
+
+    he_handshake_pool_destroy(pool);
+    pool = NULL;
+
+    TEST_ASSERT_NULL(conn.handshake);
+    TEST_ASSERT_NULL(conn.timers);
+}
+
+void test_no_datagram_is_lost_in_the_hand_back(void)
+{
+    static he_conn_t conns[4];
+    he_handshake_pool_destroy(pool);
+    pool = he_handshake_pool_create(1, 1, 4, 1024);
+
+    for (size_t c = 0; c < 4; c++)
+    {
+        make_conn(&conns[c]);
+    }
+
+    // Handshakes finish part way through, whatever is still queued after that must be processed
+    // either by the pool or, once handed back, here
+    size_t inline_reads = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        if (i == 50)
+        {
+            atomic_store(&handshake_done, 1);
+        }
+        for (size_t c = 0; c < 4; c++)
+        {
+            bool queued = false;
+            TEST_ASSERT_EQUAL(HE_SUCCESS, he_handshake_pool_route(pool, 0, &conns[c], datagram,
+                                                                  sizeof(datagram), &queued));
+            inline_reads += !queued;
+        }
+    }
+
+    size_t collected = 0;
+    for (int i = 0; i < 2000 && collected < 4; i++)
+    {
+        collected += he_handshake_pool_collect(pool, 0, 8, on_done, NULL);
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+    TEST_ASSERT_EQUAL(4, collected);
+    TEST_ASSERT_EQUAL(400, (size_t)atomic_load(&reads) + inline_reads);
+
+    for (size_t c = 0; c < 4; c++)
+    {
+        TEST_ASSERT_EQUAL(HE_STATE_LINK_UP, conns[c].state);
+        TEST_ASSERT_NULL(conns[c].handshake);
+    }
+}
+
+#endif // TEST
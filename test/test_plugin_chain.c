@@ -238,6 +238,251 @@ void test_egress_only_plugin(void)
     TEST_ASSERT_EQUAL(1, egress_count);
 }
 
+int order_log[32];
+int order_log_count = 0;
+
+he_plugin_return_code_t log_order(uint8_t *packet, size_t *length, size_t capacity, void *data)
+{
+    order_log[order_log_count++] = *(int *)data;
+    return HE_PLUGIN_SUCCESS;
+}
+
+void test_ordering_preserved_beyond_initial_capacity(void)
+{
+    he_return_code_t res = HE_ERR_FAILED;
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    int ids[10];
+    plugin_struct_t plugins[10] = {0};
+
+    for (int i = 0; i < 10; i++)
+    {
+        ids[i] = i;
+        plugins[i].do_ingress = log_order;
+        // Only every other plugin handles egress
+        plugins[i].do_egress = (i % 2 == 0) ? log_order : NULL;
+        plugins[i].data = &ids[i];
+        res = he_plugin_register_plugin(chain, &plugins[i]);
+        TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    }
+
+    order_log_count = 0;
+    res = he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(10, order_log_count);
+    for (int i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL(i, order_log[i]);
+    }
+
+    order_log_count = 0;
+    res = he_plugin_egress(chain, packet, &test_packet_size, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(5, order_log_count);
+    for (int i = 0; i < 5; i++)
+    {
+        TEST_ASSERT_EQUAL(8 - i * 2, order_log[i]);
+    }
+
+    he_plugin_destroy_chain(chain);
+}
+
+void test_chain_with_storage_never_allocates(void)
+{
+    he_plugin_chain_t chain;
+    plugin_struct_t *storage[2 * 3] = {0};
+
+    he_plugin_chain_init_with_storage(&chain, storage, 2);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(&chain, &call_counting_plugin));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_register_plugin(&chain, &only_egress_plugin));
+    TEST_ASSERT_EQUAL(HE_ERR_NO_MEMORY, he_plugin_register_plugin(&chain, &only_ingress_plugin));
+
+    TEST_ASSERT_EQUAL_PTR(&call_counting_plugin, storage[0]);
+    TEST_ASSERT_EQUAL_PTR(&call_counting_plugin, storage[2]);
+    TEST_ASSERT_EQUAL_PTR(&only_egress_plugin, storage[5]);
+
+    size_t length = test_packet_size;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_plugin_egress(&chain, packet, &length, packet_max_length));
+    TEST_ASSERT_EQUAL(2, egress_count);
+
+    // Neither the chain nor the storage belong to the chain, so this must leave them alone
+    he_plugin_destroy_chain(&chain);
+}
+
+void test_drop_stops_the_chain(void)
+{
+    he_return_code_t res = HE_ERR_FAILED;
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    memset(packet, 0, packet_max_length);
+
+    res = he_plugin_register_plugin(chain, &zero_dropping_plugin);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    res = he_plugin_register_plugin(chain, &call_counting_plugin);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+
+    res = he_plugin_ingress(chain, packet, &test_packet_size, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, res);
+    TEST_ASSERT_EQUAL(0, ingress_count);
+
+    // Egress reaches the counting plugin first, then drops
+    res = he_plugin_egress(chain, packet, &test_packet_size, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, res);
+    TEST_ASSERT_EQUAL(1, egress_count);
+
+    he_plugin_destroy_chain(chain);
+}
+
+#define BATCH_SIZE 4
+
+int batch_call_count = 0;
+
+he_plugin_return_code_t drop_odd_lengths_batch(uint8_t **packets, size_t *lengths, const size_t *capacities,
+                                               he_plugin_return_code_t *verdicts, size_t count, void *data)
+{
+    batch_call_count++;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (verdicts[i] == HE_PLUGIN_SUCCESS && lengths[i] % 2 == 1)
+        {
+            verdicts[i] = HE_PLUGIN_DROP;
+        }
+    }
+    return HE_PLUGIN_SUCCESS;
+}
+
+he_plugin_return_code_t fail_batch(uint8_t **packets, size_t *lengths, const size_t *capacities,
+                                   he_plugin_return_code_t *verdicts, size_t count, void *data)
+{
+    batch_call_count++;
+    return HE_PLUGIN_FAIL;
+}
+
+plugin_struct_t batch_only_plugin = {
+    .do_ingress_batch = drop_odd_lengths_batch,
+    .do_egress_batch = drop_odd_lengths_batch,
+};
+
+plugin_struct_t failing_batch_plugin = {
+    .do_ingress_batch = fail_batch,
+    .do_egress_batch = fail_batch,
+};
+
+uint8_t batch_buffers[BATCH_SIZE][64];
+uint8_t *batch_packets[BATCH_SIZE];
+size_t batch_lengths[BATCH_SIZE];
+size_t batch_capacities[BATCH_SIZE];
+he_plugin_return_code_t batch_verdicts[BATCH_SIZE];
+
+static void setup_batch(void)
+{
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        batch_packets[i] = batch_buffers[i];
+        batch_lengths[i] = 10 + i;
+        batch_capacities[i] = sizeof(batch_buffers[i]);
+    }
+    batch_call_count = 0;
+}
+
+void test_batch_fails_on_null(void)
+{
+    setup_batch();
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                      he_plugin_ingress_batch(chain, NULL, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER,
+                      he_plugin_egress_batch(chain, batch_packets, batch_lengths, batch_capacities, NULL, BATCH_SIZE));
+
+    he_plugin_destroy_chain(chain);
+}
+
+void test_batch_falls_back_to_per_packet_hooks(void)
+{
+    setup_batch();
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    he_plugin_register_plugin(chain, &call_counting_plugin);
+
+    he_return_code_t res =
+        he_plugin_ingress_batch(chain, batch_packets, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(BATCH_SIZE, ingress_count);
+
+    res = he_plugin_egress_batch(chain, batch_packets, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(BATCH_SIZE, egress_count);
+
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, batch_verdicts[i]);
+    }
+
+    he_plugin_destroy_chain(chain);
+}
+
+void test_batch_dropped_packets_skip_later_plugins(void)
+{
+    setup_batch();
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    he_plugin_register_plugin(chain, &batch_only_plugin);
+    he_plugin_register_plugin(chain, &call_counting_plugin);
+
+    he_return_code_t res =
+        he_plugin_ingress_batch(chain, batch_packets, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(1, batch_call_count);
+    // Lengths 11 and 13 are dropped before reaching the counting plugin
+    TEST_ASSERT_EQUAL(2, ingress_count);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, batch_verdicts[0]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, batch_verdicts[1]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_SUCCESS, batch_verdicts[2]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, batch_verdicts[3]);
+
+    // Egress runs the counting plugin first, so it sees every packet
+    res = he_plugin_egress_batch(chain, batch_packets, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(BATCH_SIZE, egress_count);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, batch_verdicts[1]);
+
+    he_plugin_destroy_chain(chain);
+}
+
+void test_batch_failure_fails_live_packets(void)
+{
+    setup_batch();
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    he_plugin_register_plugin(chain, &batch_only_plugin);
+    he_plugin_register_plugin(chain, &failing_batch_plugin);
+
+    he_return_code_t res =
+        he_plugin_ingress_batch(chain, batch_packets, batch_lengths, batch_capacities, batch_verdicts, BATCH_SIZE);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_FAIL, batch_verdicts[0]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, batch_verdicts[1]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_FAIL, batch_verdicts[2]);
+    TEST_ASSERT_EQUAL(HE_PLUGIN_DROP, batch_verdicts[3]);
+
+    he_plugin_destroy_chain(chain);
+}
+
+void test_single_packet_path_uses_batch_only_plugin(void)
+{
+    he_plugin_chain_t *chain = he_plugin_chain_create();
+    he_plugin_register_plugin(chain, &batch_only_plugin);
+    batch_call_count = 0;
+
+    size_t length = 11;
+    he_return_code_t res = he_plugin_ingress(chain, packet, &length, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, res);
+
+    length = 12;
+    res = he_plugin_egress(chain, packet, &length, packet_max_length);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, res);
+    TEST_ASSERT_EQUAL(2, batch_call_count);
+
+    he_plugin_destroy_chain(chain);
+}
+
 void test_plugin_chain_destroy_fails_on_null(void)
 {
     he_plugin_destroy_chain(NULL);
@@ -0,0 +1,335 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "pmtu.h"
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "core.h"
+#include "fec.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "timers.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+// What wolfSSL adds to a DTLS 1.2 AES-GCM record: header, explicit nonce and tag
+#define OVERHEAD (13 + 8 + 16)
+#define MAX_QUEUED 16
+
+he_timers_t *timers = NULL;
+// a runs discovery, b only answers its probes
+he_conn_t a;
+he_conn_t b;
+
+uint64_t now = 0;
+// Largest datagram the path between them takes
+size_t path_mtu = HE_MAX_WIRE_MTU;
+// Largest record wolfSSL was told to build, per connection
+size_t record_limit[2];
+size_t probes_sent = 0;
+int pmtu_events = 0;
+// Whether b runs a version that knows probes
+bool b_answers = true;
+
+typedef struct queued_record
+{
+    he_conn_t *to;
+    uint8_t data[HE_MAX_WIRE_MTU];
+    size_t length;
+} queued_record_t;
+
+queued_record_t queue[MAX_QUEUED];
+size_t num_queued = 0;
+
+static he_conn_t *conn_of(WOLFSSL *ssl)
+{
+    return (uintptr_t)ssl == 1 ? &a : &b;
+}
+
+int output_size(WOLFSSL *ssl, int length, int cmock_num_calls)
+{
+    return length + OVERHEAD;
+}
+
+int set_record_limit(WOLFSSL *ssl, unsigned short mtu, int cmock_num_calls)
+{
+    record_limit[(uintptr_t)ssl - 1] = mtu;
+    return SSL_SUCCESS;
+}
+
+// Encrypts by adding OVERHEAD, then puts the datagram on a path that drops anything too large
+int write_record(WOLFSSL *ssl, const void *data, int length, int cmock_num_calls)
+{
+    size_t record = (size_t)length + OVERHEAD;
+    if (record > record_limit[(uintptr_t)ssl - 1])
+    {
+        return SSL_FATAL_ERROR;
+    }
+
+    const uint8_t *bytes = data;
+    if (conn_of(ssl) == &a && bytes[0] == HE_PMTU_MARKER && bytes[1] == HE_PMTU_TYPE_PROBE)
+    {
+        probes_sent++;
+    }
+
+    if (record + sizeof(he_wire_hdr_t) > path_mtu)
+    {
+        return length;
+    }
+
+    TEST_ASSERT_TRUE(num_queued < MAX_QUEUED);
+    queued_record_t *queued = &queue[num_queued++];
+    queued->to = conn_of(ssl) == &a ? &b : &a;
+    memcpy(queued->data, data, length);
+    queued->length = length;
+
+    return length;
+}
+
+he_return_code_t count_pmtu_events(he_conn_t *conn, he_conn_event_t event, void *context)
+{
+    if (event == HE_EVENT_PMTU_CHANGED)
+    {
+        pmtu_events++;
+    }
+    return HE_SUCCESS;
+}
+
+static void deliver_all(void)
+{
+    // Answering a record can queue another, take them one at a time
+    while (num_queued)
+    {
+        queued_record_t record = queue[0];
+        memmove(queue, queue + 1, --num_queued * sizeof(queued_record_t));
+
+        TEST_ASSERT_TRUE(he_internal_pmtu_is_control(record.data, record.length));
+        if (record.to == &b && !b_answers)
+        {
+            continue;
+        }
+        he_internal_pmtu_receive(record.to, record.data, record.length);
+    }
+}
+
+static void run_for(uint64_t ms)
+{
+    uint64_t until = now + ms;
+    while (now < until)
+    {
+        now += 10;
+        he_timers_advance(timers, now);
+        deliver_all();
+    }
+}
+
+static size_t inside_mtu_for(size_t datagram)
+{
+    return datagram - sizeof(he_wire_hdr_t) - OVERHEAD;
+}
+
+void setUp(void)
+{
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    now = 1000;
+    path_mtu = HE_MAX_WIRE_MTU;
+    record_limit[0] = record_limit[1] = HE_MAX_WIRE_MTU - sizeof(he_wire_hdr_t);
+    probes_sent = 0;
+    pmtu_events = 0;
+    b_answers = true;
+    num_queued = 0;
+
+    wolfSSL_GetOutputSize_StubWithCallback(output_size);
+    wolfSSL_dtls_set_mtu_StubWithCallback(set_record_limit);
+    wolfSSL_write_StubWithCallback(write_record);
+
+    timers = he_timers_create(now);
+    a.wolf_ssl = (WOLFSSL *)(uintptr_t)1;
+    a.state = HE_STATE_ONLINE;
+    b.wolf_ssl = (WOLFSSL *)(uintptr_t)2;
+    b.state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_attach(timers, &a));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_attach(timers, &b));
+    he_conn_edit_settings(&a)->event_cb = count_pmtu_events;
+}
+
+void tearDown(void)
+{
+    he_timers_destroy(timers);
+    timers = NULL;
+    free(a.pmtu);
+    he_conn_template_release(a.conn_template);
+}
+
+void test_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_conn_set_pmtu_discovery(NULL, true));
+    TEST_ASSERT_EQUAL(0, he_conn_get_inside_mtu(NULL));
+}
+
+void test_inside_mtu_defaults_to_max_mtu(void)
+{
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inside_mtu(&a));
+}
+
+void test_clean_path_settles_on_first_probe(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+
+    TEST_ASSERT_EQUAL(1, probes_sent);
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, a.pmtu->current);
+    TEST_ASSERT_EQUAL(inside_mtu_for(HE_MAX_WIRE_MTU), he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU - sizeof(he_wire_hdr_t), record_limit[0]);
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+
+    // Nothing more until the re-probe
+    run_for(HE_PMTU_REPROBE_MS / 2);
+    TEST_ASSERT_EQUAL(1, probes_sent);
+}
+
+void test_search_converges_on_a_narrow_path(void)
+{
+    path_mtu = 1280;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(60000);
+
+    TEST_ASSERT_FALSE(a.pmtu->searching);
+    TEST_ASSERT_TRUE(a.pmtu->current <= 1280);
+    TEST_ASSERT_TRUE(a.pmtu->current > 1280 - HE_PMTU_RESOLUTION);
+    TEST_ASSERT_EQUAL(inside_mtu_for(a.pmtu->current), he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(a.pmtu->current - sizeof(he_wire_hdr_t), record_limit[0]);
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+}
+
+void test_peer_that_never_answers_keeps_the_defaults(void)
+{
+    b_answers = false;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(60000);
+
+    TEST_ASSERT_FALSE(a.pmtu->searching);
+    TEST_ASSERT_EQUAL(0, a.pmtu->current);
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU - sizeof(he_wire_hdr_t), record_limit[0]);
+    TEST_ASSERT_EQUAL(0, pmtu_events);
+
+    // Once the peer is upgraded the next search settles the path
+    b_answers = true;
+    run_for(HE_PMTU_REPROBE_MS);
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, a.pmtu->current);
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+}
+
+void test_path_that_only_takes_the_minimum_is_found(void)
+{
+    path_mtu = HE_PMTU_MIN + HE_PMTU_RESOLUTION / 2;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(60000);
+
+    TEST_ASSERT_FALSE(a.pmtu->searching);
+    TEST_ASSERT_EQUAL(HE_PMTU_MIN, a.pmtu->current);
+    TEST_ASSERT_EQUAL(inside_mtu_for(HE_PMTU_MIN), he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+}
+
+void test_outside_mtu_caps_the_search(void)
+{
+    he_conn_edit_settings(&a)->outside_mtu = 1000;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+
+    TEST_ASSERT_EQUAL(1, probes_sent);
+    TEST_ASSERT_EQUAL(1000, a.pmtu->current);
+    TEST_ASSERT_EQUAL(inside_mtu_for(1000), he_conn_get_inside_mtu(&a));
+}
+
+void test_shrinking_path_is_found_on_reprobe(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, a.pmtu->current);
+
+    path_mtu = 1200;
+    run_for(HE_PMTU_REPROBE_MS);
+    TEST_ASSERT_TRUE(a.pmtu->verifying);
+
+    // The size in use is lost, so the connection drops to the minimum straight away
+    run_for(HE_PMTU_PROBE_TIMEOUT_MS * HE_PMTU_MAX_PROBES);
+    TEST_ASSERT_EQUAL(inside_mtu_for(HE_PMTU_MIN), he_conn_get_inside_mtu(&a));
+
+    run_for(60000);
+    TEST_ASSERT_FALSE(a.pmtu->searching);
+    TEST_ASSERT_TRUE(a.pmtu->current <= 1200);
+    TEST_ASSERT_TRUE(a.pmtu->current > 1200 - HE_PMTU_RESOLUTION);
+    TEST_ASSERT_EQUAL(3, pmtu_events);
+}
+
+void test_unchanged_path_is_only_verified(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+    run_for(HE_PMTU_REPROBE_MS);
+
+    TEST_ASSERT_EQUAL(2, probes_sent);
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU, a.pmtu->current);
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+}
+
+void test_nothing_is_probed_unless_online(void)
+{
+    a.state = HE_STATE_CONNECTING;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    he_internal_pmtu_poll(&a);
+
+    a.state = HE_STATE_ONLINE;
+    a.renegotiation_in_progress = true;
+    he_internal_pmtu_poll(&a);
+
+    TEST_ASSERT_EQUAL(0, probes_sent);
+}
+
+void test_stray_ack_is_ignored(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    uint8_t ack[HE_PMTU_HEADER_SIZE] = {HE_PMTU_MARKER, HE_PMTU_TYPE_ACK, 0x05, 0xdc};
+    he_internal_pmtu_receive(&a, ack, sizeof(ack));
+
+    TEST_ASSERT_EQUAL(0, a.pmtu->current);
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inside_mtu(&a));
+}
+
+void test_inside_packets_past_the_inside_mtu_are_refused(void)
+{
+    path_mtu = 1000;
+    he_conn_edit_settings(&a)->outside_mtu = 1000;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+
+    uint8_t packet[HE_MAX_MTU] = {0x45};
+    size_t length = he_conn_get_inside_mtu(&a) + 1;
+    TEST_ASSERT_EQUAL(HE_ERR_PACKET_TOO_LARGE,
+                      he_conn_inside_packet_received(&a, packet, length, sizeof(packet)));
+}
+
+void test_disabling_goes_back_to_the_defaults(void)
+{
+    he_conn_edit_settings(&a)->outside_mtu = 1000;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, true));
+    run_for(100);
+    TEST_ASSERT_EQUAL(1, pmtu_events);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_set_pmtu_discovery(&a, false));
+    TEST_ASSERT_NULL(a.pmtu);
+    TEST_ASSERT_EQUAL(HE_MAX_MTU, he_conn_get_inside_mtu(&a));
+    TEST_ASSERT_EQUAL(HE_MAX_WIRE_MTU - sizeof(he_wire_hdr_t), record_limit[0]);
+    TEST_ASSERT_EQUAL(2, pmtu_events);
+}
+
+#endif
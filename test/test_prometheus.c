@@ -0,0 +1,94 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "prometheus.h"
+#include "stats.h"
+#include "utils.h"
+
+he_stats_t stats;
+char text[4096];
+
+void setUp(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    memset(text, 0, sizeof(text));
+}
+
+void tearDown(void)
+{
+}
+
+void test_write_stats_counters(void)
+{
+    stats.packets[HE_STATS_INSIDE_IN] = 3;
+    stats.bytes[HE_STATS_INSIDE_IN] = 1500;
+    stats.packets[HE_STATS_OUTSIDE_OUT] = 4;
+    stats.aggressive_duplicates = 8;
+
+    size_t length = he_prometheus_write_stats(&stats, text, sizeof(text));
+    TEST_ASSERT_EQUAL(strlen(text), length);
+
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_packets_total counter\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_packets_total{direction=\"inside_in\"} 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_packets_total{direction=\"outside_out\"} 4\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_packets_total{direction=\"inside_out\"} 0\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_bytes_total{direction=\"inside_in\"} 1500\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_aggressive_duplicates_total 8\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_drops_total counter\n"));
+}
+
+void test_write_stats_only_lists_reasons_with_drops(void)
+{
+    stats.drops[-HE_ERR_PLUGIN_DROP] = 5;
+
+    he_prometheus_write_stats(&stats, text, sizeof(text));
+
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_drops_total{reason=\"HE_ERR_PLUGIN_DROP\"} 5\n"));
+    TEST_ASSERT_NULL(strstr(text, "HE_ERR_PACKET_TOO_LARGE"));
+}
+
+void test_write_stats_truncates_like_snprintf(void)
+{
+    size_t full = he_prometheus_write_stats(&stats, text, sizeof(text));
+
+    char small[32];
+    memset(small, 'x', sizeof(small));
+    TEST_ASSERT_EQUAL(full, he_prometheus_write_stats(&stats, small, sizeof(small)));
+    TEST_ASSERT_EQUAL(sizeof(small) - 1, strlen(small));
+    TEST_ASSERT_EQUAL_MEMORY(text, small, sizeof(small) - 1);
+
+    // Just asking how much room is needed
+    TEST_ASSERT_EQUAL(full, he_prometheus_write_stats(&stats, NULL, 0));
+}
+
+void test_write_stats_rejects_null(void)
+{
+    TEST_ASSERT_EQUAL(0, he_prometheus_write_stats(NULL, text, sizeof(text)));
+    TEST_ASSERT_EQUAL(0, he_prometheus_write_stats(&stats, NULL, sizeof(text)));
+}
+
+void test_write_session_cache(void)
+{
+    he_session_cache_stats_t cache = {0};
+    cache.entries = 12;
+    cache.lookups = 10;
+    cache.hits = 7;
+    cache.stores = 20;
+    cache.evictions = 8;
+
+    size_t length = he_prometheus_write_session_cache(&cache, text, sizeof(text));
+    TEST_ASSERT_EQUAL(strlen(text), length);
+
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_session_cache_entries gauge\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_session_cache_entries 12\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE helium_session_cache_lookups_total counter\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_session_cache_lookups_total 10\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_session_cache_hits_total 7\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_session_cache_stores_total 20\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "helium_session_cache_evictions_total 8\n"));
+
+    TEST_ASSERT_EQUAL(0, he_prometheus_write_session_cache(NULL, text, sizeof(text)));
+}
+
+#endif // TEST
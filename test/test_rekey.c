@@ -0,0 +1,381 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "rekey.h"
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "core.h"
+#include "fec.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "timers.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+#define NUM_CONNS 512
+
+#define INTERVAL 60000
+#define JITTER 60000
+
+he_rekey_t *rekey = NULL;
+he_rekey_config_t config;
+he_conn_t conns[NUM_CONNS];
+
+uint64_t now = 0;
+uint64_t started_at[NUM_CONNS];
+int starts[NUM_CONNS];
+
+static he_conn_t *make_conn(size_t index)
+{
+    he_conn_t *conn = &conns[index];
+    conn->wolf_ssl = (WOLFSSL *)(uintptr_t)(index + 1);
+    conn->state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_rekey_attach(rekey, conn));
+    return conn;
+}
+
+static void create_rekey(void)
+{
+    he_rekey_destroy(rekey);
+    rekey = he_rekey_create(&config, now);
+    TEST_ASSERT_NOT_NULL(rekey);
+}
+
+static size_t poll_until(uint64_t until)
+{
+    size_t started = 0;
+    while (now < until)
+    {
+        now += HE_REKEY_TICK_MS;
+        started += he_rekey_poll(rekey, now);
+    }
+    return started;
+}
+
+int record_start(WOLFSSL *ssl, int cmock_num_calls)
+{
+    size_t index = (uintptr_t)ssl - 1;
+    started_at[index] = now;
+    starts[index]++;
+    return SSL_SUCCESS;
+}
+
+int refuse_start(WOLFSSL *ssl, int cmock_num_calls)
+{
+    return SSL_FATAL_ERROR;
+}
+
+void setUp(void)
+{
+    memset(conns, 0, sizeof(conns));
+    memset(started_at, 0, sizeof(started_at));
+    memset(starts, 0, sizeof(starts));
+    now = 1000000;
+
+    memset(&config, 0, sizeof(config));
+    config.interval_ms = INTERVAL;
+    config.max_in_progress = NUM_CONNS;
+    rekey = he_rekey_create(&config, now);
+
+    wolfSSL_Rehandshake_StubWithCallback(record_start);
+}
+
+void tearDown(void)
+{
+    he_rekey_destroy(rekey);
+    rekey = NULL;
+}
+
+void test_create_rejects_bad_config(void)
+{
+    TEST_ASSERT_NULL(he_rekey_create(NULL, now));
+
+    config.interval_ms = 0;
+    TEST_ASSERT_NULL(he_rekey_create(&config, now));
+
+    config.interval_ms = INTERVAL;
+    config.max_in_progress = 0;
+    TEST_ASSERT_NULL(he_rekey_create(&config, now));
+}
+
+void test_attach_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_rekey_attach(NULL, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_rekey_attach(rekey, NULL));
+    TEST_ASSERT_EQUAL(0, he_rekey_poll(NULL, now));
+    he_rekey_detach(NULL);
+}
+
+void test_renegotiates_after_the_interval(void)
+{
+    he_conn_t *conn = make_conn(0);
+    uint64_t attached = now;
+
+    TEST_ASSERT_EQUAL(0, poll_until(attached + INTERVAL - HE_REKEY_TICK_MS));
+    TEST_ASSERT_EQUAL(1, poll_until(attached + INTERVAL));
+    TEST_ASSERT_TRUE(conn->renegotiation_in_progress);
+    TEST_ASSERT_FALSE(conn->renegotiation_due);
+    TEST_ASSERT_EQUAL(attached + INTERVAL, started_at[0]);
+
+    // Nothing more while it runs, the next one is an interval after it finishes
+    TEST_ASSERT_EQUAL(0, poll_until(now + INTERVAL));
+    conn->renegotiation_in_progress = false;
+    uint64_t finished = now + HE_REKEY_TICK_MS;
+    TEST_ASSERT_EQUAL(0, poll_until(finished + INTERVAL - HE_REKEY_TICK_MS));
+    TEST_ASSERT_EQUAL(1, poll_until(finished + INTERVAL));
+    TEST_ASSERT_EQUAL(2, starts[0]);
+
+    he_rekey_stats_t stats = {0};
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_rekey_get_stats(rekey, &stats));
+    TEST_ASSERT_EQUAL(2, stats.started);
+    TEST_ASSERT_EQUAL(1, stats.completed);
+    TEST_ASSERT_EQUAL(1, stats.in_progress);
+}
+
+void test_connections_attached_together_are_spread_over_the_window(void)
+{
+    config.jitter_ms = JITTER;
+    create_rekey();
+
+    uint64_t attached = now;
+    for (size_t i = 0; i < NUM_CONNS; i++)
+    {
+        make_conn(i);
+    }
+
+    TEST_ASSERT_EQUAL(NUM_CONNS, poll_until(attached + INTERVAL + JITTER + HE_REKEY_TICK_MS));
+
+    // Split the window in ten, each part should get about a tenth of the rekeys
+    int buckets[10] = {0};
+    for (size_t i = 0; i < NUM_CONNS; i++)
+    {
+        TEST_ASSERT_EQUAL(1, starts[i]);
+        TEST_ASSERT_GREATER_OR_EQUAL(attached + INTERVAL, started_at[i]);
+        TEST_ASSERT_LESS_OR_EQUAL(attached + INTERVAL + JITTER + HE_REKEY_TICK_MS, started_at[i]);
+
+        uint64_t offset = started_at[i] - attached - INTERVAL;
+        buckets[offset * 10 / (JITTER + HE_REKEY_TICK_MS)]++;
+    }
+
+    for (size_t i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_GREATER_THAN(NUM_CONNS / 20, buckets[i]);
+        TEST_ASSERT_LESS_THAN(NUM_CONNS / 5, buckets[i]);
+    }
+}
+
+void test_caps_renegotiations_in_progress(void)
+{
+    config.max_in_progress = 2;
+    create_rekey();
+
+    uint64_t attached = now;
+    for (size_t i = 0; i < 8; i++)
+    {
+        make_conn(i);
+    }
+
+    TEST_ASSERT_EQUAL(2, poll_until(attached + INTERVAL));
+    TEST_ASSERT_EQUAL(0, poll_until(now + 1000));
+
+    size_t started = 0;
+    for (size_t i = 0; i < 8; i++)
+    {
+        started += starts[i];
+    }
+    TEST_ASSERT_EQUAL(2, started);
+
+    he_rekey_stats_t stats = {0};
+    he_rekey_get_stats(rekey, &stats);
+    TEST_ASSERT_EQUAL(2, stats.in_progress);
+    TEST_ASSERT_GREATER_THAN(0, stats.throttled);
+
+    // Each one that finishes lets exactly one more start
+    for (size_t i = 0; i < 8; i++)
+    {
+        if (starts[i])
+        {
+            conns[i].renegotiation_in_progress = false;
+            break;
+        }
+    }
+    TEST_ASSERT_EQUAL(1, poll_until(now + HE_REKEY_TICK_MS));
+
+    for (size_t i = 0; i < 8; i++)
+    {
+        conns[i].renegotiation_in_progress = false;
+    }
+    TEST_ASSERT_EQUAL(2, poll_until(now + HE_REKEY_TICK_MS));
+
+    he_rekey_get_stats(rekey, &stats);
+    TEST_ASSERT_EQUAL(5, stats.started);
+    TEST_ASSERT_EQUAL(3, stats.completed);
+}
+
+void test_bulk_traffic_postpones_a_renegotiation(void)
+{
+    config.bulk_bytes = 10000;
+    config.bulk_window_ms = 1000;
+    config.max_postpone_ms = 60000;
+    create_rekey();
+
+    he_conn_t *conn = make_conn(0);
+    uint64_t due = now + INTERVAL;
+
+    // Due, but first it is watched for a window
+    TEST_ASSERT_EQUAL(0, poll_until(due));
+    TEST_ASSERT_TRUE(conn->renegotiation_due);
+
+    conn->stats.bytes[HE_STATS_INSIDE_OUT] += 20000;
+    TEST_ASSERT_EQUAL(0, poll_until(due + 1000));
+
+    he_rekey_stats_t stats = {0};
+    he_rekey_get_stats(rekey, &stats);
+    TEST_ASSERT_EQUAL(1, stats.postponed);
+
+    // A quiet window lets it go ahead
+    conn->stats.bytes[HE_STATS_INSIDE_IN] += 100;
+    TEST_ASSERT_EQUAL(1, poll_until(due + 2000));
+    TEST_ASSERT_EQUAL(due + 2000, started_at[0]);
+}
+
+void test_bulk_traffic_cannot_postpone_past_the_deadline(void)
+{
+    config.bulk_bytes = 10000;
+    config.bulk_window_ms = 1000;
+    config.max_postpone_ms = 5000;
+    create_rekey();
+
+    he_conn_t *conn = make_conn(0);
+    uint64_t due = now + INTERVAL;
+
+    poll_until(due);
+    while (!starts[0] && now < due + 60000)
+    {
+        conn->stats.bytes[HE_STATS_INSIDE_IN] += 50000;
+        poll_until(now + 500);
+    }
+
+    TEST_ASSERT_EQUAL(1, starts[0]);
+    TEST_ASSERT_GREATER_OR_EQUAL(due + 5000, started_at[0]);
+    TEST_ASSERT_LESS_OR_EQUAL(due + 6000, started_at[0]);
+}
+
+void test_timed_out_renegotiation_gives_up_its_place(void)
+{
+    config.max_in_progress = 1;
+    config.timeout_ms = 5000;
+    create_rekey();
+
+    uint64_t due = now + INTERVAL;
+    make_conn(0);
+    make_conn(1);
+
+    TEST_ASSERT_EQUAL(1, poll_until(due));
+    TEST_ASSERT_EQUAL(0, poll_until(due + 4900));
+    TEST_ASSERT_EQUAL(1, poll_until(due + 5000));
+    TEST_ASSERT_EQUAL(1, starts[0]);
+    TEST_ASSERT_EQUAL(1, starts[1]);
+
+    he_rekey_stats_t stats = {0};
+    he_rekey_get_stats(rekey, &stats);
+    TEST_ASSERT_EQUAL(1, stats.timed_out);
+}
+
+void test_connection_that_is_not_online_waits_another_interval(void)
+{
+    he_conn_t *conn = make_conn(0);
+    conn->state = HE_STATE_AUTHENTICATING;
+    uint64_t due = now + INTERVAL;
+
+    TEST_ASSERT_EQUAL(0, poll_until(due + 1000));
+    TEST_ASSERT_FALSE(conn->renegotiation_due);
+
+    conn->state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(0, poll_until(due + INTERVAL - HE_REKEY_TICK_MS));
+    TEST_ASSERT_EQUAL(1, poll_until(due + INTERVAL));
+}
+
+void test_refused_renegotiation_is_retried_an_interval_later(void)
+{
+    config.max_in_progress = 1;
+    create_rekey();
+
+    uint64_t due = now + INTERVAL;
+    he_conn_t *conn = make_conn(0);
+    make_conn(1);
+
+    wolfSSL_Rehandshake_StubWithCallback(refuse_start);
+    wolfSSL_get_error_IgnoreAndReturn(-1);
+    TEST_ASSERT_EQUAL(0, poll_until(due));
+    TEST_ASSERT_FALSE(conn->renegotiation_in_progress);
+
+    he_rekey_stats_t stats = {0};
+    he_rekey_get_stats(rekey, &stats);
+    TEST_ASSERT_EQUAL(2, stats.failed);
+    TEST_ASSERT_EQUAL(0, stats.in_progress);
+
+    wolfSSL_Rehandshake_StubWithCallback(record_start);
+    TEST_ASSERT_EQUAL(1, poll_until(due + INTERVAL));
+}
+
+void test_long_gap_between_polls(void)
+{
+    uint64_t attached = now;
+    for (size_t i = 0; i < 16; i++)
+    {
+        make_conn(i);
+    }
+
+    now = attached + INTERVAL + 10 * HE_REKEY_SLOTS * HE_REKEY_TICK_MS;
+    TEST_ASSERT_EQUAL(16, he_rekey_poll(rekey, now));
+}
+
+void test_detach_stops_renegotiations(void)
+{
+    he_conn_t *conn = make_conn(0);
+    he_rekey_detach(conn);
+    TEST_ASSERT_NULL(conn->rekey);
+    TEST_ASSERT_NULL(conn->rekey_pprev);
+
+    TEST_ASSERT_EQUAL(0, poll_until(now + 2 * INTERVAL));
+}
+
+void test_destroyed_connection_leaves_the_scheduler(void)
+{
+    wolfSSL_free_Ignore();
+
+    he_conn_t *conn = he_conn_create();
+    conn->wolf_ssl = (WOLFSSL *)(uintptr_t)1;
+    conn->state = HE_STATE_ONLINE;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_rekey_attach(rekey, conn));
+    make_conn(1);
+
+    he_conn_destroy(conn);
+    TEST_ASSERT_EQUAL(1, poll_until(now + INTERVAL));
+    TEST_ASSERT_EQUAL(1, starts[1]);
+}
+
+void test_destroy_detaches_connections(void)
+{
+    he_conn_t *running = make_conn(0);
+    poll_until(now + INTERVAL);
+    make_conn(1);
+    TEST_ASSERT_TRUE(running->renegotiation_in_progress);
+    TEST_ASSERT_NOT_NULL(running->rekey_pprev);
+
+    he_rekey_destroy(rekey);
+    rekey = NULL;
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        TEST_ASSERT_NULL(conns[i].rekey);
+        TEST_ASSERT_NULL(conns[i].rekey_pprev);
+    }
+}
+
+#endif // TEST
@@ -0,0 +1,394 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include <pthread.h>
+
+#include "session_cache.h"
+
+#include "mock_ssl.h"
+
+he_session_cache_t *cache;
+uint8_t buffer[HE_SESSION_CACHE_MAX_DATA];
+size_t length;
+
+WOLFSSL *ssl = (WOLFSSL *)0x1;
+WOLFSSL_CTX *ctx = (WOLFSSL_CTX *)0x2;
+WOLFSSL_SESSION *session = (WOLFSSL_SESSION *)0x3;
+
+int (*new_cb)(WOLFSSL *, WOLFSSL_SESSION *);
+WOLFSSL_SESSION *(*get_cb)(WOLFSSL *, const unsigned char *, int, int *);
+void (*remove_cb)(WOLFSSL_CTX *, WOLFSSL_SESSION *);
+
+const uint8_t session_id[] = "0123456789abcdef0123456789abcdef";
+const uint8_t serialised[] = "a serialised session";
+
+static void make_id(uint8_t *id, uint32_t n)
+{
+    memset(id, 0, HE_SESSION_CACHE_MAX_ID);
+    memcpy(id, &n, sizeof(n));
+}
+
+static he_return_code_t store(uint32_t n)
+{
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    make_id(id, n);
+    return he_session_cache_store(cache, id, sizeof(id), (uint8_t *)&n, sizeof(n));
+}
+
+static he_return_code_t find(uint32_t n)
+{
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    make_id(id, n);
+    length = sizeof(buffer);
+    return he_session_cache_find(cache, id, sizeof(id), buffer, &length);
+}
+
+static void capture_new_cb(WOLFSSL_CTX *c, int (*cb)(WOLFSSL *, WOLFSSL_SESSION *), int calls)
+{
+    new_cb = cb;
+}
+
+static void capture_get_cb(WOLFSSL_CTX *c,
+                           WOLFSSL_SESSION *(*cb)(WOLFSSL *, const unsigned char *, int, int *),
+                           int calls)
+{
+    get_cb = cb;
+}
+
+static void capture_remove_cb(WOLFSSL_CTX *c, void (*cb)(WOLFSSL_CTX *, WOLFSSL_SESSION *),
+                              int calls)
+{
+    remove_cb = cb;
+}
+
+static const unsigned char *get_session_id(const WOLFSSL_SESSION *s, unsigned int *len, int calls)
+{
+    *len = 32;
+    return session_id;
+}
+
+static int serialise_session(WOLFSSL_SESSION *s, unsigned char **out, int calls)
+{
+    if (out)
+    {
+        memcpy(*out, serialised, sizeof(serialised));
+        *out += sizeof(serialised);
+    }
+    return sizeof(serialised);
+}
+
+static WOLFSSL_SESSION *deserialise_session(WOLFSSL_SESSION **s, const unsigned char **in,
+                                            long len, int calls)
+{
+    TEST_ASSERT_EQUAL(sizeof(serialised), len);
+    TEST_ASSERT_EQUAL_MEMORY(serialised, *in, len);
+    return session;
+}
+
+static void attach(void)
+{
+    wolfSSL_CTX_set_ex_data_ExpectAndReturn(ctx, HE_SESSION_CACHE_EX_DATA_INDEX, cache,
+                                            WOLFSSL_SUCCESS);
+    wolfSSL_CTX_set_session_cache_mode_ExpectAndReturn(
+        ctx, WOLFSSL_SESS_CACHE_SERVER | WOLFSSL_SESS_CACHE_NO_INTERNAL, WOLFSSL_SUCCESS);
+    wolfSSL_CTX_sess_set_new_cb_StubWithCallback(capture_new_cb);
+    wolfSSL_CTX_sess_set_get_cb_StubWithCallback(capture_get_cb);
+    wolfSSL_CTX_sess_set_remove_cb_StubWithCallback(capture_remove_cb);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_cache_attach(cache, ctx));
+
+    wolfSSL_get_SSL_CTX_IgnoreAndReturn(ctx);
+    wolfSSL_CTX_get_ex_data_IgnoreAndReturn(cache);
+    wolfSSL_SESSION_get_id_StubWithCallback(get_session_id);
+}
+
+void setUp(void)
+{
+    cache = he_session_cache_create(8, 1);
+    new_cb = NULL;
+    get_cb = NULL;
+    remove_cb = NULL;
+}
+
+void tearDown(void)
+{
+    he_session_cache_destroy(cache);
+}
+
+void test_create_rejects_bad_sizes(void)
+{
+    TEST_ASSERT_NULL(he_session_cache_create(0, 1));
+    TEST_ASSERT_NULL(he_session_cache_create(8, 0));
+    TEST_ASSERT_NULL(he_session_cache_create(2, 4));
+    he_session_cache_destroy(NULL);
+}
+
+void test_capacity_is_split_across_shards(void)
+{
+    he_session_cache_t *sharded = he_session_cache_create(10, 3);
+    TEST_ASSERT_NOT_NULL(sharded);
+
+    he_session_cache_stats_t stats;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_cache_get_stats(sharded, &stats));
+    TEST_ASSERT_EQUAL(10, stats.capacity);
+    TEST_ASSERT_EQUAL(0, stats.entries);
+
+    he_session_cache_destroy(sharded);
+}
+
+void test_store_and_find(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, store(1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, find(1));
+    TEST_ASSERT_EQUAL(sizeof(uint32_t), length);
+    TEST_ASSERT_EQUAL_UINT32(1, *(uint32_t *)buffer);
+
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, find(2));
+}
+
+void test_store_replaces_the_same_id(void)
+{
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    make_id(id, 1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_cache_store(cache, id, sizeof(id), id, 4));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, store(1));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, find(1));
+    TEST_ASSERT_EQUAL_UINT32(1, *(uint32_t *)buffer);
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(1, stats.entries);
+    TEST_ASSERT_EQUAL(2, stats.stores);
+}
+
+void test_least_recently_used_is_evicted(void)
+{
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, store(i));
+    }
+
+    // Using the oldest one makes 1 the next to go
+    TEST_ASSERT_EQUAL(HE_SUCCESS, find(0));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, store(8));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, find(1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, find(0));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, store(9));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, find(2));
+
+    for (uint32_t i = 3; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, find(i));
+        TEST_ASSERT_EQUAL_UINT32(i, *(uint32_t *)buffer);
+    }
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(8, stats.entries);
+    TEST_ASSERT_EQUAL(2, stats.evictions);
+}
+
+void test_remove(void)
+{
+    store(1);
+    store(2);
+
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    make_id(id, 1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_cache_remove(cache, id, sizeof(id)));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_cache_remove(cache, id, sizeof(id)));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, find(1));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, find(2));
+
+    // The freed slot is reused without evicting anything
+    for (uint32_t i = 3; i < 10; i++)
+    {
+        store(i);
+    }
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(8, stats.entries);
+    TEST_ASSERT_EQUAL(0, stats.evictions);
+    TEST_ASSERT_EQUAL(1, stats.removals);
+}
+
+void test_stats_give_the_hit_rate(void)
+{
+    store(1);
+    find(1);
+    find(1);
+    find(1);
+    find(2);
+
+    he_session_cache_stats_t stats;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_cache_get_stats(cache, &stats));
+    TEST_ASSERT_EQUAL(8, stats.capacity);
+    TEST_ASSERT_EQUAL(1, stats.entries);
+    TEST_ASSERT_EQUAL(4, stats.lookups);
+    TEST_ASSERT_EQUAL(3, stats.hits);
+    TEST_ASSERT_EQUAL(1, stats.stores);
+}
+
+void test_find_into_a_small_buffer(void)
+{
+    store(1);
+
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    make_id(id, 1);
+    length = 2;
+    TEST_ASSERT_EQUAL(HE_ERR_BUFFER_TOO_SMALL,
+                      he_session_cache_find(cache, id, sizeof(id), buffer, &length));
+    TEST_ASSERT_EQUAL(sizeof(uint32_t), length);
+}
+
+void test_bad_arguments(void)
+{
+    uint8_t id[HE_SESSION_CACHE_MAX_ID + 1] = {0};
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_store(NULL, id, 4, id, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_store(cache, NULL, 4, id, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_store(cache, id, 4, NULL, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_ZERO_SIZE, he_session_cache_store(cache, id, 0, id, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_ZERO_SIZE, he_session_cache_store(cache, id, 4, id, 0));
+    TEST_ASSERT_EQUAL(HE_ERR_STRING_TOO_LONG,
+                      he_session_cache_store(cache, id, sizeof(id), id, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_STRING_TOO_LONG,
+                      he_session_cache_store(cache, id, 4, id, HE_SESSION_CACHE_MAX_DATA + 1));
+
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_find(cache, id, 4, buffer, NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_remove(NULL, id, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_get_stats(cache, NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_cache_attach(cache, NULL));
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(2, stats.too_large);
+    TEST_ASSERT_EQUAL(0, stats.entries);
+}
+
+void test_attach_fails_if_wolfssl_refuses(void)
+{
+    wolfSSL_CTX_set_ex_data_ExpectAndReturn(ctx, HE_SESSION_CACHE_EX_DATA_INDEX, cache,
+                                            WOLFSSL_FAILURE);
+    TEST_ASSERT_EQUAL(HE_ERR_INIT_FAILED, he_session_cache_attach(cache, ctx));
+}
+
+void test_new_sessions_from_wolfssl_are_stored(void)
+{
+    attach();
+    wolfSSL_i2d_SSL_SESSION_StubWithCallback(serialise_session);
+
+    // The cache holds its own serialised copy, not a reference
+    TEST_ASSERT_EQUAL(0, new_cb(ssl, session));
+
+    length = sizeof(buffer);
+    TEST_ASSERT_EQUAL(HE_SUCCESS,
+                      he_session_cache_find(cache, session_id, 32, buffer, &length));
+    TEST_ASSERT_EQUAL(sizeof(serialised), length);
+    TEST_ASSERT_EQUAL_MEMORY(serialised, buffer, length);
+}
+
+void test_oversized_sessions_are_skipped(void)
+{
+    attach();
+    wolfSSL_i2d_SSL_SESSION_ExpectAndReturn(session, NULL, HE_SESSION_CACHE_MAX_DATA + 1);
+
+    TEST_ASSERT_EQUAL(0, new_cb(ssl, session));
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(0, stats.entries);
+    TEST_ASSERT_EQUAL(1, stats.too_large);
+}
+
+void test_resumption_finds_the_stored_session(void)
+{
+    attach();
+    he_session_cache_store(cache, session_id, 32, serialised, sizeof(serialised));
+    wolfSSL_d2i_SSL_SESSION_StubWithCallback(deserialise_session);
+
+    int copy = 1;
+    TEST_ASSERT_EQUAL_PTR(session, get_cb(ssl, session_id, 32, &copy));
+    TEST_ASSERT_EQUAL(0, copy);
+
+    // And an unknown one falls back to a full handshake
+    TEST_ASSERT_NULL(get_cb(ssl, serialised, 8, &copy));
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(2, stats.lookups);
+    TEST_ASSERT_EQUAL(1, stats.hits);
+}
+
+void test_removed_sessions_from_wolfssl_are_forgotten(void)
+{
+    attach();
+    he_session_cache_store(cache, session_id, 32, serialised, sizeof(serialised));
+
+    remove_cb(ctx, session);
+
+    length = sizeof(buffer);
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION,
+                      he_session_cache_find(cache, session_id, 32, buffer, &length));
+}
+
+typedef struct worker_args
+{
+    uint32_t base;
+    size_t mismatches;
+} worker_args_t;
+
+static void *worker(void *arg)
+{
+    worker_args_t *args = arg;
+    uint8_t id[HE_SESSION_CACHE_MAX_ID];
+    uint8_t out[16];
+
+    for (uint32_t i = 0; i < 5000; i++)
+    {
+        uint32_t n = args->base + i % 64;
+        make_id(id, n);
+        he_session_cache_store(cache, id, sizeof(id), (uint8_t *)&n, sizeof(n));
+
+        size_t out_length = sizeof(out);
+        if (he_session_cache_find(cache, id, sizeof(id), out, &out_length) == HE_SUCCESS &&
+            (out_length != sizeof(n) || memcmp(out, &n, sizeof(n)) != 0))
+        {
+            args->mismatches++;
+        }
+    }
+
+    return NULL;
+}
+
+void test_threads_share_the_cache(void)
+{
+    he_session_cache_destroy(cache);
+    cache = he_session_cache_create(128, 4);
+
+    pthread_t threads[4];
+    worker_args_t args[4] = {{0}};
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        args[i].base = (uint32_t)i * 1000;
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL(0, args[i].mismatches);
+    }
+
+    he_session_cache_stats_t stats;
+    he_session_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL(4 * 5000, stats.stores);
+    TEST_ASSERT_EQUAL(4 * 5000, stats.lookups);
+    TEST_ASSERT_TRUE(stats.entries <= 128);
+    TEST_ASSERT_TRUE(stats.hits > 0);
+}
+
+#endif // TEST
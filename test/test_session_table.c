@@ -0,0 +1,295 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "session_table.h"
+#include "conn_template.h"
+#include "core.h"
+#include "stats.h"
+#include "mock_random.h"
+
+he_session_table_t *table = NULL;
+he_conn_t conns[64];
+
+void setUp(void)
+{
+    memset(conns, 0, sizeof(conns));
+    table = he_session_table_create(64);
+}
+
+void tearDown(void)
+{
+    for (size_t i = 0; i < 64; i++)
+    {
+        free(conns[i].wolf_rng);
+    }
+    he_session_table_destroy(table);
+    table = NULL;
+}
+
+void test_create_rejects_zero_entries(void)
+{
+    TEST_ASSERT_NULL(he_session_table_create(0));
+}
+
+void test_insert_and_lookup(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 0x1234, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 0x5678, &conns[1]));
+
+    TEST_ASSERT_EQUAL_PTR(&conns[0], he_session_table_lookup(table, 0x1234));
+    TEST_ASSERT_EQUAL_PTR(&conns[1], he_session_table_lookup(table, 0x5678));
+    TEST_ASSERT_NULL(he_session_table_lookup(table, 0x9abc));
+    TEST_ASSERT_EQUAL(2, he_session_table_count(table));
+}
+
+void test_insert_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_table_insert(NULL, 1, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_session_table_insert(table, 1, NULL));
+    TEST_ASSERT_NULL(he_session_table_lookup(NULL, 1));
+}
+
+void test_reserved_sessions_are_rejected(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_insert(table, 0, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_insert(table, UINT64_MAX, &conns[0]));
+    TEST_ASSERT_NULL(he_session_table_lookup(table, 0));
+    TEST_ASSERT_NULL(he_session_table_lookup(table, UINT64_MAX));
+}
+
+void test_insert_duplicate(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 42, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_ERR_SESSION_EXISTS, he_session_table_insert(table, 42, &conns[1]));
+    TEST_ASSERT_EQUAL_PTR(&conns[0], he_session_table_lookup(table, 42));
+}
+
+void test_insert_when_full(void)
+{
+    for (uint64_t i = 0; i < 64; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, i + 1, &conns[i]));
+    }
+
+    TEST_ASSERT_EQUAL(HE_ERR_NO_MEMORY, he_session_table_insert(table, 1000, &conns[0]));
+    TEST_ASSERT_EQUAL(64, he_session_table_count(table));
+}
+
+void test_remove(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 42, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_remove(table, 42));
+    TEST_ASSERT_NULL(he_session_table_lookup(table, 42));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_remove(table, 42));
+    TEST_ASSERT_EQUAL(0, he_session_table_count(table));
+}
+
+void test_remove_keeps_colliding_entries_reachable(void)
+{
+    // Sequential IDs plus random looking ones give plenty of probe chains to break
+    for (uint64_t i = 0; i < 64; i++)
+    {
+        uint64_t session = (i & 1) ? (i + 1) : (i + 1) * 0x9e3779b97f4a7c15ULL;
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, session, &conns[i]));
+    }
+
+    for (uint64_t i = 0; i < 64; i += 2)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_remove(table, (i + 1) * 0x9e3779b97f4a7c15ULL));
+    }
+
+    for (uint64_t i = 0; i < 64; i++)
+    {
+        if (i & 1)
+        {
+            TEST_ASSERT_EQUAL_PTR(&conns[i], he_session_table_lookup(table, i + 1));
+        }
+        else
+        {
+            TEST_ASSERT_NULL(he_session_table_lookup(table, (i + 1) * 0x9e3779b97f4a7c15ULL));
+        }
+    }
+
+    TEST_ASSERT_EQUAL(32, he_session_table_count(table));
+}
+
+void test_rekey(void)
+{
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 1, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 2, &conns[1]));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_rekey(table, 1, 3));
+    TEST_ASSERT_NULL(he_session_table_lookup(table, 1));
+    TEST_ASSERT_EQUAL_PTR(&conns[0], he_session_table_lookup(table, 3));
+    TEST_ASSERT_EQUAL(2, he_session_table_count(table));
+
+    TEST_ASSERT_EQUAL(HE_ERR_SESSION_EXISTS, he_session_table_rekey(table, 3, 2));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_rekey(table, 1, 4));
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_rekey(table, 3, 0));
+}
+
+void test_promote_pending(void)
+{
+    conns[0].session_id = 10;
+    conns[0].pending_session_id = 20;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 10, &conns[0]));
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_promote_pending(table, &conns[0]));
+
+    TEST_ASSERT_EQUAL(20, conns[0].session_id);
+    TEST_ASSERT_EQUAL(0, conns[0].pending_session_id);
+    TEST_ASSERT_NULL(he_session_table_lookup(table, 10));
+    TEST_ASSERT_EQUAL_PTR(&conns[0], he_session_table_lookup(table, 20));
+}
+
+void test_promote_pending_without_pending(void)
+{
+    conns[0].session_id = 10;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 10, &conns[0]));
+
+    TEST_ASSERT_EQUAL(HE_ERR_UNKNOWN_SESSION, he_session_table_promote_pending(table, &conns[0]));
+    TEST_ASSERT_EQUAL(10, conns[0].session_id);
+}
+
+void test_promote_pending_collision_leaves_conn_alone(void)
+{
+    conns[0].session_id = 10;
+    conns[0].pending_session_id = 20;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 10, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 20, &conns[1]));
+
+    TEST_ASSERT_EQUAL(HE_ERR_SESSION_EXISTS, he_session_table_promote_pending(table, &conns[0]));
+    TEST_ASSERT_EQUAL(10, conns[0].session_id);
+    TEST_ASSERT_EQUAL(20, conns[0].pending_session_id);
+}
+
+void test_lookup_packet(void)
+{
+    uint8_t packet[sizeof(he_wire_hdr_t) + 8] = {0};
+    uint64_t session = 0x0102030405060708ULL;
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, session, &conns[0]));
+
+    // Put the header at an odd offset to make sure alignment doesn't matter
+    uint8_t *hdr = packet + 1;
+    hdr[0] = 'H';
+    hdr[1] = 'e';
+    memcpy(hdr + offsetof(he_wire_hdr_t, session), &session, sizeof(session));
+
+    TEST_ASSERT_EQUAL_PTR(&conns[0], he_session_table_lookup_packet(table, hdr, sizeof(he_wire_hdr_t)));
+    TEST_ASSERT_NULL(he_session_table_lookup_packet(table, hdr, sizeof(he_wire_hdr_t) - 1));
+
+    hdr[1] = 'x';
+    TEST_ASSERT_NULL(he_session_table_lookup_packet(table, hdr, sizeof(he_wire_hdr_t)));
+    TEST_ASSERT_NULL(he_session_table_lookup_packet(table, NULL, sizeof(he_wire_hdr_t)));
+}
+
+// Hands out the same ID twice, then a different one
+int colliding_ids(WC_RNG *rng, byte *b, word32 sz, int cmock_num_calls)
+{
+    uint64_t value = cmock_num_calls < 2 ? 0x77 : 0x78;
+    memcpy(b, &value, sizeof(value));
+    return 0;
+}
+
+void test_insert_new_retries_on_collision(void)
+{
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_StubWithCallback(colliding_ids);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert_new(table, &conns[0]));
+    TEST_ASSERT_EQUAL(0x77, conns[0].session_id);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert_new(table, &conns[1]));
+    TEST_ASSERT_EQUAL(0x78, conns[1].session_id);
+    TEST_ASSERT_EQUAL_PTR(&conns[1], he_session_table_lookup(table, 0x78));
+}
+
+int always_same_id(WC_RNG *rng, byte *b, word32 sz, int cmock_num_calls)
+{
+    uint64_t value = 0x99;
+    memcpy(b, &value, sizeof(value));
+    return 0;
+}
+
+void test_insert_new_gives_up_after_repeated_collisions(void)
+{
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_StubWithCallback(always_same_id);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, 0x99, &conns[1]));
+
+    TEST_ASSERT_EQUAL(HE_ERR_SESSION_EXISTS, he_session_table_insert_new(table, &conns[0]));
+    TEST_ASSERT_EQUAL(0, conns[0].session_id);
+}
+
+void test_insert_new_rng_failure(void)
+{
+    wc_InitRng_IgnoreAndReturn(0);
+    wc_RNG_GenerateBlock_ExpectAnyArgsAndReturn(-1);
+
+    TEST_ASSERT_EQUAL(HE_ERR_RNG_FAILURE, he_session_table_insert_new(table, &conns[0]));
+    TEST_ASSERT_EQUAL(0, he_session_table_count(table));
+}
+
+typedef struct
+{
+    atomic_bool *stop;
+    int misses;
+} reader_args_t;
+
+static void *stable_reader(void *arg)
+{
+    reader_args_t *args = arg;
+
+    while (!atomic_load(args->stop))
+    {
+        for (uint64_t i = 0; i < 16; i++)
+        {
+            if (he_session_table_lookup(table, i + 1) != &conns[i])
+            {
+                args->misses++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void test_lookups_never_miss_during_churn(void)
+{
+    atomic_bool stop = false;
+    reader_args_t args[2] = {{&stop, 0}, {&stop, 0}};
+    pthread_t readers[2];
+
+    for (uint64_t i = 0; i < 16; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_session_table_insert(table, i + 1, &conns[i]));
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_create(&readers[i], NULL, stable_reader, &args[i]);
+    }
+
+    // Keep inserting, rekeying and removing other sessions so entries get shifted around
+    for (uint64_t round = 0; round < 20000; round++)
+    {
+        uint64_t session = 1000 + (round % 40);
+        he_session_table_insert(table, session, &conns[32]);
+        he_session_table_rekey(table, session, session + 100000);
+        he_session_table_remove(table, session + 100000);
+    }
+
+    atomic_store(&stop, true);
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_join(readers[i], NULL);
+        TEST_ASSERT_EQUAL(0, args[i].misses);
+    }
+}
+
+#endif // TEST
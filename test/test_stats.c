@@ -0,0 +1,152 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include <pthread.h>
+
+#include "stats.h"
+
+he_conn_t conn;
+he_stats_t before;
+
+void setUp(void)
+{
+    memset(&conn, 0, sizeof(conn));
+    // Blocks are never freed, so compare against whatever earlier tests left behind
+    he_stats_get_global(&before);
+}
+
+void tearDown(void)
+{
+}
+
+void test_get_rejects_null(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_stats_get_thread(NULL));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_stats_get_global(NULL));
+}
+
+void test_packet_counts_conn_and_thread(void)
+{
+    he_stats_t thread_before;
+    he_stats_get_thread(&thread_before);
+
+    he_internal_stats_packet(&conn, HE_STATS_OUTSIDE_IN, 100);
+    he_internal_stats_packet(&conn, HE_STATS_OUTSIDE_IN, 50);
+    he_internal_stats_packet(&conn, HE_STATS_INSIDE_OUT, 20);
+
+    TEST_ASSERT_EQUAL(2, conn.stats.packets[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(150, conn.stats.bytes[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_INSIDE_OUT]);
+    TEST_ASSERT_EQUAL(20, conn.stats.bytes[HE_STATS_INSIDE_OUT]);
+    TEST_ASSERT_EQUAL(0, conn.stats.packets[HE_STATS_INSIDE_IN]);
+
+    he_stats_t thread;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_stats_get_thread(&thread));
+    TEST_ASSERT_EQUAL(thread_before.packets[HE_STATS_OUTSIDE_IN] + 2,
+                      thread.packets[HE_STATS_OUTSIDE_IN]);
+    TEST_ASSERT_EQUAL(thread_before.bytes[HE_STATS_OUTSIDE_IN] + 150,
+                      thread.bytes[HE_STATS_OUTSIDE_IN]);
+}
+
+void test_drops_are_counted_by_reason(void)
+{
+    he_internal_stats_drop(&conn, HE_ERR_PLUGIN_DROP, 1);
+    he_internal_stats_drop(&conn, HE_ERR_PACKET_TOO_LARGE, 3);
+
+    TEST_ASSERT_EQUAL(4, conn.stats.dropped);
+
+    he_stats_t stats;
+    he_stats_get_global(&stats);
+    TEST_ASSERT_EQUAL(before.drops[-HE_ERR_PLUGIN_DROP] + 1, stats.drops[-HE_ERR_PLUGIN_DROP]);
+    TEST_ASSERT_EQUAL(before.drops[-HE_ERR_PACKET_TOO_LARGE] + 3,
+                      stats.drops[-HE_ERR_PACKET_TOO_LARGE]);
+}
+
+void test_drop_with_unknown_reason_only_counts_on_conn(void)
+{
+    he_internal_stats_drop(&conn, (he_return_code_t)-HE_STATS_MAX_REASONS, 1);
+    he_internal_stats_drop(&conn, (he_return_code_t)1, 1);
+
+    TEST_ASSERT_EQUAL(2, conn.stats.dropped);
+
+    he_stats_t stats;
+    he_stats_get_global(&stats);
+    TEST_ASSERT_EQUAL_MEMORY(before.drops, stats.drops, sizeof(stats.drops));
+}
+
+void test_duplicates(void)
+{
+    he_internal_stats_duplicates(&conn, 2);
+
+    TEST_ASSERT_EQUAL(2, conn.stats.aggressive_duplicates);
+
+    he_stats_t stats;
+    he_stats_get_global(&stats);
+    TEST_ASSERT_EQUAL(before.aggressive_duplicates + 2, stats.aggressive_duplicates);
+}
+
+#define COUNTING_THREADS 4
+#define COUNTS_PER_THREAD 10000
+
+static void *count_packets(void *arg)
+{
+    he_conn_t *thread_conn = arg;
+    for (int i = 0; i < COUNTS_PER_THREAD; i++)
+    {
+        he_internal_stats_packet(thread_conn, HE_STATS_INSIDE_IN, 10);
+    }
+    return NULL;
+}
+
+void test_blocks_fill_whole_cache_lines(void)
+{
+    he_internal_stats_packet(&conn, HE_STATS_INSIDE_IN, 1);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)he_thread_stats % HE_STATS_CACHE_LINE);
+    TEST_ASSERT_EQUAL(0, sizeof(he_stats_block_t) % HE_STATS_CACHE_LINE);
+}
+
+void test_global_merges_every_thread_including_exited_ones(void)
+{
+    pthread_t threads[COUNTING_THREADS];
+    he_conn_t conns[COUNTING_THREADS] = {0};
+
+    for (int i = 0; i < COUNTING_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, count_packets, &conns[i]);
+    }
+
+    // Read while they count, totals only ever go up
+    uint64_t last = before.packets[HE_STATS_INSIDE_IN];
+    for (int i = 0; i < 100; i++)
+    {
+        he_stats_t stats;
+        he_stats_get_global(&stats);
+        TEST_ASSERT_TRUE(stats.packets[HE_STATS_INSIDE_IN] >= last);
+        last = stats.packets[HE_STATS_INSIDE_IN];
+    }
+
+    for (int i = 0; i < COUNTING_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL(COUNTS_PER_THREAD, conns[i].stats.packets[HE_STATS_INSIDE_IN]);
+    }
+
+    he_stats_t stats;
+    he_stats_get_global(&stats);
+    TEST_ASSERT_EQUAL(before.packets[HE_STATS_INSIDE_IN] + COUNTING_THREADS * COUNTS_PER_THREAD,
+                      stats.packets[HE_STATS_INSIDE_IN]);
+    TEST_ASSERT_EQUAL(before.bytes[HE_STATS_INSIDE_IN] + COUNTING_THREADS * COUNTS_PER_THREAD * 10,
+                      stats.bytes[HE_STATS_INSIDE_IN]);
+
+    // None of it landed on this thread
+    he_stats_t thread;
+    he_stats_t thread_again;
+    he_stats_get_thread(&thread);
+    he_internal_stats_packet(&conn, HE_STATS_OUTSIDE_OUT, 1);
+    he_stats_get_thread(&thread_again);
+    TEST_ASSERT_EQUAL(thread.packets[HE_STATS_OUTSIDE_OUT] + 1,
+                      thread_again.packets[HE_STATS_OUTSIDE_OUT]);
+}
+
+#endif // TEST
@@ -0,0 +1,257 @@
+#ifdef TEST
+
+#include "unity.h"
+
+#include "timers.h"
+#include "conn.h"
+#include "config.h"
+#include "conn_template.h"
+#include "coalesce.h"
+#include "core.h"
+#include "fec.h"
+#include "pmtu.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "mock_ssl.h"
+#include "mock_random.h"
+
+#define NUM_CONNS 64
+
+he_timers_t *timers = NULL;
+he_conn_t conns[NUM_CONNS];
+
+uint64_t now = 0;
+uint64_t fired_at[NUM_CONNS];
+
+static he_conn_t *make_conn(size_t index)
+{
+    he_conn_t *conn = &conns[index];
+    conn->wolf_ssl = (WOLFSSL *)(uintptr_t)(index + 1);
+    conn->state = HE_STATE_CONNECTING;
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_attach(timers, conn));
+    return conn;
+}
+
+// Records when each connection was nudged, then has wolfSSL give up so nothing is re-armed
+int record_and_give_up(WOLFSSL *ssl, int cmock_num_calls)
+{
+    fired_at[(uintptr_t)ssl - 1] = now;
+    return SSL_FATAL_ERROR;
+}
+
+void setUp(void)
+{
+    memset(conns, 0, sizeof(conns));
+    memset(fired_at, 0, sizeof(fired_at));
+    now = 1000;
+    timers = he_timers_create(now);
+}
+
+void tearDown(void)
+{
+    he_timers_destroy(timers);
+    timers = NULL;
+}
+
+void test_attach_null_pointers(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_timers_attach(NULL, &conns[0]));
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_timers_attach(timers, NULL));
+}
+
+void test_arm_requires_attached_conn(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_timers_arm(NULL, 10));
+    TEST_ASSERT_EQUAL(HE_ERR_FAILED, he_timers_arm(&conns[0], 10));
+}
+
+void test_fires_on_expiry_and_rearms(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 10));
+
+    TEST_ASSERT_EQUAL(0, he_timers_advance(timers, 1009));
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_SUCCESS);
+    wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn->wolf_ssl, 2);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 1010));
+
+    // wolfSSL backed off to two seconds
+    TEST_ASSERT_EQUAL(2000, he_conn_get_nudge_time(conn));
+    TEST_ASSERT_TRUE(conn->is_nudge_timer_running);
+    TEST_ASSERT_EQUAL(0, he_timers_advance(timers, 3009));
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 3010));
+}
+
+void test_zero_delay_fires_on_next_tick(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 0));
+    TEST_ASSERT_EQUAL(1001, he_timers_next_expiry(timers));
+}
+
+void test_cancel(void)
+{
+    he_conn_t *a = make_conn(0);
+    he_conn_t *b = make_conn(1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(a, 50));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(b, 50));
+
+    a->is_nudge_timer_running = true;
+    he_timers_cancel(a);
+    TEST_ASSERT_FALSE(a->is_nudge_timer_running);
+    TEST_ASSERT_NULL(a->timer_pprev);
+
+    wolfSSL_dtls_got_timeout_StubWithCallback(record_and_give_up);
+    now = 2000;
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, now));
+    TEST_ASSERT_EQUAL(0, fired_at[0]);
+    TEST_ASSERT_EQUAL(2000, fired_at[1]);
+}
+
+void test_rearm_moves_timer(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 10));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 500));
+
+    // Nothing is left behind in the old slot
+    TEST_ASSERT_TRUE(he_timers_next_expiry(timers) > 1010);
+    TEST_ASSERT_EQUAL(0, he_timers_advance(timers, 1499));
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 1500));
+}
+
+void test_failed_nudge_disconnects(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 1));
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 1001));
+    TEST_ASSERT_EQUAL(HE_STATE_DISCONNECTED, conn->state);
+}
+
+void test_long_delays_cascade_to_exact_tick(void)
+{
+    // One delay per level, plus one past the top of the wheel
+    uint64_t delays[] = {5, 100, 5000, 300000, (1ULL << 24) + 77};
+    size_t count = sizeof(delays) / sizeof(delays[0]);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(make_conn(i), delays[i]));
+    }
+
+    wolfSSL_dtls_got_timeout_StubWithCallback(record_and_give_up);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t expires = 1000 + delays[i];
+
+        now = expires - 1;
+        TEST_ASSERT_EQUAL(0, he_timers_advance(timers, now));
+        now = expires;
+        TEST_ASSERT_EQUAL(1, he_timers_advance(timers, now));
+        TEST_ASSERT_EQUAL(expires, fired_at[i]);
+    }
+
+    TEST_ASSERT_EQUAL(UINT64_MAX, he_timers_next_expiry(timers));
+}
+
+void test_next_expiry(void)
+{
+    he_timers_destroy(timers);
+    timers = he_timers_create(1024);
+    TEST_ASSERT_EQUAL(UINT64_MAX, he_timers_next_expiry(timers));
+
+    he_conn_t *near = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(make_conn(1), 200));
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(near, 30));
+
+    // Exact on the bottom level
+    TEST_ASSERT_EQUAL(1054, he_timers_next_expiry(timers));
+
+    // The start of the slot on upper levels
+    he_timers_cancel(near);
+    TEST_ASSERT_EQUAL(1216, he_timers_next_expiry(timers));
+}
+
+void test_random_timers_fire_in_the_right_window(void)
+{
+    uint64_t expires[NUM_CONNS];
+    uint32_t seed = 12345;
+
+    for (size_t i = 0; i < NUM_CONNS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint64_t delay = 1 + (seed >> 8) % 200000;
+        expires[i] = 1000 + delay;
+        TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(make_conn(i), delay));
+    }
+
+    wolfSSL_dtls_got_timeout_StubWithCallback(record_and_give_up);
+
+    size_t fired = 0;
+    while (now < 202000)
+    {
+        uint64_t previous = now;
+        seed = seed * 1103515245 + 12345;
+        now += 1 + (seed >> 8) % 3000;
+        fired += he_timers_advance(timers, now);
+
+        for (size_t i = 0; i < NUM_CONNS; i++)
+        {
+            if (fired_at[i] == now)
+            {
+                TEST_ASSERT_TRUE(expires[i] > previous && expires[i] <= now);
+            }
+        }
+    }
+
+    TEST_ASSERT_EQUAL(NUM_CONNS, fired);
+}
+
+void test_destroy_detaches_armed_conns(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 10));
+
+    he_timers_destroy(timers);
+    timers = NULL;
+
+    TEST_ASSERT_NULL(conn->timers);
+    TEST_ASSERT_NULL(conn->timer_pprev);
+}
+
+void test_conn_uses_wheel_instead_of_callback(void)
+{
+    he_conn_t *conn = make_conn(0);
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_SUCCESS);
+    wolfSSL_dtls_get_current_timeout_ExpectAndReturn(conn->wolf_ssl, 1);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_conn_nudge(conn));
+
+    TEST_ASSERT_TRUE(conn->is_nudge_timer_running);
+    TEST_ASSERT_EQUAL(0, he_timers_advance(timers, 1999));
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_FATAL_ERROR);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 2000));
+}
+
+void test_online_conn_cancels_timer(void)
+{
+    he_conn_t *conn = make_conn(0);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_timers_arm(conn, 10));
+    conn->state = HE_STATE_ONLINE;
+
+    wolfSSL_dtls_got_timeout_ExpectAndReturn(conn->wolf_ssl, SSL_SUCCESS);
+    TEST_ASSERT_EQUAL(1, he_timers_advance(timers, 1010));
+
+    TEST_ASSERT_FALSE(conn->is_nudge_timer_running);
+    TEST_ASSERT_EQUAL(UINT64_MAX, he_timers_next_expiry(timers));
+}
+
+#endif // TEST
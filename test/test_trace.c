@@ -0,0 +1,184 @@
+#ifdef TEST
+
+// The tracepoint macros are what's under test, compile them in whatever the build says
+#define HE_ENABLE_TRACE
+
+#include "unity.h"
+
+#include <pthread.h>
+
+#include "trace.h"
+
+void setUp(void)
+{
+    he_trace_set_enabled(true);
+}
+
+void tearDown(void)
+{
+    he_trace_set_enabled(false);
+}
+
+static uint64_t ring_head(void)
+{
+    return he_thread_trace ? atomic_load(&he_thread_trace->head) : 0;
+}
+
+static const he_trace_record_t *newest_record(size_t back)
+{
+    uint64_t head = ring_head();
+    return &he_thread_trace->records[(head - 1 - back) & (HE_TRACE_RING_RECORDS - 1)];
+}
+
+typedef struct dumped_thread
+{
+    he_trace_dump_thread_t thread;
+    he_trace_record_t *records;
+} dumped_thread_t;
+
+// Dumps into memory and finds the ring of this thread, which was registered last
+static he_trace_dump_header_t dump(dumped_thread_t *threads, size_t max_threads)
+{
+    FILE *file = tmpfile();
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_trace_dump(file));
+    rewind(file);
+
+    he_trace_dump_header_t header;
+    TEST_ASSERT_EQUAL(1, fread(&header, sizeof(header), 1, file));
+    TEST_ASSERT_TRUE(header.num_threads <= max_threads);
+
+    for (uint32_t i = 0; i < header.num_threads; i++)
+    {
+        TEST_ASSERT_EQUAL(1, fread(&threads[i].thread, sizeof(threads[i].thread), 1, file));
+        threads[i].records = malloc(threads[i].thread.num_records * sizeof(he_trace_record_t) + 1);
+        TEST_ASSERT_EQUAL(threads[i].thread.num_records,
+                          fread(threads[i].records, sizeof(he_trace_record_t),
+                                threads[i].thread.num_records, file));
+    }
+
+    fclose(file);
+    return header;
+}
+
+static void free_dump(dumped_thread_t *threads, const he_trace_dump_header_t *header)
+{
+    for (uint32_t i = 0; i < header->num_threads; i++)
+    {
+        free(threads[i].records);
+    }
+}
+
+void test_macros_record_begin_and_end(void)
+{
+    HE_TRACE_BEGIN(0xabcd, HE_TRACE_PLUGIN_EGRESS, 2, 100);
+    uint64_t head = ring_head();
+    HE_TRACE_END(0xabcd, HE_TRACE_PLUGIN_EGRESS, 2, 90, HE_ERR_PLUGIN_DROP);
+    TEST_ASSERT_EQUAL(head + 1, ring_head());
+
+    const he_trace_record_t *end = newest_record(0);
+    const he_trace_record_t *begin = newest_record(1);
+
+    TEST_ASSERT_EQUAL(HE_TRACE_EVENT_BEGIN, begin->event);
+    TEST_ASSERT_EQUAL(HE_TRACE_PLUGIN_EGRESS, begin->stage);
+    TEST_ASSERT_EQUAL(2, begin->index);
+    TEST_ASSERT_EQUAL(100, begin->length);
+    TEST_ASSERT_EQUAL_UINT64(0xabcd, begin->session);
+    TEST_ASSERT_EQUAL(0, begin->rc);
+
+    TEST_ASSERT_EQUAL(HE_TRACE_EVENT_END, end->event);
+    TEST_ASSERT_EQUAL(90, end->length);
+    TEST_ASSERT_EQUAL(HE_ERR_PLUGIN_DROP, end->rc);
+    TEST_ASSERT_TRUE(end->timestamp >= begin->timestamp);
+}
+
+void test_nothing_is_recorded_while_disabled(void)
+{
+    HE_TRACE_BEGIN(1, HE_TRACE_DECRYPT, 0, 0);
+    uint64_t head = ring_head();
+
+    he_trace_set_enabled(false);
+    HE_TRACE_END(1, HE_TRACE_DECRYPT, 0, 0, 0);
+    TEST_ASSERT_EQUAL(head, ring_head());
+}
+
+void test_dump_rejects_null(void)
+{
+    TEST_ASSERT_EQUAL(HE_ERR_NULL_POINTER, he_trace_dump(NULL));
+}
+
+void test_dump_keeps_the_newest_records_oldest_first(void)
+{
+    // Wrap the ring one and a half times
+    uint32_t total = HE_TRACE_RING_RECORDS + HE_TRACE_RING_RECORDS / 2;
+    for (uint32_t i = 0; i < total; i++)
+    {
+        HE_TRACE_BEGIN(7, HE_TRACE_DTLS_READ, 0, i);
+    }
+
+    dumped_thread_t threads[64];
+    he_trace_dump_header_t header = dump(threads, 64);
+
+    TEST_ASSERT_EQUAL_MEMORY(HE_TRACE_DUMP_MAGIC, header.magic, sizeof(header.magic));
+    TEST_ASSERT_EQUAL(sizeof(he_trace_record_t), header.record_size);
+    TEST_ASSERT_TRUE(header.dump_ticks >= header.start_ticks);
+    TEST_ASSERT_TRUE(header.dump_ns >= header.start_ns);
+
+    dumped_thread_t *mine = NULL;
+    for (uint32_t i = 0; i < header.num_threads; i++)
+    {
+        if (threads[i].thread.thread == he_thread_trace->thread)
+        {
+            mine = &threads[i];
+        }
+    }
+    TEST_ASSERT_NOT_NULL(mine);
+    // The oldest slot is always the next one to be written, so it is never dumped
+    TEST_ASSERT_EQUAL(HE_TRACE_RING_RECORDS - 1, mine->thread.num_records);
+
+    // Nothing else was recorded after the loop, so the dump ends with its last record
+    for (uint32_t i = 0; i < HE_TRACE_RING_RECORDS - 1; i++)
+    {
+        TEST_ASSERT_EQUAL(total - HE_TRACE_RING_RECORDS + 1 + i, mine->records[i].length);
+    }
+
+    free_dump(threads, &header);
+}
+
+static void *record_on_another_thread(void *arg)
+{
+    HE_TRACE_BEGIN(0x5555, HE_TRACE_ENCRYPT, 0, 64);
+    HE_TRACE_END(0x5555, HE_TRACE_ENCRYPT, 0, 64, 64);
+    *(uint32_t *)arg = he_thread_trace->thread;
+    return NULL;
+}
+
+void test_dump_includes_threads_that_have_exited(void)
+{
+    uint32_t thread_id = UINT32_MAX;
+    pthread_t thread;
+    pthread_create(&thread, NULL, record_on_another_thread, &thread_id);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_NOT_EQUAL(UINT32_MAX, thread_id);
+    TEST_ASSERT_NOT_EQUAL(he_thread_trace->thread, thread_id);
+
+    dumped_thread_t threads[64];
+    he_trace_dump_header_t header = dump(threads, 64);
+
+    bool found = false;
+    for (uint32_t i = 0; i < header.num_threads; i++)
+    {
+        if (threads[i].thread.thread == thread_id)
+        {
+            found = true;
+            TEST_ASSERT_EQUAL(2, threads[i].thread.num_records);
+            TEST_ASSERT_EQUAL_UINT64(0x5555, threads[i].records[0].session);
+            TEST_ASSERT_EQUAL(HE_TRACE_EVENT_END, threads[i].records[1].event);
+        }
+    }
+    TEST_ASSERT_TRUE(found);
+
+    free_dump(threads, &header);
+}
+
+#endif // TEST
@@ -3,18 +3,442 @@
 #include "unity.h"
 
 #include "wolf.h"
+#include "core.h"
+#include "conn_template.h"
+#include "fec.h"
+#include "stats.h"
+#include "plugin_chain.h"
+#include "mock_random.h"
+
+he_conn_t conn;
+uint8_t incoming[100];
+char wolf_buffer[1500];
+
+int write_count = 0;
+uint8_t written[1500];
+size_t written_length = 0;
+const uint8_t *gather_header = NULL;
+const uint8_t *gather_payload = NULL;
+size_t gather_payload_length = 0;
+
+he_return_code_t capture_outside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    write_count++;
+    memcpy(written, packet, length);
+    written_length = length;
+    return HE_SUCCESS;
+}
+
+he_return_code_t capture_outside_write_gather(he_conn_t *conn, const uint8_t *header, size_t header_length,
+                                              const uint8_t *payload, size_t payload_length, void *context)
+{
+    write_count++;
+    TEST_ASSERT_EQUAL(sizeof(he_wire_hdr_t), header_length);
+    gather_header = header;
+    gather_payload = payload;
+    gather_payload_length = payload_length;
+    return HE_SUCCESS;
+}
+
+he_plugin_return_code_t passthrough(uint8_t *packet, size_t *length, size_t capacity, void *data)
+{
+    return HE_PLUGIN_SUCCESS;
+}
+
+int batch_calls = 0;
+size_t batch_count = 0;
+he_outside_datagram_t batch_datagrams[HE_OUTSIDE_WRITE_BATCH_MAX_DATAGRAMS];
+
+he_return_code_t capture_outside_write_batch(he_conn_t *conn, const he_outside_datagram_t *datagrams,
+                                             size_t count, void *context)
+{
+    batch_calls++;
+    batch_count = count;
+    memcpy(batch_datagrams, datagrams, count * sizeof(he_outside_datagram_t));
+    return HE_SUCCESS;
+}
+
+plugin_struct_t passthrough_plugin = {
+    .do_egress = passthrough,
+};
 
 void setUp(void)
 {
+    memset(&conn, 0, sizeof(conn));
+    conn.state = HE_STATE_ONLINE;
+    conn.session_id = 0xabcdef;
+    write_count = 0;
+    batch_calls = 0;
+    batch_count = 0;
+    gather_header = NULL;
+    gather_payload = NULL;
+    for (int i = 0; i < sizeof(incoming); i++)
+    {
+        incoming[i] = i;
+    }
 }
 
 void tearDown(void)
 {
+    he_conn_template_release(conn.conn_template);
+}
+
+void test_dtls_read_no_data(void)
+{
+    int res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(wolf_buffer), &conn);
+    TEST_ASSERT_EQUAL(WOLFSSL_CBIO_ERR_WANT_READ, res);
+}
+
+void test_dtls_read_datagram_only_once(void)
+{
+    conn.incoming_data = incoming;
+    conn.incoming_data_length = sizeof(incoming);
+
+    int res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(wolf_buffer), &conn);
+    TEST_ASSERT_EQUAL(sizeof(incoming), res);
+    TEST_ASSERT_EQUAL_MEMORY(incoming, wolf_buffer, sizeof(incoming));
+
+    res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(wolf_buffer), &conn);
+    TEST_ASSERT_EQUAL(WOLFSSL_CBIO_ERR_WANT_READ, res);
+}
+
+void test_dtls_read_counts_oversize_datagrams_as_dropped(void)
+{
+    he_stats_t before;
+    he_stats_get_thread(&before);
+    conn.incoming_data = incoming;
+    conn.incoming_data_length = sizeof(incoming);
+
+    int res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(incoming) - 1, &conn);
+    TEST_ASSERT_EQUAL(0, res);
+    TEST_ASSERT_EQUAL(1, conn.stats.dropped);
+
+    he_stats_t after;
+    he_stats_get_thread(&after);
+    TEST_ASSERT_EQUAL(before.drops[-HE_ERR_PACKET_TOO_LARGE] + 1,
+                      after.drops[-HE_ERR_PACKET_TOO_LARGE]);
+}
+
+void test_dtls_read_stream_serves_from_offset(void)
+{
+    he_conn_edit_settings(&conn)->connection_type = HE_CONNECTION_TYPE_STREAM;
+    he_internal_setup_stream_state(&conn, incoming, sizeof(incoming));
+
+    // wolfSSL asks for the 5 byte record header first, then the rest
+    int res = he_wolf_dtls_read(NULL, wolf_buffer, 5, &conn);
+    TEST_ASSERT_EQUAL(5, res);
+    TEST_ASSERT_EQUAL_MEMORY(incoming, wolf_buffer, 5);
+    TEST_ASSERT_EQUAL_PTR(incoming + 5, conn.incoming_data_read_offset_ptr);
+
+    res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(wolf_buffer), &conn);
+    TEST_ASSERT_EQUAL(sizeof(incoming) - 5, res);
+    TEST_ASSERT_EQUAL_MEMORY(incoming + 5, wolf_buffer, sizeof(incoming) - 5);
+    TEST_ASSERT_EQUAL(0, conn.incoming_data_left_to_read);
+
+    res = he_wolf_dtls_read(NULL, wolf_buffer, sizeof(wolf_buffer), &conn);
+    TEST_ASSERT_EQUAL(WOLFSSL_CBIO_ERR_WANT_READ, res);
+}
+
+void test_dtls_write_copies_header_and_record(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(1, write_count);
+    TEST_ASSERT_EQUAL(100 + sizeof(he_wire_hdr_t), written_length);
+    TEST_ASSERT_EQUAL('H', written[0]);
+    TEST_ASSERT_EQUAL_UINT64(0xabcdef, ((he_wire_hdr_t *)written)->session);
+    TEST_ASSERT_EQUAL_MEMORY(wolf_buffer, written + sizeof(he_wire_hdr_t), 100);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(100 + sizeof(he_wire_hdr_t), conn.stats.bytes[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(0, conn.stats.aggressive_duplicates);
+}
+
+he_return_code_t failing_outside_write(he_conn_t *conn, uint8_t *packet, size_t length, void *context)
+{
+    return HE_ERR_FAILED;
+}
+
+he_conn_t other;
+uint8_t first_sent[1500];
+size_t first_sent_length = 0;
+
+// Sends a record on another connection from inside the first write, as a host forwarding
+// between connections would
+he_return_code_t reenter_outside_write(he_conn_t *target, uint8_t *packet, size_t length, void *context)
+{
+    if (target != &conn)
+    {
+        return HE_SUCCESS;
+    }
+
+    if (write_count++ == 0)
+    {
+        memcpy(first_sent, packet, length);
+        first_sent_length = length;
+        char record[200];
+        memset(record, 0xee, sizeof(record));
+        TEST_ASSERT_EQUAL(sizeof(record), he_wolf_dtls_write(NULL, record, sizeof(record), &other));
+    }
+    else
+    {
+        // The duplicates still carry the outer record
+        TEST_ASSERT_EQUAL(first_sent_length, length);
+        TEST_ASSERT_EQUAL_MEMORY(first_sent, packet, length);
+    }
+    return HE_SUCCESS;
+}
+
+void test_dtls_write_survives_a_callback_writing_on_another_connection(void)
+{
+    memset(&other, 0, sizeof(other));
+    other.state = HE_STATE_ONLINE;
+    conn.state = HE_STATE_CONNECTING;
+    he_conn_edit_settings(&conn)->outside_write_cb = reenter_outside_write;
+    he_conn_edit_settings(&other)->outside_write_cb = reenter_outside_write;
+    memset(wolf_buffer, 0x11, 100);
+
+    TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    TEST_ASSERT_EQUAL(3, write_count);
+    TEST_ASSERT_EQUAL(2, conn.stats.aggressive_duplicates);
+    TEST_ASSERT_EQUAL(1, other.stats.packets[HE_STATS_OUTSIDE_OUT]);
+
+    he_conn_template_release(other.conn_template);
+}
+
+void test_dtls_write_counts_callback_failures_as_dropped(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_cb = failing_outside_write;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(WOLFSSL_CBIO_ERR_GENERAL, res);
+    TEST_ASSERT_EQUAL(0, conn.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(1, conn.stats.dropped);
+}
+
+void test_dtls_write_gather_passes_record_without_copy(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+    he_conn_edit_settings(&conn)->outside_write_gather_cb = capture_outside_write_gather;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(1, write_count);
+    TEST_ASSERT_EQUAL_PTR(wolf_buffer, gather_payload);
+    TEST_ASSERT_EQUAL(100, gather_payload_length);
+    TEST_ASSERT_EQUAL_PTR(&conn.wire_hdr, gather_header);
+    TEST_ASSERT_EQUAL_UINT64(0xabcdef, conn.wire_hdr.session);
+}
+
+void test_dtls_write_gather_is_aggressive_when_not_online(void)
+{
+    conn.state = HE_STATE_CONNECTING;
+    he_conn_edit_settings(&conn)->outside_write_gather_cb = capture_outside_write_gather;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(3, write_count);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(2, conn.stats.aggressive_duplicates);
+}
+
+void test_dtls_write_egress_plugins_use_the_copying_path(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+    he_conn_edit_settings(&conn)->outside_write_gather_cb = capture_outside_write_gather;
+    conn.outside_plugins = he_plugin_chain_create();
+    he_plugin_register_plugin(conn.outside_plugins, &passthrough_plugin);
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(1, write_count);
+    TEST_ASSERT_NULL(gather_payload);
+    TEST_ASSERT_EQUAL(100 + sizeof(he_wire_hdr_t), written_length);
+
+    he_plugin_destroy_chain(conn.outside_plugins);
+}
+
+void test_dtls_write_refreshes_header_on_session_change(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_gather_cb = capture_outside_write_gather;
+
+    he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL_UINT64(0xabcdef, ((he_wire_hdr_t *)gather_header)->session);
+
+    conn.session_id = 0x123456;
+    he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL_UINT64(0x123456, ((he_wire_hdr_t *)gather_header)->session);
 }
 
-void test_wolf_NeedToImplement(void)
+void test_dtls_write_batch_flushes_immediately_outside_a_burst(void)
+{
+    he_outside_write_batch_t *batch = he_internal_get_outside_write_batch();
+    he_conn_edit_settings(&conn)->outside_write_batch_cb = capture_outside_write_batch;
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(0, write_count);
+    TEST_ASSERT_EQUAL(1, batch_calls);
+    TEST_ASSERT_EQUAL(1, batch_count);
+    TEST_ASSERT_EQUAL(100 + sizeof(he_wire_hdr_t), batch_datagrams[0].length);
+    TEST_ASSERT_EQUAL(0, batch->num_datagrams);
+}
+
+void test_dtls_write_batch_aggressive_duplicates_share_a_buffer(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_batch_cb = capture_outside_write_batch;
+    he_conn_edit_settings(&conn)->use_aggressive_mode = true;
+
+    int res = he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn);
+    TEST_ASSERT_EQUAL(100, res);
+    TEST_ASSERT_EQUAL(1, batch_calls);
+    TEST_ASSERT_EQUAL(3, batch_count);
+    TEST_ASSERT_EQUAL_PTR(batch_datagrams[0].packet, batch_datagrams[1].packet);
+    TEST_ASSERT_EQUAL_PTR(batch_datagrams[0].packet, batch_datagrams[2].packet);
+}
+
+void test_dtls_write_batch_queues_during_a_burst(void)
+{
+    he_outside_write_batch_t *batch = he_internal_get_outside_write_batch();
+    he_conn_edit_settings(&conn)->outside_write_batch_cb = capture_outside_write_batch;
+    conn.in_input_burst = true;
+
+    for (int i = 0; i < HE_OUTSIDE_WRITE_BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    }
+    TEST_ASSERT_EQUAL(0, batch_calls);
+    TEST_ASSERT_EQUAL(HE_OUTSIDE_WRITE_BATCH_SIZE, batch->num_datagrams);
+
+    // The queue is full, the next write flushes it first
+    TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    TEST_ASSERT_EQUAL(1, batch_calls);
+    TEST_ASSERT_EQUAL(HE_OUTSIDE_WRITE_BATCH_SIZE, batch_count);
+    TEST_ASSERT_EQUAL(1, batch->num_datagrams);
+
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_flush_outside_writes(&conn));
+    TEST_ASSERT_EQUAL(2, batch_calls);
+    TEST_ASSERT_EQUAL(1, batch_count);
+}
+
+he_conn_t *batch_conns[4];
+
+he_return_code_t record_batch_conn(he_conn_t *conn, const he_outside_datagram_t *datagrams, size_t count,
+                                   void *context)
 {
-    TEST_IGNORE_MESSAGE("Need to Implement wolf");
+    batch_conns[batch_calls] = conn;
+    return capture_outside_write_batch(conn, datagrams, count, context);
+}
+
+void test_dtls_write_batch_holds_one_connection_at_a_time(void)
+{
+    he_outside_write_batch_t *batch = he_internal_get_outside_write_batch();
+    he_conn_edit_settings(&conn)->outside_write_batch_cb = record_batch_conn;
+    conn.in_input_burst = true;
+    TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    TEST_ASSERT_EQUAL(0, batch_calls);
+
+    // A callback sends on another connection in the middle of the burst
+    memset(&other, 0, sizeof(other));
+    other.state = HE_STATE_ONLINE;
+    he_conn_edit_settings(&other)->outside_write_batch_cb = record_batch_conn;
+    TEST_ASSERT_EQUAL(50, he_wolf_dtls_write(NULL, wolf_buffer, 50, &other));
+
+    TEST_ASSERT_EQUAL(2, batch_calls);
+    TEST_ASSERT_EQUAL_PTR(&conn, batch_conns[0]);
+    TEST_ASSERT_EQUAL_PTR(&other, batch_conns[1]);
+    TEST_ASSERT_EQUAL(50 + sizeof(he_wire_hdr_t), batch_datagrams[0].length);
+    TEST_ASSERT_EQUAL(1, conn.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(1, other.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(0, batch->num_datagrams);
+    TEST_ASSERT_NULL(batch->conn);
+
+    // Nothing is left for the first connection's end of burst flush
+    TEST_ASSERT_EQUAL(HE_SUCCESS, he_internal_flush_outside_writes(&conn));
+    TEST_ASSERT_EQUAL(2, batch_calls);
+
+    he_conn_template_release(other.conn_template);
+}
+
+// Sends on the same connection from inside the batch callback, once
+he_return_code_t write_from_batch(he_conn_t *target, const he_outside_datagram_t *datagrams, size_t count,
+                                  void *context)
+{
+    capture_outside_write_batch(target, datagrams, count, context);
+    if (batch_calls == 1)
+    {
+        TEST_ASSERT_EQUAL(30, he_wolf_dtls_write(NULL, wolf_buffer, 30, target));
+    }
+    return HE_SUCCESS;
+}
+
+void test_dtls_write_from_the_batch_callback_goes_out_on_its_own(void)
+{
+    he_conn_edit_settings(&conn)->outside_write_batch_cb = write_from_batch;
+
+    TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    TEST_ASSERT_EQUAL(2, batch_calls);
+    TEST_ASSERT_EQUAL(1, batch_count);
+    TEST_ASSERT_EQUAL(30 + sizeof(he_wire_hdr_t), batch_datagrams[0].length);
+    TEST_ASSERT_EQUAL(2, conn.stats.packets[HE_STATS_OUTSIDE_OUT]);
+    TEST_ASSERT_EQUAL(0, he_internal_get_outside_write_batch()->num_datagrams);
+}
+
+void test_dtls_write_fec_marks_records_capable_before_the_peer_is(void)
+{
+    he_fec_t fec = {0};
+    conn.fec = &fec;
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    }
+
+    // No parity until the peer has said it can use it
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP, write_count);
+    TEST_ASSERT_EQUAL(HE_FEC_CAPABLE, ((he_wire_hdr_t *)written)->reserved[0]);
+    TEST_ASSERT_EQUAL(0, he_internal_get_wire_header(&conn)->reserved[0]);
+}
+
+void test_dtls_write_fec_follows_a_group_with_parity(void)
+{
+    he_fec_t fec = {0};
+    fec.peer_capable = true;
+    conn.fec = &fec;
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+
+    for (int i = 0; i < HE_FEC_MAX_GROUP - 1; i++)
+    {
+        TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    }
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP - 1, write_count);
+    TEST_ASSERT_EQUAL(HE_FEC_CAPABLE | HE_FEC_TYPE_DATA, ((he_wire_hdr_t *)written)->reserved[0]);
+
+    TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP + 1, write_count);
+    TEST_ASSERT_EQUAL(HE_FEC_CAPABLE | HE_FEC_TYPE_PARITY, ((he_wire_hdr_t *)written)->reserved[0]);
+    TEST_ASSERT_EQUAL(sizeof(he_wire_hdr_t) + HE_FEC_LENGTH_SIZE + 100, written_length);
+    TEST_ASSERT_EQUAL(1, fec.parity_sent);
+}
+
+void test_dtls_write_fec_stays_out_of_aggressive_mode(void)
+{
+    he_fec_t fec = {0};
+    fec.peer_capable = true;
+    conn.fec = &fec;
+    he_conn_edit_settings(&conn)->use_aggressive_mode = true;
+    he_conn_edit_settings(&conn)->outside_write_cb = capture_outside_write;
+
+    for (int i = 0; i < HE_FEC_MAX_GROUP; i++)
+    {
+        TEST_ASSERT_EQUAL(100, he_wolf_dtls_write(NULL, wolf_buffer, 100, &conn));
+    }
+
+    TEST_ASSERT_EQUAL(HE_FEC_MAX_GROUP * 3, write_count);
+    TEST_ASSERT_EQUAL(0, fec.parity_sent);
 }
 
 #endif // TEST
@@ -0,0 +1,286 @@
+// Turns a file written by he_trace_dump() into something a human can look at:
+//
+//   he_trace_dump --format chrome trace.bin > trace.json    (chrome://tracing or Perfetto)
+//   he_trace_dump --format folded trace.bin | flamegraph.pl > trace.svg
+//
+// Folded stacks weigh each stage by its self time in nanoseconds.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/// Deeper than any real nesting of stages
+#define DUMP_MAX_DEPTH 32
+
+typedef enum dump_format
+{
+    DUMP_FORMAT_CHROME,
+    DUMP_FORMAT_FOLDED,
+} dump_format_t;
+
+typedef struct dump_frame
+{
+    const he_trace_record_t *begin;
+    uint64_t session;
+    /// Time spent in stages nested inside this one
+    double child_ns;
+} dump_frame_t;
+
+static const char *const dump_stage_names[HE_TRACE_STAGES] = {
+    "outside_receive", "decrypt",       "dtls_read", "plugin_ingress", "plugin_egress",
+    "inside_write",    "inside_receive", "encrypt",   "dtls_write",     "outside_write",
+};
+
+static double dump_ns_per_tick = 1.0;
+static uint64_t dump_start_ticks = 0;
+static bool dump_first_event = true;
+
+static double dump_ns(uint64_t ticks)
+{
+    return (double)(int64_t)(ticks - dump_start_ticks) * dump_ns_per_tick;
+}
+
+static void dump_frame_name(const he_trace_record_t *record, char *name, size_t size)
+{
+    const char *stage =
+        record->stage < HE_TRACE_STAGES ? dump_stage_names[record->stage] : "unknown";
+
+    if (record->stage == HE_TRACE_PLUGIN_INGRESS || record->stage == HE_TRACE_PLUGIN_EGRESS)
+    {
+        snprintf(name, size, "%s[%u]", stage, (unsigned)record->index);
+    }
+    else
+    {
+        snprintf(name, size, "%s", stage);
+    }
+}
+
+static void dump_chrome_event(uint32_t thread, const he_trace_record_t *record, uint64_t session)
+{
+    char name[64];
+    dump_frame_name(record, name, sizeof(name));
+
+    // Chrome wants microseconds
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%" PRIu32
+           ",\"args\":{\"session\":\"0x%016" PRIx64 "\",\"length\":%" PRIu32,
+           dump_first_event ? "" : ",", name,
+           record->event == HE_TRACE_EVENT_BEGIN ? "B" : "E", dump_ns(record->timestamp) / 1000.0,
+           thread, session, record->length);
+    if (record->event == HE_TRACE_EVENT_END)
+    {
+        printf(",\"rc\":%" PRId32, record->rc);
+    }
+    printf("}}");
+
+    dump_first_event = false;
+}
+
+static void dump_folded_frame(uint32_t thread, const dump_frame_t *stack, size_t depth,
+                              double self_ns)
+{
+    if (self_ns < 0.5)
+    {
+        return;
+    }
+
+    printf("thread_%" PRIu32, thread);
+    for (size_t i = 0; i < depth; i++)
+    {
+        char name[64];
+        dump_frame_name(stack[i].begin, name, sizeof(name));
+        printf(";%s", name);
+    }
+    printf(" %.0f\n", self_ns);
+}
+
+static void dump_thread(dump_format_t format, uint32_t thread, const he_trace_record_t *records,
+                        size_t count)
+{
+    dump_frame_t stack[DUMP_MAX_DEPTH];
+    size_t depth = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const he_trace_record_t *record = &records[i];
+
+        if (record->event == HE_TRACE_EVENT_BEGIN)
+        {
+            if (depth == DUMP_MAX_DEPTH)
+            {
+                continue;
+            }
+
+            // Plugins don't know the connection, they run on behalf of the enclosing stage
+            uint64_t session = record->session;
+            if (session == 0 && depth > 0)
+            {
+                session = stack[depth - 1].session;
+            }
+
+            stack[depth].begin = record;
+            stack[depth].session = session;
+            stack[depth].child_ns = 0;
+            depth++;
+
+            if (format == DUMP_FORMAT_CHROME)
+            {
+                dump_chrome_event(thread, record, session);
+            }
+            continue;
+        }
+
+        // The ring may have wrapped between a begin and its end, leaving ends with nothing to
+        // match. Skip those, and unwind any begins whose end was lost.
+        size_t match = depth;
+        while (match > 0 && (stack[match - 1].begin->stage != record->stage ||
+                             stack[match - 1].begin->index != record->index))
+        {
+            match--;
+        }
+        if (match == 0)
+        {
+            continue;
+        }
+        depth = match;
+
+        dump_frame_t *frame = &stack[depth - 1];
+        double total_ns = dump_ns(record->timestamp) - dump_ns(frame->begin->timestamp);
+
+        if (format == DUMP_FORMAT_CHROME)
+        {
+            dump_chrome_event(thread, record, frame->session);
+        }
+        else
+        {
+            dump_folded_frame(thread, stack, depth, total_ns - frame->child_ns);
+        }
+
+        depth--;
+        if (depth > 0)
+        {
+            stack[depth - 1].child_ns += total_ns;
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--format chrome|folded] <trace file>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    dump_format_t format = DUMP_FORMAT_CHROME;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "chrome") == 0)
+            {
+                format = DUMP_FORMAT_CHROME;
+            }
+            else if (strcmp(argv[i], "folded") == 0)
+            {
+                format = DUMP_FORMAT_FOLDED;
+            }
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (path == NULL && argv[i][0] != '-')
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path == NULL)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    he_trace_dump_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, HE_TRACE_DUMP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(he_trace_record_t))
+    {
+        fprintf(stderr, "%s: not a trace dump from this version of Helium\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    dump_start_ticks = header.start_ticks;
+    if (header.dump_ticks > header.start_ticks && header.dump_ns > header.start_ns)
+    {
+        dump_ns_per_tick = (double)(header.dump_ns - header.start_ns) /
+                           (double)(header.dump_ticks - header.start_ticks);
+    }
+
+    if (format == DUMP_FORMAT_CHROME)
+    {
+        printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+
+    // The ring size is a build option of the library, go by what the dump says
+    he_trace_record_t *records = NULL;
+    int ret = 0;
+    for (uint32_t t = 0; t < header.num_threads; t++)
+    {
+        he_trace_dump_thread_t thread;
+        if (fread(&thread, sizeof(thread), 1, file) != 1)
+        {
+            fprintf(stderr, "%s: truncated\n", path);
+            ret = 1;
+            break;
+        }
+
+        he_trace_record_t *grown =
+            realloc(records, ((size_t)thread.num_records + 1) * sizeof(he_trace_record_t));
+        if (grown == NULL)
+        {
+            ret = 1;
+            break;
+        }
+        records = grown;
+
+        if (fread(records, sizeof(he_trace_record_t), thread.num_records, file) !=
+            thread.num_records)
+        {
+            fprintf(stderr, "%s: truncated\n", path);
+            ret = 1;
+            break;
+        }
+
+        dump_thread(format, thread.thread, records, thread.num_records);
+    }
+
+    if (format == DUMP_FORMAT_CHROME)
+    {
+        printf("\n]}\n");
+    }
+
+    free(records);
+    fclose(file);
+    return ret;
+}